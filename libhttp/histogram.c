@@ -0,0 +1,109 @@
+// histogram.c -- Log-linear latency histograms
+// Copyright (C) 2008-2010 Markus Gutschke <markus@shellinabox.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// In addition to these license terms, the author grants the following
+// additional rights:
+//
+// If you modify this program, or any covered work, by linking or
+// combining it with the OpenSSL project's OpenSSL library (or a
+// modified version of that library), containing parts covered by the
+// terms of the OpenSSL or SSLeay licenses, the author
+// grants you additional permission to convey the resulting work.
+// Corresponding Source for a non-source form of such a combination
+// shall include the source code for the parts of OpenSSL used as well
+// as that of the covered work.
+//
+// You may at your option choose to remove this additional permission from
+// the work, or from any part of it.
+//
+// It is possible to build this program in a way that it loads OpenSSL
+// libraries at run-time. If doing so, the following notices are required
+// by the OpenSSL and SSLeay licenses:
+//
+// This product includes software developed by the OpenSSL Project
+// for use in the OpenSSL Toolkit. (http://www.openssl.org/)
+//
+// This product includes cryptographic software written by Eric Young
+// (eay@cryptsoft.com)
+//
+//
+// The most up-to-date version of this program is always available from
+// http://shellinabox.com
+
+#include "config.h"
+
+#include <string.h>
+
+#include "libhttp/histogram.h"
+#include "logging/logging.h"
+
+static int histogramBucket(uint64_t value) {
+  if (value < 2*HISTOGRAM_SUB_BUCKETS) {
+    return (int)value;
+  }
+  int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+  return shift*HISTOGRAM_SUB_BUCKETS + (int)(value >> shift);
+}
+
+static uint64_t histogramBucketLimit(int bucket) {
+  // Returns the largest value that falls into "bucket".
+  if (bucket < 2*HISTOGRAM_SUB_BUCKETS) {
+    return bucket;
+  }
+  int shift          = bucket/HISTOGRAM_SUB_BUCKETS - 1;
+  uint64_t mantissa  = bucket - shift*HISTOGRAM_SUB_BUCKETS;
+  return ((mantissa + 1) << shift) - 1;
+}
+
+void initHistogram(struct Histogram *histogram) {
+  memset(histogram, 0, sizeof(struct Histogram));
+}
+
+void histogramRecord(struct Histogram *histogram, uint64_t value) {
+  histogram->count++;
+  histogram->sum    += value;
+  if (value > histogram->max) {
+    histogram->max   = value;
+  }
+  histogram->buckets[histogramBucket(value)]++;
+}
+
+uint64_t histogramPercentile(const struct Histogram *histogram,
+                             double percentile) {
+  if (!histogram->count) {
+    return 0;
+  }
+  uint64_t rank      = (uint64_t)(percentile*histogram->count/100.0 + 0.5);
+  if (rank < 1) {
+    rank             = 1;
+  } else if (rank > histogram->count) {
+    rank             = histogram->count;
+  }
+  uint64_t seen      = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen            += histogram->buckets[i];
+    if (seen >= rank) {
+      uint64_t limit = histogramBucketLimit(i);
+      return limit < histogram->max ? limit : histogram->max;
+    }
+  }
+  dcheck(0);
+  return histogram->max;
+}
+
+uint64_t histogramMean(const struct Histogram *histogram) {
+  return histogram->count ? histogram->sum/histogram->count : 0;
+}
@@ -48,6 +48,8 @@
 
 #include <errno.h>
 #include <stdarg.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 
 #define HTTP_DONE          0
@@ -56,10 +58,26 @@
 #define HTTP_SUSPEND       3
 #define HTTP_PARTIAL_REPLY 4
 
-#define WS_START_OF_FRAME    0x0100
-#define WS_END_OF_FRAME      0x0200
-#define WS_CONNECTION_OPENED 0xFF00
-#define WS_CONNECTION_CLOSED 0x7F00
+// WebSocket handlers receive data as the message opcode, combined with flags
+// that mark the first and the last chunk of each message. Large or
+// fragmented messages can be delivered in more than one chunk.
+#define WS_TEXT_FRAME         0x0001
+#define WS_BINARY_FRAME       0x0002
+#define WS_START_OF_FRAME     0x0100
+#define WS_END_OF_FRAME       0x0200
+#define WS_CONNECTION_OPENED  0xFF00
+#define WS_CONNECTION_CLOSED  0x7F00
+#define WS_CONNECTION_DRAINED 0xFD00
+
+#define WS_CLOSE_NORMAL       1000
+#define WS_CLOSE_GOING_AWAY   1001
+#define WS_CLOSE_POLICY       1008
+
+// Connections can ask the server to perform their I/O, if the event backend
+// supports it. From then on, the file descriptor must only be accessed with
+// serverReadv() and serverWritev().
+#define SERVER_READ           1
+#define SERVER_WRITE          2
 
 #define NO_MSG             "\001"
 #define BINARY_MSG         "\001%d%p"
@@ -68,12 +86,15 @@
 
 typedef struct HashMap HashMap;
 typedef struct HttpConnection HttpConnection;
+typedef struct HttpDeflateStream HttpDeflateStream;
+typedef struct HttpReply HttpReply;
 typedef struct ServerConnection ServerConnection;
 typedef struct Server Server;
 typedef struct URL URL;
 
 Server *newCGIServer(int localhostOnly, int portMin, int portMax, int timeout);
 Server *newServer(int localhostOnly, int port);
+Server *newServerFromFd(int fd);
 void deleteServer(Server *server);
 int  serverGetListeningPort(Server *server);
 int  serverGetFd(Server *server);
@@ -83,6 +104,9 @@ void serverRegisterHttpHandler(Server *server, const char *url,
 void serverRegisterStreamingHttpHandler(Server *server, const char *url,
                                int (*handler)(HttpConnection *, void *),
                                void *arg);
+int  serverCollectPayload(HttpConnection *http,
+                          int (*handler)(HttpConnection *, void *,
+                                         const char *, int), void *arg);
 void serverRegisterWebSocketHandler(Server *server, const char *url,
               int (*handler)(HttpConnection *, void *, int, const char *, int),
               void *arg);
@@ -93,12 +117,34 @@ ServerConnection *serverAddConnection(Server *server, int fd,
                               void (*destroyConnection)(void *arg),
                               void *arg);
 void serverDeleteConnection(Server *server, int fd);
+int  serverDelegateIo(Server *server, int fd, int ops);
+ssize_t serverReadv(Server *server, int fd, const struct iovec *iov,
+                    int count);
+ssize_t serverWritev(Server *server, int fd, const struct iovec *iov,
+                     int count);
+void serverSetConnectionDescriber(ServerConnection *connection,
+                                  char *(*describeConnection)(void *arg));
+void serverAdoptConnection(Server *server, int fd);
+void serverSetHandOff(Server *server,
+                      int (*handOff)(void *arg, int fd, const char *line,
+                                     int len),
+                      void *arg);
+void serverSetReactors(Server *server, int numReactors,
+                       void (*initReactor)(Server *reactor, int id, void *arg),
+                       void (*destroyReactor)(Server *reactor, int id,
+                                              void *arg),
+                       void *arg);
+void serverSetRouter(Server *server,
+                     int (*route)(void *arg, const char *line, int len),
+                     void *arg);
 void serverSetTimeout(ServerConnection *connection, time_t timeout);
+void serverSetTimeoutMs(ServerConnection *connection, int timeout);
 time_t serverGetTimeout(ServerConnection *connection);
 ServerConnection *serverGetConnection(Server *server, ServerConnection *hint,
                                       int fd);
 short serverConnectionSetEvents(Server *server, ServerConnection *connection,
                                 int fd, short events);
+short serverConnectionGetEvents(ServerConnection *connection);
 void serverExitLoop(Server *server, int exitAll);
 void serverLoop(Server *server);
 int  serverSupportsSSL();
@@ -107,12 +153,35 @@ void serverSetCertificate(Server *server, const char *filename,
                           int autoGenerateMissing);
 void serverSetCertificateFd(Server *server, int fd);
 void serverSetNumericHosts(Server *server, int numericHosts);
+void serverSetConnectionLimits(Server *server, int maxConnections,
+                               int maxConnectionsPerPeer);
 
 void httpTransfer(HttpConnection *http, char *msg, int len);
 void httpTransferPartialReply(HttpConnection *http, char *msg, int len);
+void httpTransferStatic(HttpConnection *http, char *header, const char *body,
+                        int bodyLength);
+HttpReply *newHttpReply(int size);
+void deleteHttpReply(HttpReply *reply);
+char *httpReplyReserve(HttpReply *reply, int len);
+void httpReplyCommit(HttpReply *reply, int len);
+void httpReplyAppend(HttpReply *reply, const char *buf, int len);
+void httpReplyPrintf(HttpReply *reply, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+const char *httpReplyBody(const HttpReply *reply, int *len);
+void httpTransferReply(HttpConnection *http, HttpReply *reply, int compress,
+                       const char *fmt, ...)
+  __attribute__((format(printf, 4, 5)));
+HttpDeflateStream *newHttpDeflateStream(void);
+void deleteHttpDeflateStream(HttpDeflateStream *stream);
+void httpResetDeflateStream(HttpDeflateStream *stream);
+char *httpDeflateStream(HttpDeflateStream *stream, const char *buf, int len,
+                        int *compressedLength);
+void httpDeflateStreamToReply(HttpDeflateStream *stream, const char *buf,
+                              int len, HttpReply *reply);
 void httpSetCallback(HttpConnection *http,
                      int (*callback)(HttpConnection *, void *,
                                      const char *, int), void *arg);
+void httpPauseRead(HttpConnection *http, int pause);
 void *httpGetPrivate(HttpConnection *http);
 void *httpSetPrivate(HttpConnection *http, void *private);
 void httpSendReply(HttpConnection *http, int code,
@@ -122,6 +191,9 @@ void httpSendWebSocketTextMsg(HttpConnection *http, int type, const char *fmt,
                               ...) __attribute__((format(printf, 3, 4)));
 void httpSendWebSocketBinaryMsg(HttpConnection *http, int type,
                                 const void *buf, int len);
+void httpCloseWebSocket(HttpConnection *http, int code, const char *reason);
+int  httpWebSocketCongested(HttpConnection *http, int limit);
+int  httpGetPendingOutput(const HttpConnection *http);
 void httpExitLoop(HttpConnection *http, int exitAll);
 Server *httpGetServer(const HttpConnection *http);
 ServerConnection *httpGetServerConnection(const HttpConnection *);
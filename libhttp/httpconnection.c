@@ -57,8 +57,13 @@
 #include <sys/poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#ifdef HAVE_PTHREAD_CREATE
+#include <pthread.h>
+#endif
+
 #ifdef HAVE_ZLIB
 #include <zlib.h>
 #endif
@@ -80,11 +85,70 @@
 #endif
 
 #include "libhttp/httpconnection.h"
+#include "libhttp/websocket.h"
 #include "logging/logging.h"
 
 #define MAX_HEADER_LENGTH   (64<<10)
 #define CONNECTION_TIMEOUT  (10*60)
 
+// Idle WebSockets get pinged this often, which keeps proxies from dropping
+// them. If there still is no sign of life one interval later, we give up.
+#define WEBSOCKET_PING_INTERVAL 30
+#define WEBSOCKET_MAX_FRAME     (1<<30)
+
+// While only part of the request line has arrived, we look at it again this
+// often, until it is complete. After a while, we give up and handle the
+// request in the thread that accepted it.
+#define HANDOFF_WAIT_INTERVAL   10
+#define MAX_HANDOFF_WAITS       200
+
+// Maximum number of segments that we pass to a single call to writev().
+#define MAX_WRITE_SEGMENTS  16
+
+// Replies that might exceed the size of a single IP packet get compressed.
+#define MIN_COMPRESS_LENGTH 1400
+
+// Replies that are built in place keep this much room in front of the body,
+// so that the headers can be filled in once the length is known. Each
+// reactor thread holds on to a few of their buffers for later replies.
+#define REPLY_HEADROOM      512
+#define MAX_POOLED_REPLIES  8
+#define MAX_POOLED_SIZE     (256<<10)
+
+struct HttpReply {
+  struct HttpReply          *next;
+  char                      *buf;
+  int                       size;
+  int                       length;
+};
+
+static __thread struct HttpReply *replyPool;
+static __thread int               replyPoolSize;
+
+#ifdef HAVE_ZLIB
+// Long-lived streams that compress a sequence of replies as a whole. Each
+// reply refers back to data from earlier replies, and it is flushed on a
+// byte boundary, so that the client can decompress it right away.
+struct HttpDeflateStream {
+  z_stream                  strm;
+};
+
+// Static content only ever has to be compressed once. The results are kept
+// for the lifetime of the process.
+struct HttpCompressedBody {
+  struct HttpCompressedBody *next;
+  const char                *body;
+  int                       bodyLength;
+  char                      *data;
+  int                       length;
+};
+
+static struct HttpCompressedBody *compressedBodies;
+#ifdef HAVE_PTHREAD_CREATE
+static pthread_mutex_t compressedBodiesLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+#endif
+
 static int httpPromoteToSSL(struct HttpConnection *http, const char *buf,
                             int len) {
   if (http->ssl->enabled && !http->sslHndl) {
@@ -103,7 +167,7 @@ static int httpPromoteToSSL(struct HttpConnection *http, const char *buf,
     if (http->sslHndl) {
       check(!rc);
       // Reset renegotiations count for connections promoted to SSL.
-      http->ssl->renegotiationCount = 0;
+      http->renegotiationCount = 0;
       SSL_set_app_data(http->sslHndl, http);
     }
     free(http->partial);
@@ -142,21 +206,57 @@ static ssize_t httpRead(struct HttpConnection *http, char *buf, ssize_t len) {
     dcheck(!ERR_peek_error());
 
     // Shutdown SSL connection, if client initiated renegotiation.
-    if (http->ssl->renegotiationCount > 1) {
+    if (http->renegotiationCount > 1) {
       debug("[ssl] Connection shutdown due to client initiated renegotiation!");
       rc                     = 0;
       errno                  = EINVAL;
     }
   } else {
-    rc = NOINTR(read(http->fd, buf, len));
+    struct iovec iov          = { buf, len };
+    rc = serverReadv(http->server, http->fd, &iov, 1);
   }
   sslUnblockSigPipe();
   if (rc > 0) {
-    serverSetTimeout(httpGetServerConnection(http), CONNECTION_TIMEOUT);
+    if (http->state == WEBSOCKET) {
+      http->websocketPinged   = 0;
+      serverSetTimeout(httpGetServerConnection(http),
+                       WEBSOCKET_PING_INTERVAL);
+    } else {
+      serverSetTimeout(httpGetServerConnection(http), CONNECTION_TIMEOUT);
+    }
   }
   return rc;
 }
 
+int httpPeekCommand(struct HttpConnection *http, char *buf, int len) {
+  // Returns the length of the request line, without consuming any data.
+  // Otherwise, returns -1 and sets errno to EAGAIN, if no data is available
+  // yet, to EINPROGRESS, if only part of the line has arrived, or to EINVAL,
+  // if the line does not fit into "buf" or the peer closed the connection.
+  int rc;
+  int wouldBlock;
+  if (http->sslHndl) {
+    sslBlockSigPipe();
+    dcheck(!ERR_peek_error());
+    rc                        = SSL_peek(http->sslHndl, buf, len);
+    wouldBlock                = rc <= 0 &&
+                                SSL_get_error(http->sslHndl, rc) ==
+                                SSL_ERROR_WANT_READ;
+    ERR_clear_error();
+    sslUnblockSigPipe();
+  } else {
+    rc                        = NOINTR(recv(http->fd, buf, len, MSG_PEEK));
+    wouldBlock                = rc < 0 && errno == EAGAIN;
+  }
+  const char *eol             = rc > 0 ? memchr(buf, '\n', rc) : NULL;
+  if (!eol) {
+    errno                     = wouldBlock ? EAGAIN :
+                                rc > 0 && rc < len ? EINPROGRESS : EINVAL;
+    return -1;
+  }
+  return eol - buf;
+}
+
 static ssize_t httpWrite(struct HttpConnection *http, const char *buf,
                          ssize_t len) {
   sslBlockSigPipe();
@@ -184,12 +284,113 @@ static ssize_t httpWrite(struct HttpConnection *http, const char *buf,
     }
     dcheck(!ERR_peek_error());
   } else {
-    rc = NOINTR(write(http->fd, buf, len));
+    struct iovec iov          = { (void *)buf, len };
+    rc = serverWritev(http->server, http->fd, &iov, 1);
   }
   sslUnblockSigPipe();
   return rc;
 }
 
+static void httpQueueReply(struct HttpConnection *http, const char *data,
+                           int length, char *owned, struct HttpReply *reply) {
+  if (length <= 0) {
+    free(owned);
+    deleteHttpReply(reply);
+    return;
+  }
+  struct HttpSegment *segment;
+  check(segment               = malloc(sizeof(struct HttpSegment)));
+  segment->next               = NULL;
+  segment->data               = data;
+  segment->length             = length;
+  segment->owned              = owned;
+  segment->reply              = reply;
+  *http->msgTail              = segment;
+  http->msgTail               = &segment->next;
+  http->msgLength            += length;
+}
+
+static void httpQueueOutput(struct HttpConnection *http, const char *data,
+                            int length, char *owned) {
+  httpQueueReply(http, data, length, owned, NULL);
+}
+
+static void httpDiscardOutput(struct HttpConnection *http) {
+  while (http->msg) {
+    struct HttpSegment *segment = http->msg;
+    http->msg                 = segment->next;
+    free(segment->owned);
+    deleteHttpReply(segment->reply);
+    free(segment);
+  }
+  http->msgTail               = &http->msg;
+  http->msgLength             = 0;
+}
+
+static void httpConsumeOutput(struct HttpConnection *http, int length) {
+  http->msgLength            -= length;
+  while (length > 0) {
+    struct HttpSegment *segment = http->msg;
+    check(segment);
+    if (length < segment->length) {
+      segment->data          += length;
+      segment->length        -= length;
+      break;
+    }
+    length                   -= segment->length;
+    http->msg                 = segment->next;
+    free(segment->owned);
+    deleteHttpReply(segment->reply);
+    free(segment);
+  }
+  if (!http->msg) {
+    http->msgTail             = &http->msg;
+  }
+}
+
+static ssize_t httpWriteOutput(struct HttpConnection *http) {
+  // Writes as much of the queued data as the socket accepts. Returns the
+  // number of bytes written, or -1 and sets errno.
+  ssize_t rc;
+  if (http->sslHndl) {
+    // OpenSSL cannot gather data from multiple buffers. Write one segment at
+    // a time, until one of them can only be sent partially.
+    rc                        = 0;
+    for (struct HttpSegment *segment = http->msg; segment;
+         segment = segment->next) {
+      ssize_t wrote           = httpWrite(http, segment->data,
+                                          segment->length);
+      if (wrote <= 0) {
+        if (!rc) {
+          rc                  = wrote;
+        }
+        break;
+      }
+      rc                     += wrote;
+      if (wrote < segment->length) {
+        break;
+      }
+    }
+  } else {
+    struct iovec iov[MAX_WRITE_SEGMENTS];
+    int count                 = 0;
+    for (struct HttpSegment *segment = http->msg;
+         segment && count < MAX_WRITE_SEGMENTS; segment = segment->next) {
+      iov[count].iov_base     = (void *)segment->data;
+      iov[count].iov_len      = segment->length;
+      count++;
+    }
+    sslBlockSigPipe();
+    rc                        = serverWritev(http->server, http->fd, iov,
+                                             count);
+    sslUnblockSigPipe();
+  }
+  if (rc > 0) {
+    httpConsumeOutput(http, rc);
+  }
+  return rc;
+}
+
 static int httpShutdown(struct HttpConnection *http, int how) {
   if (http->sslHndl) {
     if (how != SHUT_RD) {
@@ -235,6 +436,37 @@ static char *strcasestr(const char *haystack, const char *needle) {
 }
 #endif
 
+static char *httpRedactPath(const char *path) {
+  // Session keys grant access to a shell. Some clients have no choice but
+  // to pass them in the query string, but they must never end up in a log
+  // file. Returns a newly allocated copy of "path" without them.
+  const char *query          = strchr(path, '?');
+  char *redacted;
+  if (!query) {
+    check(redacted           = strdup(path));
+    return redacted;
+  }
+  check(redacted             = malloc(2*strlen(path) + 1));
+  memcpy(redacted, path, query + 1 - path);
+  char *dst                  = redacted + (query + 1 - path);
+  for (const char *src = query + 1; *src; ) {
+    int argLength            = strcspn(src, "&");
+    if (argLength >= 8 && !memcmp(src, "session=", 8)) {
+      memcpy(dst, "session=***", 11);
+      dst                   += 11;
+    } else {
+      memcpy(dst, src, argLength);
+      dst                   += argLength;
+    }
+    src                     += argLength;
+    if (*src) {
+      *dst++                 = *src++;
+    }
+  }
+  *dst                       = '\000';
+  return redacted;
+}
+
 static int httpFinishCommand(struct HttpConnection *http) {
   int rc            = HTTP_DONE;
   if ((http->callback || http->websocketHandler) && !http->done) {
@@ -260,22 +492,26 @@ static int httpFinishCommand(struct HttpConnection *http) {
     check(http->path);
     check(http->version);
     if (http->peerName) {
+      // Reactor threads log concurrently, so they cannot share the static
+      // buffer of localtime().
       time_t t      = currentTime;
-      struct tm *ltime;
-      check (ltime  = localtime(&t));
+      struct tm ltime;
+      check(localtime_r(&t, &ltime));
       char timeBuf[80];
       char lengthBuf[40];
       check(strftime(timeBuf, sizeof(timeBuf),
-                     "[%d/%b/%Y:%H:%M:%S %z]", ltime));
+                     "[%d/%b/%Y:%H:%M:%S %z]", &ltime));
       if (http->totalWritten > 0) {
         snprintf(lengthBuf, sizeof(lengthBuf), "%d", http->totalWritten);
       } else {
         *lengthBuf  = '\000';
         strncat(lengthBuf, "-", sizeof(lengthBuf)-1);
       }
+      char *path    = httpRedactPath(http->path);
       info("[http] %s - - %s \"%s %s %s\" %d %s",
-           http->peerName, timeBuf, http->method, http->path, http->version,
+           http->peerName, timeBuf, http->method, path, http->version,
            http->code, lengthBuf);
+      free(path);
     }
   }
   return rc;
@@ -332,12 +568,19 @@ static void httpSetState(struct HttpConnection *http, int state) {
     check(!http->private);
     free(http->url);
     free(http->method);
-    free(http->path);
+    if (http->path) {
+      // Remember the last request, so that we can still describe the
+      // connection after the request has completed.
+      free(http->lastPath);
+      http->lastPath         = http->path;
+    }
     free(http->matchedPath);
     free(http->pathInfo);
     free(http->query);
     free(http->version);
     http->done               = 0;
+    http->partialReplyIdle   = 0;
+    http->readPaused         = 0;
     http->url                = NULL;
     http->method             = NULL;
     http->path               = NULL;
@@ -349,6 +592,7 @@ static void httpSetState(struct HttpConnection *http, int state) {
     initHashMap(&http->header, httpDestroyHeaders, NULL);
     http->headerLength       = 0;
     http->callback           = NULL;
+    http->websocketHandler   = NULL;
     http->arg                = NULL;
     http->totalWritten       = 0;
     http->code               = 200;
@@ -373,14 +617,19 @@ void initHttpConnection(struct HttpConnection *http, struct Server *server,
   http->fd                 = fd;
   http->port               = port;
   http->closed             = 0;
+  http->handedOff          = 0;
+  http->handOffWaits       = 0;
   http->isSuspended        = 0;
   http->isPartialReply     = 0;
+  http->partialReplyIdle   = 0;
+  http->readPaused         = 0;
   http->done               = 0;
   http->state              = ssl ? SNIFFING_SSL : COMMAND;
   http->peerName           = getPeerName(fd, &http->peerPort, numericHosts);
   http->url                = NULL;
   http->method             = NULL;
   http->path               = NULL;
+  http->lastPath           = NULL;
   http->matchedPath        = NULL;
   http->pathInfo           = NULL;
   http->query              = NULL;
@@ -391,11 +640,18 @@ void initHttpConnection(struct HttpConnection *http, struct Server *server,
   http->partial            = NULL;
   http->partialLength      = 0;
   http->msg                = NULL;
+  http->msgTail            = &http->msg;
   http->msgLength          = 0;
-  http->msgOffset          = 0;
   http->totalWritten       = 0;
   http->expecting          = 0;
   http->websocketType      = WS_UNDEFINED;
+  memset(http->websocketMask, 0, sizeof(http->websocketMask));
+  http->websocketMaskIdx   = 0;
+  http->websocketUTF8      = 0;
+  http->websocketPinged    = 0;
+  http->websocketClosing   = 0;
+  http->websocketCongested = 0;
+  http->websocketDeflate   = NULL;
   http->callback           = NULL;
   http->websocketHandler   = NULL;
   http->arg                = NULL;
@@ -404,6 +660,7 @@ void initHttpConnection(struct HttpConnection *http, struct Server *server,
   http->ssl                = ssl;
   http->sslHndl            = NULL;
   http->lastError          = 0;
+  http->renegotiationCount = 0;
   if (logIsInfo()) {
     debug("[http] Accepted connection from %s:%d",
           http->peerName ? http->peerName : "???", http->peerPort);
@@ -429,19 +686,24 @@ void destroyHttpConnection(struct HttpConnection *http) {
       debug("[http] Closing connection to %s:%d",
             http->peerName ? http->peerName : "???", http->peerPort);
     }
-    httpShutdown(http, http->closed ? SHUT_WR : SHUT_RDWR);
+    if (!http->handedOff) {
+      httpShutdown(http, http->closed ? SHUT_WR : SHUT_RDWR);
+    }
+    serverReleaseConnection(http->server, http->fd);
     dcheck(!close(http->fd) || errno != EBADF);
     free(http->peerName);
     free(http->url);
     free(http->method);
     free(http->path);
+    free(http->lastPath);
     free(http->matchedPath);
     free(http->pathInfo);
     free(http->query);
     free(http->version);
+    deleteWebSocketDeflate(http->websocketDeflate);
     destroyHashMap(&http->header);
     free(http->partial);
-    free(http->msg);
+    httpDiscardOutput(http);
   }
 }
 
@@ -451,6 +713,30 @@ void deleteHttpConnection(struct HttpConnection *http) {
 }
 
 #ifdef HAVE_ZLIB
+static int httpHasToken(const char *list, const char *token) {
+  // Checks whether a comma separated header value contains "token". The
+  // comparison is case insensitive.
+  int len                = strlen(token);
+  while (*list) {
+    while (*list == ' ' || *list == '\t' || *list == ',') {
+      list++;
+    }
+    const char *end      = list;
+    while (*end && *end != ',') {
+      end++;
+    }
+    const char *last     = end;
+    while (last > list && (last[-1] == ' ' || last[-1] == '\t')) {
+      last--;
+    }
+    if (last - list == len && !strncasecmp(list, token, len)) {
+      return 1;
+    }
+    list                 = end;
+  }
+  return 0;
+}
+
 static int httpAcceptsEncoding(struct HttpConnection *http,
                                const char *encoding) {
   int encodingLength  = strlen(encoding);
@@ -571,6 +857,229 @@ static void addHeader(char **header, int *headerLength, const char *fmt, ...) {
   free(tmp);
 }
 
+#ifdef HAVE_ZLIB
+static char *httpCompress(const char *buf, int len, int *compressedLength) {
+  // Returns a newly allocated, gzip'd copy of "buf", or NULL if compression
+  // fails to reduce the size.
+  char *compressed;
+  check(compressed          = malloc(len));
+  z_stream strm             = { .zalloc    = Z_NULL,
+                                .zfree     = Z_NULL,
+                                .opaque    = Z_NULL,
+                                .avail_in  = len,
+                                .next_in   = (unsigned char *)buf,
+                                .avail_out = len,
+                                .next_out  = (unsigned char *)compressed
+                              };
+  if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                   31, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+    if (deflate(&strm, Z_FINISH) == Z_STREAM_END) {
+      // Compression was successful and resulted in reduction in size
+      debug("[http] Compressed response from %d to %d", len,
+            len - strm.avail_out);
+      *compressedLength     = len - strm.avail_out;
+      deflateEnd(&strm);
+      return compressed;
+    }
+    deflateEnd(&strm);
+  }
+  free(compressed);
+  return NULL;
+}
+
+static const struct HttpCompressedBody *httpCompressStatic(const char *body,
+                                                           int bodyLength) {
+#ifdef HAVE_PTHREAD_CREATE
+  pthread_mutex_lock(&compressedBodiesLock);
+#endif
+  struct HttpCompressedBody *entry;
+  for (entry                = compressedBodies; entry; entry = entry->next) {
+    if (entry->body == body && entry->bodyLength == bodyLength) {
+      break;
+    }
+  }
+  if (!entry) {
+    // Remember failed attempts, too. There is no point in trying again.
+    check(entry             = malloc(sizeof(struct HttpCompressedBody)));
+    entry->body             = body;
+    entry->bodyLength       = bodyLength;
+    entry->length           = 0;
+    entry->data             = httpCompress(body, bodyLength, &entry->length);
+    entry->next             = compressedBodies;
+    compressedBodies        = entry;
+  }
+#ifdef HAVE_PTHREAD_CREATE
+  pthread_mutex_unlock(&compressedBodiesLock);
+#endif
+  return entry->data ? entry : NULL;
+}
+#endif
+
+HttpDeflateStream *newHttpDeflateStream(void) {
+  // Returns NULL, if compression is not available.
+#ifdef HAVE_ZLIB
+  struct HttpDeflateStream *stream;
+  check(stream              = calloc(1, sizeof(struct HttpDeflateStream)));
+  if (deflateInit2(&stream->strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                   -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(stream);
+    return NULL;
+  }
+  return stream;
+#else
+  return NULL;
+#endif
+}
+
+void deleteHttpDeflateStream(HttpDeflateStream *stream) {
+#ifdef HAVE_ZLIB
+  if (stream) {
+    deflateEnd(&stream->strm);
+    free(stream);
+  }
+#else
+  check(!stream);
+#endif
+}
+
+void httpResetDeflateStream(HttpDeflateStream *stream ATTR_UNUSED) {
+  // Starts over with an empty dictionary. This is necessary, whenever the
+  // client might have missed some of the earlier output.
+#ifdef HAVE_ZLIB
+  deflateReset(&stream->strm);
+#else
+  UNUSED(stream);
+  fatal("[http] Compression is not supported");
+#endif
+}
+
+char *httpDeflateStream(HttpDeflateStream *stream ATTR_UNUSED,
+                        const char *buf ATTR_UNUSED, int len ATTR_UNUSED,
+                        int *compressedLength ATTR_UNUSED) {
+  // Returns a newly allocated chunk of raw deflate data, that ends on a
+  // sync flush.
+#ifdef HAVE_ZLIB
+  z_stream *strm            = &stream->strm;
+  int size                  = len + len/8 + 64;
+  char *compressed;
+  check(compressed          = malloc(size));
+  strm->next_in             = (unsigned char *)buf;
+  strm->avail_in            = len;
+  *compressedLength         = 0;
+  for (;;) {
+    strm->next_out          = (unsigned char *)compressed + *compressedLength;
+    strm->avail_out         = size - *compressedLength;
+    int rc                  = deflate(strm, Z_SYNC_FLUSH);
+    check(rc == Z_OK || rc == Z_BUF_ERROR);
+    *compressedLength       = size - strm->avail_out;
+    if (strm->avail_out) {
+      break;
+    }
+    check(compressed        = realloc(compressed, size *= 2));
+  }
+  return compressed;
+#else
+  UNUSED(stream);
+  UNUSED(buf);
+  UNUSED(len);
+  UNUSED(compressedLength);
+  fatal("[http] Compression is not supported");
+#endif
+}
+
+void httpDeflateStreamToReply(HttpDeflateStream *stream ATTR_UNUSED,
+                              const char *buf ATTR_UNUSED,
+                              int len ATTR_UNUSED,
+                              struct HttpReply *reply ATTR_UNUSED) {
+  // Same as httpDeflateStream(), but appends the raw deflate data to the
+  // body of "reply".
+#ifdef HAVE_ZLIB
+  z_stream *strm            = &stream->strm;
+  strm->next_in             = (unsigned char *)buf;
+  strm->avail_in            = len;
+  for (int size = len + len/8 + 64;; size *= 2) {
+    strm->next_out          = (unsigned char *)httpReplyReserve(reply, size);
+    strm->avail_out         = size;
+    int rc                  = deflate(strm, Z_SYNC_FLUSH);
+    check(rc == Z_OK || rc == Z_BUF_ERROR);
+    httpReplyCommit(reply, size - strm->avail_out);
+    if (strm->avail_out) {
+      break;
+    }
+  }
+#else
+  UNUSED(stream);
+  UNUSED(buf);
+  UNUSED(len);
+  UNUSED(reply);
+  fatal("[http] Compression is not supported");
+#endif
+}
+
+static void httpFinishTransfer(struct HttpConnection *http) {
+  // The caller can suspend the connection, so that it can send an
+  // asynchronous reply. Once the reply has been sent, the connection
+  // gets reactivated. Normally, this means it would go back to listening
+  // for commands.
+  // Similarly, the caller can indicate that this is a partial message and
+  // return additional data in subsequent calls to the callback handler.
+  if (http->isSuspended || http->isPartialReply) {
+    if (http->msgLength > 0) {
+      int wrote             = httpWriteOutput(http);
+      if (wrote < 0 && errno != EAGAIN) {
+        httpCloseRead(http);
+        httpDiscardOutput(http);
+      }
+    }
+
+    check(http->state == PAYLOAD || http->state == DISCARD_PAYLOAD);
+    if (!http->isPartialReply) {
+      if (http->expecting < 0) {
+        // If we do not know the length of the content, close the connection.
+        debug("[http] Closing previously suspended connection!");
+        httpCloseRead(http);
+        httpSetState(http, DISCARD_PAYLOAD);
+      } else if (http->expecting == 0) {
+        httpSetState(http, COMMAND);
+        http->isSuspended  = 0;
+        struct ServerConnection *connection = httpGetServerConnection(http);
+        if (!serverGetTimeout(connection)) {
+          serverSetTimeout(connection, CONNECTION_TIMEOUT);
+        }
+        serverConnectionSetEvents(http->server, connection, http->fd,
+                                  http->msgLength ? POLLIN|POLLOUT : POLLIN);
+      }
+    } else {
+      // Partial replies can be continued at any time, not just from inside
+      // of the callback. Make sure that the server loop notices.
+      struct ServerConnection *connection = httpGetServerConnection(http);
+      if (connection) {
+        serverConnectionSetEvents(http->server, connection, http->fd,
+                                  (!http->closed && http->expecting ?
+                                   POLLIN : 0) | POLLOUT);
+      }
+    }
+  } else if (http->state == WEBSOCKET) {
+    // WebSocket messages can be sent at any time, not just in response to
+    // incoming data. Try writing them right away, and let the server loop
+    // take care of anything that is left over.
+    if (http->msgLength > 0) {
+      int wrote             = httpWriteOutput(http);
+      if (wrote < 0 && errno != EAGAIN) {
+        httpCloseRead(http);
+        httpDiscardOutput(http);
+      }
+    }
+    struct ServerConnection *connection = httpGetServerConnection(http);
+    if (connection) {
+      serverConnectionSetEvents(http->server, connection, http->fd,
+                                (http->closed ? 0 : POLLIN) |
+                                (http->msgLength || http->closed ||
+                                 http->websocketCongested ? POLLOUT : 0));
+    }
+  }
+}
+
 void httpTransfer(struct HttpConnection *http, char *msg, int len) {
   check(msg);
   check(len >= 0);
@@ -616,7 +1125,7 @@ void httpTransfer(struct HttpConnection *http, char *msg, int len) {
         // Compress replies that might exceed the size of a single IP packet
         compress            = !isHead &&
                               !http->isPartialReply &&
-                              len > 1400 &&
+                              len > MIN_COMPRESS_LENGTH &&
                               httpAcceptsEncoding(http, "gzip");
         #endif
         break;
@@ -646,137 +1155,203 @@ void httpTransfer(struct HttpConnection *http, char *msg, int len) {
     if (compress) {
       #ifdef HAVE_ZLIB
       // Compress the message
-      char *compressed;
-      check(compressed      = malloc(len));
-      check(len >= bodyOffset + 2);
-      z_stream strm         = { .zalloc    = Z_NULL,
-                                .zfree     = Z_NULL,
-                                .opaque    = Z_NULL,
-                                .avail_in  = l,
-                                .next_in   = (unsigned char *)line,
-                                .avail_out = len,
-                                .next_out  = (unsigned char *)compressed
-                              };
-      if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
-                       31, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
-        if (deflate(&strm, Z_FINISH) == Z_STREAM_END) {
-          // Compression was successful and resulted in reduction in size
-          debug("[http] Compressed response from %d to %d", len, len-strm.avail_out);
-          free(msg);
-          msg               = compressed;
-          len              -= strm.avail_out;
-          bodyOffset        = 0;
-          removeHeader(header, &headerLength, "content-length:");
-          removeHeader(header, &headerLength, "content-encoding:");
-          addHeader(&header, &headerLength, "Content-Length: %d\r\n", len);
-          addHeader(&header, &headerLength, "Content-Encoding: gzip\r\n");
-        } else {
-          free(compressed);
-        }
-        deflateEnd(&strm);
-      } else {
-        free(compressed);
+      int compressedLength;
+      char *compressed      = httpCompress(line, l, &compressedLength);
+      if (compressed) {
+        free(msg);
+        msg                 = compressed;
+        len                 = compressedLength;
+        bodyOffset          = 0;
+        removeHeader(header, &headerLength, "content-length:");
+        removeHeader(header, &headerLength, "content-encoding:");
+        addHeader(&header, &headerLength, "Content-Length: %d\r\n", len);
+        addHeader(&header, &headerLength, "Content-Encoding: gzip\r\n");
       }
       #endif
     }
   }
 
+  // Headers and body are queued separately, so that neither of them has to
+  // be copied.
   http->totalWritten       += headerLength + (len - bodyOffset);
-  if (!headerLength) {
-    free(header);
-  } else if (http->msg) {
-    check(http->msg         = realloc(http->msg,
-                                      http->msgLength - http->msgOffset +
-                                      max(http->msgOffset, headerLength)));
-    if (http->msgOffset) {
-      memmove(http->msg, http->msg + http->msgOffset,
-              http->msgLength - http->msgOffset);
-      http->msgLength      -= http->msgOffset;
-      http->msgOffset       = 0;
-    }
-    memcpy(http->msg + http->msgLength, header, headerLength);
-    http->msgLength        += headerLength;
-    free(header);
-  } else {
-    check(!http->msgOffset);
-    http->msg               = header;
-    http->msgLength         = headerLength;
-  }
-
-  if (len <= bodyOffset) {
-    free(msg);
-  } else if (http->msg) {
-    check(http->msg         = realloc(http->msg,
-                                      http->msgLength - http->msgOffset +
-                                      max(http->msgOffset, len - bodyOffset)));
-    if (http->msgOffset) {
-      memmove(http->msg, http->msg + http->msgOffset,
-              http->msgLength - http->msgOffset);
-      http->msgLength      -= http->msgOffset;
-      http->msgOffset       = 0;
-    }
-    memcpy(http->msg + http->msgLength, msg + bodyOffset, len - bodyOffset);
-    http->msgLength        += len - bodyOffset;
-    free(msg);
-  } else {
-    check(!http->msgOffset);
-    if (bodyOffset) {
-      memmove(msg, msg + bodyOffset, len - bodyOffset);
+  httpQueueOutput(http, header, headerLength, header);
+  httpQueueOutput(http, msg + bodyOffset, len - bodyOffset, msg);
+  httpFinishTransfer(http);
+}
+
+void httpTransferStatic(struct HttpConnection *http, char *header,
+                        const char *body, int bodyLength) {
+  // Sends "header", which must be a complete set of HTTP headers, followed
+  // by "body". The body is never copied, and it has to stay valid for the
+  // lifetime of the process (e.g. data that is compiled into the binary).
+  check(header);
+  check(bodyLength >= 0);
+  int headerLength          = strlen(header);
+  check(headerLength >= 4 && !memcmp(header + headerLength - 4,
+                                     "\r\n\r\n", 4));
+  check(!http->isPartialReply);
+  if (http->method && !strcmp(http->method, "HEAD")) {
+    bodyLength              = 0;
+  }
+
+  #ifdef HAVE_ZLIB
+  if (bodyLength > MIN_COMPRESS_LENGTH && httpAcceptsEncoding(http, "gzip")) {
+    const struct HttpCompressedBody *compressed = httpCompressStatic(
+                                                          body, bodyLength);
+    if (compressed) {
+      body                  = compressed->data;
+      bodyLength            = compressed->length;
+      removeHeader(header, &headerLength, "content-length:");
+      removeHeader(header, &headerLength, "content-encoding:");
+      addHeader(&header, &headerLength, "Content-Length: %d\r\n",
+                bodyLength);
+      addHeader(&header, &headerLength, "Content-Encoding: gzip\r\n");
     }
-    http->msg               = msg;
-    http->msgLength         = len - bodyOffset;
   }
+  #endif
 
-  // The caller can suspend the connection, so that it can send an
-  // asynchronous reply. Once the reply has been sent, the connection
-  // gets reactivated. Normally, this means it would go back to listening
-  // for commands.
-  // Similarly, the caller can indicate that this is a partial message and
-  // return additional data in subsequent calls to the callback handler.
-  if (http->isSuspended || http->isPartialReply) {
-    if (http->msg && http->msgLength > 0) {
-      int wrote             = httpWrite(http, http->msg, http->msgLength);
-      if (wrote < 0 && errno != EAGAIN) {
-        httpCloseRead(http);
-        free(http->msg);
-        http->msgLength     = 0;
-        http->msg           = NULL;
-      } else if (wrote > 0) {
-        if (wrote == http->msgLength) {
-          free(http->msg);
-          http->msgLength   = 0;
-          http->msg         = NULL;
-        } else {
-          memmove(http->msg, http->msg + wrote, http->msgLength - wrote);
-          http->msgLength  -= wrote;
-        }
-      }
+  http->totalWritten       += headerLength + bodyLength;
+  httpQueueOutput(http, header, headerLength, header);
+  httpQueueOutput(http, body, bodyLength, NULL);
+  httpFinishTransfer(http);
+}
+
+struct HttpReply *newHttpReply(int size) {
+  // Starts an empty reply, with room for at least "size" bytes of body.
+  // The buffers of earlier replies get recycled, whenever possible.
+  check(size >= 0);
+  struct HttpReply *reply   = replyPool;
+  if (reply) {
+    replyPool               = reply->next;
+    replyPoolSize--;
+  } else {
+    check(reply             = malloc(sizeof(struct HttpReply)));
+    reply->buf              = NULL;
+    reply->size             = 0;
+  }
+  reply->next               = NULL;
+  reply->length             = REPLY_HEADROOM;
+  httpReplyReserve(reply, size);
+  return reply;
+}
+
+void deleteHttpReply(struct HttpReply *reply) {
+  if (reply) {
+    if (replyPoolSize < MAX_POOLED_REPLIES &&
+        reply->size <= REPLY_HEADROOM + MAX_POOLED_SIZE) {
+      reply->next           = replyPool;
+      replyPool             = reply;
+      replyPoolSize++;
+    } else {
+      free(reply->buf);
+      free(reply);
     }
+  }
+}
 
-    check(http->state == PAYLOAD || http->state == DISCARD_PAYLOAD);
-    if (!http->isPartialReply) {
-      if (http->expecting < 0) {
-        // If we do not know the length of the content, close the connection.
-        debug("[http] Closing previously suspended connection!");
-        httpCloseRead(http);
-        httpSetState(http, DISCARD_PAYLOAD);
-      } else if (http->expecting == 0) {
-        httpSetState(http, COMMAND);
-        http->isSuspended  = 0;
-        struct ServerConnection *connection = httpGetServerConnection(http);
-        if (!serverGetTimeout(connection)) {
-          serverSetTimeout(connection, CONNECTION_TIMEOUT);
-        }
-        serverConnectionSetEvents(http->server, connection, http->fd,
-                                  http->msgLength ? POLLIN|POLLOUT : POLLIN);
-      }
+char *httpReplyReserve(struct HttpReply *reply, int len) {
+  // Returns room for "len" more bytes at the end of the body. They only
+  // become part of the reply, once the caller commits them.
+  check(len >= 0);
+  if (reply->size - reply->length < len) {
+    int size                = max(2*reply->size, reply->length + len);
+    check(reply->buf        = realloc(reply->buf, size));
+    reply->size             = size;
+  }
+  return reply->buf + reply->length;
+}
+
+void httpReplyCommit(struct HttpReply *reply, int len) {
+  check(len >= 0 && len <= reply->size - reply->length);
+  reply->length            += len;
+}
+
+void httpReplyAppend(struct HttpReply *reply, const char *buf, int len) {
+  memcpy(httpReplyReserve(reply, len), buf, len);
+  reply->length            += len;
+}
+
+void httpReplyPrintf(struct HttpReply *reply, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int len                   = vsnprintf(reply->buf + reply->length,
+                                        reply->size - reply->length, fmt, ap);
+  va_end(ap);
+  check(len >= 0);
+  if (len >= reply->size - reply->length) {
+    va_start(ap, fmt);
+    check(vsnprintf(httpReplyReserve(reply, len + 1), len + 1,
+                    fmt, ap) == len);
+    va_end(ap);
+  }
+  reply->length            += len;
+}
+
+const char *httpReplyBody(const struct HttpReply *reply, int *len) {
+  *len                      = reply->length - REPLY_HEADROOM;
+  return reply->buf + REPLY_HEADROOM;
+}
+
+void httpTransferReply(struct HttpConnection *http, struct HttpReply *reply,
+                       int compress, const char *fmt, ...) {
+  // Sends "reply" with the status line and the headers that "fmt" expands
+  // to. Content-Length is added here, and all headers are written straight
+  // in front of the body. So, the reply goes out as a single block that
+  // never has to be copied or parsed again. Unless "compress" is zero,
+  // large bodies get gzip'd for clients that accept it. Takes ownership of
+  // "reply".
+  check(!http->isPartialReply);
+  char header[REPLY_HEADROOM];
+  va_list ap;
+  va_start(ap, fmt);
+  int headerLength          = vsnprintf(header, sizeof(header), fmt, ap);
+  va_end(ap);
+  check(headerLength > 9 && headerLength < (int)sizeof(header) &&
+        !memcmp(header, "HTTP/1.", 7) &&
+        !memcmp(header + headerLength - 2, "\r\n", 2));
+
+  int bodyLength            = reply->length - REPLY_HEADROOM;
+  int isHead                = http->method && !strcmp(http->method, "HEAD");
+  char *compressed          = NULL;
+  int compressedLength      = 0;
+  #ifdef HAVE_ZLIB
+  // Compress replies that might exceed the size of a single IP packet
+  if (compress && !isHead && bodyLength > MIN_COMPRESS_LENGTH &&
+      httpAcceptsEncoding(http, "gzip")) {
+    compressed              = httpCompress(reply->buf + REPLY_HEADROOM,
+                                           bodyLength, &compressedLength);
+  }
+  #else
+  UNUSED(compress);
+  #endif
+  headerLength             += snprintf(header + headerLength,
+                                       sizeof(header) - headerLength,
+                                       "%sContent-Length: %d\r\n\r\n",
+                                       compressed ? "Content-Encoding: gzip\r\n"
+                                                  : "",
+                                       compressed ? compressedLength
+                                                  : bodyLength);
+  check(headerLength < (int)sizeof(header));
+  char *start               = reply->buf + REPLY_HEADROOM - headerLength;
+  memcpy(start, header, headerLength);
+  if (compressed) {
+    http->totalWritten     += headerLength + compressedLength;
+    httpQueueReply(http, start, headerLength, NULL, reply);
+    httpQueueOutput(http, compressed, compressedLength, compressed);
+  } else {
+    if (isHead) {
+      bodyLength            = 0;
     }
+    http->totalWritten     += headerLength + bodyLength;
+    httpQueueReply(http, start, headerLength + bodyLength, NULL, reply);
   }
+  httpFinishTransfer(http);
 }
 
 void httpTransferPartialReply(struct HttpConnection *http, char *msg, int len){
   check(!http->isSuspended);
-  http->isPartialReply = 1;
+  http->isPartialReply   = 1;
+  http->partialReplyIdle = 0;
   if (http->state != PAYLOAD && http->state != DISCARD_PAYLOAD) {
     check(http->state == HEADERS);
     httpSetState(http, PAYLOAD);
@@ -784,9 +1359,47 @@ void httpTransferPartialReply(struct HttpConnection *http, char *msg, int len){
   httpTransfer(http, msg, len);
 }
 
+static int httpSplitPath(struct HttpConnection *http, char *diff) {
+  // Splits the request path into the part that matched a handler, any
+  // additional path information, and the query string. Returns zero, if
+  // the handler's URL did not end on a path component boundary.
+  check(diff);
+  while (diff > http->path && diff[-1] == '/') {
+    diff--;
+  }
+  if (*diff && *diff != '/' && *diff != '?' && *diff != '#') {
+    return 0;
+  }
+  check(!http->matchedPath);
+  check(!http->pathInfo);
+  check(!http->query);
+
+  check(http->matchedPath              = malloc(diff - http->path + 1));
+  memcpy(http->matchedPath, http->path, diff - http->path);
+  http->matchedPath[diff - http->path] = '\000';
+
+  const char *query = strchr(diff, '?');
+  if (*diff && *diff != '?') {
+    const char *endOfInfo              = query
+                                         ? query : strrchr(diff, '\000');
+    check(http->pathInfo               = malloc(endOfInfo - diff + 1));
+    memcpy(http->pathInfo, diff, endOfInfo - diff);
+    http->pathInfo[endOfInfo - diff]   = '\000';
+  }
+
+  if (query) {
+    check(http->query                  = strdup(query + 1));
+  }
+  return 1;
+}
+
 static int httpHandleCommand(struct HttpConnection *http,
                              const struct Trie *handlers) {
-  debug("[http] Handling \"%s\" \"%s\"", http->method, http->path);
+  if (logIsDebug()) {
+    char *path                         = httpRedactPath(http->path);
+    debug("[http] Handling \"%s\" \"%s\"", http->method, path);
+    free(path);
+  }
   const char *contentLength                  = getFromHashMap(&http->header,
                                                              "content-length");
   if (contentLength != NULL && *contentLength) {
@@ -854,95 +1467,76 @@ static int httpHandleCommand(struct HttpConnection *http,
   struct HttpHandler *h = (struct HttpHandler *)getFromTrie(handlers,
                                                             http->path, &diff);
 
-  if (h) {
+  if (h && httpSplitPath(http, diff)) {
     if (h->websocketHandler) {
-      // Check for WebSocket handshake
+      // Check for a WebSocket handshake (RFC 6455, section 4.2)
       const char *upgrade                    = getFromHashMap(&http->header,
                                                               "upgrade");
-      if (upgrade && !strcmp(upgrade, "WebSocket")) {
+      if (upgrade && httpHasToken(upgrade, "websocket")) {
         const char *connection               = getFromHashMap(&http->header,
                                                               "connection");
-        if (connection && !strcmp(connection, "Upgrade")) {
-          const char *origin                 = getFromHashMap(&http->header,
-                                                              "origin");
-          if (origin) {
-            for (const char *ptr = origin; *ptr; ptr++) {
-              if ((unsigned char)*ptr < ' ') {
-                goto bad_ws_upgrade;
-              }
-            }
-
-            const char *protocol             = getFromHashMap(&http->header,
-                                                         "websocket-protocol");
-            if (protocol) {
-              for (const char *ptr = protocol; *ptr; ptr++) {
-                if ((unsigned char)*ptr < ' ') {
-                  goto bad_ws_upgrade;
-                }
-              }
-            }
-            char *port                       = NULL;
-            if (http->port != (http->sslHndl ? 443 : 80)) {
-              port                           = stringPrintf(NULL,
-                                                            ":%d", http->port);
-            }
-            char *response                   = stringPrintf(NULL,
-              "HTTP/1.1 101 Web Socket Protocol Handshake\r\n"
-              "Upgrade: WebSocket\r\n"
-              "Connection: Upgrade\r\n"
-              "WebSocket-Origin: %s\r\n"
-              "WebSocket-Location: %s://%s%s%s\r\n"
-              "%s%s%s"
-              "\r\n",
-              origin,
-              http->sslHndl ? "wss" : "ws", host && *host ? host : "localhost",
-              port ? port : "", http->path,
-              protocol ? "WebSocket-Protocol: " : "",
-              protocol ? protocol : "",
-              protocol ? "\r\n" : "");
-            free(port);
-            debug("[http] Switching to WebSockets");
-            httpTransfer(http, response, strlen(response));
-            if (http->expecting < 0) {
-              http->expecting                = 0;
-            }
-            http->websocketHandler           = h->websocketHandler;
-            httpSetState(http, WEBSOCKET);
-            return HTTP_READ_MORE;
-          }
+        const char *key                      = getFromHashMap(&http->header,
+                                                         "sec-websocket-key");
+        const char *version                  = getFromHashMap(&http->header,
+                                                     "sec-websocket-version");
+        if (strcmp(http->method, "GET") ||
+            strcmp(http->version, "HTTP/1.1") < 0 ||
+            !connection || !httpHasToken(connection, "upgrade") ||
+            !key || strlen(key) != 24) {
+          httpSendReply(http, 400, "Bad Request", NO_MSG);
+          return HTTP_DONE;
+        }
+        if (!version || strcmp(version, "13")) {
+          // Tell the client which version of the protocol we speak.
+          static const char response[]       =
+            "HTTP/1.1 426 Upgrade Required\r\n"
+            "Sec-WebSocket-Version: 13\r\n"
+            "Content-Length: 0\r\n"
+            "\r\n";
+          char *header;
+          check(header                       = strdup(response));
+          http->code                         = 426;
+          httpTransferStatic(http, header, "", 0);
+          return HTTP_DONE;
         }
+        const char *extensions               = getFromHashMap(&http->header,
+                                                  "sec-websocket-extensions");
+        char *extension                      = NULL;
+        if (extensions) {
+          http->websocketDeflate             = newWebSocketDeflate(extensions,
+                                                                  &extension);
+        }
+        char *accept                         = websocketAcceptKey(key);
+        char *response                       = stringPrintf(NULL,
+          "HTTP/1.1 101 Switching Protocols\r\n"
+          "Upgrade: websocket\r\n"
+          "Connection: Upgrade\r\n"
+          "Sec-WebSocket-Accept: %s\r\n"
+          "%s%s%s"
+          "\r\n",
+          accept,
+          extension ? "Sec-WebSocket-Extensions: " : "",
+          extension ? extension : "", extension ? "\r\n" : "");
+        free(accept);
+        free(extension);
+        debug("[http] Switching to WebSockets");
+        http->code                           = 101;
+        httpTransfer(http, response, strlen(response));
+        if (http->expecting < 0) {
+          http->expecting                    = 0;
+        }
+        http->websocketHandler               = h->websocketHandler;
+        http->arg                            = h->websocketArg;
+        http->websocketType                  = WS_UNDEFINED;
+        httpSetState(http, WEBSOCKET);
+        serverSetTimeout(httpGetServerConnection(http),
+                         WEBSOCKET_PING_INTERVAL);
+        return HTTP_READ_MORE;
       }
     }
-  bad_ws_upgrade:;
 
     if (h->handler) {
-      check(diff);
-      while (diff > http->path && diff[-1] == '/') {
-        diff--;
-      }
-      if (!*diff || *diff == '/' || *diff == '?' || *diff == '#') {
-        check(!http->matchedPath);
-        check(!http->pathInfo);
-        check(!http->query);
-
-        check(http->matchedPath              = malloc(diff - http->path + 1));
-        memcpy(http->matchedPath, http->path, diff - http->path);
-        http->matchedPath[diff - http->path] = '\000';
-
-        const char *query = strchr(diff, '?');
-        if (*diff && *diff != '?') {
-          const char *endOfInfo              = query
-                                               ? query : strrchr(diff, '\000');
-          check(http->pathInfo               = malloc(endOfInfo - diff + 1));
-          memcpy(http->pathInfo, diff, endOfInfo - diff);
-          http->pathInfo[endOfInfo - diff]   = '\000';
-        }
-
-        if (query) {
-          check(http->query                  = strdup(query + 1));
-        }
-        return h->handler(http, h->arg);
-      }
+      return h->handler(http, h->arg);
     }
   }
   httpSendReply(http, 404, "File Not Found", NO_MSG);
@@ -1271,138 +1865,274 @@ static int httpParsePayload(struct HttpConnection *http, int offset,
   return consumed;
 }
 
+static void httpSendWebSocketFrame(struct HttpConnection *http, int opcode,
+                                   int fin, const char *payload, int len) {
+  char *frame;
+  if (http->websocketDeflate && !(opcode & 0x8)) {
+    int frameLength;
+    frame                = websocketDeflateFrame(http->websocketDeflate,
+                                                 opcode, fin, payload, len,
+                                                 &frameLength);
+    httpTransfer(http, frame, frameLength);
+    return;
+  }
+  check(frame            = malloc(WS_MAX_HEADER_LENGTH + len));
+  int headerLength       = websocketFrameHeader(frame, opcode, fin, len);
+  memcpy(frame + headerLength, payload, len);
+  httpTransfer(http, frame, headerLength + len);
+}
+
+static int httpFailWebSocket(struct HttpConnection *http, int code,
+                             const char *reason) {
+  // The peer violated the protocol. Tell it why, and stop reading.
+  debug("[http] Closing WebSocket: %s", reason);
+  httpCloseWebSocket(http, code, reason);
+  httpCloseRead(http);
+  return -1;
+}
+
+static int httpHandleWebSocketControl(struct HttpConnection *http,
+                                      int opcode, const char *payload,
+                                      int len) {
+  switch (opcode) {
+  case WS_OP_PING:
+    if (!http->websocketClosing) {
+      httpSendWebSocketFrame(http, WS_OP_PONG, 1, payload, len);
+    }
+    break;
+  case WS_OP_PONG:
+    http->websocketPinged        = 0;
+    break;
+  case WS_OP_CLOSE: {
+    int code                     = 0;
+    if (len == 1) {
+      return httpFailWebSocket(http, WS_CLOSE_PROTOCOL, "Bad close frame");
+    } else if (len >= 2) {
+      code                       = ((unsigned char)payload[0] << 8) |
+                                    (unsigned char)payload[1];
+      int utf8                   = 0;
+      if (!websocketValidCloseCode(code)) {
+        return httpFailWebSocket(http, WS_CLOSE_PROTOCOL, "Bad close code");
+      }
+      if (!websocketCheckUTF8(&utf8, (const unsigned char *)payload + 2,
+                              len - 2) || utf8) {
+        return httpFailWebSocket(http, WS_CLOSE_INVALID_DATA,
+                                 "Bad close reason");
+      }
+    }
+
+    // Either this completes a closing handshake that we started, or we
+    // have to echo the peer's status code. Either way, the connection is
+    // done once our close frame has been sent.
+    httpCloseWebSocket(http, code, NULL);
+    httpCloseRead(http);
+    break; }
+  default:
+    return httpFailWebSocket(http, WS_CLOSE_PROTOCOL, "Unknown opcode");
+  }
+  return 0;
+}
+
+static int httpDeliverWebSocket(struct HttpConnection *http, int end,
+                                const char *data, int len) {
+  // Passes (uncompressed) payload of a data message on to the handler.
+  int type                          = http->websocketType &
+                                      (0xF | WS_START_OF_FRAME);
+  if (end) {
+    type                           |= WS_END_OF_FRAME;
+  }
+  if ((type & 0xF) == WS_OP_TEXT &&
+      (!websocketCheckUTF8(&http->websocketUTF8,
+                           (const unsigned char *)data, len) ||
+       (end && http->websocketUTF8))) {
+    return httpFailWebSocket(http, WS_CLOSE_INVALID_DATA,
+                             "Text is not valid UTF-8");
+  }
+  if (len || end) {
+    // Once we have started closing the connection, incoming data is
+    // no longer of interest.
+    if (!http->websocketClosing &&
+        http->websocketHandler(http, http->arg, type, data, len) !=
+        HTTP_DONE) {
+      return -1;
+    }
+    http->websocketType            &= ~WS_START_OF_FRAME;
+  }
+  return 0;
+}
+
 static int httpHandleWebSocket(struct HttpConnection *http, int offset,
                                const char *buf, int bytes) {
+  // Parses RFC 6455 frames. Payload of data frames is passed to the handler
+  // as soon as it arrives, so large messages never have to be buffered. But
+  // frame headers and control frames are only processed when they are
+  // complete. Returns the number of bytes consumed, so that the caller can
+  // hold on to the remainder, or -1 if the connection should be closed.
   check(http->websocketHandler);
-  int ch                          = 0x00;
-  while (bytes > offset) {
+  int start                         = offset;
+  while (!http->closed) {
+    int available                   = bytes - offset;
     if (http->websocketType & WS_UNDEFINED) {
-      ch                          = httpGetChar(http, buf, bytes, &offset);
-      check(ch >= 0);
-      if (http->websocketType & 0xFF) {
-        // Reading another byte of length information.
-        if (http->expecting > 0xFFFFFF) {
-          return 0;
+      // Waiting for the next frame header.
+      if (available < 2) {
+        break;
+      }
+      int i                         = offset;
+      int b0                        = httpGetChar(http, buf, bytes, &i);
+      int b1                        = httpGetChar(http, buf, bytes, &i);
+      int opcode                    = b0 & 0xF;
+      uint64_t length               = b1 & 0x7F;
+      int extra                     = length == 126 ? 2 : length == 127 ? 8:0;
+      // If compression was negotiated, RSV1 marks the first frame of a
+      // compressed message.
+      if (b0 & (http->websocketDeflate &&
+                (opcode == WS_OP_TEXT || opcode == WS_OP_BINARY)
+                ? 0x70 & ~WS_RSV1 : 0x70)) {
+        return httpFailWebSocket(http, WS_CLOSE_PROTOCOL,
+                                 "Reserved bits are set");
+      }
+      if (!(b1 & 0x80)) {
+        return httpFailWebSocket(http, WS_CLOSE_PROTOCOL,
+                                 "Client frames must be masked");
+      }
+      if (available < 6 + extra) {
+        break;
+      }
+      if (extra) {
+        length                      = 0;
+        while (extra--) {
+          length                    = (length << 8) |
+                                      httpGetChar(http, buf, bytes, &i);
         }
-        http->expecting           = (128 * http->expecting) + (ch & 0x7F);
-        if ((ch & 0x80) == 0) {
-          // Done reading length information.
-          http->websocketType    &= ~WS_UNDEFINED;
-
-          // ch is used to detect when we read the terminating byte in text
-          // mode. In binary mode, it must be set to something other than 0xFF.
-          ch                      = 0x00;
+      }
+      unsigned char mask[4];
+      for (int j = 0; j < 4; j++) {
+        mask[j]                     = httpGetChar(http, buf, bytes, &i);
+      }
+
+      if (opcode & 0x8) {
+        // Control frames are short, and they can be interleaved with the
+        // fragments of a data message.
+        if (!(b0 & 0x80) || length > 125) {
+          return httpFailWebSocket(http, WS_CLOSE_PROTOCOL,
+                                   "Bad control frame");
         }
-      } else {
-        // Reading first byte of frame.
-        http->websocketType       = (ch & 0xFF) | WS_START_OF_FRAME;
-        if (ch & 0x80) {
-          // For binary data, we have to read the length before we can start
-          // processing payload.
-          http->websocketType    |= WS_UNDEFINED;
-          http->expecting         = 0;
+        if (bytes - i < (int)length) {
+          break;
+        }
+        char payload[125];
+        for (int j = 0; j < (int)length; j++) {
+          payload[j]                = httpGetChar(http, buf, bytes, &i) ^
+                                      mask[j & 3];
+        }
+        offset                      = i;
+        if (httpHandleWebSocketControl(http, opcode, payload, length) < 0) {
+          return -1;
         }
+        continue;
       }
-    } else if (http->websocketType & 0x80) {
-      // Binary data
-      if (http->expecting) {
-        if (offset < 0) {
-        handle_partial:
-          check(-offset <= http->partialLength);
-          int len                 = -offset;
-          if (len >= http->expecting) {
-            len                   = http->expecting;
-            http->websocketType  |= WS_END_OF_FRAME;
-          }
-          if (len &&
-              http->websocketHandler(http, http->arg, http->websocketType,
-                                  http->partial + http->partialLength + offset,
-                                  len) != HTTP_DONE) {
-            return 0;
-          }
-
-          if (ch == 0xFF) {
-            // In text mode, we jump to handle_partial, when we find the
-            // terminating 0xFF byte. If so, we should try to consume it now.
-            if (len < http->partialLength) {
-              len++;
-              http->websocketType = WS_UNDEFINED;
-            }
-          }
-
-          if (len == http->partialLength) {
-            free(http->partial);
-            http->partial         = NULL;
-            http->partialLength   = 0;
-          } else {
-            memmove(http->partial, http->partial + len,
-                    http->partialLength - len);
-            http->partialLength  -= len;
-          }
-          offset                 += len;
-          http->expecting        -= len;
-        } else {
-        handle_buffered:;
-          int len                 = bytes - offset;
-          if (len >= http->expecting) {
-            len                   = http->expecting;
-            http->websocketType  |= WS_END_OF_FRAME;
-          }
-          if (len &&
-              http->websocketHandler(http, http->arg, http->websocketType,
-                                     buf + offset, len) != HTTP_DONE) {
-            return 0;
-          }
 
-          if (ch == 0xFF) {
-            // In text mode, we jump to handle_buffered, when we find the
-            // terminating 0xFF byte. If so, we should consume it now.
-            check(offset + len < bytes);
-            len++;
-            http->websocketType   = WS_UNDEFINED;
-          }
-          offset                 += len;
-          http->expecting        -= len;
-        }
-        http->websocketType      &= ~(WS_START_OF_FRAME | WS_END_OF_FRAME);
+      // Data frames either start a new message, or they continue the one
+      // that is in progress.
+      if (opcode == WS_OP_CONTINUATION
+          ? !(http->websocketType & 0xF)
+          : (opcode != WS_OP_TEXT && opcode != WS_OP_BINARY) ||
+            (http->websocketType & 0xF)) {
+        return httpFailWebSocket(http, WS_CLOSE_PROTOCOL,
+                                 "Unexpected data frame");
+      }
+      if (length > WEBSOCKET_MAX_FRAME) {
+        return httpFailWebSocket(http, WS_CLOSE_TOO_BIG, "Frame too big");
+      }
+      offset                        = i;
+      if (opcode) {
+        http->websocketType         = opcode | WS_START_OF_FRAME |
+                                      (b0 & WS_RSV1 ? WS_COMPRESSED : 0);
+        http->websocketUTF8         = 0;
       } else {
-        // Read all data. Go back to looking for a new frame header.
-        http->websocketType       = WS_UNDEFINED;
+        http->websocketType        &= ~WS_UNDEFINED;
       }
-    } else {
-      // Process text data until we find a 0xFF bytes.
-      int i                       = offset;
-
-      // If we have partial data, process that first.
-      while (i < 0) {
-        ch                        = httpGetChar(http, buf, bytes, &i);
-        check(ch != -1);
-
-        // Terminate when we either find the 0xFF, or we have reached the end
-        // of partial data.
-        if (ch == 0xFF || !i) {
-          // Set WS_END_OF_FRAME, iff we have found the 0xFF marker.
-          http->expecting         = i - offset - (ch == 0xFF);
-          goto handle_partial;
-        }
+      if (b0 & 0x80) {
+        http->websocketType        |= WS_FINAL_FRAGMENT;
       }
+      memcpy(http->websocketMask, mask, sizeof(mask));
+      http->websocketMaskIdx        = 0;
+      http->expecting               = length;
+      available                     = bytes - offset;
+    }
 
-      // Read all remaining buffered bytes (i.e. positive offset).
-      while (bytes > i) {
-        ch                        = httpGetChar(http, buf, bytes, &i);
-        check(ch != -1);
-
-        // Terminate when we either find the 0xFF, or we have reached the end
-        // of buffered data.
-        if (ch == 0xFF || bytes == i) {
-          // Set WS_END_OF_FRAME, iff we have found the 0xFF marker.
-          http->expecting         = i - offset - (ch == 0xFF);
-          goto handle_buffered;
-        }
+    // Unmask as much of the payload as we have, and pass it on. Leave room
+    // for the tail that terminates compressed messages.
+    char data[4096 + 4];
+    int len                         = available;
+    if (len > http->expecting) {
+      len                           = http->expecting;
+    }
+    if (len > (int)sizeof(data) - 4) {
+      len                           = sizeof(data) - 4;
+    }
+    if (!len && http->expecting) {
+      break;
+    }
+    for (int j = 0; j < len; j++) {
+      data[j]                       = httpGetChar(http, buf, bytes, &offset) ^
+                                      http->websocketMask[
+                                        http->websocketMaskIdx++ & 3];
+    }
+    http->expecting                -= len;
+    int end                         = !http->expecting &&
+                                      (http->websocketType&WS_FINAL_FRAGMENT);
+    if (http->websocketType & WS_COMPRESSED) {
+      // The sender strips the empty block that ends each compressed
+      // message. It has to be put back, before inflating the last bit.
+      if (end) {
+        memcpy(data + len, "\x00\x00\xFF\xFF", 4);
+        len                        += 4;
       }
+      const char *in                = data;
+      char out[4096];
+      int n;
+      do {
+        n                           = websocketInflate(http->websocketDeflate,
+                                                       &in, &len, out,
+                                                       sizeof(out));
+        if (n < 0) {
+          return httpFailWebSocket(http, WS_CLOSE_INVALID_DATA,
+                                   "Bad compressed data");
+        }
+        if (httpDeliverWebSocket(http, end && !len && n < (int)sizeof(out),
+                                 out, n) < 0) {
+          return -1;
+        }
+      } while (len || n == (int)sizeof(out));
+    } else if (httpDeliverWebSocket(http, end, data, len) < 0) {
+      return -1;
+    }
+    if (!http->expecting) {
+      // Go back to looking for a new frame header. Remember the opcode,
+      // if more fragments of this message are still to come.
+      http->websocketType           = WS_UNDEFINED |
+        (http->websocketType & WS_FINAL_FRAGMENT
+         ? 0 : http->websocketType & (0xF | WS_COMPRESSED));
     }
   }
-  return 1;
+  return offset - start;
+}
+
+char *httpDescribeConnection(void *http_) {
+  struct HttpConnection *http = (struct HttpConnection *)http_;
+  const char *path            = http->path ? http->path : http->lastPath;
+  const char *peerName        = http->peerName ? http->peerName : "???";
+  if (path) {
+    char *redacted            = httpRedactPath(path);
+    char *description         = stringPrintf(NULL, "\"%s\" from %s:%d",
+                                             redacted, peerName,
+                                             http->peerPort);
+    free(redacted);
+    return description;
+  }
+  return stringPrintf(NULL, "connection from %s:%d",
+                      peerName, http->peerPort);
 }
 
 int httpHandleConnection(struct ServerConnection *connection, void *http_,
@@ -1416,10 +2146,62 @@ int httpHandleConnection(struct ServerConnection *connection, void *http_,
     *events                          = 0;
     char buf[4096];
     int  eof                         = http->closed;
-    if ((revents & POLLIN) && !http->closed) {
+    if (((revents & POLLIN) || http->handOffWaits) && !http->closed &&
+        http->state == COMMAND && !http->partial && !http->isSuspended &&
+        !http->isPartialReply && !http->msgLength) {
+      int handOff                    = serverHandOff(http->server, http);
+      if (handOff == HANDOFF_PARTIAL &&
+          http->handOffWaits++ < MAX_HANDOFF_WAITS) {
+        // Part of the request line has arrived. The poller keeps reporting
+        // it for as long as we leave it unread. So, stop polling for input,
+        // and look again in a little while.
+        *events                      = 0;
+        serverSetTimeoutMs(connection, HANDOFF_WAIT_INTERVAL);
+        return 1;
+      }
+      if (handOff != HANDOFF_PROCESS && handOff != HANDOFF_REACTOR &&
+          http->handOffWaits) {
+        // Once the connection has been handed off, it is no longer ours to
+        // touch. Otherwise, resume normal processing.
+        http->handOffWaits           = 0;
+        serverSetTimeout(connection, CONNECTION_TIMEOUT);
+      }
+      switch (handOff) {
+      case HANDOFF_PROCESS:
+        // Another process took over this connection. Close our copy of the
+        // file descriptor without shutting down the socket.
+        debug("[http] Handed off connection from %s:%d",
+              http->peerName ? http->peerName : "???", http->peerPort);
+        http->handedOff              = 1;
+        http->closed                 = 1;
+        return 0;
+      case HANDOFF_REACTOR:
+        // Another reactor thread owns this connection now, and it might
+        // already be using it. Don't touch it anymore.
+        return 1;
+      case HANDOFF_PENDING:
+        // Nothing has arrived yet. Don't read, as the request line could
+        // show up in the meantime, and we would consume it without having
+        // looked at it.
+        *events                      = POLLIN;
+        return 1;
+      case HANDOFF_PARTIAL:
+        debug("[http] Request line from %s:%d is taking too long, not "
+              "handing off connection",
+              http->peerName ? http->peerName : "???", http->peerPort);
+        break;
+      default:
+        break;
+      }
+    }
+    if ((revents & POLLIN) && !http->closed && !http->readPaused) {
       bytes                          = httpRead(http, buf, sizeof(buf));
       if (bytes > 0) {
-        http->headerLength          += bytes;
+        // Payloads have limits of their own. Only the request line and the
+        // headers count towards this one.
+        http->headerLength          += http->state == PAYLOAD ||
+                                       http->state == DISCARD_PAYLOAD ||
+                                       http->state == WEBSOCKET ? 0 : bytes;
         if (http->headerLength > MAX_HEADER_LENGTH) {
           debug("[http] Connection closed due to exceeded header size!");
           httpSendReply(http, 413, "Header too big", NO_MSG);
@@ -1560,11 +2342,14 @@ int httpHandleConnection(struct ServerConnection *connection, void *http_,
             pushBack                 = bytes - offset - len;
           }
         } else if (http->state == WEBSOCKET) {
-          if (!httpHandleWebSocket(http, offset, buf, bytes)) {
+          int len                    = httpHandleWebSocket(http, offset, buf,
+                                                           bytes);
+          if (len < 0) {
             httpCloseRead(http);
             break;
           }
-          consumed                  += bytes - offset;
+          consumed                   = len;
+          pushBack                   = bytes - offset - len;
         } else {
           check(0);
         }
@@ -1630,24 +2415,12 @@ int httpHandleConnection(struct ServerConnection *connection, void *http_,
 
     for (;;) {
       // Try to write any pending outgoing data
-      if (http->msg && http->msgLength > 0) {
-        int wrote                    = httpWrite(http, http->msg,
-                                                 http->msgLength);
+      if (http->msgLength > 0) {
+        int wrote                    = httpWriteOutput(http);
         if (wrote < 0 && errno != EAGAIN) {
           httpCloseRead(http);
-          free(http->msg);
-          http->msgLength            = 0;
-          http->msg                  = NULL;
+          httpDiscardOutput(http);
           break;
-        } else if (wrote > 0) {
-          if (wrote == http->msgLength) {
-            free(http->msg);
-            http->msgLength          = 0;
-            http->msg                = NULL;
-          } else {
-            memmove(http->msg, http->msg + wrote, http->msgLength - wrote);
-            http->msgLength         -= wrote;
-          }
         }
         // SSL might require reading in order to write
         else if (wrote < 0 && errno == EAGAIN && http->sslHndl) {
@@ -1661,6 +2434,12 @@ int httpHandleConnection(struct ServerConnection *connection, void *http_,
       // buffer whenever it runs low.
       if (http->isPartialReply && (!http->msg || http->msgLength <= 0)) {
         httpConsumePayload(http, "", 0);
+        if (http->isPartialReply && http->msgLength <= 0) {
+          // The callback has no more data right now. It will push the rest
+          // with httpTransferPartialReply(), as soon as it becomes available.
+          http->partialReplyIdle     = 1;
+          break;
+        }
       } else {
         break;
       }
@@ -1668,23 +2447,41 @@ int httpHandleConnection(struct ServerConnection *connection, void *http_,
 
     *events                         |=
       (*events & ~(POLLIN|POLLOUT)) |
-      (!http->closed && ((http->state != PAYLOAD &&
-                          http->state != DISCARD_PAYLOAD) ||
-                         http->expecting) ? POLLIN : 0) |
-      (http->msg || http->isPartialReply ? POLLOUT : 0);
+      (!http->closed && !http->readPaused &&
+       ((http->state != PAYLOAD && http->state != DISCARD_PAYLOAD) ||
+        http->expecting) ? POLLIN : 0) |
+      (http->msg || serverWritePending(http->server, http->fd) ||
+       (http->isPartialReply && !http->partialReplyIdle) ? POLLOUT : 0);
+
+    if (http->websocketCongested && !http->msgLength &&
+        http->state == WEBSOCKET) {
+      // All queued messages have been sent. The handler can produce more.
+      http->websocketCongested       = 0;
+      http->websocketHandler(http, http->arg, WS_CONNECTION_DRAINED, NULL, 0);
+      *events                       |= http->msg ? POLLOUT : 0;
+    }
 
     connection                       = httpGetServerConnection(http);
     int timedOut                     = serverGetTimeout(connection) < 0;
+    if (timedOut && http->state == WEBSOCKET && !http->closed &&
+        !http->websocketClosing && !http->websocketPinged) {
+      // The connection has been idle for a while. Ping the peer, so that
+      // we find out whether it is still there.
+      http->websocketPinged          = 1;
+      httpSendWebSocketFrame(http, WS_OP_PING, 1, "", 0);
+      serverSetTimeout(connection, WEBSOCKET_PING_INTERVAL);
+      *events                       |= POLLIN | (http->msg ? POLLOUT : 0);
+      timedOut                       = 0;
+    }
     if (timedOut) {
       free(http->partial);
       http->partial                  = NULL;
       http->partialLength            = 0;
-      free(http->msg);
-      http->msg                      = NULL;
-      http->msgLength                = 0;
+      httpDiscardOutput(http);
     }
 
-    if ((!(*events || http->isSuspended) || timedOut) && http->sslHndl) {
+    if ((!(*events || http->isSuspended || http->isPartialReply) ||
+         timedOut) && http->sslHndl) {
       *events                        = 0;
       serverSetTimeout(connection, 1);
       int wasAlreadyClosed           = http->closed;
@@ -1728,7 +2525,23 @@ int httpHandleConnection(struct ServerConnection *connection, void *http_,
     revents                          = POLLIN | POLLOUT;
   } while (bytes > 0 && *events & POLLIN && !http->closed);
   return (*events & (POLLIN|POLLOUT)) ||
-         (!http->closed && http->isSuspended);
+         (!http->closed && (http->isSuspended || http->isPartialReply ||
+                            http->readPaused));
+}
+
+void httpPauseRead(struct HttpConnection *http, int pause) {
+  // Lets the callback stop the flow of a large payload, until it is ready
+  // for more. The peer eventually stops sending, once the socket buffers
+  // fill up.
+  if (http->readPaused == !!pause) {
+    return;
+  }
+  http->readPaused                   = !!pause;
+  struct ServerConnection *connection = httpGetServerConnection(http);
+  if (!pause && connection && !http->closed) {
+    serverConnectionSetEvents(http->server, connection, http->fd,
+                              serverConnectionGetEvents(connection) | POLLIN);
+  }
 }
 
 void httpSetCallback(struct HttpConnection *http,
@@ -1804,7 +2617,10 @@ void httpSendReply(struct HttpConnection *http, int code,
 
 void httpSendWebSocketTextMsg(struct HttpConnection *http, int type,
                               const char *fmt, ...) {
-  check(type >= 0 && type <= 0x7F);
+  // "type" is a combination of WS_START_OF_FRAME and WS_END_OF_FRAME. This
+  // allows for sending long messages in fragments.
+  check(!(type & ~(WS_TEXT_FRAME | WS_START_OF_FRAME | WS_END_OF_FRAME)));
+  check(http->state == WEBSOCKET);
   va_list ap;
   va_start(ap, fmt);
   char *buf;
@@ -1824,65 +2640,101 @@ void httpSendWebSocketTextMsg(struct HttpConnection *http, int type,
   // We assume that all input data is directly mapped in the range 0..255
   // (e.g. ISO-8859-1). In order to transparently send it over a web socket,
   // we have to encode it in UTF-8.
-  int utf8Len        = len + 2;
+  int utf8Len        = len;
   for (int i = 0; i < len; ++i) {
     if (buf[i] & 0x80) {
       ++utf8Len;
     }
   }
-  char *utf8;
-  check(utf8         = malloc(utf8Len));
-  utf8[0]            = type;
-  for (int i = 0, j = 1; i < len; ++i) {
+  char *frame;
+  check(frame        = malloc(WS_MAX_HEADER_LENGTH + utf8Len));
+  int opcode         = type & WS_START_OF_FRAME
+                       ? WS_OP_TEXT : WS_OP_CONTINUATION;
+  int headerLength   = websocketFrameHeader(frame, opcode,
+                                            type & WS_END_OF_FRAME, utf8Len);
+  int j              = headerLength;
+  for (int i = 0; i < len; ++i) {
     unsigned char ch = buf[i];
     if (ch & 0x80) {
-      utf8[j++]      = 0xC0 + (ch >> 6);
-      utf8[j++]      = 0x80 + (ch & 0x3F);
+      frame[j++]     = 0xC0 + (ch >> 6);
+      frame[j++]     = 0x80 + (ch & 0x3F);
     } else {
-      utf8[j++]      = ch;
+      frame[j++]     = ch;
     }
-    check(j < utf8Len);
   }
-  utf8[utf8Len-1]    = '\xFF';
 
   // Free our temporary buffer, if we actually did allocate one.
   if (strcmp(fmt, BINARY_MSG)) {
     free(buf);
   }
 
-  // Send to browser.
-  httpTransfer(http, utf8, utf8Len);
+  // Send to browser, unless we are already closing the connection.
+  if (http->websocketClosing) {
+    free(frame);
+  } else if (http->websocketDeflate) {
+    httpSendWebSocketFrame(http, opcode, type & WS_END_OF_FRAME,
+                           frame + headerLength, utf8Len);
+    free(frame);
+  } else {
+    httpTransfer(http, frame, j);
+  }
 }
 
 void httpSendWebSocketBinaryMsg(struct HttpConnection *http, int type,
                                 const void *buf, int len) {
-  check(type >= 0x80 && type <= 0xFF);
-  check(len > 0 && len < 0x7FFFFFF0);
-
-  // Allocate buffer for header and payload.
-  char *data;
-  check(data  = malloc(len + 6));
-  data[0]     = type;
+  check(!(type & ~(WS_BINARY_FRAME | WS_START_OF_FRAME | WS_END_OF_FRAME)));
+  check(http->state == WEBSOCKET);
+  check(len >= 0 && len < 0x7FFFFFF0 - WS_MAX_HEADER_LENGTH);
+  if (!http->websocketClosing) {
+    httpSendWebSocketFrame(http, type & WS_START_OF_FRAME
+                                 ? WS_OP_BINARY : WS_OP_CONTINUATION,
+                           type & WS_END_OF_FRAME, buf, len);
+  }
+}
 
-  // Convert length to base-128.
-  int i       = 0;
-  int l       = len;
-  do {
-    data[++i] = 0x80 + (l & 0x7F);
-    l        /= 128;
-  } while (l);
-  data[i]    &= 0x7F;
+void httpCloseWebSocket(struct HttpConnection *http, int code,
+                        const char *reason) {
+  // Starts the closing handshake. No more data is delivered to the handler
+  // after this. The connection gets closed when the peer confirms, or after
+  // a short timeout. A "code" of zero sends a close frame without a status.
+  check(http->state == WEBSOCKET);
+  if (!http->websocketClosing) {
+    http->websocketClosing = 1;
+    char payload[125];
+    int len                = 0;
+    if (code) {
+      payload[len++]       = code >> 8;
+      payload[len++]       = code;
+      if (reason) {
+        int reasonLength   = strlen(reason);
+        if (reasonLength > (int)sizeof(payload) - len) {
+          reasonLength     = sizeof(payload) - len;
+        }
+        memcpy(payload + len, reason, reasonLength);
+        len               += reasonLength;
+      }
+    }
+    httpSendWebSocketFrame(http, WS_OP_CLOSE, 1, payload, len);
+    struct ServerConnection *connection = httpGetServerConnection(http);
+    if (connection) {
+      serverSetTimeout(connection, 5);
+    }
+  }
+}
 
-  // Reverse digits, so that they are big-endian.
-  for (int j = 0; j < i/2; ++j) {
-    char ch   = data[1+j];
-    data[1+j] = data[i-j];
-    data[i-j] = ch;
+int httpWebSocketCongested(struct HttpConnection *http, int limit) {
+  // Returns non-zero, if more than "limit" bytes are still waiting to be
+  // sent. The handler then gets notified with WS_CONNECTION_DRAINED, as soon
+  // as they have all been written.
+  if (http->msgLength > limit) {
+    http->websocketCongested = 1;
+    return 1;
   }
+  return 0;
+}
 
-  // Transmit header and payload.
-  memmove(data + i + 1, buf, len);
-  httpTransfer(http, data, len + i + 1);
+int httpGetPendingOutput(const struct HttpConnection *http) {
+  return http->msgLength;
 }
 
 void httpExitLoop(struct HttpConnection *http, int exitAll) {
@@ -61,19 +61,40 @@
 #define HTTP_PARTIAL_REPLY 4
 
 #define WS_UNDEFINED       0x1000
+#define WS_FINAL_FRAGMENT  0x2000
+#define WS_COMPRESSED      0x4000
 #define WS_START_OF_FRAME  0x0100
 #define WS_END_OF_FRAME    0x0200
 
 #define NO_MSG             "\001"
 
+struct WebSocketDeflate;
+struct HttpReply;
+
+// Outgoing data is kept in a queue of segments, so that headers and bodies
+// never have to be concatenated. Segments either own their data, or they
+// refer to memory that stays valid for the lifetime of the process. Data
+// from a reply builder goes back to its pool, once it has been written.
+struct HttpSegment {
+  struct HttpSegment      *next;
+  const char              *data;
+  int                     length;
+  char                    *owned;
+  struct HttpReply        *reply;
+};
+
 struct HttpConnection {
   struct Server           *server;
   struct ServerConnection *connection;
   int                     fd;
   int                     port;
   int                     closed;
+  int                     handedOff;
+  int                     handOffWaits;
   int                     isSuspended;
   int                     isPartialReply;
+  int                     partialReplyIdle;
+  int                     readPaused;
   int                     done;
   enum { SNIFFING_SSL, COMMAND, HEADERS, PAYLOAD, DISCARD_PAYLOAD,
          WEBSOCKET } state;
@@ -82,6 +103,7 @@ struct HttpConnection {
   char                    *url;
   char                    *method;
   char                    *path;
+  char                    *lastPath;
   char                    *matchedPath;
   char                    *pathInfo;
   char                    *query;
@@ -91,12 +113,19 @@ struct HttpConnection {
   char                    *key;
   char                    *partial;
   int                     partialLength;
-  char                    *msg;
+  struct HttpSegment      *msg;
+  struct HttpSegment      **msgTail;
   int                     msgLength;
-  int                     msgOffset;
   int                     totalWritten;
   int                     expecting;
   int                     websocketType;
+  unsigned char           websocketMask[4];
+  int                     websocketMaskIdx;
+  int                     websocketUTF8;
+  int                     websocketPinged;
+  int                     websocketClosing;
+  int                     websocketCongested;
+  struct WebSocketDeflate *websocketDeflate;
   int                     (*callback)(struct HttpConnection *, void *,
                                       const char *,int);
   int                     (*websocketHandler)(struct HttpConnection *, void *,
@@ -107,6 +136,7 @@ struct HttpConnection {
   struct SSLSupport       *ssl;
   SSL                     *sslHndl;
   int                     lastError;
+  int                     renegotiationCount;
 };
 
 struct HttpHandler {
@@ -114,7 +144,7 @@ struct HttpHandler {
   int (*streamingHandler)(struct HttpConnection *, void *, const char *, int);
   int (*websocketHandler)(struct HttpConnection *, void *, int,
                           const char *, int);
-  void *arg, *streamingArg;
+  void *arg, *streamingArg, *websocketArg;
 
 };
 
@@ -128,11 +158,27 @@ void destroyHttpConnection(struct HttpConnection *http);
 void deleteHttpConnection(struct HttpConnection *http);
 void httpTransfer(struct HttpConnection *http, char *msg, int len);
 void httpTransferPartialReply(struct HttpConnection *http, char *msg, int len);
+void httpTransferStatic(struct HttpConnection *http, char *header,
+                        const char *body, int bodyLength);
+struct HttpReply *newHttpReply(int size);
+void deleteHttpReply(struct HttpReply *reply);
+char *httpReplyReserve(struct HttpReply *reply, int len);
+void httpReplyCommit(struct HttpReply *reply, int len);
+void httpReplyAppend(struct HttpReply *reply, const char *buf, int len);
+void httpReplyPrintf(struct HttpReply *reply, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+const char *httpReplyBody(const struct HttpReply *reply, int *len);
+void httpTransferReply(struct HttpConnection *http, struct HttpReply *reply,
+                       int compress, const char *fmt, ...)
+  __attribute__((format(printf, 4, 5)));
+int httpPeekCommand(struct HttpConnection *http, char *buf, int len);
 int httpHandleConnection(struct ServerConnection *connection, void *http_,
                          short *events, short revents);
+char *httpDescribeConnection(void *http_);
 void httpSetCallback(struct HttpConnection *http,
                      int (*callback)(struct HttpConnection *, void *,
                                      const char *, int), void *arg);
+void httpPauseRead(struct HttpConnection *http, int pause);
 void *httpGetPrivate(struct HttpConnection *http);
 void *httpSetPrivate(struct HttpConnection *http, void *private);
 void httpSendReply(struct HttpConnection *http, int code,
@@ -143,6 +189,9 @@ void httpSendWebSocketTextMsg(struct HttpConnection *http, int type,
   __attribute__((format(printf, 3, 4)));
 void httpSendWebSocketBinaryMsg(struct HttpConnection *http, int type,
                                 const void *buf, int len);
+void httpCloseWebSocket(struct HttpConnection *http, int code,
+                        const char *reason);
+int  httpWebSocketCongested(struct HttpConnection *http, int limit);
 void httpExitLoop(struct HttpConnection *http, int exitAll);
 struct Server *httpGetServer(const struct HttpConnection *http);
 struct ServerConnection *httpGetServerConnection(const struct HttpConnection*);
@@ -0,0 +1,1297 @@
+// poller.c -- Pluggable readiness notification backends for the server loop
+// Copyright (C) 2008-2010 Markus Gutschke <markus@shellinabox.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// In addition to these license terms, the author grants the following
+// additional rights:
+//
+// If you modify this program, or any covered work, by linking or
+// combining it with the OpenSSL project's OpenSSL library (or a
+// modified version of that library), containing parts covered by the
+// terms of the OpenSSL or SSLeay licenses, the author
+// grants you additional permission to convey the resulting work.
+// Corresponding Source for a non-source form of such a combination
+// shall include the source code for the parts of OpenSSL used as well
+// as that of the covered work.
+//
+// You may at your option choose to remove this additional permission from
+// the work, or from any part of it.
+//
+// It is possible to build this program in a way that it loads OpenSSL
+// libraries at run-time. If doing so, the following notices are required
+// by the OpenSSL and SSLeay licenses:
+//
+// This product includes software developed by the OpenSSL Project
+// for use in the OpenSSL Toolkit. (http://www.openssl.org/)
+//
+// This product includes cryptographic software written by Eric Young
+// (eay@cryptsoft.com)
+//
+//
+// The most up-to-date version of this program is always available from
+// http://shellinabox.com
+
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/poll.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+
+#include "libhttp/http.h"
+#include "libhttp/poller.h"
+#include "logging/logging.h"
+
+#ifdef HAVE_UNUSED
+#defined ATTR_UNUSED __attribute__((unused))
+#defined UNUSED(x)   do { } while (0)
+#else
+#define ATTR_UNUSED
+#define UNUSED(x)    do { (void)(x); } while (0)
+#endif
+
+#if defined(__APPLE__) && defined(__MACH__)
+// While MacOS X does ship with an implementation of poll(), this
+// implementation is apparently known to be broken and does not comply
+// with POSIX standards. Fortunately, the operating system is not entirely
+// unable to check for input events. We can fall back on calling select()
+// instead. This is generally not desirable, as it is less efficient and
+// has a compile-time restriction on the maximum number of file
+// descriptors. But on MacOS X, that's the best we can do.
+
+int x_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+  fd_set r, w, x;
+  FD_ZERO(&r);
+  FD_ZERO(&w);
+  FD_ZERO(&x);
+  int maxFd             = -1;
+  for (int i = 0; i < nfds; ++i) {
+    if (fds[i].fd > maxFd) {
+      maxFd = fds[i].fd;
+    } else if (fds[i].fd < 0) {
+      continue;
+    }
+    if (fds[i].events & POLLIN) {
+      FD_SET(fds[i].fd, &r);
+    }
+    if (fds[i].events & POLLOUT) {
+      FD_SET(fds[i].fd, &w);
+    }
+    if (fds[i].events & POLLPRI) {
+      FD_SET(fds[i].fd, &x);
+    }
+  }
+  struct timeval tmoVal = { 0 }, *tmo;
+  if (timeout < 0) {
+    tmo                 = NULL;
+  } else {
+    tmoVal.tv_sec       =  timeout / 1000;
+    tmoVal.tv_usec      = (timeout % 1000) * 1000;
+    tmo                 = &tmoVal;
+  }
+  int numRet            = select(maxFd + 1, &r, &w, &x, tmo);
+  for (int i = 0, n = numRet; i < nfds && n > 0; ++i) {
+    if (fds[i].fd < 0) {
+      continue;
+    }
+    if (FD_ISSET(fds[i].fd, &x)) {
+      fds[i].revents    = POLLPRI;
+    } else if (FD_ISSET(fds[i].fd, &r)) {
+      fds[i].revents    = POLLIN;
+    } else {
+      fds[i].revents    = 0;
+    }
+    if (FD_ISSET(fds[i].fd, &w)) {
+      fds[i].revents   |= POLLOUT;
+    }
+  }
+  return numRet;
+}
+#define poll x_poll
+#endif
+
+// Accepts a new connection with the same flags that the io_uring() backend
+// uses for multishot accept() requests.
+static int pollerAcceptFd(int fd, struct sockaddr *addr, socklen_t *addrLen) {
+#ifdef HAVE_ACCEPT4
+  return accept4(fd, addr, addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  return accept(fd, addr, addrLen);
+#endif
+}
+
+// The poll() backend keeps a dense array of all file descriptors that have
+// a non-empty event mask. A second array maps file descriptors to their
+// position in the dense array, so that updates never have to search or
+// compact the list.
+struct PollPoller {
+  struct Poller poller;
+  struct pollfd *fds;
+  int           numFds;
+  int           maxFds;
+  int           *index;
+  int           indexSize;
+};
+
+static int pollSetEvents(struct Poller *poller_, int fd,
+                         short oldEvents ATTR_UNUSED, short events) {
+  UNUSED(oldEvents);
+  struct PollPoller *poller = (struct PollPoller *)poller_;
+  check(fd >= 0);
+  if (fd >= poller->indexSize) {
+    if (!events) {
+      return 0;
+    }
+    int newSize             = 2*poller->indexSize > fd ? 2*poller->indexSize
+                                                       : fd + 1;
+    check(poller->index     = realloc(poller->index,
+                                      newSize*sizeof(int)));
+    for (int i = poller->indexSize; i < newSize; i++) {
+      poller->index[i]      = -1;
+    }
+    poller->indexSize       = newSize;
+  }
+  int pos                   = poller->index[fd];
+  if (!events) {
+    if (pos >= 0) {
+      // Move the last entry into the hole that we just created.
+      if (pos != --poller->numFds) {
+        poller->fds[pos]    = poller->fds[poller->numFds];
+        poller->index[poller->fds[pos].fd] = pos;
+      }
+      poller->index[fd]     = -1;
+    }
+  } else if (pos < 0) {
+    if (poller->numFds == poller->maxFds) {
+      poller->maxFds        = poller->maxFds ? 2*poller->maxFds : 16;
+      check(poller->fds     = realloc(poller->fds,
+                                      poller->maxFds*sizeof(struct pollfd)));
+    }
+    pos                     = poller->numFds++;
+    poller->fds[pos].fd     = fd;
+    poller->fds[pos].events = events;
+    poller->index[fd]       = pos;
+  } else {
+    poller->fds[pos].events = events;
+  }
+  return 0;
+}
+
+static int pollWait(struct Poller *poller_, struct PollerEvent *events,
+                    int maxEvents, int timeout) {
+  struct PollPoller *poller = (struct PollPoller *)poller_;
+  int eventCount            = NOINTR(poll(poller->fds, poller->numFds,
+                                          timeout));
+  if (eventCount <= 0) {
+    return eventCount;
+  }
+  int numEvents             = 0;
+  for (int i = 0; i < poller->numFds && numEvents < maxEvents &&
+                  numEvents < eventCount; i++) {
+    if (poller->fds[i].revents) {
+      events[numEvents].fd        = poller->fds[i].fd;
+      events[numEvents++].revents = poller->fds[i].revents;
+    }
+  }
+  return numEvents;
+}
+
+static void pollDestroy(struct Poller *poller_) {
+  struct PollPoller *poller = (struct PollPoller *)poller_;
+  free(poller->fds);
+  free(poller->index);
+}
+
+struct Poller *newPollPoller(void) {
+  struct PollPoller *poller;
+  check(poller              = malloc(sizeof(struct PollPoller)));
+  poller->poller.name       = "poll";
+  poller->poller.setEvents  = pollSetEvents;
+  poller->poller.wait       = pollWait;
+  poller->poller.destroy    = pollDestroy;
+  poller->poller.claim      = NULL;
+  poller->poller.release    = NULL;
+  poller->poller.accept     = NULL;
+  poller->poller.readv      = NULL;
+  poller->poller.writev     = NULL;
+  poller->poller.writePending = NULL;
+  poller->fds               = NULL;
+  poller->numFds            = 0;
+  poller->maxFds            = 0;
+  poller->index             = NULL;
+  poller->indexSize         = 0;
+  return &poller->poller;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+// The epoll() backend lets the kernel maintain the interest set. Each
+// call to wait() only costs time proportional to the number of file
+// descriptors that are actually ready.
+struct EpollPoller {
+  struct Poller      poller;
+  int                fd;
+  struct epoll_event *events;
+  int                maxEvents;
+};
+
+static int epollSetEvents(struct Poller *poller_, int fd, short oldEvents,
+                          short events) {
+  struct EpollPoller *poller = (struct EpollPoller *)poller_;
+  if (!oldEvents && !events) {
+    return 0;
+  }
+  struct epoll_event ev      = { 0 };
+  ev.events                  = ((events & POLLIN)  ? EPOLLIN  : 0) |
+                               ((events & POLLOUT) ? EPOLLOUT : 0) |
+                               ((events & POLLPRI) ? EPOLLPRI : 0);
+  ev.data.fd                 = fd;
+  return epoll_ctl(poller->fd,
+                   !oldEvents ? EPOLL_CTL_ADD :
+                   !events    ? EPOLL_CTL_DEL : EPOLL_CTL_MOD, fd, &ev);
+}
+
+static int epollWait(struct Poller *poller_, struct PollerEvent *events,
+                     int maxEvents, int timeout) {
+  struct EpollPoller *poller = (struct EpollPoller *)poller_;
+  if (maxEvents > poller->maxEvents) {
+    poller->maxEvents        = maxEvents;
+    check(poller->events     = realloc(poller->events,
+                                       maxEvents*sizeof(struct epoll_event)));
+  }
+  int eventCount             = NOINTR(epoll_wait(poller->fd, poller->events,
+                                                 maxEvents, timeout));
+  for (int i = 0; i < eventCount; i++) {
+    uint32_t ev              = poller->events[i].events;
+    events[i].fd             = poller->events[i].data.fd;
+    events[i].revents        = ((ev & EPOLLIN)  ? POLLIN  : 0) |
+                               ((ev & EPOLLOUT) ? POLLOUT : 0) |
+                               ((ev & EPOLLPRI) ? POLLPRI : 0) |
+                               ((ev & EPOLLERR) ? POLLERR : 0) |
+                               ((ev & EPOLLHUP) ? POLLHUP : 0);
+  }
+  return eventCount;
+}
+
+static void epollDestroy(struct Poller *poller_) {
+  struct EpollPoller *poller = (struct EpollPoller *)poller_;
+  NOINTR(close(poller->fd));
+  free(poller->events);
+}
+
+struct Poller *newEpollPoller(void) {
+  int fd                     = epoll_create1(EPOLL_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct EpollPoller *poller;
+  check(poller               = malloc(sizeof(struct EpollPoller)));
+  poller->poller.name        = "epoll";
+  poller->poller.setEvents   = epollSetEvents;
+  poller->poller.wait        = epollWait;
+  poller->poller.destroy     = epollDestroy;
+  poller->poller.claim       = NULL;
+  poller->poller.release     = NULL;
+  poller->poller.accept      = NULL;
+  poller->poller.readv       = NULL;
+  poller->poller.writev      = NULL;
+  poller->poller.writePending = NULL;
+  poller->fd                 = fd;
+  poller->events             = NULL;
+  poller->maxEvents          = 0;
+  return &poller->poller;
+}
+#else
+struct Poller *newEpollPoller(void) {
+  return NULL;
+}
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) &&       \
+    defined(IORING_FEAT_EXT_ARG)
+// The io_uring() backend arms one-shot poll requests. Changes to the event
+// masks are only queued up in the submission ring, and get sent to the
+// kernel together with the next call to wait(). So, no matter how many
+// connections changed their interest set, each iteration of the server
+// loop costs a single system call.
+//
+// Requests are tagged with the file descriptor and a sequence number.
+// Completions for requests that have since been replaced are ignored.
+// Completions only ever update our bookkeeping and mark the descriptor as
+// dirty. Each call to wait() then looks at the dirty descriptors, reports
+// the ones that are ready, and re-arms the ones that fired last time. Ready
+// descriptors stay dirty. This keeps the backend level-triggered, just like
+// the others.
+//
+// On kernels that support multishot accept() and provided buffer rings,
+// the backend can also take over the I/O for claimed descriptors. A single
+// multishot request accepts all new connections. Reads complete into
+// buffers that the kernel picks from a shared pool, once data has actually
+// arrived. So, idle connections don't tie up any memory. Writes get copied
+// into one of a fixed number of registered buffers, and are sent from
+// there. A keypress then travels from the socket to the pty, and its echo
+// travels back to the browser, without any calls to read() or write().
+#define URING_ENTRIES        256
+#define URING_REMOVE_TAG     0
+#define URING_POLL           (1ULL << 63)
+
+#ifdef IORING_ACCEPT_MULTISHOT
+#define URING_IO
+#define URING_BUFFERS        64
+#define URING_BUFFER_SIZE    (16 << 10)
+#define URING_BUFFER_GROUP   0
+
+// Requests that are made on behalf of a claimed descriptor carry the
+// address of its UringIo in "user_data". The low bits identify the type of
+// operation.
+#define URING_OP_READ        1
+#define URING_OP_WRITE       2
+#define URING_OP_ACCEPT      3
+#define URING_OP_POLL        4
+#define URING_OP_CANCEL      5
+#define URING_OP_MASK        7
+#endif
+
+struct UringIo {
+  int  fd;
+  int  ops;
+  int  isSocket;
+  int  inflight;
+  int  releasing;
+  int  cancelling;
+  int  reading;
+  int  pollBeforeRead;
+  int  inBuffer;
+  int  inStart;
+  int  inLength;
+  int  inEof;
+  int  inError;
+  int  hangup;
+  char *leftover;
+  int  leftoverLength;
+  int  writing;
+  int  pollBeforeWrite;
+  int  outBuffer;
+  int  outStart;
+  int  outLength;
+  int  outError;
+  int  accepting;
+  int  acceptError;
+  int  *accepted;
+  int  numAccepted;
+  int  maxAccepted;
+};
+
+struct UringFd {
+  short          events;
+  short          revents;
+  short          armed;
+  short          dirty;
+  uint32_t       tag;
+  struct UringIo *io;
+};
+
+struct UringPoller {
+  struct Poller       poller;
+  int                 fd;
+  void                *ring;
+  size_t              ringSize;
+  struct io_uring_sqe *sqes;
+  size_t              sqesSize;
+  unsigned            *sqHead;
+  unsigned            *sqTail;
+  unsigned            sqMask;
+  unsigned            *sqArray;
+  unsigned            sqEntries;
+  unsigned            *cqHead;
+  unsigned            *cqTail;
+  unsigned            cqMask;
+  struct io_uring_cqe *cqes;
+  unsigned            tail;
+  uint32_t            nextTag;
+  struct UringFd      *fds;
+  int                 fdsSize;
+  int                 *dirty;
+  int                 numDirty;
+  int                 maxDirty;
+  int                 ops;
+  void                *bufRing;
+  size_t              bufRingSize;
+  uint16_t            bufTail;
+  char                *readBuffers;
+  char                *writeBuffers;
+  int                 *freeWriteBuffers;
+  int                 numFreeWriteBuffers;
+};
+
+static int uringEnter(struct UringPoller *poller, unsigned minComplete,
+                      int timeout) {
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg = { 0 };
+  if (timeout >= 0) {
+    ts.tv_sec                = timeout / 1000;
+    ts.tv_nsec               = (timeout % 1000) * 1000000LL;
+    arg.ts                   = (uintptr_t)&ts;
+  }
+  unsigned toSubmit          = poller->tail -
+                               __atomic_load_n(poller->sqHead,
+                                               __ATOMIC_ACQUIRE);
+  int rc                     = syscall(__NR_io_uring_enter, poller->fd,
+                                       toSubmit, minComplete,
+                                       IORING_ENTER_GETEVENTS |
+                                       IORING_ENTER_EXT_ARG,
+                                       &arg, sizeof(arg));
+  if (rc < 0 && (errno == ETIME || errno == EINTR)) {
+    rc                       = 0;
+  }
+  return rc;
+}
+
+static void uringReserve(struct UringPoller *poller, unsigned count) {
+  if (poller->tail - __atomic_load_n(poller->sqHead, __ATOMIC_ACQUIRE) +
+      count > poller->sqEntries) {
+    // The submission ring is full. Hand everything to the kernel, without
+    // waiting for completions.
+    check(uringEnter(poller, 0, 0) >= 0);
+  }
+}
+
+static struct io_uring_sqe *uringGetSqe(struct UringPoller *poller) {
+  uringReserve(poller, 1);
+  unsigned idx               = poller->tail & poller->sqMask;
+  struct io_uring_sqe *sqe   = poller->sqes + idx;
+  memset(sqe, 0, sizeof(*sqe));
+  poller->sqArray[idx]       = idx;
+  poller->tail++;
+  __atomic_store_n(poller->sqTail, poller->tail, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+static void uringGrow(struct UringPoller *poller, int fd) {
+  if (fd >= poller->fdsSize) {
+    int newSize              = 2*poller->fdsSize > fd ? 2*poller->fdsSize
+                                                      : fd + 1;
+    check(poller->fds        = realloc(poller->fds,
+                                       newSize*sizeof(struct UringFd)));
+    memset(poller->fds + poller->fdsSize, 0,
+           (newSize - poller->fdsSize)*sizeof(struct UringFd));
+    poller->fdsSize          = newSize;
+  }
+}
+
+static void uringMarkDirty(struct UringPoller *poller, int fd) {
+  struct UringFd *state      = poller->fds + fd;
+  if (!state->dirty) {
+    if (poller->numDirty == poller->maxDirty) {
+      poller->maxDirty       = poller->maxDirty ? 2*poller->maxDirty : 16;
+      check(poller->dirty    = realloc(poller->dirty,
+                                       poller->maxDirty*sizeof(int)));
+    }
+    poller->dirty[poller->numDirty++] = fd;
+    state->dirty             = 1;
+  }
+}
+
+static void uringArm(struct UringPoller *poller, int fd, short events) {
+  struct UringFd *state      = poller->fds + fd;
+  if (++poller->nextTag == URING_REMOVE_TAG || poller->nextTag > 0x7FFFFFFF) {
+    poller->nextTag          = URING_REMOVE_TAG + 1;
+  }
+  state->tag                 = poller->nextTag;
+  state->armed               = events;
+  struct io_uring_sqe *sqe   = uringGetSqe(poller);
+  sqe->opcode                = IORING_OP_POLL_ADD;
+  sqe->fd                    = fd;
+  sqe->poll32_events         = events | POLLERR | POLLHUP;
+  sqe->user_data             = URING_POLL | ((uint64_t)state->tag << 32) |
+                               (unsigned)fd;
+}
+
+static void uringDisarm(struct UringPoller *poller, int fd) {
+  struct UringFd *state      = poller->fds + fd;
+  struct io_uring_sqe *sqe   = uringGetSqe(poller);
+  sqe->opcode                = IORING_OP_POLL_REMOVE;
+  sqe->fd                    = -1;
+  sqe->addr                  = URING_POLL | ((uint64_t)state->tag << 32) |
+                               (unsigned)fd;
+  sqe->user_data             = URING_REMOVE_TAG;
+  state->armed               = 0;
+}
+
+static void uringFreeIo(struct UringIo *io) {
+  for (int i = 0; i < io->numAccepted; i++) {
+    NOINTR(close(io->accepted[i]));
+  }
+  free(io->accepted);
+  free(io->leftover);
+  free(io);
+}
+
+#ifdef URING_IO
+static short uringIoEvents(const struct UringIo *io) {
+  if (!io) {
+    return 0;
+  }
+  return ((io->ops & (POLLER_READ | POLLER_ACCEPT)) ? POLLIN  : 0) |
+         ((io->ops & POLLER_WRITE)                  ? POLLOUT : 0);
+}
+
+static void uringRecycle(struct UringPoller *poller, int buffer) {
+  struct io_uring_buf_ring *ring = poller->bufRing;
+  struct io_uring_buf *buf   = ring->bufs +
+                               (poller->bufTail & (URING_BUFFERS - 1));
+  buf->addr                  = (uintptr_t)(poller->readBuffers +
+                                           buffer*URING_BUFFER_SIZE);
+  buf->len                   = URING_BUFFER_SIZE;
+  buf->bid                   = buffer;
+  __atomic_store_n(&ring->tail, ++poller->bufTail, __ATOMIC_RELEASE);
+}
+
+static void uringPollFirst(struct UringPoller *poller, struct UringIo *io,
+                           short events) {
+  // Older kernels fail operations on non-blocking descriptors, instead of
+  // waiting for them to become ready. Link a poll request in front of them.
+  uringReserve(poller, 2);
+  struct io_uring_sqe *sqe   = uringGetSqe(poller);
+  sqe->opcode                = IORING_OP_POLL_ADD;
+  sqe->fd                    = io->fd;
+  sqe->poll32_events         = events;
+  sqe->flags                 = IOSQE_IO_LINK;
+  sqe->user_data             = (uintptr_t)io | URING_OP_POLL;
+  io->inflight++;
+}
+
+static void uringSubmitRead(struct UringPoller *poller, struct UringIo *io) {
+  if (io->pollBeforeRead) {
+    uringPollFirst(poller, io, POLLIN);
+  }
+  struct io_uring_sqe *sqe   = uringGetSqe(poller);
+  sqe->opcode                = IORING_OP_READ;
+  sqe->fd                    = io->fd;
+  sqe->off                   = (uint64_t)-1;
+  sqe->len                   = URING_BUFFER_SIZE;
+  sqe->flags                 = IOSQE_BUFFER_SELECT;
+  sqe->buf_group             = URING_BUFFER_GROUP;
+  sqe->user_data             = (uintptr_t)io | URING_OP_READ;
+  io->inflight++;
+  io->reading                = 1;
+}
+
+static void uringSubmitWrite(struct UringPoller *poller, struct UringIo *io) {
+  if (io->pollBeforeWrite) {
+    uringPollFirst(poller, io, POLLOUT);
+  }
+  struct io_uring_sqe *sqe   = uringGetSqe(poller);
+  sqe->fd                    = io->fd;
+  sqe->addr                  = (uintptr_t)(poller->writeBuffers +
+                                           io->outBuffer*URING_BUFFER_SIZE +
+                                           io->outStart);
+  sqe->len                   = io->outLength;
+  if (io->isSocket) {
+    // Sockets must not raise SIGPIPE, if the peer went away.
+    sqe->opcode              = IORING_OP_SEND;
+    sqe->msg_flags           = MSG_NOSIGNAL;
+  } else {
+    sqe->opcode              = IORING_OP_WRITE_FIXED;
+    sqe->off                 = (uint64_t)-1;
+    sqe->buf_index           = 0;
+  }
+  sqe->user_data             = (uintptr_t)io | URING_OP_WRITE;
+  io->inflight++;
+  io->writing                = 1;
+}
+
+static void uringSubmitAccept(struct UringPoller *poller, struct UringIo *io) {
+  struct io_uring_sqe *sqe   = uringGetSqe(poller);
+  sqe->opcode                = IORING_OP_ACCEPT;
+  sqe->fd                    = io->fd;
+  sqe->ioprio                = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags          = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data             = (uintptr_t)io | URING_OP_ACCEPT;
+  io->inflight++;
+  io->accepting              = 1;
+}
+
+static void uringSubmitCancel(struct UringPoller *poller, struct UringIo *io) {
+  struct io_uring_sqe *sqe   = uringGetSqe(poller);
+  sqe->opcode                = IORING_OP_ASYNC_CANCEL;
+  sqe->fd                    = io->fd;
+  sqe->cancel_flags          = IORING_ASYNC_CANCEL_FD |
+                               IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data             = (uintptr_t)io | URING_OP_CANCEL;
+  io->inflight++;
+  io->cancelling             = 1;
+}
+
+static void uringFreeWriteBuffer(struct UringPoller *poller,
+                                 struct UringIo *io) {
+  poller->freeWriteBuffers[poller->numFreeWriteBuffers++] = io->outBuffer;
+  io->outBuffer              = -1;
+  io->writing                = 0;
+}
+
+static void uringComplete(struct UringPoller *poller, uint64_t userData,
+                          int res, unsigned flags) {
+  struct UringIo *io         = (struct UringIo *)(uintptr_t)
+                               (userData & ~(uint64_t)URING_OP_MASK);
+  io->inflight--;
+  switch (userData & URING_OP_MASK) {
+  case URING_OP_READ:
+    io->reading              = 0;
+    if (flags & IORING_CQE_F_BUFFER) {
+      int buffer             = flags >> IORING_CQE_BUFFER_SHIFT;
+      if (res > 0) {
+        io->inBuffer         = buffer;
+        io->inStart          = 0;
+        io->inLength         = res;
+      } else {
+        uringRecycle(poller, buffer);
+      }
+    }
+    if (!res) {
+      io->inEof              = 1;
+    } else if (res == -EAGAIN) {
+      io->pollBeforeRead     = 1;
+    } else if (res == -ENOBUFS) {
+      // All buffers are in use. Fall back on reporting readiness.
+      debug("[server] Out of read buffers, no longer reading from fd %d",
+            io->fd);
+      io->ops               &= ~POLLER_READ;
+    } else if (res == -EIO && !io->isSocket) {
+      // This is how ptys report that the other side has gone away. poll()
+      // would have returned POLLHUP instead.
+      io->hangup             = 1;
+    } else if (res < 0 && res != -ECANCELED) {
+      io->inError            = -res;
+    }
+    break;
+  case URING_OP_WRITE:
+    if (!io->releasing && (res == -EAGAIN ||
+                           (res >= 0 && res < io->outLength))) {
+      if (res > 0) {
+        io->outStart        += res;
+        io->outLength       -= res;
+      } else {
+        io->pollBeforeWrite  = 1;
+      }
+      uringSubmitWrite(poller, io);
+    } else {
+      if (res < 0 && res != -ECANCELED) {
+        io->outError         = -res;
+      }
+      uringFreeWriteBuffer(poller, io);
+    }
+    break;
+  case URING_OP_ACCEPT:
+    if (res >= 0) {
+      if (io->numAccepted == io->maxAccepted) {
+        io->maxAccepted      = io->maxAccepted ? 2*io->maxAccepted : 16;
+        check(io->accepted   = realloc(io->accepted,
+                                       io->maxAccepted*sizeof(int)));
+      }
+      io->accepted[io->numAccepted++] = res;
+    } else if (res == -EINVAL) {
+      // The kernel doesn't know about multishot accept() requests.
+      io->ops               &= ~POLLER_ACCEPT;
+    } else if (res != -ECANCELED) {
+      io->acceptError        = -res;
+    }
+    if (flags & IORING_CQE_F_MORE) {
+      io->inflight++;
+    } else {
+      io->accepting          = 0;
+    }
+    break;
+  case URING_OP_CANCEL:
+    io->cancelling           = 0;
+    break;
+  default:
+    break;
+  }
+  uringMarkDirty(poller, io->fd);
+}
+
+static short uringUpdateIo(struct UringPoller *poller, int fd) {
+  struct UringFd *state      = poller->fds + fd;
+  struct UringIo *io         = state->io;
+  if (!io || io->releasing) {
+    return 0;
+  }
+  short revents              = 0;
+  if (io->hangup) {
+    // Just like POLLHUP from poll(), this goes away once the condition
+    // clears. Try reading again, next time around.
+    io->hangup               = 0;
+    revents                 |= POLLHUP;
+  } else if (state->events & POLLIN) {
+    if (io->inLength || io->leftoverLength || io->inEof || io->inError ||
+        io->numAccepted || io->acceptError) {
+      revents               |= POLLIN;
+    } else if ((io->ops & POLLER_READ) && !io->reading) {
+      uringSubmitRead(poller, io);
+    }
+    if ((io->ops & POLLER_ACCEPT) && !io->accepting && !io->acceptError) {
+      uringSubmitAccept(poller, io);
+    }
+  } else if (io->accepting && !io->cancelling) {
+    // Nobody is interested in new connections right now. Stop accepting
+    // them, instead of queueing them up.
+    uringSubmitCancel(poller, io);
+  }
+  if ((state->events & POLLOUT) && (io->ops & POLLER_WRITE) &&
+      !io->writing) {
+    revents                 |= POLLOUT;
+  }
+  return revents;
+}
+#else
+static short uringIoEvents(const struct UringIo *io ATTR_UNUSED) {
+  UNUSED(io);
+  return 0;
+}
+
+static void uringComplete(struct UringPoller *poller ATTR_UNUSED,
+                          uint64_t userData ATTR_UNUSED,
+                          int res ATTR_UNUSED, unsigned flags ATTR_UNUSED) {
+  UNUSED(poller);
+  UNUSED(userData);
+  UNUSED(res);
+  UNUSED(flags);
+}
+
+static short uringUpdateIo(struct UringPoller *poller ATTR_UNUSED,
+                           int fd ATTR_UNUSED) {
+  UNUSED(poller);
+  UNUSED(fd);
+  return 0;
+}
+#endif
+
+static short uringPollEvents(const struct UringFd *state) {
+  return state->events & ~uringIoEvents(state->io);
+}
+
+static int uringSetEvents(struct Poller *poller_, int fd,
+                          short oldEvents ATTR_UNUSED, short events) {
+  UNUSED(oldEvents);
+  struct UringPoller *poller = (struct UringPoller *)poller_;
+  check(fd >= 0);
+  if (fd >= poller->fdsSize) {
+    if (!events) {
+      return 0;
+    }
+    uringGrow(poller, fd);
+  }
+  struct UringFd *state      = poller->fds + fd;
+  state->events              = events;
+  if (!events) {
+    state->revents           = 0;
+  }
+  if (state->armed && state->armed != uringPollEvents(state)) {
+    uringDisarm(poller, fd);
+  }
+  uringMarkDirty(poller, fd);
+  return 0;
+}
+
+static void uringReap(struct UringPoller *poller) {
+  unsigned head              = *poller->cqHead;
+  unsigned tail              = __atomic_load_n(poller->cqTail,
+                                               __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = poller->cqes + (head & poller->cqMask);
+    if (cqe->user_data & URING_POLL) {
+      uint32_t tag           = (cqe->user_data >> 32) & 0x7FFFFFFF;
+      int fd                 = (int)(cqe->user_data & 0xFFFFFFFF);
+      if (fd < poller->fdsSize && poller->fds[fd].armed &&
+          poller->fds[fd].tag == tag) {
+        poller->fds[fd].armed    = 0;
+        poller->fds[fd].revents |= cqe->res < 0 ? POLLNVAL : cqe->res;
+        uringMarkDirty(poller, fd);
+      }
+    } else if (cqe->user_data != URING_REMOVE_TAG) {
+      uringComplete(poller, cqe->user_data, cqe->res, cqe->flags);
+    }
+  }
+  __atomic_store_n(poller->cqHead, head, __ATOMIC_RELEASE);
+}
+
+static short uringUpdate(struct UringPoller *poller, int fd) {
+  struct UringFd *state      = poller->fds + fd;
+  short fired                = state->revents & (state->events | POLLERR |
+                                                 POLLHUP | POLLNVAL);
+  state->revents             = 0;
+  short revents              = fired | uringUpdateIo(poller, fd);
+  short events               = uringPollEvents(state);
+  if (!fired && events && !state->armed) {
+    uringArm(poller, fd, events);
+  }
+  return revents;
+}
+
+static int uringCheck(struct UringPoller *poller, struct PollerEvent *events,
+                      int maxEvents) {
+  int numEvents              = 0;
+  int numDirty               = 0;
+  for (int i = 0; i < poller->numDirty; i++) {
+    int fd                   = poller->dirty[i];
+    if (numEvents < maxEvents) {
+      short revents          = uringUpdate(poller, fd);
+      if (!revents) {
+        poller->fds[fd].dirty = 0;
+        continue;
+      }
+      events[numEvents].fd        = fd;
+      events[numEvents++].revents = revents;
+    }
+    poller->dirty[numDirty++] = fd;
+  }
+  poller->numDirty           = numDirty;
+  return numEvents;
+}
+
+static int uringWait(struct Poller *poller_, struct PollerEvent *events,
+                     int maxEvents, int timeout) {
+  struct UringPoller *poller = (struct UringPoller *)poller_;
+  uringReap(poller);
+  int numEvents              = uringCheck(poller, events, maxEvents);
+  if (!numEvents ||
+      poller->tail != __atomic_load_n(poller->sqHead, __ATOMIC_ACQUIRE)) {
+    if (uringEnter(poller, !numEvents && timeout ? 1 : 0,
+                   numEvents ? 0 : timeout) < 0) {
+      return -1;
+    }
+    if (!numEvents) {
+      uringReap(poller);
+      numEvents              = uringCheck(poller, events, maxEvents);
+    }
+  }
+  return numEvents;
+}
+
+static void uringDestroy(struct Poller *poller_) {
+  struct UringPoller *poller = (struct UringPoller *)poller_;
+  munmap(poller->sqes, poller->sqesSize);
+  munmap(poller->ring, poller->ringSize);
+  NOINTR(close(poller->fd));
+  for (int fd = 0; fd < poller->fdsSize; fd++) {
+    if (poller->fds[fd].io) {
+      uringFreeIo(poller->fds[fd].io);
+    }
+  }
+  if (poller->bufRing) {
+    munmap(poller->bufRing, poller->bufRingSize);
+  }
+  free(poller->readBuffers);
+  free(poller->writeBuffers);
+  free(poller->freeWriteBuffers);
+  free(poller->fds);
+  free(poller->dirty);
+}
+
+#ifdef URING_IO
+static void uringRelease(struct Poller *poller_, int fd, int keepInput) {
+  struct UringPoller *poller = (struct UringPoller *)poller_;
+  struct UringIo *io;
+  if (fd < 0 || fd >= poller->fdsSize || !(io = poller->fds[fd].io)) {
+    return;
+  }
+  if (io->inflight) {
+    // The kernel has to be done with the descriptor, before the caller is
+    // allowed to close it or to access it directly.
+    io->releasing            = 1;
+    uringSubmitCancel(poller, io);
+    while (io->inflight) {
+      check(uringEnter(poller, 1, -1) >= 0);
+      uringReap(poller);
+    }
+    io->releasing            = 0;
+  }
+  if (io->inLength) {
+    if (keepInput) {
+      check(io->leftover     = realloc(io->leftover,
+                                       io->leftoverLength + io->inLength));
+      memcpy(io->leftover + io->leftoverLength,
+             poller->readBuffers + io->inBuffer*URING_BUFFER_SIZE +
+             io->inStart, io->inLength);
+      io->leftoverLength    += io->inLength;
+    }
+    uringRecycle(poller, io->inBuffer);
+    io->inBuffer             = -1;
+    io->inLength             = 0;
+  }
+  if (keepInput && (io->leftoverLength || io->numAccepted)) {
+    // Data that we already received stays available to pollerReadv() and
+    // pollerAccept(). Everything else is handled by the caller again.
+    io->ops                  = 0;
+    io->inEof                = 0;
+    io->inError              = 0;
+    io->outError             = 0;
+    io->acceptError          = 0;
+  } else {
+    uringFreeIo(io);
+    poller->fds[fd].io       = NULL;
+  }
+  uringMarkDirty(poller, fd);
+}
+
+static int uringClaim(struct Poller *poller_, int fd, int ops) {
+  struct UringPoller *poller = (struct UringPoller *)poller_;
+  check(fd >= 0);
+  ops                       &= poller->ops;
+  if (!ops) {
+    return 0;
+  }
+  uringGrow(poller, fd);
+  struct UringFd *state      = poller->fds + fd;
+  if (state->io) {
+    uringRelease(poller_, fd, 0);
+  }
+  struct UringIo *io;
+  check(io                   = calloc(1, sizeof(struct UringIo)));
+  io->fd                     = fd;
+  io->ops                    = ops;
+  io->inBuffer               = -1;
+  io->outBuffer              = -1;
+  struct stat sb;
+  io->isSocket               = !fstat(fd, &sb) && S_ISSOCK(sb.st_mode);
+  state->io                  = io;
+  if (state->armed) {
+    uringDisarm(poller, fd);
+  }
+  uringMarkDirty(poller, fd);
+  return ops;
+}
+
+static int uringAccept(struct Poller *poller_, int fd, struct sockaddr *addr,
+                       socklen_t *addrLen) {
+  struct UringPoller *poller = (struct UringPoller *)poller_;
+  struct UringIo *io         = fd < poller->fdsSize ? poller->fds[fd].io
+                                                    : NULL;
+  if (!io || (!(io->ops & POLLER_ACCEPT) && !io->numAccepted &&
+              !io->acceptError)) {
+    return pollerAcceptFd(fd, addr, addrLen);
+  }
+  uringMarkDirty(poller, fd);
+  if (io->numAccepted) {
+    int clientFd             = io->accepted[0];
+    memmove(io->accepted, io->accepted + 1,
+            --io->numAccepted*sizeof(int));
+    if (addr && getpeername(clientFd, addr, addrLen)) {
+      *addrLen               = 0;
+    }
+    return clientFd;
+  }
+  errno                      = io->acceptError ? io->acceptError : EAGAIN;
+  io->acceptError            = 0;
+  return -1;
+}
+
+static ssize_t uringReadv(struct Poller *poller_, int fd,
+                          const struct iovec *iov, int count) {
+  struct UringPoller *poller = (struct UringPoller *)poller_;
+  struct UringIo *io         = fd < poller->fdsSize ? poller->fds[fd].io
+                                                    : NULL;
+  if (!io || (!(io->ops & POLLER_READ) && !io->leftoverLength)) {
+    return NOINTR(readv(fd, iov, count));
+  }
+  uringMarkDirty(poller, fd);
+  const char *src;
+  int avail;
+  if (io->leftoverLength) {
+    src                      = io->leftover;
+    avail                    = io->leftoverLength;
+  } else if (io->inLength) {
+    src                      = poller->readBuffers +
+                               io->inBuffer*URING_BUFFER_SIZE + io->inStart;
+    avail                    = io->inLength;
+  } else if (io->inError) {
+    errno                    = io->inError;
+    return -1;
+  } else if (io->inEof) {
+    return 0;
+  } else {
+    errno                    = EAGAIN;
+    return -1;
+  }
+  int len                    = 0;
+  for (int i = 0; i < count && len < avail; i++) {
+    int n                    = avail - len < (int)iov[i].iov_len ?
+                               avail - len : (int)iov[i].iov_len;
+    memcpy(iov[i].iov_base, src + len, n);
+    len                     += n;
+  }
+  if (io->leftoverLength) {
+    memmove(io->leftover, io->leftover + len, io->leftoverLength - len);
+    io->leftoverLength      -= len;
+  } else if (!(io->inLength -= len)) {
+    uringRecycle(poller, io->inBuffer);
+    io->inBuffer             = -1;
+  } else {
+    io->inStart             += len;
+  }
+  return len;
+}
+
+static ssize_t uringWritev(struct Poller *poller_, int fd,
+                           const struct iovec *iov, int count) {
+  struct UringPoller *poller = (struct UringPoller *)poller_;
+  struct UringIo *io         = fd < poller->fdsSize ? poller->fds[fd].io
+                                                    : NULL;
+  if (!io || !(io->ops & POLLER_WRITE)) {
+    return NOINTR(writev(fd, iov, count));
+  }
+  if (io->outError) {
+    errno                    = io->outError;
+    return -1;
+  }
+  if (io->writing) {
+    errno                    = EAGAIN;
+    return -1;
+  }
+  if (!poller->numFreeWriteBuffers) {
+    // Nothing is in flight for this descriptor. So, writing directly
+    // can't reorder any data.
+    return NOINTR(writev(fd, iov, count));
+  }
+  io->outBuffer              = poller->freeWriteBuffers[
+                                          --poller->numFreeWriteBuffers];
+  char *dst                  = poller->writeBuffers +
+                               io->outBuffer*URING_BUFFER_SIZE;
+  int len                    = 0;
+  for (int i = 0; i < count && len < URING_BUFFER_SIZE; i++) {
+    int n                    = URING_BUFFER_SIZE - len < (int)iov[i].iov_len ?
+                               URING_BUFFER_SIZE - len : (int)iov[i].iov_len;
+    memcpy(dst + len, iov[i].iov_base, n);
+    len                     += n;
+  }
+  if (!len) {
+    uringFreeWriteBuffer(poller, io);
+    return 0;
+  }
+  io->outStart               = 0;
+  io->outLength              = len;
+  uringSubmitWrite(poller, io);
+  uringMarkDirty(poller, fd);
+  return len;
+}
+
+static int uringWritePending(struct Poller *poller_, int fd) {
+  struct UringPoller *poller = (struct UringPoller *)poller_;
+  return fd < poller->fdsSize && poller->fds[fd].io &&
+         poller->fds[fd].io->writing;
+}
+
+static void uringSetupIo(struct UringPoller *poller) {
+  // Accepting connections doesn't need any buffers. Reads and writes only
+  // get delegated, if the kernel let us register buffers for them.
+  poller->ops                = POLLER_ACCEPT;
+  long pageSize              = sysconf(_SC_PAGESIZE);
+  size_t bufRingSize         = (URING_BUFFERS*sizeof(struct io_uring_buf) +
+                                pageSize - 1) & ~(pageSize - 1);
+  void *bufRing              = mmap(NULL, bufRingSize,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufRing != MAP_FAILED) {
+    struct io_uring_buf_reg reg = { 0 };
+    reg.ring_addr            = (uintptr_t)bufRing;
+    reg.ring_entries         = URING_BUFFERS;
+    reg.bgid                 = URING_BUFFER_GROUP;
+    if (!syscall(__NR_io_uring_register, poller->fd,
+                 IORING_REGISTER_PBUF_RING, &reg, 1)) {
+      poller->bufRing        = bufRing;
+      poller->bufRingSize    = bufRingSize;
+      check(poller->readBuffers = malloc(URING_BUFFERS*URING_BUFFER_SIZE));
+      for (int i = 0; i < URING_BUFFERS; i++) {
+        uringRecycle(poller, i);
+      }
+      poller->ops           |= POLLER_READ;
+    } else {
+      munmap(bufRing, bufRingSize);
+    }
+  }
+  void *writeBuffers;
+  if (!posix_memalign(&writeBuffers, pageSize,
+                      URING_BUFFERS*URING_BUFFER_SIZE)) {
+    struct iovec iov         = { writeBuffers,
+                                 URING_BUFFERS*URING_BUFFER_SIZE };
+    if (!syscall(__NR_io_uring_register, poller->fd,
+                 IORING_REGISTER_BUFFERS, &iov, 1)) {
+      poller->writeBuffers   = writeBuffers;
+      check(poller->freeWriteBuffers = malloc(URING_BUFFERS*sizeof(int)));
+      for (int i = 0; i < URING_BUFFERS; i++) {
+        poller->freeWriteBuffers[i] = i;
+      }
+      poller->numFreeWriteBuffers = URING_BUFFERS;
+      poller->ops           |= POLLER_WRITE;
+    } else {
+      free(writeBuffers);
+    }
+  }
+}
+#endif
+
+struct Poller *newUringPoller(void) {
+  struct io_uring_params params = { 0 };
+  params.flags               = IORING_SETUP_CQSIZE;
+  params.cq_entries          = 8*URING_ENTRIES;
+  int fd                     = syscall(__NR_io_uring_setup, URING_ENTRIES,
+                                       &params);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  // We rely on a single mapping for both rings, on events never getting
+  // dropped, and on being able to pass a timeout to io_uring_enter().
+  if ((params.features & (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                          IORING_FEAT_EXT_ARG)) !=
+      (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)) {
+    NOINTR(close(fd));
+    return NULL;
+  }
+  size_t sqSize              = params.sq_off.array +
+                               params.sq_entries*sizeof(unsigned);
+  size_t cqSize              = params.cq_off.cqes +
+                               params.cq_entries*sizeof(struct io_uring_cqe);
+  size_t ringSize            = sqSize > cqSize ? sqSize : cqSize;
+  char *ring                 = mmap(NULL, ringSize, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, fd,
+                                    IORING_OFF_SQ_RING);
+  if (ring == MAP_FAILED) {
+    NOINTR(close(fd));
+    return NULL;
+  }
+  size_t sqesSize            = params.sq_entries*sizeof(struct io_uring_sqe);
+  void *sqes                 = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, fd,
+                                    IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    munmap(ring, ringSize);
+    NOINTR(close(fd));
+    return NULL;
+  }
+  check(!fcntl(fd, F_SETFD, FD_CLOEXEC));
+
+  struct UringPoller *poller;
+  check(poller               = calloc(1, sizeof(struct UringPoller)));
+  poller->poller.name        = "io_uring";
+  poller->poller.setEvents   = uringSetEvents;
+  poller->poller.wait        = uringWait;
+  poller->poller.destroy     = uringDestroy;
+  poller->fd                 = fd;
+  poller->ring               = ring;
+  poller->ringSize           = ringSize;
+  poller->sqes               = sqes;
+  poller->sqesSize           = sqesSize;
+  poller->sqHead             = (unsigned *)(ring + params.sq_off.head);
+  poller->sqTail             = (unsigned *)(ring + params.sq_off.tail);
+  poller->sqMask             = *(unsigned *)(ring + params.sq_off.ring_mask);
+  poller->sqArray            = (unsigned *)(ring + params.sq_off.array);
+  poller->sqEntries          = params.sq_entries;
+  poller->cqHead             = (unsigned *)(ring + params.cq_off.head);
+  poller->cqTail             = (unsigned *)(ring + params.cq_off.tail);
+  poller->cqMask             = *(unsigned *)(ring + params.cq_off.ring_mask);
+  poller->cqes               = (struct io_uring_cqe *)(ring +
+                                                       params.cq_off.cqes);
+  poller->tail               = *poller->sqTail;
+  poller->nextTag            = URING_REMOVE_TAG;
+#ifdef URING_IO
+  poller->poller.claim       = uringClaim;
+  poller->poller.release     = uringRelease;
+  poller->poller.accept      = uringAccept;
+  poller->poller.readv       = uringReadv;
+  poller->poller.writev      = uringWritev;
+  poller->poller.writePending = uringWritePending;
+  uringSetupIo(poller);
+#endif
+  return &poller->poller;
+}
+#else
+struct Poller *newUringPoller(void) {
+  return NULL;
+}
+#endif
+
+struct Poller *newPoller(const char *name) {
+  struct Poller *poller = NULL;
+  if (name && !strcmp(name, "io_uring")) {
+    if (!(poller        = newUringPoller())) {
+      info("[server] io_uring() is not available. Falling back on epoll()");
+    }
+  }
+  if (!poller && (!name || strcmp(name, "poll"))) {
+    poller              = newEpollPoller();
+  }
+  if (!poller) {
+    poller              = newPollPoller();
+  }
+  debug("[server] Using %s() for event notification", poller->name);
+  return poller;
+}
+
+void deletePoller(struct Poller *poller) {
+  if (poller) {
+    poller->destroy(poller);
+    free(poller);
+  }
+}
+
+int pollerClaim(struct Poller *poller, int fd, int ops) {
+  return poller->claim ? poller->claim(poller, fd, ops) : 0;
+}
+
+void pollerRelease(struct Poller *poller, int fd, int keepInput) {
+  if (poller->release) {
+    poller->release(poller, fd, keepInput);
+  }
+}
+
+int pollerAccept(struct Poller *poller, int fd, struct sockaddr *addr,
+                 socklen_t *addrLen) {
+  return poller->accept ? poller->accept(poller, fd, addr, addrLen)
+                        : pollerAcceptFd(fd, addr, addrLen);
+}
+
+ssize_t pollerReadv(struct Poller *poller, int fd, const struct iovec *iov,
+                    int count) {
+  return poller->readv ? poller->readv(poller, fd, iov, count)
+                       : NOINTR(readv(fd, iov, count));
+}
+
+ssize_t pollerWritev(struct Poller *poller, int fd, const struct iovec *iov,
+                     int count) {
+  return poller->writev ? poller->writev(poller, fd, iov, count)
+                        : NOINTR(writev(fd, iov, count));
+}
+
+int pollerWritePending(struct Poller *poller, int fd) {
+  return poller->writePending ? poller->writePending(poller, fd) : 0;
+}
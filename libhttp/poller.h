@@ -0,0 +1,110 @@
+// poller.h -- Pluggable readiness notification backends for the server loop
+// Copyright (C) 2008-2010 Markus Gutschke <markus@shellinabox.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// In addition to these license terms, the author grants the following
+// additional rights:
+//
+// If you modify this program, or any covered work, by linking or
+// combining it with the OpenSSL project's OpenSSL library (or a
+// modified version of that library), containing parts covered by the
+// terms of the OpenSSL or SSLeay licenses, the author
+// grants you additional permission to convey the resulting work.
+// Corresponding Source for a non-source form of such a combination
+// shall include the source code for the parts of OpenSSL used as well
+// as that of the covered work.
+//
+// You may at your option choose to remove this additional permission from
+// the work, or from any part of it.
+//
+// It is possible to build this program in a way that it loads OpenSSL
+// libraries at run-time. If doing so, the following notices are required
+// by the OpenSSL and SSLeay licenses:
+//
+// This product includes software developed by the OpenSSL Project
+// for use in the OpenSSL Toolkit. (http://www.openssl.org/)
+//
+// This product includes cryptographic software written by Eric Young
+// (eay@cryptsoft.com)
+//
+//
+// The most up-to-date version of this program is always available from
+// http://shellinabox.com
+
+#ifndef POLLER_H__
+#define POLLER_H__
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// A Poller tracks the set of file descriptors that the server loop is
+// interested in, and reports which of them are ready. Event masks use the
+// same POLLIN/POLLOUT/POLLPRI/POLLERR/POLLHUP bits as poll(). Descriptors
+// with an empty event mask are not monitored at all.
+//
+// All backends are level-triggered, so that callers can leave data unread
+// and still get notified again on the next call to wait().
+//
+// Some backends can also perform I/O on behalf of the caller. Once a file
+// descriptor has been claimed, readiness means that data has already been
+// received, that an earlier write has completed, or that a connection has
+// already been accepted. From then on, all I/O has to go through the
+// poller, until the descriptor gets released again. Backends that don't
+// support this simply perform the corresponding system calls.
+
+#define POLLER_READ   1
+#define POLLER_WRITE  2
+#define POLLER_ACCEPT 4
+
+struct PollerEvent {
+  int   fd;
+  short revents;
+};
+
+struct Poller {
+  const char *name;
+  int        (*setEvents)(struct Poller *poller, int fd, short oldEvents,
+                          short events);
+  int        (*wait)(struct Poller *poller, struct PollerEvent *events,
+                     int maxEvents, int timeout);
+  void       (*destroy)(struct Poller *poller);
+  int        (*claim)(struct Poller *poller, int fd, int ops);
+  void       (*release)(struct Poller *poller, int fd, int keepInput);
+  int        (*accept)(struct Poller *poller, int fd, struct sockaddr *addr,
+                       socklen_t *addrLen);
+  ssize_t    (*readv)(struct Poller *poller, int fd,
+                      const struct iovec *iov, int count);
+  ssize_t    (*writev)(struct Poller *poller, int fd,
+                       const struct iovec *iov, int count);
+  int        (*writePending)(struct Poller *poller, int fd);
+};
+
+struct Poller *newPoller(const char *name);
+struct Poller *newPollPoller(void);
+struct Poller *newEpollPoller(void);
+struct Poller *newUringPoller(void);
+void deletePoller(struct Poller *poller);
+int pollerClaim(struct Poller *poller, int fd, int ops);
+void pollerRelease(struct Poller *poller, int fd, int keepInput);
+int pollerAccept(struct Poller *poller, int fd, struct sockaddr *addr,
+                 socklen_t *addrLen);
+ssize_t pollerReadv(struct Poller *poller, int fd, const struct iovec *iov,
+                    int count);
+ssize_t pollerWritev(struct Poller *poller, int fd, const struct iovec *iov,
+                     int count);
+int pollerWritePending(struct Poller *poller, int fd);
+
+#endif /* POLLER_H__ */
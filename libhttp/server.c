@@ -43,12 +43,17 @@
 // The most up-to-date version of this program is always available from
 // http://shellinabox.com
 
+#define _GNU_SOURCE
 #include "config.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <signal.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/poll.h>
@@ -60,8 +65,12 @@
 #include <unistd.h>
 
 #include "libhttp/server.h"
+#include "libhttp/hashmap.h"
+#include "libhttp/histogram.h"
 #include "libhttp/httpconnection.h"
+#include "libhttp/poller.h"
 #include "libhttp/ssl.h"
+#include "libhttp/timer.h"
 #include "logging/logging.h"
 
 #ifdef HAVE_UNUSED
@@ -74,77 +83,65 @@
 
 #define INITIAL_TIMEOUT    (10*60)
 
+// Connections are allocated in slabs of this many entries. Slabs are never
+// freed while the server is running, so pointers to connections stay valid.
+#define CONNECTION_SLAB_SIZE 64
+
 // Maximum amount of payload (e.g. form values that have been POST'd) that we
 // read into memory. If the application needs any more than this, the streaming
 // API should be used, instead.
 #define MAX_PAYLOAD_LENGTH (64<<10)
 
+// Maximum number of connections that we accept in a single iteration of
+// the loop. This drains accept storms quickly, without starving existing
+// connections.
+#define MAX_ACCEPT_BATCH   64
 
-#if defined(__APPLE__) && defined(__MACH__)
-// While MacOS X does ship with an implementation of poll(), this
-// implementation is apparently known to be broken and does not comply
-// with POSIX standards. Fortunately, the operating system is not entirely
-// unable to check for input events. We can fall back on calling select()
-// instead. This is generally not desirable, as it is less efficient and
-// has a compile-time restriction on the maximum number of file
-// descriptors. But on MacOS X, that's the best we can do.
-
-int x_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
-  fd_set r, w, x;
-  FD_ZERO(&r);
-  FD_ZERO(&w);
-  FD_ZERO(&x);
-  int maxFd             = -1;
-  for (int i = 0; i < nfds; ++i) {
-    if (fds[i].fd > maxFd) {
-      maxFd = fds[i].fd;
-    } else if (fds[i].fd < 0) {
-      continue;
-    }
-    if (fds[i].events & POLLIN) {
-      FD_SET(fds[i].fd, &r);
-    }
-    if (fds[i].events & POLLOUT) {
-      FD_SET(fds[i].fd, &w);
-    }
-    if (fds[i].events & POLLPRI) {
-      FD_SET(fds[i].fd, &x);
-    }
-  }
-  struct timeval tmoVal = { 0 }, *tmo;
-  if (timeout < 0) {
-    tmo                 = NULL;
-  } else {
-    tmoVal.tv_sec       =  timeout / 1000;
-    tmoVal.tv_usec      = (timeout % 1000) * 1000;
-    tmo                 = &tmoVal;
-  }
-  int numRet            = select(maxFd + 1, &r, &w, &x, tmo);
-  for (int i = 0, n = numRet; i < nfds && n > 0; ++i) {
-    if (fds[i].fd < 0) {
-      continue;
-    }
-    if (FD_ISSET(fds[i].fd, &x)) {
-      fds[i].revents    = POLLPRI;
-    } else if (FD_ISSET(fds[i].fd, &r)) {
-      fds[i].revents    = POLLIN;
-    } else {
-      fds[i].revents    = 0;
-    }
-    if (FD_ISSET(fds[i].fd, &w)) {
-      fds[i].revents   |= POLLOUT;
-    }
-  }
-  return numRet;
-}
-#define poll x_poll
+// If we run out of file descriptors or memory, stop accepting connections
+// for a little while. Otherwise, the listening socket would stay readable
+// and we would spin.
+#define ACCEPT_BACKOFF_MS  100
+
+// When collecting latency statistics, summarize them this often.
+#define STATS_INTERVAL_MS  (60*1000)
+
+#ifdef HAVE_PTHREAD_CREATE
+// Reactor threads release connections that the acceptor admitted.
+#define lockAdmission(server)   pthread_mutex_lock(&(server)->admissionLock)
+#define unlockAdmission(server) pthread_mutex_unlock(&(server)->admissionLock)
+#else
+#define lockAdmission(server)   do { } while (0)
+#define unlockAdmission(server) do { } while (0)
 #endif
 
-time_t currentTime;
-char  *unixDomainPath  = NULL;
-int    unixDomainUser  = 0;
-int    unixDomainGroup = 0;
-int    unixDomainChmod = 0;
+
+__thread time_t currentTime;
+int    serverReusePort       = 0;
+char  *serverEventBackend   = NULL;
+int    serverStallThreshold = 0;
+char  *unixDomainPath       = NULL;
+int    unixDomainUser       = 0;
+int    unixDomainGroup      = 0;
+int    unixDomainChmod      = 0;
+
+// Reactor threads receive new connections, and connections that move over
+// from other reactors, through a mailbox.
+struct ServerMail {
+  struct ServerMail     *next;
+  int                   fd;
+  struct HttpConnection *http;
+};
+
+// Sent to clients, when we are over capacity. This is a static string, so
+// that rejecting a connection costs next to nothing.
+static const char serverOverloadedReply[] =
+  "HTTP/1.1 503 Service Unavailable\r\n"
+  "Connection: close\r\n"
+  "Content-Type: text/plain\r\n"
+  "Content-Length: 20\r\n"
+  "Retry-After: 1\r\n"
+  "\r\n"
+  "Service Unavailable\n";
 
 struct PayLoad {
   int (*handler)(struct HttpConnection *, void *, const char *, int);
@@ -191,17 +188,25 @@ static int serverCollectFullPayload(struct HttpConnection *http,
 
 }
 
-static int serverCollectHandler(struct HttpConnection *http, void *handler_) {
-  struct HttpHandler *handler = handler_;
+int serverCollectPayload(struct HttpConnection *http,
+                         int (*handler)(struct HttpConnection *, void *,
+                                        const char *, int), void *arg) {
+  // Streaming handlers can decide to have the full payload delivered to
+  // "handler", after all. Returns the value that they should return.
   struct PayLoad *payload;
   check(payload               = malloc(sizeof(struct PayLoad)));
-  payload->handler            = handler->streamingHandler;
-  payload->arg                = handler->streamingArg;
+  payload->handler            = handler;
+  payload->arg                = arg;
   payload->len                = 0;
   payload->bytes              = malloc(0);
   httpSetCallback(http, serverCollectFullPayload, payload);
   return HTTP_READ_MORE;
+}
 
+static int serverCollectHandler(struct HttpConnection *http, void *handler_) {
+  struct HttpHandler *handler = handler_;
+  return serverCollectPayload(http, handler->streamingHandler,
+                              handler->streamingArg);
 }
 
 static void serverDestroyHandlers(void *arg ATTR_UNUSED, char *value) {
@@ -222,6 +227,7 @@ void serverRegisterHttpHandler(struct Server *server, const char *url,
     h->streamingHandler = handler;
     h->websocketHandler = NULL;
     h->streamingArg     = arg;
+    h->websocketArg     = NULL;
     addToTrie(&server->handlers, url, (char *)h);
   }
 }
@@ -238,6 +244,7 @@ void serverRegisterStreamingHttpHandler(struct Server *server, const char *url,
     h->streamingHandler = NULL;
     h->websocketHandler = NULL;
     h->streamingArg     = NULL;
+    h->websocketArg     = NULL;
     h->arg              = arg;
     addToTrie(&server->handlers, url, (char *)h);
   }
@@ -246,15 +253,24 @@ void serverRegisterStreamingHttpHandler(struct Server *server, const char *url,
 void serverRegisterWebSocketHandler(struct Server *server, const char *url,
        int (*handler)(struct HttpConnection *, void *, int, const char *, int),
        void *arg) {
-  if (!handler) {
+  // A URL can serve both regular HTTP requests and WebSocket connections. If
+  // a handler has already been registered for this exact URL, only attach
+  // the WebSocket handler to it.
+  struct HttpHandler *h = (struct HttpHandler *)getFromTrie(&server->handlers,
+                                                            url, NULL);
+  if (h) {
+    h->websocketHandler = handler;
+    h->websocketArg     = arg;
+  } else if (!handler) {
     addToTrie(&server->handlers, url, NULL);
   } else {
-    struct HttpHandler *h;
     check(h             = malloc(sizeof(struct HttpHandler)));
     h->handler          = NULL;
     h->streamingHandler = NULL;
     h->websocketHandler = handler;
-    h->arg              = arg;
+    h->arg              = NULL;
+    h->streamingArg     = NULL;
+    h->websocketArg     = arg;
     addToTrie(&server->handlers, url, (char *)h);
   }
 }
@@ -279,14 +295,75 @@ struct Server *newServer(int localhostOnly, int port) {
   return newCGIServer(localhostOnly, port, port, -1);
 }
 
-void initServer(struct Server *server, int localhostOnly, int portMin,
-                int portMax, int timeout) {
+static void serverStartListening(struct Server *server) {
+  check(!fcntl(server->serverFd, F_SETFL, O_RDWR | O_NONBLOCK));
+  pollerClaim(server->poller, server->serverFd, POLLER_ACCEPT);
+  server->poller->setEvents(server->poller, server->serverFd, 0, POLLIN);
+
+  initTrie(&server->handlers, serverDestroyHandlers, NULL);
+  serverRegisterStreamingHttpHandler(server, "/quit", serverQuitHandler, NULL);
+  initSSL(&server->ssl);
+}
+
+static void initServerState(struct Server *server, int timeout) {
   server->looping               = 0;
   server->exitAll               = 0;
   server->serverTimeout         = timeout;
+  server->serverFd              = -1;
+  server->port                  = 0;
   server->numericHosts          = 0;
-  server->connections           = NULL;
+  server->connectionSlabs       = NULL;
+  server->numConnectionSlabs    = 0;
+  server->freeConnections       = NULL;
+  server->deletedConnections    = NULL;
+  server->connectionsByFd       = NULL;
+  server->connectionsByFdSize   = 0;
   server->numConnections        = 0;
+  server->poller                = newPoller(serverEventBackend);
+  server->readyEvents           = NULL;
+  server->maxReadyEvents        = 0;
+  server->generation            = 0;
+  server->handOff               = NULL;
+  server->handOffArg            = NULL;
+  server->route                 = NULL;
+  server->routeArg              = NULL;
+  server->acceptor              = NULL;
+  server->reactors              = NULL;
+  server->numReactors           = 0;
+  server->nextReactor           = 0;
+  server->reactorId             = -1;
+  server->initReactor           = NULL;
+  server->destroyReactor        = NULL;
+  server->reactorArg            = NULL;
+  server->mailbox               = NULL;
+  server->mailboxFds[0]         = -1;
+  server->mailboxFds[1]         = -1;
+  server->stopping              = 0;
+  server->acceptResumeTime      = 0;
+  server->maxConnections        = 0;
+  server->maxConnectionsPerPeer = 0;
+  server->numAdmitted           = 0;
+  server->admittedPeers         = NULL;
+  server->admittedByFd          = NULL;
+  server->admittedByFdSize      = 0;
+#ifdef HAVE_PTHREAD_CREATE
+  check(!pthread_mutex_init(&server->admissionLock, NULL));
+#endif
+  initTimerWheel(&server->timers, timerGetMonotonicTime());
+  server->stats                 = NULL;
+  if (serverStallThreshold > 0) {
+    check(server->stats         = malloc(sizeof(struct ServerStats)));
+    initHistogram(&server->stats->iterations);
+    initHistogram(&server->stats->callbacks);
+    initHistogram(&server->stats->readyEvents);
+    server->stats->lastReport   = server->timers.now;
+    server->stats->stalled      = 0;
+  }
+}
+
+void initServer(struct Server *server, int localhostOnly, int portMin,
+                int portMax, int timeout) {
+  initServerState(server, timeout);
 
   int true                      = 1;
 
@@ -323,13 +400,7 @@ void initServer(struct Server *server, int localhostOnly, int portMin,
 
     check(!listen(server->serverFd, SOMAXCONN));
     info("[server] Listening on unix domain socket %s...", unixDomainPath);
-    check(server->pollFds         = malloc(sizeof(struct pollfd)));
-    server->pollFds->fd           = server->serverFd;
-    server->pollFds->events       = POLLIN;
-
-    initTrie(&server->handlers, serverDestroyHandlers, NULL);
-    serverRegisterStreamingHttpHandler(server, "/quit", serverQuitHandler, NULL);
-    initSSL(&server->ssl);
+    serverStartListening(server);
     return;
   }
 
@@ -337,6 +408,14 @@ void initServer(struct Server *server, int localhostOnly, int portMin,
   check(server->serverFd >= 0);
   check(!setsockopt(server->serverFd, SOL_SOCKET, SO_REUSEADDR,
                     &true, sizeof(true)));
+#ifdef SO_REUSEPORT
+  // Allow several worker processes to share the same port. The kernel
+  // then distributes incoming connections between them.
+  if (serverReusePort) {
+    check(!setsockopt(server->serverFd, SOL_SOCKET, SO_REUSEPORT,
+                      &true, sizeof(true)));
+  }
+#endif
   struct sockaddr_in serverAddr = { 0 };
   serverAddr.sin_family         = AF_INET;
   serverAddr.sin_addr.s_addr    = htonl(localhostOnly
@@ -374,29 +453,98 @@ void initServer(struct Server *server, int localhostOnly, int portMin,
   check(socklen == sizeof(serverAddr));
   server->port                  = ntohs(serverAddr.sin_port);
   info("[server] Listening on port %d...", server->port);
+  serverStartListening(server);
+}
 
-  check(server->pollFds         = malloc(sizeof(struct pollfd)));
-  server->pollFds->fd           = server->serverFd;
-  server->pollFds->events       = POLLIN;
+struct Server *newServerFromFd(int fd) {
+  struct Server *server;
+  check(server = malloc(sizeof(struct Server)));
+  initServerFromFd(server, fd);
+  return server;
+}
 
-  initTrie(&server->handlers, serverDestroyHandlers, NULL);
-  serverRegisterStreamingHttpHandler(server, "/quit", serverQuitHandler, NULL);
-  initSSL(&server->ssl);
+void initServerFromFd(struct Server *server, int fd) {
+  // Take over a socket that some other process is already listening on.
+  initServerState(server, -1);
+  server->serverFd              = fd;
+  struct sockaddr_storage serverAddr;
+  socklen_t socklen             = (socklen_t)sizeof(serverAddr);
+  check(!getsockname(fd, (struct sockaddr *)&serverAddr, &socklen));
+  if (serverAddr.ss_family == AF_INET) {
+    server->port                = ntohs(((struct sockaddr_in *)&serverAddr)
+                                        ->sin_port);
+    info("[server] Listening on inherited port %d...", server->port);
+  } else {
+    info("[server] Listening on inherited socket...");
+  }
+  serverStartListening(server);
 }
 
+static void serverRetireConnection(struct Server *server,
+                                   struct ServerConnection *connection);
+
+static void serverDestroyConnections(struct Server *server) {
+  for (int i = 0; i < server->numConnectionSlabs; i++) {
+    for (int j = 0; j < CONNECTION_SLAB_SIZE; j++) {
+      struct ServerConnection *connection = server->connectionSlabs[i] + j;
+      if (!connection->deleted) {
+        serverRetireConnection(server, connection);
+        connection->destroyConnection(connection->arg);
+      }
+    }
+  }
+}
+
+static void serverStopReactors(struct Server *server);
+
 void destroyServer(struct Server *server) {
   if (server) {
+    serverStopReactors(server);
     if (server->serverFd >= 0) {
       info("[server] Shutting down server");
       NOINTR(close(server->serverFd));
     }
-    for (int i = 0; i < server->numConnections; i++) {
-      server->connections[i].destroyConnection(server->connections[i].arg);
+    serverDestroyConnections(server);
+    for (struct ServerMail *mail = server->mailbox; mail; ) {
+      // Mail that arrived after the reactor stopped looping.
+      struct ServerMail *next     = mail->next;
+      if (mail->http) {
+        deleteHttpConnection(mail->http);
+      } else {
+        serverReleaseConnection(server, mail->fd);
+        NOINTR(close(mail->fd));
+      }
+      free(mail);
+      mail                        = next;
+    }
+    for (int i = 0; i < 2; i++) {
+      if (server->mailboxFds[i] >= 0) {
+        NOINTR(close(server->mailboxFds[i]));
+      }
+    }
+    destroyTimerWheel(&server->timers);
+    for (int i = 0; i < server->numConnectionSlabs; i++) {
+      free(server->connectionSlabs[i]);
+    }
+    free(server->connectionSlabs);
+    free(server->connectionsByFd);
+    deletePoller(server->poller);
+    free(server->readyEvents);
+    free(server->stats);
+    if (server->acceptor) {
+      // Reactors share handlers and SSL support with their acceptor.
+      return;
     }
-    free(server->connections);
-    free(server->pollFds);
     destroyTrie(&server->handlers);
     destroySSL(&server->ssl);
+    for (int i = 0; i < server->admittedByFdSize; i++) {
+      free(server->admittedByFd[i]);
+    }
+    free(server->admittedByFd);
+    deleteHashMap(server->admittedPeers);
+#ifdef HAVE_PTHREAD_CREATE
+    pthread_mutex_destroy(&server->admissionLock);
+#endif
 
     if (unixDomainPath) {
       struct stat st;
@@ -421,92 +569,162 @@ int serverGetFd(struct Server *server) {
   return server->serverFd;
 }
 
+static void serverSetEvents(struct Server *server,
+                            struct ServerConnection *connection,
+                            short events) {
+  if (connection->events != events) {
+    server->poller->setEvents(server->poller, connection->fd,
+                              connection->events, events);
+    connection->events          = events;
+  }
+}
+
+static struct ServerConnection *serverAllocConnection(struct Server *server) {
+  if (!server->freeConnections) {
+    // Grow the table by another slab. All entries in a new slab start out
+    // on the free list.
+    if (!(server->numConnectionSlabs & (server->numConnectionSlabs - 1))) {
+      check(server->connectionSlabs   = realloc(server->connectionSlabs,
+                                   (server->numConnectionSlabs ?
+                                    2*server->numConnectionSlabs : 1)*
+                                   sizeof(struct ServerConnection *)));
+    }
+    struct ServerConnection *slab;
+    check(slab                        = malloc(CONNECTION_SLAB_SIZE*
+                                            sizeof(struct ServerConnection)));
+    server->connectionSlabs[server->numConnectionSlabs++] = slab;
+    for (int i = CONNECTION_SLAB_SIZE; i-- > 0; ) {
+      slab[i].deleted                 = 1;
+      slab[i].next                    = server->freeConnections;
+      server->freeConnections         = slab + i;
+    }
+  }
+  struct ServerConnection *connection = server->freeConnections;
+  server->freeConnections             = connection->next;
+  connection->next                    = NULL;
+  return connection;
+}
+
+static void serverRetireConnection(struct Server *server,
+                                   struct ServerConnection *connection) {
+  // The entry cannot be reused until the end of the current iteration of
+  // the server loop, as there might still be pending events that refer
+  // to it.
+  serverSetEvents(server, connection, 0);
+  pollerRelease(server->poller, connection->fd, 0);
+  timerDisarm(&connection->timer);
+  connection->deleted                 = 1;
+  if (server->connectionsByFd[connection->fd] == connection) {
+    server->connectionsByFd[connection->fd] = NULL;
+  }
+  connection->next                    = server->deletedConnections;
+  server->deletedConnections          = connection;
+  server->numConnections--;
+}
+
 struct ServerConnection *serverAddConnection(struct Server *server, int fd,
                          int (*handleConnection)(struct ServerConnection *c,
                                                  void *arg, short *events,
                                                  short revents),
                          void (*destroyConnection)(void *arg),
                          void *arg) {
-  check(server->connections     = realloc(server->connections,
-                                          ++server->numConnections*
-                                          sizeof(struct ServerConnection)));
-  check(server->pollFds         = realloc(server->pollFds,
-                                          (server->numConnections + 1) *
-                                          sizeof(struct pollfd)));
-  server->pollFds[server->numConnections].fd     = fd;
-  server->pollFds[server->numConnections].events = POLLIN;
-  struct ServerConnection *connection            =
-                              server->connections + server->numConnections - 1;
-  connection->deleted           = 0;
-  connection->timeout           = 0;
-  connection->handleConnection  = handleConnection;
-  connection->destroyConnection = destroyConnection;
-  connection->arg               = arg;
+  check(fd >= 0);
+  if (fd >= server->connectionsByFdSize) {
+    int newSize                   = 2*server->connectionsByFdSize > fd
+                                    ? 2*server->connectionsByFdSize : fd + 1;
+    check(server->connectionsByFd = realloc(server->connectionsByFd,
+                                      newSize*sizeof(struct ServerConnection *)));
+    for (int i = server->connectionsByFdSize; i < newSize; i++) {
+      server->connectionsByFd[i]  = NULL;
+    }
+    server->connectionsByFdSize   = newSize;
+  }
+  struct ServerConnection *connection = serverAllocConnection(server);
+  server->connectionsByFd[fd]     = connection;
+  server->numConnections++;
+  connection->deleted             = 0;
+  connection->fd                  = fd;
+  connection->events              = 0;
+  connection->generation          = server->generation;
+  connection->dispatched          = server->generation - 1;
+  initTimer(&connection->timer, &server->timers, connection);
+  connection->handleConnection    = handleConnection;
+  connection->destroyConnection   = destroyConnection;
+  connection->describeConnection  = NULL;
+  connection->arg                 = arg;
+  serverSetEvents(server, connection, POLLIN);
   return connection;
 }
 
 void serverDeleteConnection(struct Server *server, int fd) {
-  for (int i = 0; i < server->numConnections; i++) {
-    if (fd == server->pollFds[i + 1].fd && !server->connections[i].deleted) {
-      server->connections[i].deleted = 1;
-      server->connections[i].destroyConnection(server->connections[i].arg);
-      return;
-    }
+  struct ServerConnection *connection = serverGetConnection(server, NULL, fd);
+  if (connection) {
+    serverRetireConnection(server, connection);
+    connection->destroyConnection(connection->arg);
   }
 }
 
+int serverDelegateIo(struct Server *server, int fd, int ops) {
+  return pollerClaim(server->poller, fd,
+                     ((ops & SERVER_READ)  ? POLLER_READ  : 0) |
+                     ((ops & SERVER_WRITE) ? POLLER_WRITE : 0));
+}
+
+ssize_t serverReadv(struct Server *server, int fd, const struct iovec *iov,
+                    int count) {
+  return pollerReadv(server->poller, fd, iov, count);
+}
+
+ssize_t serverWritev(struct Server *server, int fd, const struct iovec *iov,
+                     int count) {
+  return pollerWritev(server->poller, fd, iov, count);
+}
+
+int serverWritePending(struct Server *server, int fd) {
+  return pollerWritePending(server->poller, fd);
+}
+
+void serverSetConnectionDescriber(struct ServerConnection *connection,
+                                  char *(*describeConnection)(void *arg)) {
+  connection->describeConnection  = describeConnection;
+}
+
 void serverSetTimeout(struct ServerConnection *connection, time_t timeout) {
-  if (!currentTime) {
-    currentTime       = time(NULL);
+  serverSetTimeoutMs(connection, timeout > 0 ? timeout*1000 : 0);
+}
+
+void serverSetTimeoutMs(struct ServerConnection *connection, int timeout) {
+  // Deadlines are relative to the time when the server loop last woke up.
+  struct Timer *timer = &connection->timer;
+  if (timeout > 0) {
+    timerArm(timer, timer->wheel->now + timeout);
+  } else {
+    timerDisarm(timer);
   }
-  connection->timeout = timeout > 0 ? timeout + currentTime : 0;
 }
 
 time_t serverGetTimeout(struct ServerConnection *connection) {
-  if (connection->timeout) {
+  if (connection->timer.deadline) {
     // Returns <0 if expired, 0 if not set, and >0 if still pending.
-    if (!currentTime) {
-      currentTime = time(NULL);
+    int64_t remaining = timerGetRemaining(&connection->timer);
+    if (remaining <= 0) {
+      return -1;
     }
-    int remaining = connection->timeout - currentTime;
-    if (!remaining) {
-      remaining--;
-    }
-    return remaining;
+    return (remaining + 999)/1000;
   } else {
     return 0;
   }
 }
 
 struct ServerConnection *serverGetConnection(struct Server *server,
-                                             struct ServerConnection *hint,
+                                             struct ServerConnection *hint
+                                             ATTR_UNUSED,
                                              int fd) {
-  if (hint &&
-      server->connections <= hint &&
-      server->connections + server->numConnections > hint) {
-    // The compiler would like to optimize the expression:
-    //   &server->connections[hint - server->connections]     <=>
-    //   server->connections + hint - server->connections     <=>
-    //   hint
-    // This transformation is correct as far as the language specification is
-    // concerned, but it is unintended as we actually want to check whether
-    // the alignment is correct. So, instead of comparing
-    //   &server->connections[hint - server->connections] == hint
-    // we first use memcpy() to break aliasing.
-    uintptr_t ptr1, ptr2;
-    memcpy(&ptr1, &hint, sizeof(ptr1));
-    memcpy(&ptr2, &server->connections, sizeof(ptr2));
-    int idx = (ptr1 - ptr2)/sizeof(*server->connections);
-    if (&server->connections[idx] == hint &&
-        !hint->deleted &&
-        server->pollFds[hint - server->connections + 1].fd == fd) {
-      return hint;
-    }
-  }
-  for (int i = 0; i < server->numConnections; i++) {
-    if (server->pollFds[i + 1].fd == fd && !server->connections[i].deleted) {
-      return server->connections + i;
-    }
+  // Connections no longer move around in memory, so the hint is not needed
+  // anymore. It is retained for API compatibility.
+  UNUSED(hint);
+  if (fd >= 0 && fd < server->connectionsByFdSize) {
+    return server->connectionsByFd[fd];
   }
   return NULL;
 }
@@ -516,158 +734,650 @@ short serverConnectionSetEvents(struct Server *server,
                                 short events) {
   dcheck(server);
   dcheck(connection);
-  dcheck(connection >= server->connections);
-  dcheck(connection < server->connections + server->numConnections);
-  dcheck(connection == &server->connections[connection - server->connections]);
   dcheck(!connection->deleted);
-  int   idx                       = connection - server->connections;
-  short oldEvents                 = server->pollFds[idx + 1].events;
-  dcheck(fd == server->pollFds[idx + 1].fd);
-  server->pollFds[idx + 1].events = events;
+  dcheck(fd == connection->fd);
+  dcheck(serverGetConnection(server, NULL, fd) == connection);
+  short oldEvents                 = connection->events;
+  serverSetEvents(server, connection, events);
   return oldEvents;
 }
 
+short serverConnectionGetEvents(struct ServerConnection *connection) {
+  dcheck(connection);
+  dcheck(!connection->deleted);
+  return connection->events;
+}
+
 void serverExitLoop(struct Server *server, int exitAll) {
   server->looping--;
   server->exitAll |= exitAll;
 }
 
+static void serverWakeUp(struct Server *server) {
+  // If the pipe is full, the owner has not caught up with earlier wake ups
+  // yet. It will still see everything that we posted.
+  char ch                         = 0;
+  if (NOINTR(write(server->mailboxFds[1], &ch, 1)) < 0) {
+    dcheck(errno == EAGAIN);
+  }
+}
+
+static void serverPostMail(struct Server *server, int fd,
+                           struct HttpConnection *http) {
+  struct ServerMail *mail;
+  check(mail                      = malloc(sizeof(struct ServerMail)));
+  mail->fd                        = fd;
+  mail->http                      = http;
+
+  // Any thread can post mail, but only the owner ever takes it out. This
+  // makes a lock-free stack sufficient.
+  do {
+    mail->next                    = server->mailbox;
+  } while (!__sync_bool_compare_and_swap(&server->mailbox, mail->next, mail));
+  serverWakeUp(server);
+}
+
+void serverAdoptConnection(struct Server *server, int fd) {
+  check(!fcntl(fd, F_SETFL, O_RDWR | O_NONBLOCK));
+  struct SSLSupport *ssl          = server->acceptor ? &server->acceptor->ssl
+                                                     : &server->ssl;
+  if (!ssl->enabled && !server->route && !server->handOff) {
+    // Nobody ever needs to peek at the data on this connection. So, the
+    // poller can perform all I/O on our behalf.
+    pollerClaim(server->poller, fd, POLLER_READ | POLLER_WRITE);
+  }
+  struct HttpConnection *http;
+  http                            = newHttpConnection(
+                                     server, fd, server->port,
+                                     ssl->enabled ? ssl : NULL,
+                                     server->numericHosts);
+  struct ServerConnection *connection = serverAddConnection(server, fd,
+                                  httpHandleConnection,
+                                  (void (*)(void *))deleteHttpConnection,
+                                  http);
+  serverSetConnectionDescriber(connection, httpDescribeConnection);
+  serverSetTimeout(connection, INITIAL_TIMEOUT);
+}
+
+static void serverDestroyPeerCount(void *arg ATTR_UNUSED, char *key,
+                                   char *value) {
+  UNUSED(arg);
+  free(key);
+  free(value);
+}
+
+void serverSetConnectionLimits(struct Server *server, int maxConnections,
+                               int maxConnectionsPerPeer) {
+  check(!server->acceptor);
+  server->maxConnections          = maxConnections > 0 ? maxConnections : 0;
+  server->maxConnectionsPerPeer   = maxConnectionsPerPeer > 0
+                                    ? maxConnectionsPerPeer : 0;
+  if (server->maxConnectionsPerPeer && !server->admittedPeers) {
+    server->admittedPeers         = newHashMap(serverDestroyPeerCount, NULL);
+  }
+}
+
+static int serverAdmitConnection(struct Server *server, int fd,
+                                 const struct sockaddr_storage *addr) {
+  if (!server->maxConnections && !server->maxConnectionsPerPeer) {
+    return 1;
+  }
+
+  // Connections are counted per remote IP address. Clients that connect
+  // over a unix domain socket only count towards the global limit.
+  char peer[INET_ADDRSTRLEN]      = "";
+  if (server->maxConnectionsPerPeer && addr->ss_family == AF_INET) {
+    inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr,
+              peer, sizeof(peer));
+  }
+  lockAdmission(server);
+  int admit                       = !server->maxConnections ||
+                                    server->numAdmitted <
+                                    server->maxConnections;
+  int *count                      = NULL;
+  if (admit && *peer) {
+    count                         = (int *)getFromHashMap(
+                                              server->admittedPeers, peer);
+    admit                         = !count ||
+                                    *count < server->maxConnectionsPerPeer;
+  }
+  if (admit) {
+    if (fd >= server->admittedByFdSize) {
+      int newSize                 = 2*server->admittedByFdSize > fd
+                                    ? 2*server->admittedByFdSize : fd + 1;
+      check(server->admittedByFd  = realloc(server->admittedByFd,
+                                            newSize*sizeof(char *)));
+      memset(server->admittedByFd + server->admittedByFdSize, 0,
+             (newSize - server->admittedByFdSize)*sizeof(char *));
+      server->admittedByFdSize    = newSize;
+    }
+    if (*peer) {
+      if (!count) {
+        check(count               = malloc(sizeof(int)));
+        *count                    = 0;
+        addToHashMap(server->admittedPeers, strdup(peer), (char *)count);
+      }
+      ++*count;
+    }
+    check(server->admittedByFd[fd] = strdup(peer));
+    server->numAdmitted++;
+  }
+  unlockAdmission(server);
+  return admit;
+}
+
+void serverReleaseConnection(struct Server *server, int fd) {
+  // Connections must be released before their file descriptor is closed.
+  // Otherwise, the acceptor could hand out the same descriptor again.
+  if (server->acceptor) {
+    server                        = server->acceptor;
+  }
+  if ((!server->maxConnections && !server->maxConnectionsPerPeer) || fd < 0) {
+    return;
+  }
+  lockAdmission(server);
+  if (fd < server->admittedByFdSize && server->admittedByFd[fd]) {
+    char *peer                    = server->admittedByFd[fd];
+    server->admittedByFd[fd]      = NULL;
+    server->numAdmitted--;
+    if (*peer) {
+      int *count                  = (int *)getFromHashMap(
+                                              server->admittedPeers, peer);
+      if (count && !--*count) {
+        deleteFromHashMap(server->admittedPeers, peer);
+      }
+    }
+    free(peer);
+  }
+  unlockAdmission(server);
+}
+
+static void serverRejectConnection(int fd) {
+  // This is best effort only. We never wait for the socket to become
+  // writable, and we do not read the client's request.
+  if (send(fd, serverOverloadedReply, sizeof(serverOverloadedReply) - 1,
+           MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+    debug("[server] Failed to send overload notification");
+  }
+  NOINTR(close(fd));
+}
+
+static void serverAcceptConnections(struct Server *server) {
+  for (int i = 0; i < MAX_ACCEPT_BATCH; i++) {
+    struct sockaddr_storage clientAddr;
+    socklen_t sockLen             = sizeof(clientAddr);
+    clientAddr.ss_family          = AF_UNSPEC;
+    int clientFd                  = pollerAccept(server->poller,
+                                                 server->serverFd,
+                                                 (struct sockaddr *)&clientAddr,
+                                                 &sockLen);
+    if (clientFd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+        continue;
+      }
+      if (errno == EMFILE || errno == ENFILE ||
+          errno == ENOBUFS || errno == ENOMEM) {
+        warn("[server] Cannot accept connections: %s. Pausing for %dms.",
+             strerror(errno), ACCEPT_BACKOFF_MS);
+        server->acceptResumeTime  = server->timers.now + ACCEPT_BACKOFF_MS;
+        server->poller->setEvents(server->poller, server->serverFd,
+                                  POLLIN, 0);
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        debug("[server] Failed to accept connection: %s", strerror(errno));
+      }
+      break;
+    }
+    if (!serverAdmitConnection(server, clientFd, &clientAddr)) {
+      debug("[server] Too many connections. Rejecting new connection");
+      serverRejectConnection(clientFd);
+    } else if (server->numReactors) {
+      // Distribute connections between reactor threads in round-robin
+      // fashion.
+      serverPostMail(server->reactors[server->nextReactor], clientFd, NULL);
+      server->nextReactor         = (server->nextReactor + 1) %
+                                    server->numReactors;
+    } else {
+      serverAdoptConnection(server, clientFd);
+    }
+  }
+}
+
+void serverSetHandOff(struct Server *server,
+                      int (*handOff)(void *arg, int fd, const char *line,
+                                     int len),
+                      void *arg) {
+  server->handOff                 = handOff;
+  server->handOffArg              = arg;
+}
+
+void serverSetRouter(struct Server *server,
+                     int (*route)(void *arg, const char *line, int len),
+                     void *arg) {
+  server->route                   = route;
+  server->routeArg                = arg;
+}
+
+int serverHandOff(struct Server *server, struct HttpConnection *http) {
+  // Peek at the request line without consuming it, so that whoever takes
+  // over the connection can read the request from scratch. If the line has
+  // not fully arrived yet, the caller has to wait for the rest of it. Lines
+  // that don't fit into our buffer are never handed off.
+  if (!server->route && !server->handOff) {
+    return HANDOFF_NONE;
+  }
+  char buf[1024];
+  int len                         = httpPeekCommand(http, buf, sizeof(buf));
+  if (len < 0) {
+    return errno == EAGAIN      ? HANDOFF_PENDING :
+           errno == EINPROGRESS ? HANDOFF_PARTIAL : HANDOFF_NONE;
+  }
+  struct Server *acceptor         = server->acceptor;
+  if (acceptor && server->route) {
+    int id                        = server->route(server->routeArg, buf, len);
+    if (id >= 0 && id < acceptor->numReactors && id != server->reactorId) {
+      // Move the connection to the reactor thread that owns the session.
+      // As soon as it has been posted, the other thread can start using
+      // it. So, we have to let go of it first.
+      serverRetireConnection(server, serverGetConnection(server, NULL,
+                                                         http->fd));
+      serverPostMail(acceptor->reactors[id], http->fd, http);
+      return HANDOFF_REACTOR;
+    }
+  }
+  if (server->handOff && !http->sslHndl &&
+      server->handOff(server->handOffArg, http->fd, buf, len) > 0) {
+    return HANDOFF_PROCESS;
+  }
+  return HANDOFF_NONE;
+}
+
+static void serverReportStall(struct Server *server,
+                              struct ServerConnection *connection,
+                              int64_t elapsed) {
+  // Connections that were deleted by their handler can no longer describe
+  // themselves.
+  char *description                     = NULL;
+  if (!connection->deleted && connection->describeConnection) {
+    description                         = connection->describeConnection(
+                                                            connection->arg);
+  }
+  message("[server] Event loop stalled for %dms in handler for %s%s%d",
+          (int)(elapsed/1000),
+          description ? description : "",
+          description ? ", fd " : "fd ", connection->fd);
+  free(description);
+  server->stats->stalled                = 1;
+}
+
+static void serverReportStats(struct Server *server) {
+  struct ServerStats *stats             = server->stats;
+  char name[32];
+  if (server->reactorId >= 0) {
+    snprintf(name, sizeof(name), "Reactor %d", server->reactorId);
+  } else {
+    snprintf(name, sizeof(name), "Event loop");
+  }
+  message("[server] %s: %llu iterations, busy p50/p99/max %llu/%llu/%lluus; "
+          "%llu callbacks, p50/p99/max %llu/%llu/%lluus; "
+          "ready fds p50/p99/max %llu/%llu/%llu",
+          name,
+          (unsigned long long)stats->iterations.count,
+          (unsigned long long)histogramPercentile(&stats->iterations, 50),
+          (unsigned long long)histogramPercentile(&stats->iterations, 99),
+          (unsigned long long)stats->iterations.max,
+          (unsigned long long)stats->callbacks.count,
+          (unsigned long long)histogramPercentile(&stats->callbacks, 50),
+          (unsigned long long)histogramPercentile(&stats->callbacks, 99),
+          (unsigned long long)stats->callbacks.max,
+          (unsigned long long)histogramPercentile(&stats->readyEvents, 50),
+          (unsigned long long)histogramPercentile(&stats->readyEvents, 99),
+          (unsigned long long)stats->readyEvents.max);
+  initHistogram(&stats->iterations);
+  initHistogram(&stats->callbacks);
+  initHistogram(&stats->readyEvents);
+  stats->lastReport                     = server->timers.now;
+}
+
+static void serverRecordIteration(struct Server *server, int64_t start,
+                                  int eventCount) {
+  struct ServerStats *stats             = server->stats;
+  int64_t elapsed                       = timerGetMonotonicTimeUs() - start;
+  histogramRecord(&stats->iterations, elapsed);
+  histogramRecord(&stats->readyEvents, eventCount);
+  if (!stats->stalled && elapsed >= (int64_t)serverStallThreshold*1000) {
+    // None of the handlers took very long by itself, but all of them
+    // together did.
+    message("[server] Event loop stalled for %dms while handling %d events",
+            (int)(elapsed/1000), eventCount);
+  }
+  stats->stalled                        = 0;
+  if (server->timers.now - stats->lastReport >= STATS_INTERVAL_MS) {
+    serverReportStats(server);
+  }
+}
+
+static void serverDispatch(struct Server *server,
+                           struct ServerConnection *connection,
+                           short revents) {
+  // Connections that were added after we started dispatching events must
+  // not pick up notifications that were meant for a previous owner of the
+  // same file descriptor. And no connection is dispatched more than once
+  // per iteration of the loop.
+  if (connection->deleted ||
+      connection->generation == server->generation ||
+      connection->dispatched == server->generation) {
+    return;
+  }
+  connection->dispatched                = server->generation;
+  short events                          = connection->events;
+  short oldEvents                       = events;
+  int64_t start                         = server->stats ?
+                                          timerGetMonotonicTimeUs() : 0;
+  int keep                              = connection->handleConnection(
+                                       connection, connection->arg,
+                                       &events, revents);
+  if (server->stats) {
+    int64_t elapsed                     = timerGetMonotonicTimeUs() - start;
+    histogramRecord(&server->stats->callbacks, elapsed);
+    if (elapsed >= (int64_t)serverStallThreshold*1000) {
+      serverReportStall(server, connection, elapsed);
+    }
+  }
+  if (connection->deleted) {
+    // The handler deleted its own connection.
+    return;
+  }
+  if (!keep) {
+    serverRetireConnection(server, connection);
+    connection->destroyConnection(connection->arg);
+  } else if (events != oldEvents) {
+    serverSetEvents(server, connection, events);
+  }
+}
+
+static void serverMoveConnection(struct Server *server,
+                                 struct HttpConnection *http) {
+  http->server                          = server;
+  struct ServerConnection *connection   = serverAddConnection(server,
+                                  http->fd, httpHandleConnection,
+                                  (void (*)(void *))deleteHttpConnection,
+                                  http);
+  serverSetConnectionDescriber(connection, httpDescribeConnection);
+  serverSetTimeout(connection, INITIAL_TIMEOUT);
+
+  // The previous owner peeked at the request. For SSL connections, this
+  // can leave data buffered in user space, where the poller cannot see it.
+  // So, give the connection a chance to run right away.
+  connection->generation                = server->generation - 1;
+  serverDispatch(server, connection, POLLIN);
+}
+
+static int serverMailboxHandler(struct ServerConnection *connection
+                                ATTR_UNUSED, void *arg, short *events,
+                                short revents ATTR_UNUSED) {
+  UNUSED(connection);
+  UNUSED(revents);
+  struct Server *server                 = (struct Server *)arg;
+  char buf[64];
+  while (NOINTR(read(server->mailboxFds[0], buf, sizeof(buf))) > 0) {
+  }
+
+  // Take all mail at once, and then process it in the order of arrival.
+  struct ServerMail *mail               = __sync_lock_test_and_set(
+                                                      &server->mailbox, NULL);
+  struct ServerMail *inOrder            = NULL;
+  while (mail) {
+    struct ServerMail *next             = mail->next;
+    mail->next                          = inOrder;
+    inOrder                             = mail;
+    mail                                = next;
+  }
+  while ((mail = inOrder) != NULL) {
+    inOrder                             = mail->next;
+    if (mail->http) {
+      serverMoveConnection(server, mail->http);
+    } else {
+      serverAdoptConnection(server, mail->fd);
+    }
+    free(mail);
+  }
+  if (server->stopping) {
+    serverExitLoop(server, 1);
+  }
+  *events                               = POLLIN;
+  return 1;
+}
+
+static void serverMailboxDestroy(void *arg ATTR_UNUSED) {
+  UNUSED(arg);
+}
+
+static void serverInitMailbox(struct Server *server) {
+  check(!pipe(server->mailboxFds));
+  for (int i = 0; i < 2; i++) {
+    check(!fcntl(server->mailboxFds[i], F_SETFL, O_NONBLOCK));
+    check(!fcntl(server->mailboxFds[i], F_SETFD, FD_CLOEXEC));
+  }
+  serverAddConnection(server, server->mailboxFds[0], serverMailboxHandler,
+                      serverMailboxDestroy, server);
+}
+
+void serverSetReactors(struct Server *server, int numReactors,
+                       void (*initReactor)(struct Server *reactor, int id,
+                                           void *arg),
+                       void (*destroyReactor)(struct Server *reactor, int id,
+                                              void *arg),
+                       void *arg) {
+  check(!server->acceptor);
+  check(!server->reactors);
+#ifndef HAVE_PTHREAD_CREATE
+  if (numReactors > 0) {
+    fatal("[server] Reactor threads are not supported on this platform!");
+  }
+#endif
+  server->numReactors                   = numReactors > 0 ? numReactors : 0;
+  server->initReactor                   = initReactor;
+  server->destroyReactor                = destroyReactor;
+  server->reactorArg                    = arg;
+}
+
+#ifdef HAVE_PTHREAD_CREATE
+static void *serverReactorMain(void *arg) {
+  struct Server *server                 = (struct Server *)arg;
+  struct Server *acceptor               = server->acceptor;
+  if (acceptor->initReactor) {
+    acceptor->initReactor(server, server->reactorId, acceptor->reactorArg);
+  }
+  serverLoop(server);
+
+  // Connections must be torn down by the thread that owns them.
+  serverDestroyConnections(server);
+  if (acceptor->destroyReactor) {
+    acceptor->destroyReactor(server, server->reactorId,
+                             acceptor->reactorArg);
+  }
+  if (!server->stopping) {
+    // If a reactor exits on its own, shut down the entire server.
+    acceptor->stopping                  = 1;
+    serverWakeUp(acceptor);
+  }
+  return NULL;
+}
+#endif
+
+static void serverStartReactors(struct Server *server) {
+#ifdef HAVE_PTHREAD_CREATE
+  // Signals are always handled by the thread that runs the acceptor.
+  sigset_t mask, oldMask;
+  sigfillset(&mask);
+  check(!pthread_sigmask(SIG_BLOCK, &mask, &oldMask));
+  serverInitMailbox(server);
+  check(server->reactors                = malloc(server->numReactors*
+                                                 sizeof(struct Server *)));
+  for (int i = 0; i < server->numReactors; i++) {
+    struct Server *reactor;
+    check(reactor                       = malloc(sizeof(struct Server)));
+    initServerState(reactor, -1);
+    reactor->acceptor                   = server;
+    reactor->reactorId                  = i;
+    reactor->port                       = server->port;
+    reactor->numericHosts               = server->numericHosts;
+    reactor->route                      = server->route;
+    reactor->routeArg                   = server->routeArg;
+    serverInitMailbox(reactor);
+    server->reactors[i]                 = reactor;
+    check(!pthread_create(&reactor->thread, NULL, serverReactorMain,
+                          reactor));
+  }
+  check(!pthread_sigmask(SIG_SETMASK, &oldMask, NULL));
+  debug("[server] Started %d reactor threads", server->numReactors);
+#else
+  UNUSED(server);
+#endif
+}
+
+static void serverStopReactors(struct Server *server) {
+#ifdef HAVE_PTHREAD_CREATE
+  if (!server->reactors) {
+    return;
+  }
+  for (int i = 0; i < server->numReactors; i++) {
+    server->reactors[i]->stopping       = 1;
+    serverWakeUp(server->reactors[i]);
+  }
+  for (int i = 0; i < server->numReactors; i++) {
+    check(!pthread_join(server->reactors[i]->thread, NULL));
+    deleteServer(server->reactors[i]);
+  }
+  free(server->reactors);
+  server->reactors                      = NULL;
+#else
+  UNUSED(server);
+#endif
+}
+
 void serverLoop(struct Server *server) {
-  check(server->serverFd >= 0);
-  time_t lastTime;
-  currentTime                             = time(&lastTime);
+  check(server->serverFd >= 0 || server->acceptor);
+  if (server->numReactors && !server->reactors) {
+    serverStartReactors(server);
+  }
+  currentTime                             = time(NULL);
+  timerWheelAdvance(&server->timers, timerGetMonotonicTime());
   int loopDepth                           = ++server->looping;
   while (server->looping >= loopDepth && !server->exitAll) {
-    // TODO: There probably should be some limit on the maximum number
-    // of concurrently opened HTTP connections, as this could lead to
-    // memory exhaustion and a DoS attack.
-    time_t timeout                        = -1;
-    int numFds                            = server->numConnections + 1;
-
-    for (int i = 0; i < server->numConnections; i++) {
-      while (i < numFds - 1 && !server->pollFds[i + 1].events) {
-        // Sort filedescriptors that currently do not expect any events to
-        // the end of the list.
-        check(--numFds > 0);
-        struct pollfd tmpPollFd;
-        memmove(&tmpPollFd, server->pollFds + numFds, sizeof(struct pollfd));
-        memmove(server->pollFds + numFds, server->pollFds + i + 1,
-                sizeof(struct pollfd));
-        memmove(server->pollFds + i + 1, &tmpPollFd, sizeof(struct pollfd));
-        struct ServerConnection tmpConnection;
-        memmove(&tmpConnection, server->connections + numFds - 1,
-                sizeof(struct ServerConnection));
-        memmove(server->connections + numFds - 1, server->connections + i,
-                sizeof(struct ServerConnection));
-        memmove(server->connections + i, &tmpConnection,
-                sizeof(struct ServerConnection));
-      }
+    int64_t now                           = server->timers.now;
+    int64_t deadline                      = timerWheelNextDeadline(
+                                                             &server->timers);
 
-      if (server->connections[i].timeout &&
-          (timeout < 0 || timeout > server->connections[i].timeout)) {
-        timeout                           = server->connections[i].timeout;
+    // Resume accepting connections after having backed off.
+    if (server->acceptResumeTime) {
+      if (server->acceptResumeTime <= now) {
+        server->acceptResumeTime          = 0;
+        server->poller->setEvents(server->poller, server->serverFd,
+                                  0, POLLIN);
+      } else if (deadline < 0 || deadline > server->acceptResumeTime) {
+        deadline                          = server->acceptResumeTime;
       }
     }
 
     // serverTimeout is always a delta value, unlike connection timeouts
     // which are absolute times.
     if (server->serverTimeout >= 0) {
-      if (timeout < 0 || timeout > server->serverTimeout + currentTime) {
-        timeout                           = server->serverTimeout+currentTime;
+      int64_t serverDeadline              = now +
+                                      (int64_t)server->serverTimeout*1000;
+      if (deadline < 0 || deadline > serverDeadline) {
+        deadline                          = serverDeadline;
       }
     }
 
-    if (timeout >= 0) {
-      // Wait at least one second longer than needed, so that even if
-      // poll() decides to return a second early (due to possible rounding
-      // errors), we still correctly detect a timeout condition.
-      if (timeout >= lastTime) {
-        timeout                           = (timeout - lastTime + 1) * 1000;
+    int timeout                           = -1;
+    if (deadline >= 0) {
+      if (deadline <= now) {
+        timeout                           = 0;
+      } else if (deadline - now > INT_MAX) {
+        timeout                           = INT_MAX;
       } else {
-        timeout                           = 1000;
+        timeout                           = deadline - now;
       }
     }
 
-    int eventCount                        = NOINTR(poll(server->pollFds,
-                                                        numFds,
-                                                        timeout));
+    // Every file descriptor could potentially be ready at the same time.
+    int maxEvents                         = server->numConnections + 1;
+    if (maxEvents > server->maxReadyEvents) {
+      server->maxReadyEvents              = 2*maxEvents;
+      check(server->readyEvents           = realloc(server->readyEvents,
+                                     server->maxReadyEvents *
+                                     sizeof(struct PollerEvent)));
+    }
+    int eventCount                        = server->poller->wait(
+                                     server->poller, server->readyEvents,
+                                     maxEvents, timeout);
     check(eventCount >= 0);
-    if (timeout >= 0) {
-      timeout                            += lastTime;
-    }
-    currentTime                           = time(&lastTime);
-    int isTimeout                         = timeout >= 0 &&
-                                            timeout/1000 <= lastTime;
-    if (eventCount > 0 && server->pollFds[0].revents) {
-      eventCount--;
-      if (server->pollFds[0].revents && POLLIN) {
-        struct sockaddr_in clientAddr;
-        socklen_t sockLen                 = sizeof(clientAddr);
-        int clientFd                      = accept(
-                   server->serverFd, (struct sockaddr *)&clientAddr, &sockLen);
-        dcheck(clientFd >= 0);
-        if (clientFd >= 0) {
-          check(!fcntl(clientFd, F_SETFL, O_RDWR | O_NONBLOCK));
-          struct HttpConnection *http;
-          http                            = newHttpConnection(
-                                     server, clientFd, server->port,
-                                     server->ssl.enabled ? &server->ssl : NULL,
-                                     server->numericHosts);
-          serverSetTimeout(
-            serverAddConnection(server, clientFd, httpHandleConnection,
-                                (void (*)(void *))deleteHttpConnection,
-                                http),
-            INITIAL_TIMEOUT);
+    int64_t iterationStart                = server->stats ?
+                                            timerGetMonotonicTimeUs() : 0;
+    currentTime                           = time(NULL);
+    timerWheelAdvance(&server->timers, timerGetMonotonicTime());
+    server->generation++;
+    int accepted                          = 0;
+    for (int i = 0; i < eventCount; i++) {
+      struct PollerEvent *event           = server->readyEvents + i;
+      if (event->fd == server->serverFd) {
+        serverAcceptConnections(server);
+        accepted                          = 1;
+      } else {
+        struct ServerConnection *connection = serverGetConnection(server,
+                                                            NULL, event->fd);
+        if (connection) {
+          serverDispatch(server, connection, event->revents);
         }
       }
-    } else {
-      if (server->serverTimeout > 0 && !server->numConnections) {
-        // In CGI mode, exit the server, if we haven't had any active
-        // connections in a while.
-        break;
-      }
     }
-    for (int i = 1;
-         (isTimeout || eventCount > 0) && i <= server->numConnections;
-         i++) {
-      struct ServerConnection *connection = server->connections + i - 1;
-      if (connection->deleted) {
-        continue;
-      }
-      if (!eventCount) {
-        server->pollFds[i].revents        = 0;
-      }
-      if (server->pollFds[i].revents ||
-          (connection->timeout && lastTime >= connection->timeout)) {
-        if (server->pollFds[i].revents) {
-          eventCount--;
-        }
-        short events                      = server->pollFds[i].events;
-        short oldEvents                   = events;
-        if (!connection->handleConnection(connection, connection->arg,
-                                         &events, server->pollFds[i].revents)){
-          connection                      = server->connections + i - 1;
-          connection->destroyConnection(connection->arg);
-          connection->deleted             = 1;
-        } else if (events != oldEvents) {
-          server->pollFds[i].events       = events;
-        }
-      }
+    if (!accepted && server->serverTimeout > 0 && !server->numConnections) {
+      // In CGI mode, exit the server, if we haven't had any active
+      // connections in a while.
+      break;
+    }
+
+    // Notify all connections whose timers expired. Handlers that already
+    // ran in this iteration have had a chance to observe their timeout, or
+    // to re-arm their timer.
+    struct Timer *timer;
+    while ((timer = timerWheelNextExpired(&server->timers)) != NULL) {
+      serverDispatch(server, (struct ServerConnection *)timer->arg, 0);
     }
-    for (int i = 1; i <= server->numConnections; i++) {
-      if (server->connections[i-1].deleted) {
-        memmove(server->pollFds + i, server->pollFds + i + 1,
-                (server->numConnections - i) * sizeof(struct pollfd));
-        memmove(server->connections + i - 1, server->connections + i,
-                (server->numConnections - i)*sizeof(struct ServerConnection));
-        check(--i >= 0);
-        check(--server->numConnections >= 0);
+
+    // Entries that were deleted during this iteration can now be reused.
+    // Nested loops leave this to the outermost one, as callers further up
+    // the stack might still hold on to a deleted connection.
+    if (loopDepth == 1) {
+      while (server->deletedConnections) {
+        struct ServerConnection *connection = server->deletedConnections;
+        server->deletedConnections        = connection->next;
+        connection->next                  = server->freeConnections;
+        server->freeConnections           = connection;
       }
     }
+    if (server->stats) {
+      serverRecordIteration(server, iterationStart, eventCount);
+    }
   }
   // Even if multiple clients requested for us to exit the loop, we only
   // ever exit the outer most loop.
   server->looping                         = loopDepth - 1;
+  if (loopDepth == 1) {
+    // Once the loop has stopped, the poller must no longer read or accept
+    // anything behind our back. Data that it already received stays
+    // available, though.
+    for (int fd = 0; fd < server->connectionsByFdSize; fd++) {
+      if (server->connectionsByFd[fd]) {
+        pollerRelease(server->poller, fd, 1);
+      }
+    }
+    if (server->serverFd >= 0) {
+      pollerRelease(server->poller, server->serverFd, 1);
+    }
+    serverStopReactors(server);
+  }
 }
 
 void serverSetupSSL(struct Server *server, int enable, int force) {
@@ -692,5 +1402,8 @@ void serverSetNumericHosts(struct Server *server, int numericHosts) {
 }
 
 struct Trie *serverGetHttpHandlers(struct Server *server) {
+  if (server->acceptor) {
+    return &server->acceptor->handlers;
+  }
   return &server->handlers;
 }
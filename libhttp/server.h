@@ -46,27 +46,49 @@
 #ifndef SERVER_H__
 #define SERVER_H__
 
+#include <pthread.h>
 #include <time.h>
 
 #include "libhttp/trie.h"
+#include "libhttp/histogram.h"
 #include "libhttp/http.h"
+#include "libhttp/poller.h"
 #include "libhttp/ssl.h"
+#include "libhttp/timer.h"
 
 #ifndef UNIX_PATH_MAX
 #define UNIX_PATH_MAX 108
 #endif
 
 
+struct HashMap;
 struct Server;
+struct ServerMail;
 
 struct ServerConnection {
-  int                   deleted;
-  time_t                timeout;
-  int                   (*handleConnection)(struct ServerConnection *c,
-                                            void *arg, short *events,
-                                            short revents);
-  void                  (*destroyConnection)(void *arg);
-  void                  *arg;
+  int                     deleted;
+  int                     fd;
+  short                   events;
+  int                     generation;
+  int                     dispatched;
+  struct Timer            timer;
+  struct ServerConnection *next;
+  int                     (*handleConnection)(struct ServerConnection *c,
+                                              void *arg, short *events,
+                                              short revents);
+  void                    (*destroyConnection)(void *arg);
+  char                    *(*describeConnection)(void *arg);
+  void                    *arg;
+};
+
+// Latency statistics for the server loop are only kept, if a stall
+// threshold has been set.
+struct ServerStats {
+  struct Histogram        iterations;
+  struct Histogram        callbacks;
+  struct Histogram        readyEvents;
+  int64_t                 lastReport;
+  int                     stalled;
 };
 
 struct Server {
@@ -76,18 +98,64 @@ struct Server {
   int                     serverTimeout;
   int                     serverFd;
   int                     numericHosts;
-  struct pollfd           *pollFds;
-  struct ServerConnection *connections;
+  struct Poller           *poller;
+  struct PollerEvent      *readyEvents;
+  int                     maxReadyEvents;
+  int                     generation;
+  struct TimerWheel       timers;
+  struct ServerConnection **connectionSlabs;
+  int                     numConnectionSlabs;
+  struct ServerConnection *freeConnections;
+  struct ServerConnection *deletedConnections;
+  struct ServerConnection **connectionsByFd;
+  int                     connectionsByFdSize;
   int                     numConnections;
   struct Trie             handlers;
+  int                     (*handOff)(void *arg, int fd, const char *line,
+                                     int len);
+  void                    *handOffArg;
+  int                     (*route)(void *arg, const char *line, int len);
+  void                    *routeArg;
+  struct Server           *acceptor;
+  struct Server           **reactors;
+  int                     numReactors;
+  int                     nextReactor;
+  int                     reactorId;
+  void                    (*initReactor)(struct Server *reactor, int id,
+                                         void *arg);
+  void                    (*destroyReactor)(struct Server *reactor, int id,
+                                            void *arg);
+  void                    *reactorArg;
+  struct ServerMail       *mailbox;
+  int                     mailboxFds[2];
+  volatile int            stopping;
+  pthread_t               thread;
+  int64_t                 acceptResumeTime;
+  int                     maxConnections;
+  int                     maxConnectionsPerPeer;
+  int                     numAdmitted;
+  struct HashMap          *admittedPeers;
+  char                    **admittedByFd;
+  int                     admittedByFdSize;
+  pthread_mutex_t         admissionLock;
+  struct ServerStats      *stats;
   struct SSLSupport       ssl;
 };
 
+// Return values of serverHandOff()
+#define HANDOFF_NONE    0
+#define HANDOFF_PROCESS 1
+#define HANDOFF_REACTOR 2
+#define HANDOFF_PENDING 3
+#define HANDOFF_PARTIAL 4
+
 struct Server *newCGIServer(int localhostOnly, int portMin, int portMax,
                             int timeout);
 struct Server *newServer(int localhostOnly, int port);
 void initServer(struct Server *server, int localhostOnly, int portMin,
                 int portMax, int timeout);
+struct Server *newServerFromFd(int fd);
+void initServerFromFd(struct Server *server, int fd);
 void destroyServer(struct Server *server);
 void deleteServer(struct Server *server);
 int  serverGetListeningPort(struct Server *server);
@@ -98,6 +166,9 @@ void serverRegisterHttpHandler(struct Server *server, const char *url,
 void serverRegisterStreamingHttpHandler(struct Server *server, const char *url,
                                int (*handler)(struct HttpConnection *, void *),
                                void *arg);
+int  serverCollectPayload(struct HttpConnection *http,
+                          int (*handler)(struct HttpConnection *, void *,
+                                         const char *, int), void *arg);
 void serverRegisterWebSocketHandler(struct Server *server, const char *url,
        int (*handler)(struct HttpConnection *, void *, int, const char *, int),
        void *arg);
@@ -108,7 +179,34 @@ struct ServerConnection *serverAddConnection(struct Server *server, int fd,
                             void (*destroyConnection)(void *arg),
                             void *arg);
 void serverDeleteConnection(struct Server *server, int fd);
+int  serverDelegateIo(struct Server *server, int fd, int ops);
+ssize_t serverReadv(struct Server *server, int fd, const struct iovec *iov,
+                    int count);
+ssize_t serverWritev(struct Server *server, int fd, const struct iovec *iov,
+                     int count);
+int  serverWritePending(struct Server *server, int fd);
+void serverSetConnectionDescriber(struct ServerConnection *connection,
+                                  char *(*describeConnection)(void *arg));
+void serverAdoptConnection(struct Server *server, int fd);
+void serverSetHandOff(struct Server *server,
+                      int (*handOff)(void *arg, int fd, const char *line,
+                                     int len),
+                      void *arg);
+void serverSetReactors(struct Server *server, int numReactors,
+                       void (*initReactor)(struct Server *reactor, int id,
+                                           void *arg),
+                       void (*destroyReactor)(struct Server *reactor, int id,
+                                              void *arg),
+                       void *arg);
+void serverSetRouter(struct Server *server,
+                     int (*route)(void *arg, const char *line, int len),
+                     void *arg);
+int  serverHandOff(struct Server *server, struct HttpConnection *http);
+void serverSetConnectionLimits(struct Server *server, int maxConnections,
+                               int maxConnectionsPerPeer);
+void serverReleaseConnection(struct Server *server, int fd);
 void serverSetTimeout(struct ServerConnection *connection, time_t timeout);
+void serverSetTimeoutMs(struct ServerConnection *connection, int timeout);
 time_t serverGetTimeout(struct ServerConnection *connection);
 struct ServerConnection *serverGetConnection(struct Server *server,
                                              struct ServerConnection *hint,
@@ -116,6 +214,7 @@ struct ServerConnection *serverGetConnection(struct Server *server,
 short serverConnectionSetEvents(struct Server *server,
                                 struct ServerConnection *connection, int fd,
                                 short events);
+short serverConnectionGetEvents(struct ServerConnection *connection);
 void serverExitLoop(struct Server *server, int exitAll);
 void serverLoop(struct Server *server);
 void serverSetupSSL(struct Server *server, int enable, int force);
@@ -125,7 +224,10 @@ void serverSetCertificateFd(struct Server *server, int fd);
 void serverSetNumericHosts(struct Server *server, int numericHosts);
 struct Trie *serverGetHttpHandlers(struct Server *server);
 
-extern time_t currentTime;
+extern __thread time_t currentTime;
+extern int    serverReusePort;
+extern char  *serverEventBackend;
+extern int    serverStallThreshold;
 extern char  *unixDomainPath;
 extern int    unixDomainUser;
 extern int    unixDomainGroup;
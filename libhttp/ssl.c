@@ -132,6 +132,7 @@ const char *  (*SSL_get_servername)(const SSL *, int);
 BIO *         (*SSL_get_wbio)(const SSL *);
 int           (*SSL_library_init)(void);
 SSL *         (*SSL_new)(SSL_CTX *);
+int           (*SSL_peek)(SSL *, void *, int);
 int           (*SSL_read)(SSL *, void *, int);
 SSL_CTX *     (*SSL_set_SSL_CTX)(SSL *, SSL_CTX *);
 void          (*SSL_set_accept_state)(SSL *);
@@ -172,7 +173,6 @@ void initSSL(struct SSLSupport *ssl) {
   ssl->sslContext            = NULL;
   ssl->sniCertificatePattern = NULL;
   ssl->generateMissing       = 0;
-  ssl->renegotiationCount    = 0;
   initTrie(&ssl->sniContexts, sslDestroyCachedContext, ssl);
 }
 
@@ -314,6 +314,7 @@ static void loadSSL(void) {
     { { &SSL_get_wbio },                "SSL_get_wbio" },
     { { &SSL_library_init },            "SSL_library_init" },
     { { &SSL_new },                     "SSL_new" },
+    { { &SSL_peek },                    "SSL_peek" },
     { { &SSL_read },                    "SSL_read" },
 #ifdef HAVE_TLSEXT
     { { &SSL_set_SSL_CTX },             "SSL_set_SSL_CTX" },
@@ -616,7 +617,7 @@ static void sslInfoCallback(const SSL *sslHndl, int type, int val) {
   if (type & SSL_CB_HANDSHAKE_START) {
     struct HttpConnection *http    =
                           (struct HttpConnection *) SSL_get_app_data(sslHndl);
-    http->ssl->renegotiationCount += 1;
+    http->renegotiationCount      += 1;
   }
 }
 
@@ -683,6 +684,17 @@ static SSL_CTX *sslMakeContext(void) {
 #endif
 
 #ifdef HAVE_TLSEXT
+#ifdef HAVE_PTHREAD_CREATE
+// Reactor threads share the same SSLSupport object, and with it the cache
+// of virtual host contexts.
+static pthread_mutex_t sslSNILock = PTHREAD_MUTEX_INITIALIZER;
+#define lockSNI()   pthread_mutex_lock(&sslSNILock)
+#define unlockSNI() pthread_mutex_unlock(&sslSNILock)
+#else
+#define lockSNI()   do { } while (0)
+#define unlockSNI() do { } while (0)
+#endif
+
 static int sslSNICallback(SSL *sslHndl, int *al ATTR_UNUSED,
                           struct SSLSupport *ssl) {
   UNUSED(al);
@@ -714,6 +726,7 @@ static int sslSNICallback(SSL *sslHndl, int *al ATTR_UNUSED,
       break;
     }
   }
+  lockSNI();
   SSL_CTX *context        = (SSL_CTX *)getFromTrie(&ssl->sniContexts,
                                                    serverName+1,
                                                    NULL);
@@ -741,6 +754,7 @@ static int sslSNICallback(SSL *sslHndl, int *al ATTR_UNUSED,
     free(certificate);
     addToTrie(&ssl->sniContexts, serverName+1, (char *)context);
   }
+  unlockSNI();
   free(serverName);
   if (context != ssl->sslContext) {
     check(SSL_set_SSL_CTX(sslHndl, context));
@@ -114,6 +114,7 @@ extern const char *(*x_SSL_get_servername)(const SSL *, int);
 extern BIO    *(*x_SSL_get_wbio)(const SSL *);
 extern int     (*x_SSL_library_init)(void);
 extern SSL    *(*x_SSL_new)(SSL_CTX *);
+extern int     (*x_SSL_peek)(SSL *, void *, int);
 extern int     (*x_SSL_read)(SSL *, void *, int);
 extern SSL_CTX*(*x_SSL_set_SSL_CTX)(SSL *, SSL_CTX *);
 extern void    (*x_SSL_set_accept_state)(SSL *);
@@ -159,6 +160,7 @@ extern void   *(*x_SSL_COMP_get_compression_methods)(void);
 #define SSL_get_wbio                 x_SSL_get_wbio
 #define SSL_library_init             x_SSL_library_init
 #define SSL_new                      x_SSL_new
+#define SSL_peek                     x_SSL_peek
 #define SSL_read                     x_SSL_read
 #define SSL_set_SSL_CTX              x_SSL_set_SSL_CTX
 #define SSL_set_accept_state         x_SSL_set_accept_state
@@ -204,7 +206,6 @@ struct SSLSupport {
   SSL_CTX     *sslContext;
   char        *sniCertificatePattern;
   int         generateMissing;
-  int         renegotiationCount;
   struct Trie sniContexts;
 };
 
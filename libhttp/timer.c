@@ -0,0 +1,266 @@
+// timer.c -- Hierarchical timer wheel for connection timeouts
+// Copyright (C) 2008-2010 Markus Gutschke <markus@shellinabox.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// In addition to these license terms, the author grants the following
+// additional rights:
+//
+// If you modify this program, or any covered work, by linking or
+// combining it with the OpenSSL project's OpenSSL library (or a
+// modified version of that library), containing parts covered by the
+// terms of the OpenSSL or SSLeay licenses, the author
+// grants you additional permission to convey the resulting work.
+// Corresponding Source for a non-source form of such a combination
+// shall include the source code for the parts of OpenSSL used as well
+// as that of the covered work.
+//
+// You may at your option choose to remove this additional permission from
+// the work, or from any part of it.
+//
+// It is possible to build this program in a way that it loads OpenSSL
+// libraries at run-time. If doing so, the following notices are required
+// by the OpenSSL and SSLeay licenses:
+//
+// This product includes software developed by the OpenSSL Project
+// for use in the OpenSSL Toolkit. (http://www.openssl.org/)
+//
+// This product includes cryptographic software written by Eric Young
+// (eay@cryptsoft.com)
+//
+//
+// The most up-to-date version of this program is always available from
+// http://shellinabox.com
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libhttp/timer.h"
+#include "logging/logging.h"
+
+#ifdef HAVE_UNUSED
+#defined ATTR_UNUSED __attribute__((unused))
+#defined UNUSED(x)   do { } while (0)
+#else
+#define ATTR_UNUSED
+#define UNUSED(x)    do { (void)(x); } while (0)
+#endif
+
+#define TIMER_WHEEL_MASK   (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_SPAN   ((int64_t)1 << (TIMER_WHEEL_BITS*TIMER_WHEEL_LEVELS))
+#define TIMER_UNLINKED     -1
+#define TIMER_EXPIRED      (TIMER_WHEEL_LEVELS*TIMER_WHEEL_SIZE)
+
+int64_t timerGetMonotonicTime(void) {
+  struct timespec ts;
+  check(!clock_gettime(CLOCK_MONOTONIC, &ts));
+  return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+int64_t timerGetMonotonicTimeUs(void) {
+  struct timespec ts;
+  check(!clock_gettime(CLOCK_MONOTONIC, &ts));
+  return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+void initTimerWheel(struct TimerWheel *wheel, int64_t now) {
+  memset(wheel, 0, sizeof(struct TimerWheel));
+  wheel->now           = now;
+  wheel->current       = now;
+}
+
+void destroyTimerWheel(struct TimerWheel *wheel) {
+  if (wheel) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+      for (int slot = 0; slot < TIMER_WHEEL_SIZE; slot++) {
+        while (wheel->slots[level][slot]) {
+          timerDisarm(wheel->slots[level][slot]);
+        }
+      }
+    }
+    while (wheel->expired) {
+      timerDisarm(wheel->expired);
+    }
+  }
+}
+
+void initTimer(struct Timer *timer, struct TimerWheel *wheel, void *arg) {
+  timer->next          = NULL;
+  timer->pprev         = NULL;
+  timer->wheel         = wheel;
+  timer->deadline      = 0;
+  timer->slot          = TIMER_UNLINKED;
+  timer->arg           = arg;
+}
+
+static void timerLink(struct Timer **head, struct Timer *timer, int slot) {
+  timer->next          = *head;
+  timer->pprev         = head;
+  if (*head) {
+    (*head)->pprev     = &timer->next;
+  }
+  *head                = timer;
+  timer->slot          = slot;
+}
+
+static void timerUnlink(struct Timer *timer) {
+  struct TimerWheel *wheel = timer->wheel;
+  *timer->pprev        = timer->next;
+  if (timer->next) {
+    timer->next->pprev = timer->pprev;
+  }
+  if (timer->slot < TIMER_EXPIRED) {
+    int level          = timer->slot / TIMER_WHEEL_SIZE;
+    int slot           = timer->slot % TIMER_WHEEL_SIZE;
+    if (!wheel->slots[level][slot]) {
+      wheel->occupied[level] &= ~((uint64_t)1 << slot);
+    }
+  }
+  timer->next          = NULL;
+  timer->pprev         = NULL;
+  timer->slot          = TIMER_UNLINKED;
+}
+
+static void timerInsert(struct TimerWheel *wheel, struct Timer *timer) {
+  // Pick the finest level that can represent the remaining delay. Timers
+  // that are too far in the future go into the outermost level, and get
+  // re-inserted when that slot comes up.
+  int64_t deadline     = timer->deadline;
+  if (deadline < wheel->current) {
+    deadline           = wheel->current;
+  } else if (deadline - wheel->current >= TIMER_WHEEL_SPAN) {
+    deadline           = wheel->current + TIMER_WHEEL_SPAN - 1;
+  }
+  int64_t delta        = deadline - wheel->current;
+  int level            = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         delta >= (int64_t)1 << (TIMER_WHEEL_BITS*(level + 1))) {
+    level++;
+  }
+  int slot             = (deadline >> (TIMER_WHEEL_BITS*level)) &
+                         TIMER_WHEEL_MASK;
+  timerLink(&wheel->slots[level][slot], timer, level*TIMER_WHEEL_SIZE + slot);
+  wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+void timerArm(struct Timer *timer, int64_t deadline) {
+  if (timer->slot != TIMER_UNLINKED) {
+    timerUnlink(timer);
+  }
+  timer->deadline      = deadline;
+  timerInsert(timer->wheel, timer);
+}
+
+void timerDisarm(struct Timer *timer) {
+  if (timer->slot != TIMER_UNLINKED) {
+    timerUnlink(timer);
+  }
+  timer->deadline      = 0;
+}
+
+int64_t timerGetRemaining(const struct Timer *timer) {
+  // Expired timers keep their deadline until they are either re-armed or
+  // disarmed, so that callers can tell why they have been woken up.
+  return timer->deadline - timer->wheel->now;
+}
+
+static uint64_t rotateRight(uint64_t bits, int count) {
+  return count ? (bits >> count) | (bits << (64 - count)) : bits;
+}
+
+static int64_t timerWheelNextTick(const struct TimerWheel *wheel) {
+  // Slots in the finest level map to exact deadlines. Slots in coarser
+  // levels only tell us when they need to be cascaded, which is a lower
+  // bound for the deadlines of the timers that they hold.
+  int64_t next         = -1;
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    if (!wheel->occupied[level]) {
+      continue;
+    }
+    int shift          = TIMER_WHEEL_BITS*level;
+    int64_t block      = wheel->current >> shift;
+    uint64_t pending   = rotateRight(wheel->occupied[level],
+                                     (int)(block & TIMER_WHEEL_MASK));
+    int64_t deadline;
+    if (!level) {
+      deadline         = wheel->current + __builtin_ctzll(pending);
+    } else if ((pending & 1) &&
+               !(wheel->current & (((int64_t)1 << shift) - 1))) {
+      deadline         = wheel->current;
+    } else if (pending & ~(uint64_t)1) {
+      deadline         = (block + __builtin_ctzll(pending & ~(uint64_t)1))
+                         << shift;
+    } else {
+      deadline         = (block + TIMER_WHEEL_SIZE) << shift;
+    }
+    if (next < 0 || deadline < next) {
+      next             = deadline;
+    }
+  }
+  return next;
+}
+
+int64_t timerWheelNextDeadline(const struct TimerWheel *wheel) {
+  if (wheel->expired) {
+    return wheel->now;
+  }
+  return timerWheelNextTick(wheel);
+}
+
+static void timerCascade(struct TimerWheel *wheel, int64_t tick) {
+  for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    int slot           = (tick >> (TIMER_WHEEL_BITS*level)) & TIMER_WHEEL_MASK;
+    struct Timer *timer;
+    while ((timer = wheel->slots[level][slot]) != NULL) {
+      timerUnlink(timer);
+      timerInsert(wheel, timer);
+    }
+    if (slot) {
+      break;
+    }
+  }
+}
+
+void timerWheelAdvance(struct TimerWheel *wheel, int64_t now) {
+  wheel->now           = now;
+  while (wheel->current <= now) {
+    int64_t tick       = wheel->current;
+    int idx            = tick & TIMER_WHEEL_MASK;
+    if (!idx) {
+      timerCascade(wheel, tick);
+    }
+    struct Timer *timer;
+    while ((timer = wheel->slots[0][idx]) != NULL) {
+      timerUnlink(timer);
+      timerLink(&wheel->expired, timer, TIMER_EXPIRED);
+    }
+
+    // Skip ahead to the next tick that either expires timers or needs to
+    // cascade an occupied slot. Nothing happens in between.
+    wheel->current     = tick + 1;
+    int64_t next       = timerWheelNextTick(wheel);
+    wheel->current     = next < 0 || next > now ? now + 1 : next;
+  }
+}
+
+struct Timer *timerWheelNextExpired(struct TimerWheel *wheel) {
+  struct Timer *timer  = wheel->expired;
+  if (timer) {
+    timerUnlink(timer);
+  }
+  return timer;
+}
@@ -0,0 +1,95 @@
+// timer.h -- Hierarchical timer wheel for connection timeouts
+// Copyright (C) 2008-2010 Markus Gutschke <markus@shellinabox.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// In addition to these license terms, the author grants the following
+// additional rights:
+//
+// If you modify this program, or any covered work, by linking or
+// combining it with the OpenSSL project's OpenSSL library (or a
+// modified version of that library), containing parts covered by the
+// terms of the OpenSSL or SSLeay licenses, the author
+// grants you additional permission to convey the resulting work.
+// Corresponding Source for a non-source form of such a combination
+// shall include the source code for the parts of OpenSSL used as well
+// as that of the covered work.
+//
+// You may at your option choose to remove this additional permission from
+// the work, or from any part of it.
+//
+// It is possible to build this program in a way that it loads OpenSSL
+// libraries at run-time. If doing so, the following notices are required
+// by the OpenSSL and SSLeay licenses:
+//
+// This product includes software developed by the OpenSSL Project
+// for use in the OpenSSL Toolkit. (http://www.openssl.org/)
+//
+// This product includes cryptographic software written by Eric Young
+// (eay@cryptsoft.com)
+//
+//
+// The most up-to-date version of this program is always available from
+// http://shellinabox.com
+
+#ifndef TIMER_H__
+#define TIMER_H__
+
+#include <stdint.h>
+
+// Timers are kept in a hierarchical timing wheel with TIMER_WHEEL_LEVELS
+// levels of TIMER_WHEEL_SIZE slots each. The finest level has a resolution
+// of one millisecond. Arming, re-arming and disarming a timer are all O(1)
+// operations. Timers that are further out than the wheel can represent are
+// parked in the outermost level and get re-inserted as time advances.
+//
+// All deadlines are measured in milliseconds on the monotonic clock, as
+// returned by timerGetMonotonicTime().
+
+#define TIMER_WHEEL_BITS   6
+#define TIMER_WHEEL_SIZE   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+struct TimerWheel;
+
+struct Timer {
+  struct Timer      *next;
+  struct Timer      **pprev;
+  struct TimerWheel *wheel;
+  int64_t           deadline;
+  int               slot;
+  void              *arg;
+};
+
+struct TimerWheel {
+  int64_t           now;
+  int64_t           current;
+  uint64_t          occupied[TIMER_WHEEL_LEVELS];
+  struct Timer      *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+  struct Timer      *expired;
+};
+
+int64_t timerGetMonotonicTime(void);
+int64_t timerGetMonotonicTimeUs(void);
+void initTimerWheel(struct TimerWheel *wheel, int64_t now);
+void destroyTimerWheel(struct TimerWheel *wheel);
+void initTimer(struct Timer *timer, struct TimerWheel *wheel, void *arg);
+void timerArm(struct Timer *timer, int64_t deadline);
+void timerDisarm(struct Timer *timer);
+int64_t timerGetRemaining(const struct Timer *timer);
+int64_t timerWheelNextDeadline(const struct TimerWheel *wheel);
+void timerWheelAdvance(struct TimerWheel *wheel, int64_t now);
+struct Timer *timerWheelNextExpired(struct TimerWheel *wheel);
+
+#endif /* TIMER_H__ */
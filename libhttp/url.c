@@ -335,6 +335,10 @@ static void urlParsePostBody(struct URL *url,
     } else {
       warn("[http] Missing \"boundary\" information for \"multipart/form-data\"!");
     }
+  } else if (url->query) {
+    // Other payloads are opaque to us. Arguments can only be passed in the
+    // query string.
+    urlParseQueryString(&url->args, url->query, strlen(url->query));
   }
   destroyHashMap(&contentType);
 }
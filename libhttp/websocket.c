@@ -0,0 +1,483 @@
+// websocket.c -- Helper functions for the RFC 6455 WebSocket protocol
+// Copyright (C) 2008-2010 Markus Gutschke <markus@shellinabox.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// In addition to these license terms, the author grants the following
+// additional rights:
+//
+// If you modify this program, or any covered work, by linking or
+// combining it with the OpenSSL project's OpenSSL library (or a
+// modified version of that library), containing parts covered by the
+// terms of the OpenSSL or SSLeay licenses, the author
+// grants you additional permission to convey the resulting work.
+// Corresponding Source for a non-source form of such a combination
+// shall include the source code for the parts of OpenSSL used as well
+// as that of the covered work.
+//
+// You may at your option choose to remove this additional permission from
+// the work, or from any part of it.
+//
+// It is possible to build this program in a way that it loads OpenSSL
+// libraries at run-time. If doing so, the following notices are required
+// by the OpenSSL and SSLeay licenses:
+//
+// This product includes software developed by the OpenSSL Project
+// for use in the OpenSSL Toolkit. (http://www.openssl.org/)
+//
+// This product includes cryptographic software written by Eric Young
+// (eay@cryptsoft.com)
+//
+//
+// The most up-to-date version of this program is always available from
+// http://shellinabox.com
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "libhttp/websocket.h"
+#include "logging/logging.h"
+
+// The opening handshake proves that the server understood the request, by
+// hashing the client's key together with this fixed GUID (section 4.2.2).
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#ifdef HAVE_ZLIB
+// State of the permessage-deflate extension (RFC 7692). Unless the client
+// asked us not to, the compressor keeps its sliding window from one message
+// to the next, so that even short messages can refer back to earlier
+// output.
+struct WebSocketDeflate {
+  z_stream deflater;
+  z_stream inflater;
+  int      noContextTakeover;
+};
+#endif
+
+static uint32_t rol(uint32_t x, int n) {
+  return (x << n) | (x >> (32 - n));
+}
+
+static void sha1Block(uint32_t *h, const unsigned char *block) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++) {
+    w[i]              = ((uint32_t)block[4*i]     << 24) |
+                        ((uint32_t)block[4*i + 1] << 16) |
+                        ((uint32_t)block[4*i + 2] <<  8) |
+                         (uint32_t)block[4*i + 3];
+  }
+  for (int i = 16; i < 80; i++) {
+    w[i]              = rol(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+  }
+  uint32_t a          = h[0];
+  uint32_t b          = h[1];
+  uint32_t c          = h[2];
+  uint32_t d          = h[3];
+  uint32_t e          = h[4];
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f               = (b & c) | (~b & d);
+      k               = 0x5A827999;
+    } else if (i < 40) {
+      f               = b ^ c ^ d;
+      k               = 0x6ED9EBA1;
+    } else if (i < 60) {
+      f               = (b & c) | (b & d) | (c & d);
+      k               = 0x8F1BBCDC;
+    } else {
+      f               = b ^ c ^ d;
+      k               = 0xCA62C1D6;
+    }
+    uint32_t t        = rol(a, 5) + f + e + k + w[i];
+    e                 = d;
+    d                 = c;
+    c                 = rol(b, 30);
+    b                 = a;
+    a                 = t;
+  }
+  h[0]               += a;
+  h[1]               += b;
+  h[2]               += c;
+  h[3]               += d;
+  h[4]               += e;
+}
+
+static void sha1(const char *buf, int len, unsigned char *digest) {
+  // SHA-1 is only used for the handshake. It is short enough to implement
+  // here, which saves us from depending on OpenSSL being available.
+  uint32_t h[5]       = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                          0xC3D2E1F0 };
+  unsigned char block[64];
+  int i;
+  for (i = 0; len - i >= 64; i += 64) {
+    sha1Block(h, (const unsigned char *)buf + i);
+  }
+  int tail            = len - i;
+  memcpy(block, buf + i, tail);
+  block[tail++]       = 0x80;
+  if (tail > 56) {
+    memset(block + tail, 0, 64 - tail);
+    sha1Block(h, block);
+    tail              = 0;
+  }
+  memset(block + tail, 0, 56 - tail);
+  uint64_t bits       = (uint64_t)len*8;
+  for (int j = 0; j < 8; j++) {
+    block[56 + j]     = bits >> (56 - 8*j);
+  }
+  sha1Block(h, block);
+  for (int j = 0; j < 20; j++) {
+    digest[j]         = h[j/4] >> (24 - 8*(j%4));
+  }
+}
+
+char *websocketAcceptKey(const char *key) {
+  // Returns the value of the "Sec-WebSocket-Accept" header that matches the
+  // client's "Sec-WebSocket-Key". The caller must free the result.
+  static const char *base64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                              "abcdefghijklmnopqrstuvwxyz0123456789+/";
+  int keyLength       = strlen(key);
+  char *buf;
+  check(buf           = malloc(keyLength + sizeof(WS_GUID)));
+  memcpy(buf, key, keyLength);
+  memcpy(buf + keyLength, WS_GUID, sizeof(WS_GUID));
+  unsigned char digest[21];
+  sha1(buf, keyLength + sizeof(WS_GUID) - 1, digest);
+  free(buf);
+  digest[20]          = 0;
+
+  // A 20 byte digest encodes to 27 characters plus one byte of padding.
+  char *accept;
+  check(accept        = malloc(29));
+  char *ptr           = accept;
+  for (int i = 0; i < 21; i += 3) {
+    uint32_t v        = (digest[i] << 16) | (digest[i+1] << 8) | digest[i+2];
+    *ptr++            = base64[ v >> 18        ];
+    *ptr++            = base64[(v >> 12) & 0x3F];
+    *ptr++            = base64[(v >>  6) & 0x3F];
+    *ptr++            = base64[ v        & 0x3F];
+  }
+  accept[27]          = '=';
+  accept[28]          = '\000';
+  return accept;
+}
+
+int websocketFrameHeader(char *header, int opcode, int fin, uint64_t length) {
+  // Writes the header for an unmasked frame, and returns its length.
+  int i               = 0;
+  header[i++]         = (fin ? 0x80 : 0x00) | (opcode & 0xF);
+  if (length < 126) {
+    header[i++]       = length;
+  } else if (length < 0x10000) {
+    header[i++]       = 126;
+    header[i++]       = length >> 8;
+    header[i++]       = length;
+  } else {
+    header[i++]       = 127;
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      header[i++]     = length >> shift;
+    }
+  }
+  check(i <= WS_MAX_HEADER_LENGTH);
+  return i;
+}
+
+int websocketValidCloseCode(int code) {
+  // Only codes that are defined by the standard or registered with IANA,
+  // and codes that are reserved for applications can be sent on the wire.
+  return (code >= 1000 && code <= 1003) ||
+         (code >= 1007 && code <= 1014) ||
+         (code >= 3000 && code <= 4999);
+}
+
+int websocketCheckUTF8(int *state, const unsigned char *buf, int len) {
+  // Validates UTF-8 incrementally, so that text messages can be checked
+  // while they are still arriving in fragments. "state" must be zero at the
+  // start of each message, and it is zero again if the data ended on a
+  // character boundary. Returns zero, if an invalid sequence was found.
+  int remaining       =  *state        & 0xFF;
+  int lo              = (*state >>  8) & 0xFF;
+  int hi              = (*state >> 16) & 0xFF;
+  for (int i = 0; i < len; i++) {
+    int ch            = buf[i];
+    if (remaining) {
+      if (ch < lo || ch > hi) {
+        return 0;
+      }
+      remaining--;
+      lo              = 0x80;
+      hi              = 0xBF;
+    } else if (ch < 0x80) {
+      continue;
+    } else if (ch >= 0xC2 && ch <= 0xDF) {
+      remaining       = 1;
+      lo              = 0x80;
+      hi              = 0xBF;
+    } else if (ch >= 0xE0 && ch <= 0xEF) {
+      // Reject overlong encodings and UTF-16 surrogates.
+      remaining       = 2;
+      lo              = ch == 0xE0 ? 0xA0 : 0x80;
+      hi              = ch == 0xED ? 0x9F : 0xBF;
+    } else if (ch >= 0xF0 && ch <= 0xF4) {
+      // Reject overlong encodings and code points beyond U+10FFFF.
+      remaining       = 3;
+      lo              = ch == 0xF0 ? 0x90 : 0x80;
+      hi              = ch == 0xF4 ? 0x8F : 0xBF;
+    } else {
+      return 0;
+    }
+  }
+  *state              = remaining ? remaining | (lo << 8) | (hi << 16) : 0;
+  return 1;
+}
+
+#ifdef HAVE_ZLIB
+static int websocketNextToken(const char **ptr, char *buf, int size) {
+  // Copies the next, possibly quoted, token of an extension header into
+  // "buf". Returns zero, if the token was empty or did not fit.
+  const char *s       = *ptr;
+  while (*s == ' ' || *s == '\t') {
+    s++;
+  }
+  int quoted          = *s == '"';
+  if (quoted) {
+    s++;
+  }
+  int len             = 0;
+  int ok              = 1;
+  for (; *s && (quoted ? *s != '"' : !strchr(",;= \t", *s)); s++) {
+    if (len < size - 1) {
+      buf[len++]      = *s;
+    } else {
+      ok              = 0;
+    }
+  }
+  if (quoted && *s == '"') {
+    s++;
+  }
+  while (*s == ' ' || *s == '\t') {
+    s++;
+  }
+  buf[len]            = '\000';
+  *ptr                = s;
+  return ok && len;
+}
+#endif
+
+struct WebSocketDeflate *newWebSocketDeflate(const char *offers,
+                                             char **response) {
+  // Picks the first acceptable "permessage-deflate" offer from the client's
+  // "Sec-WebSocket-Extensions" header. Returns NULL, if the connection has
+  // to stay uncompressed. Otherwise, "response" is set to the value of the
+  // header that must be sent back. The caller must free it.
+  *response           = NULL;
+#ifdef HAVE_ZLIB
+  static const char *params[] = { "server_no_context_takeover",
+                                  "client_no_context_takeover",
+                                  "server_max_window_bits",
+                                  "client_max_window_bits" };
+  const char *s       = offers;
+  while (*s) {
+    char name[32], value[8];
+    int seen          = 0;
+    int windowBits    = 15;
+    int ok            = websocketNextToken(&s, name, sizeof(name)) &&
+                        !strcasecmp(name, "permessage-deflate");
+    while (*s == ';') {
+      s++;
+      int param       = -1;
+      int valid       = websocketNextToken(&s, name, sizeof(name));
+      *value          = '\000';
+      if (*s == '=') {
+        s++;
+        valid        &= websocketNextToken(&s, value, sizeof(value)) &&
+                        strspn(value, "0123456789") == strlen(value);
+      }
+      for (int i = 0; valid && i < (int)(sizeof(params)/sizeof(*params));
+           i++) {
+        if (!strcasecmp(name, params[i])) {
+          param       = i;
+        }
+      }
+      int bits        = *value ? atoi(value) : 15;
+      if (param < 0 || (seen & (1 << param)) ||
+          (param < 2 && *value) || bits < 8 || bits > 15 ||
+          (param == 2 && (!*value || bits == 8))) {
+        // zlib cannot compress with a 256 byte window, so we have to turn
+        // down offers that insist on it.
+        ok            = 0;
+      } else if (param == 2) {
+        windowBits    = bits;
+      }
+      if (param >= 0) {
+        seen         |= 1 << param;
+      }
+    }
+    if (*s && *s != ',') {
+      ok              = 0;
+      while (*s && *s != ',') {
+        s++;
+      }
+    }
+    if (*s) {
+      s++;
+    }
+    if (!ok) {
+      continue;
+    }
+
+    // We always inflate with the largest window, as that can decode data
+    // that was compressed with any smaller window, too.
+    struct WebSocketDeflate *ctx;
+    check(ctx         = calloc(1, sizeof(struct WebSocketDeflate)));
+    if (deflateInit2(&ctx->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     -windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      free(ctx);
+      return NULL;
+    }
+    if (inflateInit2(&ctx->inflater, -15) != Z_OK) {
+      deflateEnd(&ctx->deflater);
+      free(ctx);
+      return NULL;
+    }
+    ctx->noContextTakeover = seen & 1;
+    check(*response   = malloc(128));
+    snprintf(*response, 128, "permessage-deflate%s%s",
+             seen & 1 ? "; server_no_context_takeover" : "",
+             seen & 2 ? "; client_no_context_takeover" : "");
+    if (seen & 4) {
+      int len         = strlen(*response);
+      snprintf(*response + len, 128 - len, "; server_max_window_bits=%d",
+               windowBits);
+    }
+    return ctx;
+  }
+#else
+  (void)offers;
+#endif
+  return NULL;
+}
+
+void deleteWebSocketDeflate(struct WebSocketDeflate *ctx) {
+#ifdef HAVE_ZLIB
+  if (ctx) {
+    deflateEnd(&ctx->deflater);
+    inflateEnd(&ctx->inflater);
+    free(ctx);
+  }
+#else
+  (void)ctx;
+#endif
+}
+
+char *websocketDeflateFrame(struct WebSocketDeflate *ctx, int opcode,
+                            int fin, const char *payload, int len,
+                            int *frameLength) {
+  // Compresses the payload of a data frame, and returns the complete frame.
+  // Each fragment is flushed, so that the browser can display it right
+  // away. The empty block that terminates the last fragment is implied by
+  // the protocol and does not have to be sent (RFC 7692, section 7.2.1).
+#ifdef HAVE_ZLIB
+  z_stream *strm      = &ctx->deflater;
+  int size            = WS_MAX_HEADER_LENGTH + len + len/8 + 64;
+  int used            = WS_MAX_HEADER_LENGTH;
+  char *frame;
+  check(frame         = malloc(size));
+  strm->next_in       = (Bytef *)payload;
+  strm->avail_in      = len;
+  for (;;) {
+    strm->next_out    = (Bytef *)frame + used;
+    strm->avail_out   = size - used;
+    int rc            = deflate(strm, Z_SYNC_FLUSH);
+    check(rc == Z_OK || rc == Z_BUF_ERROR);
+    used              = size - strm->avail_out;
+    if (strm->avail_out) {
+      break;
+    }
+    check(frame       = realloc(frame, size *= 2));
+  }
+  if (fin) {
+    if (used - WS_MAX_HEADER_LENGTH >= 4 &&
+        !memcmp(frame + used - 4, "\x00\x00\xFF\xFF", 4)) {
+      used           -= 4;
+    }
+    if (ctx->noContextTakeover) {
+      deflateReset(strm);
+    }
+  }
+
+  // Now that the length is known, move the header in front of the payload.
+  char header[WS_MAX_HEADER_LENGTH];
+  int length          = used - WS_MAX_HEADER_LENGTH;
+  int headerLength    = websocketFrameHeader(header, opcode, fin, length);
+  if (opcode != WS_OP_CONTINUATION) {
+    header[0]        |= WS_RSV1;
+  }
+  memmove(frame + headerLength, frame + WS_MAX_HEADER_LENGTH, length);
+  memcpy(frame, header, headerLength);
+  *frameLength        = headerLength + length;
+  return frame;
+#else
+  (void)ctx;
+  (void)opcode;
+  (void)fin;
+  (void)payload;
+  (void)len;
+  (void)frameLength;
+  fatal("[http] Compression is not supported");
+#endif
+}
+
+int websocketInflate(struct WebSocketDeflate *ctx, const char **in,
+                     int *inLength, char *out, int outLength) {
+  // Decompresses as much of "in" as fits into "out", and advances the input
+  // pointer. Returns the number of bytes written, or -1 if the compressed
+  // data is corrupt.
+#ifdef HAVE_ZLIB
+  z_stream *strm      = &ctx->inflater;
+  strm->next_in       = (Bytef *)*in;
+  strm->avail_in      = *inLength;
+  strm->next_out      = (Bytef *)out;
+  strm->avail_out     = outLength;
+  int rc              = inflate(strm, Z_SYNC_FLUSH);
+  if (rc == Z_STREAM_END) {
+    // The peer is allowed to end the stream with a final block. Anything
+    // that follows starts a new one.
+    inflateReset(strm);
+  } else if (rc != Z_OK &&
+             (rc != Z_BUF_ERROR || (strm->avail_in && strm->avail_out))) {
+    return -1;
+  }
+  *in                 = (const char *)strm->next_in;
+  *inLength           = strm->avail_in;
+  return outLength - strm->avail_out;
+#else
+  (void)ctx;
+  (void)in;
+  (void)inLength;
+  (void)out;
+  (void)outLength;
+  return -1;
+#endif
+}
@@ -0,0 +1,88 @@
+// websocket.h -- Helper functions for the RFC 6455 WebSocket protocol
+// Copyright (C) 2008-2010 Markus Gutschke <markus@shellinabox.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// In addition to these license terms, the author grants the following
+// additional rights:
+//
+// If you modify this program, or any covered work, by linking or
+// combining it with the OpenSSL project's OpenSSL library (or a
+// modified version of that library), containing parts covered by the
+// terms of the OpenSSL or SSLeay licenses, the author
+// grants you additional permission to convey the resulting work.
+// Corresponding Source for a non-source form of such a combination
+// shall include the source code for the parts of OpenSSL used as well
+// as that of the covered work.
+//
+// You may at your option choose to remove this additional permission from
+// the work, or from any part of it.
+//
+// It is possible to build this program in a way that it loads OpenSSL
+// libraries at run-time. If doing so, the following notices are required
+// by the OpenSSL and SSLeay licenses:
+//
+// This product includes software developed by the OpenSSL Project
+// for use in the OpenSSL Toolkit. (http://www.openssl.org/)
+//
+// This product includes cryptographic software written by Eric Young
+// (eay@cryptsoft.com)
+//
+//
+// The most up-to-date version of this program is always available from
+// http://shellinabox.com
+
+#ifndef WEBSOCKET_H__
+#define WEBSOCKET_H__
+
+#include <stdint.h>
+
+struct WebSocketDeflate;
+
+// Frame opcodes as defined in section 5.2 of RFC 6455.
+#define WS_OP_CONTINUATION 0x0
+#define WS_OP_TEXT         0x1
+#define WS_OP_BINARY       0x2
+#define WS_OP_CLOSE        0x8
+#define WS_OP_PING         0x9
+#define WS_OP_PONG         0xA
+
+// The RSV1 bit marks messages compressed by permessage-deflate (RFC 7692).
+#define WS_RSV1            0x40
+
+// Status codes that can be sent in close frames (section 7.4.1).
+#define WS_CLOSE_NORMAL        1000
+#define WS_CLOSE_GOING_AWAY    1001
+#define WS_CLOSE_PROTOCOL      1002
+#define WS_CLOSE_INVALID_DATA  1007
+#define WS_CLOSE_TOO_BIG       1009
+
+// Server-to-client frames are never masked, so their headers need at most
+// ten bytes.
+#define WS_MAX_HEADER_LENGTH   10
+
+char *websocketAcceptKey(const char *key);
+int  websocketFrameHeader(char *header, int opcode, int fin, uint64_t length);
+int  websocketValidCloseCode(int code);
+int  websocketCheckUTF8(int *state, const unsigned char *buf, int len);
+struct WebSocketDeflate *newWebSocketDeflate(const char *offers,
+                                             char **response);
+void deleteWebSocketDeflate(struct WebSocketDeflate *ctx);
+char *websocketDeflateFrame(struct WebSocketDeflate *ctx, int opcode,
+                            int fin, const char *payload, int len,
+                            int *frameLength);
+int  websocketInflate(struct WebSocketDeflate *ctx, const char **in,
+                      int *inLength, char *out, int outLength);
+
+#endif /* WEBSOCKET_H__ */
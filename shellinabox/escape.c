@@ -0,0 +1,457 @@
+// escape.c -- Fast JSON escaping and hex decoding
+// Copyright (C) 2008-2010 Markus Gutschke <markus@shellinabox.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// In addition to these license terms, the author grants the following
+// additional rights:
+//
+// If you modify this program, or any covered work, by linking or
+// combining it with the OpenSSL project's OpenSSL library (or a
+// modified version of that library), containing parts covered by the
+// terms of the OpenSSL or SSLeay licenses, the author
+// grants you additional permission to convey the resulting work.
+// Corresponding Source for a non-source form of such a combination
+// shall include the source code for the parts of OpenSSL used as well
+// as that of the covered work.
+//
+// You may at your option choose to remove this additional permission from
+// the work, or from any part of it.
+//
+// It is possible to build this program in a way that it loads OpenSSL
+// libraries at run-time. If doing so, the following notices are required
+// by the OpenSSL and SSLeay licenses:
+//
+// This product includes software developed by the OpenSSL Project
+// for use in the OpenSSL Toolkit. (http://www.openssl.org/)
+//
+// This product includes cryptographic software written by Eric Young
+// (eay@cryptsoft.com)
+//
+//
+// The most up-to-date version of this program is always available from
+// http://shellinabox.com
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#if defined(__GNUC__) && defined(__SSE2__) &&                                 \
+    (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SSE2_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#include "shellinabox/escape.h"
+#include "logging/logging.h"
+
+// Terminal output is mostly printable ASCII. Both the escaper and the hex
+// decoder process long runs of such bytes in bulk, and only fall back to
+// handling individual bytes when they find something that needs attention.
+// On x86, this uses SSE2, which is always available on x86-64, and AVX2,
+// if the CPU supports it.
+
+// Bytes that cannot be copied into a JSON string as they are. Bytes above
+// 0x7F are included, as they either need escaping, or need to be checked
+// for well-formed UTF-8.
+static const unsigned char jsonSpecial[256] = {
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
+
+// The kernels copy the longest prefix of "src" that needs no escaping to
+// "dst", and return its length. They can write up to 32 bytes past that
+// prefix, as long as they stay within the first "len" bytes of "dst".
+static int copyPlainScalar(char *dst, const unsigned char *src, int len) {
+  int n;
+  for (n = 0; n < len && !jsonSpecial[src[n]]; n++) {
+    dst[n]                    = src[n];
+  }
+  return n;
+}
+
+#ifdef HAVE_SSE2_KERNELS
+static int copyPlainSSE2(char *dst, const unsigned char *src, int len) {
+  const __m128i space         = _mm_set1_epi8(' ');
+  const __m128i quote         = _mm_set1_epi8('"');
+  const __m128i backslash     = _mm_set1_epi8('\\');
+  const __m128i slash         = _mm_set1_epi8('/');
+  int n;
+  for (n = 0; n + 16 <= len; n += 16) {
+    __m128i v                 = _mm_loadu_si128((const __m128i *)(src + n));
+    _mm_storeu_si128((__m128i *)(dst + n), v);
+
+    // Signed comparison finds control characters and bytes above 0x7F.
+    __m128i special           = _mm_or_si128(
+                                  _mm_or_si128(_mm_cmplt_epi8(v, space),
+                                               _mm_cmpeq_epi8(v, quote)),
+                                  _mm_or_si128(_mm_cmpeq_epi8(v, backslash),
+                                               _mm_cmpeq_epi8(v, slash)));
+    int mask                  = _mm_movemask_epi8(special);
+    if (mask) {
+      return n + __builtin_ctz(mask);
+    }
+  }
+  return n + copyPlainScalar(dst + n, src + n, len - n);
+}
+
+__attribute__((target("avx2")))
+static int copyPlainAVX2(char *dst, const unsigned char *src, int len) {
+  const __m256i space         = _mm256_set1_epi8(' ');
+  const __m256i quote         = _mm256_set1_epi8('"');
+  const __m256i backslash     = _mm256_set1_epi8('\\');
+  const __m256i slash         = _mm256_set1_epi8('/');
+  int n;
+  for (n = 0; n + 32 <= len; n += 32) {
+    __m256i v                 = _mm256_loadu_si256((const __m256i *)(src+n));
+    _mm256_storeu_si256((__m256i *)(dst + n), v);
+    __m256i special           = _mm256_or_si256(
+                                  _mm256_or_si256(_mm256_cmpgt_epi8(space, v),
+                                               _mm256_cmpeq_epi8(v, quote)),
+                                  _mm256_or_si256(
+                                               _mm256_cmpeq_epi8(v, backslash),
+                                               _mm256_cmpeq_epi8(v, slash)));
+    unsigned mask             = _mm256_movemask_epi8(special);
+    if (mask) {
+      return n + __builtin_ctz(mask);
+    }
+  }
+  return n + copyPlainSSE2(dst + n, src + n, len - n);
+}
+#endif
+
+static int escapeKernel         = ESCAPE_KERNEL_AUTO;
+
+int escapeSetKernel(int kernel) {
+  // Overrides the choice of kernel, so that they can be compared against
+  // each other. Returns false, if the CPU cannot run the requested kernel.
+  switch (kernel) {
+  case ESCAPE_KERNEL_AUTO:
+  case ESCAPE_KERNEL_SCALAR:
+    break;
+  #ifdef HAVE_SSE2_KERNELS
+  case ESCAPE_KERNEL_SSE2:
+    break;
+  case ESCAPE_KERNEL_AVX2:
+    if (!__builtin_cpu_supports("avx2")) {
+      return 0;
+    }
+    break;
+  #endif
+  default:
+    return 0;
+  }
+  escapeKernel                = kernel;
+  return 1;
+}
+
+static int selectedKernel(void) {
+  if (escapeKernel != ESCAPE_KERNEL_AUTO) {
+    return escapeKernel;
+  }
+  #ifdef HAVE_SSE2_KERNELS
+  return __builtin_cpu_supports("avx2") ? ESCAPE_KERNEL_AVX2
+                                        : ESCAPE_KERNEL_SSE2;
+  #else
+  return ESCAPE_KERNEL_SCALAR;
+  #endif
+}
+
+static int (*copyPlainKernel(void))(char *, const unsigned char *, int) {
+  switch (selectedKernel()) {
+  #ifdef HAVE_SSE2_KERNELS
+  case ESCAPE_KERNEL_AVX2:
+    return copyPlainAVX2;
+  case ESCAPE_KERNEL_SSE2:
+    return copyPlainSSE2;
+  #endif
+  default:
+    return copyPlainScalar;
+  }
+}
+
+static int utf8SequenceLength(const unsigned char *ptr, int len) {
+  // Returns the length of the well-formed UTF-8 sequence at "ptr", or zero
+  // if there is none. Overlong encodings, surrogates, and code points past
+  // U+10FFFF are not well-formed. Neither are sequences that are cut short.
+  int length;
+  if (*ptr >= 0xC2 && *ptr <= 0xDF) {
+    length                    = 2;
+  } else if (*ptr >= 0xE0 && *ptr <= 0xEF) {
+    length                    = 3;
+  } else if (*ptr >= 0xF0 && *ptr <= 0xF4) {
+    length                    = 4;
+  } else {
+    return 0;
+  }
+  if (len < length) {
+    return 0;
+  }
+  for (int i = 1; i < length; i++) {
+    if ((ptr[i] & 0xC0) != 0x80) {
+      return 0;
+    }
+  }
+  if ((*ptr == 0xE0 && ptr[1] < 0xA0) || (*ptr == 0xED && ptr[1] > 0x9F) ||
+      (*ptr == 0xF0 && ptr[1] < 0x90) || (*ptr == 0xF4 && ptr[1] > 0x8F)) {
+    return 0;
+  }
+  return length;
+}
+
+static char *escapeSegment(char *dst, const unsigned char *src, int len,
+                           int utf8,
+                           int (*copyPlain)(char *, const unsigned char *,
+                                            int)) {
+  // Escapes "len" bytes from "src" into "dst", and returns the end of the
+  // output. The caller must provide room for six bytes per input byte.
+  static const char *hexDigit = "0123456789ABCDEF";
+  const unsigned char *end    = src + len;
+  while (src < end) {
+    if (!jsonSpecial[*src]) {
+      int plain               = copyPlain(dst, src, end - src);
+      dst                    += plain;
+      src                    += plain;
+      if (src == end) {
+        break;
+      }
+    }
+    unsigned char ch          = *src++;
+    if (ch < ' ') {
+      *dst++                  = '\\';
+      switch (ch) {
+      case '\b': *dst++       = 'b'; break;
+      case '\f': *dst++       = 'f'; break;
+      case '\n': *dst++       = 'n'; break;
+      case '\r': *dst++       = 'r'; break;
+      case '\t': *dst++       = 't'; break;
+      default:
+        *dst++                = 'u';
+        *dst++                = '0';
+        *dst++                = '0';
+        *dst++                = hexDigit[ch >> 4];
+        *dst++                = hexDigit[ch & 0xF];
+        break;
+      }
+    } else if (ch <= '\x7F') {
+      *dst++                  = '\\';
+      *dst++                  = ch;
+    } else {
+      int utf8Length          = utf8 ? utf8SequenceLength(src - 1,
+                                                          end - src + 1) : 0;
+      if (utf8Length && ch == 0xE2 && src[0] == 0x80 &&
+          (src[1] & 0xFE) == 0xA8) {
+        // U+2028 and U+2029 are not allowed in JavaScript string literals.
+        memcpy(dst, src[1] == 0xA8 ? "\\u2028" : "\\u2029", 6);
+        dst                  += 6;
+        src                  += 2;
+      } else if (utf8Length) {
+        memcpy(dst, src - 1, utf8Length);
+        dst                  += utf8Length;
+        src                  += utf8Length - 1;
+      } else {
+        *dst++                = '\\';
+        *dst++                = 'u';
+        *dst++                = utf8 ? 'D' : '0';
+        *dst++                = utf8 ? 'C' : '0';
+        *dst++                = hexDigit[ch >> 4];
+        *dst++                = hexDigit[ch & 0xF];
+      }
+    }
+  }
+  return dst;
+}
+
+char *jsonEscapeTo(char *dst, const struct iovec *iov, int count, int utf8) {
+  // Escapes the concatenation of "count" segments, so that it can be used
+  // as a JSON string. By default, all bytes above 0x7F are escaped as
+  // "\u00XX". In UTF-8 mode, well-formed multi-byte sequences pass through
+  // unchanged, and any other bytes above 0x7F are escaped as lone surrogates
+  // "\uDC80" through "\uDCFF". The client turns these back into the original
+  // bytes. A sequence that straddles two segments is escaped byte by byte,
+  // which the client decodes to the same bytes.
+  // No input byte expands to more than six bytes, and "dst" must have room
+  // for that. Returns the end of the output, which is not NUL terminated.
+  int (*copyPlain)(char *, const unsigned char *, int) = copyPlainKernel();
+  for (int i = 0; i < count; i++) {
+    dst                       = escapeSegment(dst, iov[i].iov_base,
+                                              iov[i].iov_len, utf8,
+                                              copyPlain);
+  }
+  return dst;
+}
+
+char *jsonEscapeV(const struct iovec *iov, int count, int utf8) {
+  // Encode everything in a single pass, and then return any space that we
+  // did not need.
+  int len                     = 0;
+  for (int i = 0; i < count; i++) {
+    len                      += iov[i].iov_len;
+  }
+  char *result;
+  check(len >= 0);
+  check(result                = malloc(6*len + 1));
+  char *dst                   = jsonEscapeTo(result, iov, count, utf8);
+  *dst++                      = '\000';
+  check(result                = realloc(result, dst - result));
+  return result;
+}
+
+char *jsonEscape(const char *buf, int len, int utf8) {
+  struct iovec iov;
+  iov.iov_base                = (void *)buf;
+  iov.iov_len                 = len;
+  return jsonEscapeV(&iov, 1, utf8);
+}
+
+// Maps ASCII hex digits to their values, and everything else to 0xFF.
+#define XX 0xFF
+static const unsigned char hexDigitValue[256] = {
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, XX, XX, XX, XX, XX, XX,
+  XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX };
+#undef XX
+
+// The hex decoders convert as many leading pairs of hex digits as they
+// can, and return the number of input bytes that they consumed.
+static int hexDecodeScalar(char *dst, const char *src, int len) {
+  int i;
+  for (i = 0; i + 2 <= len; i += 2) {
+    unsigned char hi          = hexDigitValue[(unsigned char)src[i]];
+    unsigned char lo          = hexDigitValue[(unsigned char)src[i + 1]];
+    if ((hi | lo) & 0xF0) {
+      break;
+    }
+    dst[i >> 1]               = (hi << 4) | lo;
+  }
+  return i;
+}
+
+#ifdef HAVE_SSE2_KERNELS
+static int hexDecodeSSE2(char *dst, const char *src, int len) {
+  const __m128i zero          = _mm_setzero_si128();
+  int i;
+  for (i = 0; i + 16 <= len; i += 16) {
+    __m128i v                 = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i digit             = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    __m128i alpha             = _mm_sub_epi8(_mm_or_si128(v,
+                                                        _mm_set1_epi8(0x20)),
+                                             _mm_set1_epi8('a'));
+    __m128i isDigit           = _mm_cmpeq_epi8(_mm_subs_epu8(digit,
+                                                        _mm_set1_epi8(9)),
+                                               zero);
+    __m128i isAlpha           = _mm_cmpeq_epi8(_mm_subs_epu8(alpha,
+                                                        _mm_set1_epi8(5)),
+                                               zero);
+    if (_mm_movemask_epi8(_mm_or_si128(isDigit, isAlpha)) != 0xFFFF) {
+      break;
+    }
+    __m128i nibbles           = _mm_or_si128(_mm_and_si128(isDigit, digit),
+                                  _mm_andnot_si128(isDigit,
+                                    _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+
+    // Even bytes hold the high nibbles, and odd bytes the low nibbles.
+    __m128i bytes             = _mm_or_si128(
+                                  _mm_slli_epi16(_mm_and_si128(nibbles,
+                                                   _mm_set1_epi16(0xFF)), 4),
+                                  _mm_srli_epi16(nibbles, 8));
+    _mm_storel_epi64((__m128i *)(dst + i/2), _mm_packus_epi16(bytes, zero));
+  }
+  return i + hexDecodeScalar(dst + i/2, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int hexDecodeAVX2(char *dst, const char *src, int len) {
+  const __m256i zero          = _mm256_setzero_si256();
+  int i;
+  for (i = 0; i + 32 <= len; i += 32) {
+    __m256i v                 = _mm256_loadu_si256((const __m256i *)(src+i));
+    __m256i digit             = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+    __m256i alpha             = _mm256_sub_epi8(_mm256_or_si256(v,
+                                                     _mm256_set1_epi8(0x20)),
+                                                _mm256_set1_epi8('a'));
+    __m256i isDigit           = _mm256_cmpeq_epi8(_mm256_subs_epu8(digit,
+                                                     _mm256_set1_epi8(9)),
+                                                  zero);
+    __m256i isAlpha           = _mm256_cmpeq_epi8(_mm256_subs_epu8(alpha,
+                                                     _mm256_set1_epi8(5)),
+                                                  zero);
+    if ((unsigned)_mm256_movemask_epi8(_mm256_or_si256(isDigit, isAlpha)) !=
+        0xFFFFFFFFu) {
+      break;
+    }
+    __m256i nibbles           = _mm256_or_si256(
+                                  _mm256_and_si256(isDigit, digit),
+                                  _mm256_andnot_si256(isDigit,
+                                    _mm256_add_epi8(alpha,
+                                                    _mm256_set1_epi8(10))));
+    __m256i bytes             = _mm256_or_si256(
+                                  _mm256_slli_epi16(_mm256_and_si256(nibbles,
+                                                _mm256_set1_epi16(0xFF)), 4),
+                                  _mm256_srli_epi16(nibbles, 8));
+
+    // Packing works on each 128 bit lane separately. Move the two halves of
+    // the result next to each other.
+    __m256i packed            = _mm256_permute4x64_epi64(
+                                  _mm256_packus_epi16(bytes, zero), 0xD8);
+    _mm_storeu_si128((__m128i *)(dst + i/2),
+                     _mm256_castsi256_si128(packed));
+  }
+  return i + hexDecodeSSE2(dst + i/2, src + i, len - i);
+}
+#endif
+
+int hexDecode(char *dst, const char *src, int len) {
+  // Decodes pairs of hex digits from "src" into "dst", and returns the
+  // number of bytes that were written. Decoding stops at the first pair that
+  // is incomplete, or that contains anything other than hex digits.
+  switch (selectedKernel()) {
+  #ifdef HAVE_SSE2_KERNELS
+  case ESCAPE_KERNEL_AVX2:
+    return hexDecodeAVX2(dst, src, len) >> 1;
+  case ESCAPE_KERNEL_SSE2:
+    return hexDecodeSSE2(dst, src, len) >> 1;
+  #endif
+  default:
+    return hexDecodeScalar(dst, src, len) >> 1;
+  }
+}
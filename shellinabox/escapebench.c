@@ -0,0 +1,225 @@
+// escapebench.c -- Throughput of the JSON escaping and hex decoding kernels
+// Copyright (C) 2008-2010 Markus Gutschke <markus@shellinabox.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// In addition to these license terms, the author grants the following
+// additional rights:
+//
+// If you modify this program, or any covered work, by linking or
+// combining it with the OpenSSL project's OpenSSL library (or a
+// modified version of that library), containing parts covered by the
+// terms of the OpenSSL or SSLeay licenses, the author
+// grants you additional permission to convey the resulting work.
+// Corresponding Source for a non-source form of such a combination
+// shall include the source code for the parts of OpenSSL used as well
+// as that of the covered work.
+//
+// You may at your option choose to remove this additional permission from
+// the work, or from any part of it.
+//
+// It is possible to build this program in a way that it loads OpenSSL
+// libraries at run-time. If doing so, the following notices are required
+// by the OpenSSL and SSLeay licenses:
+//
+// This product includes software developed by the OpenSSL Project
+// for use in the OpenSSL Toolkit. (http://www.openssl.org/)
+//
+// This product includes cryptographic software written by Eric Young
+// (eay@cryptsoft.com)
+//
+//
+// The most up-to-date version of this program is always available from
+// http://shellinabox.com
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "shellinabox/escape.h"
+
+// Runs each kernel over typical inputs, and reports how many input bytes
+// it processes per clock cycle. On x86, this counts time stamp counter
+// ticks, which run at the nominal clock rate of the CPU. Elsewhere, it
+// reports bytes per nanosecond instead.
+//
+// Usage: escapebench [iterations]
+
+#define INPUT_SIZE 65536
+#define RUNS       5
+
+static const struct {
+  int        kernel;
+  const char *name;
+} kernels[]                   = { { ESCAPE_KERNEL_SCALAR, "scalar" },
+                                  { ESCAPE_KERNEL_SSE2,   "sse2"   },
+                                  { ESCAPE_KERNEL_AVX2,   "avx2"   } };
+
+#if defined(__x86_64__) || defined(__i386__)
+static const char *unit       = "bytes/cycle";
+
+static unsigned long long ticks(void) {
+  return __rdtsc();
+}
+#else
+static const char *unit       = "bytes/ns";
+
+static unsigned long long ticks(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+static void makePlainText(char *buf, int len) {
+  // Printable ASCII, broken into lines. This is what most terminal output
+  // looks like. Leave out the few printable characters that need quoting.
+  for (int i = 0; i < len; i++) {
+    char ch                   = ' ' + (i*7 + i/80)%95;
+    buf[i]                    = i % 80 == 79 ? '\n' :
+                                strchr("\"\\/", ch) ? ' ' : ch;
+  }
+}
+
+static void makeTerminalOutput(char *buf, int len) {
+  // Colored text, as it would be printed by "ls --color". Every few words,
+  // there are escape sequences that need quoting.
+  static const char *words[]  = { "\033[01;34m", "src", "\033[0m", "  ",
+                                  "README.md", "  ", "\033[01;32m",
+                                  "configure", "\033[0m", "\r\n",
+                                  "Makefile.am", "  ", "/usr/share/doc",
+                                  "  " };
+  int n                       = 0;
+  for (int i = 0; n < len; i = (i + 1) % (sizeof(words)/sizeof(*words))) {
+    for (const char *ptr = words[i]; *ptr && n < len; ptr++) {
+      buf[n++]                = *ptr;
+    }
+  }
+}
+
+static void makeHexKeys(char *buf, int len) {
+  // Key presses, as sent by the client. Both upper and lower case digits are
+  // accepted.
+  static const char *upper    = "0123456789ABCDEF";
+  static const char *lower    = "0123456789abcdef";
+  for (int i = 0; i < len; i++) {
+    unsigned byte             = (i*37 + i/16) & 0xF;
+    buf[i]                    = ((i/64) & 1 ? upper : lower)[byte];
+  }
+}
+
+static double bestOf(unsigned long long *samples) {
+  unsigned long long best     = samples[0];
+  for (int i = 1; i < RUNS; i++) {
+    if (samples[i] < best) {
+      best                    = samples[i];
+    }
+  }
+  return best ? (double)best : 1.0;
+}
+
+static double benchJsonEscape(const char *input, int len, int iterations,
+                              char **result) {
+  unsigned long long samples[RUNS];
+  for (int run = 0; run < RUNS; run++) {
+    unsigned long long start  = ticks();
+    for (int i = 0; i < iterations; i++) {
+      free(*result);
+      *result                 = jsonEscape(input, len, 1);
+    }
+    samples[run]              = ticks() - start;
+  }
+  return (double)len*iterations / bestOf(samples);
+}
+
+static double benchHexDecode(const char *input, int len, int iterations,
+                             char *output, int *decoded) {
+  unsigned long long samples[RUNS];
+  for (int run = 0; run < RUNS; run++) {
+    unsigned long long start  = ticks();
+    for (int i = 0; i < iterations; i++) {
+      *decoded                = hexDecode(output, input, len);
+      __asm__ __volatile__("" : : "r"(output) : "memory");
+    }
+    samples[run]              = ticks() - start;
+  }
+  return (double)len*iterations / bestOf(samples);
+}
+
+int main(int argc, char *argv[]) {
+  int iterations              = argc > 1 ? atoi(argv[1]) : 200;
+  if (iterations <= 0) {
+    fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+  static char plain[INPUT_SIZE], terminal[INPUT_SIZE], hex[INPUT_SIZE];
+  static char decoded[INPUT_SIZE/2], expectedDecoded[INPUT_SIZE/2];
+  makePlainText(plain, sizeof(plain));
+  makeTerminalOutput(terminal, sizeof(terminal));
+  makeHexKeys(hex, sizeof(hex));
+
+  // The scalar kernel is the reference. All other kernels must produce the
+  // same output.
+  char *expectedPlain         = NULL;
+  char *expectedTerminal      = NULL;
+  int expectedLength          = 0;
+  int status                  = 0;
+  printf("%-8s %16s %16s %16s   (%s)\n", "kernel", "jsonEscape/plain",
+         "jsonEscape/term", "hexDecode", unit);
+  for (unsigned k = 0; k < sizeof(kernels)/sizeof(*kernels); k++) {
+    if (!escapeSetKernel(kernels[k].kernel)) {
+      printf("%-8s %16s\n", kernels[k].name, "not supported");
+      continue;
+    }
+    char *resultPlain         = NULL;
+    char *resultTerminal      = NULL;
+    int length                = 0;
+    double plainRate          = benchJsonEscape(plain, sizeof(plain),
+                                                iterations, &resultPlain);
+    double terminalRate       = benchJsonEscape(terminal, sizeof(terminal),
+                                                iterations, &resultTerminal);
+    double hexRate            = benchHexDecode(hex, sizeof(hex), iterations,
+                                               decoded, &length);
+    printf("%-8s %16.2f %16.2f %16.2f\n", kernels[k].name, plainRate,
+           terminalRate, hexRate);
+    if (!expectedPlain) {
+      expectedPlain           = resultPlain;
+      expectedTerminal        = resultTerminal;
+      expectedLength          = length;
+      memcpy(expectedDecoded, decoded, sizeof(decoded));
+      continue;
+    }
+    if (strcmp(resultPlain, expectedPlain) ||
+        strcmp(resultTerminal, expectedTerminal) ||
+        length != expectedLength ||
+        memcmp(decoded, expectedDecoded, sizeof(decoded))) {
+      fprintf(stderr, "%s kernel produced different output\n",
+              kernels[k].name);
+      status                  = 1;
+    }
+    free(resultPlain);
+    free(resultTerminal);
+  }
+  free(expectedPlain);
+  free(expectedTerminal);
+  escapeSetKernel(ESCAPE_KERNEL_AUTO);
+  return status;
+}
@@ -140,6 +140,10 @@ int execle(const char *, const char *, ...);
 extern int pthread_once(pthread_once_t *, void (*)(void))__attribute__((weak));
 #endif
 
+#if defined(HAVE_PTHREAD_CREATE)
+#include <pthread.h>
+#endif
+
 // If PAM support is available, take advantage of it. Otherwise, silently fall
 // back on legacy operations for session management.
 #if defined(HAVE_SECURITY_PAM_APPL_H) && defined(HAVE_DLOPEN)
@@ -171,6 +175,7 @@ static int (*x_misc_conv)(int, const struct pam_message **,
 #endif
 
 static int   launcher = -1;
+static int   launcherLock = -1;
 static uid_t restricted;
 
 // From shellinabox/shellinaboxd.c
@@ -505,6 +510,33 @@ static int getpwuid_r(uid_t uid, struct passwd *pwd, char *buf, size_t buflen,
 }
 #endif
 
+#if defined(HAVE_PTHREAD_CREATE)
+static pthread_mutex_t launcherMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void lockLauncher(int lock) {
+  // When several worker processes share the same launcher, requests and
+  // replies must not interleave. POSIX record locks are released by the
+  // kernel, if a worker dies while holding one. But they do not serialize
+  // threads within the same process, so reactor threads also need a mutex.
+#if defined(HAVE_PTHREAD_CREATE)
+  if (lock) {
+    check(!pthread_mutex_lock(&launcherMutex));
+  }
+#endif
+  if (launcherLock >= 0) {
+    struct flock fl    = { 0 };
+    fl.l_type          = lock ? F_WRLCK : F_UNLCK;
+    fl.l_whence        = SEEK_SET;
+    check(!NOINTR(fcntl(launcherLock, F_SETLKW, &fl)));
+  }
+#if defined(HAVE_PTHREAD_CREATE)
+  if (!lock) {
+    check(!pthread_mutex_unlock(&launcherMutex));
+  }
+#endif
+}
+
 int launchChild(int service, struct Session *session, const char *url) {
   if (launcher < 0) {
     errno              = EINVAL;
@@ -538,7 +570,9 @@ int launchChild(int service, struct Session *session, const char *url) {
   request->urlLength   = strlen(u);
   memcpy(&request->url, u, request->urlLength);
   free(u);
+  lockLauncher(1);
   if (NOINTR(write(launcher, request, len)) != len) {
+    lockLauncher(0);
     free(request);
     return -1;
   }
@@ -554,6 +588,7 @@ int launchChild(int service, struct Session *session, const char *url) {
   msg.msg_control      = &cmsg_buf;
   msg.msg_controllen   = sizeof(cmsg_buf);
   int bytes            = NOINTR(recvmsg(launcher, &msg, 0));
+  lockLauncher(0);
   if (bytes < 0) {
     return -1;
   }
@@ -583,11 +618,14 @@ int terminateChild(struct Session *session) {
   ssize_t len          = sizeof(struct LaunchRequest);
   check(request        = calloc(len, 1));
   request->terminate   = session->pid;
+  lockLauncher(1);
   if (NOINTR(write(launcher, request, len)) != len) {
+    lockLauncher(0);
     debug("[server] Child %d termination request failed!", request->terminate);
     free(request);
     return -1;
   }
+  lockLauncher(0);
 
   free(request);
   session->pid         = 0;
@@ -1886,6 +1924,23 @@ int forkLauncher(void) {
   }
 }
 
+int adoptLauncher(int fd) {
+  // After an upgrade, we keep talking to the launcher that the previous
+  // process forked.
+  check(launcher < 0);
+  launcher = fd;
+  return launcher;
+}
+
+void shareLauncher(void) {
+  // Create an anonymous lock file that all processes sharing the launcher
+  // can use to serialize their requests.
+  FILE *fp;
+  check(fp                   = tmpfile());
+  check((launcherLock        = dup(fileno(fp))) >= 0);
+  fclose(fp);
+}
+
 void terminateLauncher(void) {
   if (launcher >= 0) {
     NOINTR(close(launcher));
@@ -66,6 +66,8 @@ int  launchChild(int service, struct Session *session, const char *url);
 int  terminateChild(struct Session *session);
 void setWindowSize(int pty, int width, int height);
 int  forkLauncher(void);
+int  adoptLauncher(int fd);
+void shareLauncher(void);
 void terminateLauncher(void);
 void closeAllFds(int *exceptFd, int num);
 
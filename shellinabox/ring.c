@@ -0,0 +1,180 @@
+// ring.c -- Fixed-capacity ring buffer for terminal output
+// Copyright (C) 2008-2010 Markus Gutschke <markus@shellinabox.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// In addition to these license terms, the author grants the following
+// additional rights:
+//
+// If you modify this program, or any covered work, by linking or
+// combining it with the OpenSSL project's OpenSSL library (or a
+// modified version of that library), containing parts covered by the
+// terms of the OpenSSL or SSLeay licenses, the author
+// grants you additional permission to convey the resulting work.
+// Corresponding Source for a non-source form of such a combination
+// shall include the source code for the parts of OpenSSL used as well
+// as that of the covered work.
+//
+// You may at your option choose to remove this additional permission from
+// the work, or from any part of it.
+//
+// It is possible to build this program in a way that it loads OpenSSL
+// libraries at run-time. If doing so, the following notices are required
+// by the OpenSSL and SSLeay licenses:
+//
+// This product includes software developed by the OpenSSL Project
+// for use in the OpenSSL Toolkit. (http://www.openssl.org/)
+//
+// This product includes cryptographic software written by Eric Young
+// (eay@cryptsoft.com)
+//
+//
+// The most up-to-date version of this program is always available from
+// http://shellinabox.com
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "libhttp/http.h"
+#include "logging/logging.h"
+#include "shellinabox/ring.h"
+
+void initRingBuffer(struct RingBuffer *ring, int size) {
+  // Rounds "size" up to the next power of two, so that positions can be
+  // reduced with a simple mask.
+  check(size > 0 && size <= (1 << 30));
+  unsigned capacity       = 1;
+  while ((int)capacity < size) {
+    capacity            <<= 1;
+  }
+  check(ring->data        = malloc(capacity));
+  ring->size              = capacity;
+  ring->head              = 0;
+  ring->tail              = 0;
+}
+
+void destroyRingBuffer(struct RingBuffer *ring) {
+  if (ring) {
+    free(ring->data);
+    ring->data            = NULL;
+    ring->size            = 0;
+    ring->head            = 0;
+    ring->tail            = 0;
+  }
+}
+
+int ringBufferCapacity(const struct RingBuffer *ring) {
+  return ring->size;
+}
+
+int ringBufferLength(const struct RingBuffer *ring) {
+  return ring->head - ring->tail;
+}
+
+int ringBufferSpace(const struct RingBuffer *ring) {
+  return ring->size - (ring->head - ring->tail);
+}
+
+static int ringBufferSegments(const struct RingBuffer *ring, unsigned pos,
+                              int len, struct iovec iov[2]) {
+  // Describes the "len" bytes starting at "pos" as up to two contiguous
+  // segments, and returns the number of segments.
+  if (len <= 0) {
+    return 0;
+  }
+  unsigned offset         = pos & (ring->size - 1);
+  int first               = ring->size - offset;
+  iov[0].iov_base         = ring->data + offset;
+  if (len <= first) {
+    iov[0].iov_len        = len;
+    return 1;
+  }
+  iov[0].iov_len          = first;
+  iov[1].iov_base         = ring->data;
+  iov[1].iov_len          = len - first;
+  return 2;
+}
+
+int ringBufferReserve(const struct RingBuffer *ring, struct iovec iov[2]) {
+  // Points "iov" at all of the free space, so that callers can read
+  // directly into the buffer. Data only becomes visible after calling
+  // ringBufferCommit().
+  return ringBufferSegments(ring, ring->head, ringBufferSpace(ring), iov);
+}
+
+void ringBufferCommit(struct RingBuffer *ring, int len) {
+  check(len >= 0 && len <= ringBufferSpace(ring));
+  ring->head             += len;
+}
+
+int ringBufferWrite(struct RingBuffer *ring, const char *buf, int len) {
+  // Appends as much of "buf" as fits, and returns the number of bytes that
+  // were stored.
+  struct iovec iov[2];
+  int space               = ringBufferSpace(ring);
+  if (len > space) {
+    len                   = space;
+  }
+  int count               = ringBufferSegments(ring, ring->head, len, iov);
+  for (int i = 0; i < count; i++) {
+    memcpy(iov[i].iov_base, buf, iov[i].iov_len);
+    buf                  += iov[i].iov_len;
+  }
+  ring->head             += len;
+  return len;
+}
+
+int ringBufferPeek(const struct RingBuffer *ring, int len,
+                   struct iovec iov[2]) {
+  // Points "iov" at the oldest "len" bytes, without consuming them.
+  check(len >= 0 && len <= ringBufferLength(ring));
+  return ringBufferSegments(ring, ring->tail, len, iov);
+}
+
+int ringBufferPeekAt(const struct RingBuffer *ring, int offset, int len,
+                     struct iovec iov[2]) {
+  // Points "iov" at "len" bytes, starting "offset" bytes after the oldest.
+  check(offset >= 0 && len >= 0 && offset + len <= ringBufferLength(ring));
+  return ringBufferSegments(ring, ring->tail + offset, len, iov);
+}
+
+int ringBufferPeekNewest(const struct RingBuffer *ring, int len,
+                         struct iovec iov[2]) {
+  // Points "iov" at the most recently written "len" bytes.
+  check(len >= 0 && len <= ringBufferLength(ring));
+  return ringBufferSegments(ring, ring->head - len, len, iov);
+}
+
+void ringBufferCopy(const struct RingBuffer *ring, char *buf, int len) {
+  struct iovec iov[2];
+  int count               = ringBufferPeek(ring, len, iov);
+  for (int i = 0; i < count; i++) {
+    memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+    buf                  += iov[i].iov_len;
+  }
+}
+
+void ringBufferConsume(struct RingBuffer *ring, int len) {
+  check(len >= 0 && len <= ringBufferLength(ring));
+  ring->tail             += len;
+  if (ring->head == ring->tail) {
+    // Start over at the beginning, so that short replies rarely wrap.
+    ring->head            = 0;
+    ring->tail            = 0;
+  }
+}
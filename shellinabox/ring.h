@@ -0,0 +1,81 @@
+// ring.h -- Fixed-capacity ring buffer for terminal output
+// Copyright (C) 2008-2010 Markus Gutschke <markus@shellinabox.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// In addition to these license terms, the author grants the following
+// additional rights:
+//
+// If you modify this program, or any covered work, by linking or
+// combining it with the OpenSSL project's OpenSSL library (or a
+// modified version of that library), containing parts covered by the
+// terms of the OpenSSL or SSLeay licenses, the author
+// grants you additional permission to convey the resulting work.
+// Corresponding Source for a non-source form of such a combination
+// shall include the source code for the parts of OpenSSL used as well
+// as that of the covered work.
+//
+// You may at your option choose to remove this additional permission from
+// the work, or from any part of it.
+//
+// It is possible to build this program in a way that it loads OpenSSL
+// libraries at run-time. If doing so, the following notices are required
+// by the OpenSSL and SSLeay licenses:
+//
+// This product includes software developed by the OpenSSL Project
+// for use in the OpenSSL Toolkit. (http://www.openssl.org/)
+//
+// This product includes cryptographic software written by Eric Young
+// (eay@cryptsoft.com)
+//
+//
+// The most up-to-date version of this program is always available from
+// http://shellinabox.com
+
+#ifndef RING_H__
+#define RING_H__
+
+#include <sys/uio.h>
+
+// Holds the output that a session has read from its pty, but not yet sent
+// to the client. The capacity is fixed when the buffer gets initialized, and
+// is always a power of two. "head" and "tail" count all the bytes that were
+// ever written and consumed, and are reduced modulo the capacity only when
+// accessing "data". Each session is only ever touched by the event loop
+// that owns it, so neither end needs any locking.
+struct RingBuffer {
+  char     *data;
+  unsigned size;
+  unsigned head;
+  unsigned tail;
+};
+
+void initRingBuffer(struct RingBuffer *ring, int size);
+void destroyRingBuffer(struct RingBuffer *ring);
+int  ringBufferCapacity(const struct RingBuffer *ring);
+int  ringBufferLength(const struct RingBuffer *ring);
+int  ringBufferSpace(const struct RingBuffer *ring);
+int  ringBufferReserve(const struct RingBuffer *ring, struct iovec iov[2]);
+void ringBufferCommit(struct RingBuffer *ring, int len);
+int  ringBufferWrite(struct RingBuffer *ring, const char *buf, int len);
+int  ringBufferPeek(const struct RingBuffer *ring, int len,
+                    struct iovec iov[2]);
+int  ringBufferPeekAt(const struct RingBuffer *ring, int offset, int len,
+                      struct iovec iov[2]);
+int  ringBufferPeekNewest(const struct RingBuffer *ring, int len,
+                          struct iovec iov[2]);
+void ringBufferCopy(const struct RingBuffer *ring, char *buf, int len);
+void ringBufferConsume(struct RingBuffer *ring, int len);
+
+#endif /* RING_H__ */
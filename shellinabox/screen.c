@@ -0,0 +1,1678 @@
+// screen.c -- Server-side model of the terminal screen
+// Copyright (C) 2008-2010 Markus Gutschke <markus@shellinabox.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// In addition to these license terms, the author grants the following
+// additional rights:
+//
+// If you modify this program, or any covered work, by linking or
+// combining it with the OpenSSL project's OpenSSL library (or a
+// modified version of that library), containing parts covered by the
+// terms of the OpenSSL or SSLeay licenses, the author
+// grants you additional permission to convey the resulting work.
+// Corresponding Source for a non-source form of such a combination
+// shall include the source code for the parts of OpenSSL used as well
+// as that of the covered work.
+//
+// You may at your option choose to remove this additional permission from
+// the work, or from any part of it.
+//
+// It is possible to build this program in a way that it loads OpenSSL
+// libraries at run-time. If doing so, the following notices are required
+// by the OpenSSL and SSLeay licenses:
+//
+// This product includes software developed by the OpenSSL Project
+// for use in the OpenSSL Toolkit. (http://www.openssl.org/)
+//
+// This product includes cryptographic software written by Eric Young
+// (eay@cryptsoft.com)
+//
+//
+// The most up-to-date version of this program is always available from
+// http://shellinabox.com
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging/logging.h"
+#include "shellinabox/screen.h"
+
+// The parser states and attribute bits have the same values as in
+// vt100.jspp, which makes it easier to compare the two implementations.
+#define ESnormal        0
+#define ESesc           1
+#define ESsquare        2
+#define ESgetpars       3
+#define ESgotpars       4
+#define ESdeviceattr    5
+#define ESfunckey       6
+#define EShash          7
+#define ESsetG0         8
+#define ESsetG1         9
+#define ESsetG2        10
+#define ESsetG3        11
+#define ESbang         12
+#define ESpercent      13
+#define ESignore       14
+#define ESnonstd       15
+#define ESpalette      16
+#define EStitle        17
+#define ESss2          18
+#define ESss3          19
+#define ESVTEtitle     20
+
+#define ATTR_DEFAULT   0x60F0
+#define ATTR_REVERSE   0x0100
+#define ATTR_UNDERLINE 0x0200
+#define ATTR_DIM       0x0400
+#define ATTR_BRIGHT    0x0800
+#define ATTR_BLINK     0x1000
+#define ATTR_DEF_FG    0x2000
+#define ATTR_DEF_BG    0x4000
+
+#define MAP_LATIN1     0
+#define MAP_GRAPHICS   1
+#define MAP_CP437      2
+#define MAP_DIRECT     3
+
+#define MAX_TITLE      1024
+
+static const uint16_t graphicsMap[256] = {
+  0x0000, 0x0001, 0x0002, 0x0003, 0x0004, 0x0005, 0x0006, 0x0007,
+  0x0008, 0x0009, 0x000A, 0x000B, 0x000C, 0x000D, 0x000E, 0x000F,
+  0x0010, 0x0011, 0x0012, 0x0013, 0x0014, 0x0015, 0x0016, 0x0017,
+  0x0018, 0x0019, 0x001A, 0x001B, 0x001C, 0x001D, 0x001E, 0x001F,
+  0x0020, 0x0021, 0x0022, 0x0023, 0x0024, 0x0025, 0x0026, 0x0027,
+  0x0028, 0x0029, 0x002A, 0x2192, 0x2190, 0x2191, 0x2193, 0x002F,
+  0x2588, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+  0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+  0x0040, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+  0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+  0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+  0x0058, 0x0059, 0x005A, 0x005B, 0x005C, 0x005D, 0x005E, 0x00A0,
+  0x25C6, 0x2592, 0x2409, 0x240C, 0x240D, 0x240A, 0x00B0, 0x00B1,
+  0x2591, 0x240B, 0x2518, 0x2510, 0x250C, 0x2514, 0x253C, 0xF800,
+  0xF801, 0x2500, 0xF803, 0xF804, 0x251C, 0x2524, 0x2534, 0x252C,
+  0x2502, 0x2264, 0x2265, 0x03C0, 0x2260, 0x00A3, 0x00B7, 0x007F,
+  0x0080, 0x0081, 0x0082, 0x0083, 0x0084, 0x0085, 0x0086, 0x0087,
+  0x0088, 0x0089, 0x008A, 0x008B, 0x008C, 0x008D, 0x008E, 0x008F,
+  0x0090, 0x0091, 0x0092, 0x0093, 0x0094, 0x0095, 0x0096, 0x0097,
+  0x0098, 0x0099, 0x009A, 0x009B, 0x009C, 0x009D, 0x009E, 0x009F,
+  0x00A0, 0x00A1, 0x00A2, 0x00A3, 0x00A4, 0x00A5, 0x00A6, 0x00A7,
+  0x00A8, 0x00A9, 0x00AA, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF,
+  0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x00B4, 0x00B5, 0x00B6, 0x00B7,
+  0x00B8, 0x00B9, 0x00BA, 0x00BB, 0x00BC, 0x00BD, 0x00BE, 0x00BF,
+  0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00C7,
+  0x00C8, 0x00C9, 0x00CA, 0x00CB, 0x00CC, 0x00CD, 0x00CE, 0x00CF,
+  0x00D0, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6, 0x00D7,
+  0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x00DD, 0x00DE, 0x00DF,
+  0x00E0, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x00E7,
+  0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+  0x00F0, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x00F7,
+  0x00F8, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x00FD, 0x00FE, 0x00FF,
+};
+
+static const uint16_t codePage437Map[256] = {
+  0x0000, 0x263A, 0x263B, 0x2665, 0x2666, 0x2663, 0x2660, 0x2022,
+  0x25D8, 0x25CB, 0x25D9, 0x2642, 0x2640, 0x266A, 0x266B, 0x263C,
+  0x25B6, 0x25C0, 0x2195, 0x203C, 0x00B6, 0x00A7, 0x25AC, 0x21A8,
+  0x2191, 0x2193, 0x2192, 0x2190, 0x221F, 0x2194, 0x25B2, 0x25BC,
+  0x0020, 0x0021, 0x0022, 0x0023, 0x0024, 0x0025, 0x0026, 0x0027,
+  0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+  0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+  0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+  0x0040, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+  0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+  0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+  0x0058, 0x0059, 0x005A, 0x005B, 0x005C, 0x005D, 0x005E, 0x005F,
+  0x0060, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+  0x0068, 0x0069, 0x006A, 0x006B, 0x006C, 0x006D, 0x006E, 0x006F,
+  0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+  0x0078, 0x0079, 0x007A, 0x007B, 0x007C, 0x007D, 0x007E, 0x2302,
+  0x00C7, 0x00FC, 0x00E9, 0x00E2, 0x00E4, 0x00E0, 0x00E5, 0x00E7,
+  0x00EA, 0x00EB, 0x00E8, 0x00EF, 0x00EE, 0x00EC, 0x00C4, 0x00C5,
+  0x00C9, 0x00E6, 0x00C6, 0x00F4, 0x00F6, 0x00F2, 0x00FB, 0x00F9,
+  0x00FF, 0x00D6, 0x00DC, 0x00A2, 0x00A3, 0x00A5, 0x20A7, 0x0192,
+  0x00E1, 0x00ED, 0x00F3, 0x00FA, 0x00F1, 0x00D1, 0x00AA, 0x00BA,
+  0x00BF, 0x2310, 0x00AC, 0x00BD, 0x00BC, 0x00A1, 0x00AB, 0x00BB,
+  0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x2561, 0x2562, 0x2556,
+  0x2555, 0x2563, 0x2551, 0x2557, 0x255D, 0x255C, 0x255B, 0x2510,
+  0x2514, 0x2534, 0x252C, 0x251C, 0x2500, 0x253C, 0x255E, 0x255F,
+  0x255A, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256C, 0x2567,
+  0x2568, 0x2564, 0x2565, 0x2559, 0x2558, 0x2552, 0x2553, 0x256B,
+  0x256A, 0x2518, 0x250C, 0x2588, 0x2584, 0x258C, 0x2590, 0x2580,
+  0x03B1, 0x00DF, 0x0393, 0x03C0, 0x03A3, 0x03C3, 0x00B5, 0x03C4,
+  0x03A6, 0x0398, 0x03A9, 0x03B4, 0x221E, 0x03C6, 0x03B5, 0x2229,
+  0x2261, 0x00B1, 0x2265, 0x2264, 0x2320, 0x2321, 0x00F7, 0x2248,
+  0x00B0, 0x2219, 0x00B7, 0x221A, 0x207F, 0x00B2, 0x25A0, 0x00A0,
+};
+
+static const char ctrlAction[32] = {
+  1, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 1, 0, 0, 0, 0
+};
+
+static const char ctrlAlways[32] = {
+  1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 1, 1, 1, 1,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0
+};
+
+static const struct ScreenStyle defaultStyle = { ATTR_DEFAULT, -1, -1 };
+
+static void processCharacter(struct Screen *screen, uint32_t ch);
+static void recordHistory(struct Screen *screen,
+                          const struct ScreenCell *line, int width);
+
+static void clearCells(struct ScreenCell *cell, int count,
+                       const struct ScreenStyle *style) {
+  for (int i = 0; i < count; i++) {
+    cell[i].ch    = ' ';
+    cell[i].style = *style;
+  }
+}
+
+static int isBlankCell(const struct ScreenCell *cell) {
+  return cell->ch == ' ' && cell->style.attr == ATTR_DEFAULT &&
+         cell->style.fg < 0 && cell->style.bg < 0;
+}
+
+static int sameStyle(const struct ScreenStyle *a,
+                     const struct ScreenStyle *b) {
+  return a->attr == b->attr && a->fg == b->fg && a->bg == b->bg;
+}
+
+static void clampSize(int *width, int *height) {
+  if (*width > MAX_SCREEN_WIDTH) {
+    *width                 = MAX_SCREEN_WIDTH;
+  }
+  if (*height > MAX_SCREEN_HEIGHT) {
+    *height                = MAX_SCREEN_HEIGHT;
+  }
+}
+
+static void allocateCells(struct Screen *screen, int width, int height) {
+  check(width > 0 && width <= MAX_SCREEN_WIDTH &&
+        height > 0 && height <= MAX_SCREEN_HEIGHT);
+  for (int i = 0; i < 2; i++) {
+    check(screen->cells[i] = malloc((size_t)width * (size_t)height *
+                                    sizeof(struct ScreenCell)));
+    check(screen->rows[i]  = malloc((size_t)height *
+                                    sizeof(struct ScreenCell *)));
+    for (int y = 0; y < height; y++) {
+      screen->rows[i][y]   = screen->cells[i] + (size_t)y*width;
+    }
+    clearCells(screen->cells[i], width*height, &defaultStyle);
+  }
+}
+
+static void resetTabStops(struct Screen *screen) {
+  memset(screen->tabStops, -1, screen->width + 1);
+  screen->userTabStops = 0;
+}
+
+static void resetTerminal(struct Screen *screen);
+
+void initScreen(struct Screen *screen, int width, int height, int history) {
+  check(width > 0 && height > 0);
+  clampSize(&width, &height);
+  screen->width          = width;
+  screen->height         = height;
+  allocateCells(screen, width, height);
+  check(screen->tabStops = malloc(width + 1));
+  screen->current        = 0;
+  screen->cursorX        = 0;
+  screen->cursorY        = 0;
+  screen->npar           = 0;
+  screen->questionMark   = 0;
+  memset(screen->par, 0, sizeof(screen->par));
+  memset(screen->saved, 0, sizeof(screen->saved));
+  screen->wideMode[0]    = 0;
+  screen->wideMode[1]    = 0;
+  screen->inverted       = 0;
+  screen->cursorHidden   = 0;
+  screen->title          = NULL;
+  screen->titleLength    = 0;
+  screen->titleSize      = 0;
+  screen->hasTitle       = 0;
+  for (int i = 0; i < 4; i++) {
+    screen->savedGMap[i] = i;
+  }
+  screen->savedUseGMap   = 0;
+  screen->history        = NULL;
+  screen->historyTotal   = 0;
+  if (history > 0) {
+    check(screen->history= malloc(sizeof(struct RingBuffer)));
+    initRingBuffer(screen->history, history);
+  }
+  screen->scratch        = NULL;
+  screen->scratchSize    = 0;
+  resetTerminal(screen);
+}
+
+struct Screen *newScreen(int width, int height, int history) {
+  struct Screen *screen;
+  check(screen = malloc(sizeof(struct Screen)));
+  initScreen(screen, width, height, history);
+  return screen;
+}
+
+void destroyScreen(struct Screen *screen) {
+  if (screen) {
+    for (int i = 0; i < 2; i++) {
+      free(screen->cells[i]);
+      free(screen->rows[i]);
+    }
+    free(screen->tabStops);
+    free(screen->title);
+    destroyRingBuffer(screen->history);
+    free(screen->history);
+    free(screen->scratch);
+  }
+}
+
+void deleteScreen(struct Screen *screen) {
+  destroyScreen(screen);
+  free(screen);
+}
+
+int screenAtBoundary(const struct Screen *screen) {
+  // A snapshot can only replace the output up to here, if none of that
+  // output ends in the middle of an escape sequence or of a character.
+  return screen->state == ESnormal && !screen->utfCount;
+}
+
+static struct ScreenCell *screenRow(struct Screen *screen, int y) {
+  return screen->rows[screen->current][y];
+}
+
+static void clearRegion(struct Screen *screen, int x, int y, int w, int h,
+                        const struct ScreenStyle *style) {
+  w          += x;
+  if (x < 0) {
+    x         = 0;
+  }
+  if (w > screen->width) {
+    w         = screen->width;
+  }
+  if ((w     -= x) <= 0) {
+    return;
+  }
+  h          += y;
+  if (y < 0) {
+    y         = 0;
+  }
+  if (h > screen->height) {
+    h         = screen->height;
+  }
+  for (; y < h; y++) {
+    clearCells(screenRow(screen, y) + x, w, style);
+  }
+}
+
+static void scrollLines(struct Screen *screen, int y, int h, int incY) {
+  // Moves the "h" lines starting at "y" up or down by "incY" lines, and
+  // blanks the lines that get vacated. Lines are only ever exchanged by
+  // pointer, so that scrolling the whole screen is cheap.
+  int start, count, by;
+  if (incY < 0) {
+    start                    = y + incY;
+    count                    = h - incY;
+    by                       = -incY;
+  } else {
+    start                    = y;
+    count                    = h + incY;
+    by                       = incY;
+  }
+  if (start < 0) {
+    count                   += start;
+    start                    = 0;
+  }
+  if (start + count > screen->height) {
+    count                    = screen->height - start;
+  }
+  if (by > count) {
+    by                       = count;
+  }
+  if (count <= 0 || by <= 0) {
+    return;
+  }
+  // Just like the browser, only remember lines that scroll off the top of
+  // the normal screen, while the scroll region covers all of it.
+  int record                 = screen->history && !screen->current &&
+                               incY < 0 && y == -incY &&
+                               h == screen->height + incY;
+  struct ScreenCell **rows   = screen->rows[screen->current] + start;
+  for (int i = 0; i < by; i++) {
+    struct ScreenCell *line;
+    if (incY < 0) {
+      line                   = rows[0];
+      memmove(rows, rows + 1, (count - 1)*sizeof(*rows));
+      rows[count - 1]        = line;
+      if (record) {
+        recordHistory(screen, line, screen->width);
+      }
+    } else {
+      line                   = rows[count - 1];
+      memmove(rows + 1, rows, (count - 1)*sizeof(*rows));
+      rows[0]                = line;
+    }
+    clearCells(line, screen->width, &screen->style);
+  }
+}
+
+static void scrollCharacters(struct Screen *screen, int x, int w, int incX) {
+  // Moves the "w" characters starting at "x" on the cursor line left or
+  // right by "incX" columns, and blanks the cells that get vacated.
+  struct ScreenCell *line = screenRow(screen, screen->cursorY);
+  if (w > 0) {
+    memmove(line + x + incX, line + x, w*sizeof(*line));
+  }
+  if (incX > 0) {
+    clearCells(line + x, incX, &screen->style);
+  } else {
+    clearCells(line + x + w + incX, -incX, &screen->style);
+  }
+}
+
+static void gotoXY(struct Screen *screen, int x, int y) {
+  if (x >= screen->width) {
+    x                = screen->width - 1;
+  }
+  if (x < 0) {
+    x                = 0;
+  }
+  int minY           = screen->offsetMode ? screen->top    : 0;
+  int maxY           = screen->offsetMode ? screen->bottom : screen->height;
+  if (y >= maxY) {
+    y                = maxY - 1;
+  }
+  if (y < minY) {
+    y                = minY;
+  }
+  screen->cursorX    = x;
+  screen->cursorY    = y;
+  screen->needWrap   = 0;
+}
+
+static void gotoXaY(struct Screen *screen, int x, int y) {
+  gotoXY(screen, x, screen->offsetMode ? screen->top + y : y);
+}
+
+static void bs(struct Screen *screen) {
+  if (screen->cursorX > 0) {
+    gotoXY(screen, screen->cursorX - 1, screen->cursorY);
+  }
+}
+
+static int tabStop(const struct Screen *screen, int x) {
+  // Columns are either explicitly set, explicitly cleared, or fall back
+  // to the default of a tab stop at every eighth column.
+  int state = screen->tabStops[x];
+  return state < 0 ? !(x % 8) : state;
+}
+
+static void ht(struct Screen *screen, int count) {
+  int cx       = screen->cursorX;
+  while (count-- > 0) {
+    while (cx++ < screen->width) {
+      if (tabStop(screen, cx)) {
+        break;
+      }
+    }
+  }
+  if (cx > screen->width - 1) {
+    cx         = screen->width - 1;
+  }
+  if (cx != screen->cursorX) {
+    gotoXY(screen, cx, screen->cursorY);
+  }
+}
+
+static void rt(struct Screen *screen, int count) {
+  int cx       = screen->cursorX;
+  while (count-- > 0) {
+    while (cx-- > 0) {
+      if (tabStop(screen, cx)) {
+        break;
+      }
+    }
+  }
+  if (cx < 0) {
+    cx         = 0;
+  }
+  if (cx != screen->cursorX) {
+    gotoXY(screen, cx, screen->cursorY);
+  }
+}
+
+static void cr(struct Screen *screen) {
+  gotoXY(screen, 0, screen->cursorY);
+}
+
+static void lf(struct Screen *screen, int count) {
+  if (count > screen->height) {
+    count = screen->height;
+  }
+  if (count < 1) {
+    count = 1;
+  }
+  while (count-- > 0) {
+    if (screen->cursorY == screen->bottom - 1) {
+      scrollLines(screen, screen->top + 1,
+                  screen->bottom - screen->top - 1, -1);
+    } else if (screen->cursorY < screen->height - 1) {
+      gotoXY(screen, screen->cursorX, screen->cursorY + 1);
+    }
+  }
+}
+
+static void ri(struct Screen *screen, int count) {
+  if (count > screen->height) {
+    count = screen->height;
+  }
+  if (count < 1) {
+    count = 1;
+  }
+  while (count-- > 0) {
+    if (screen->cursorY == screen->top) {
+      scrollLines(screen, screen->top,
+                  screen->bottom - screen->top - 1, 1);
+    } else if (screen->cursorY > 0) {
+      gotoXY(screen, screen->cursorX, screen->cursorY - 1);
+    }
+  }
+  screen->needWrap = 0;
+}
+
+static void saveCursor(struct Screen *screen) {
+  struct ScreenCursor *saved = &screen->saved[screen->current];
+  saved->valid               = 1;
+  saved->x                   = screen->cursorX;
+  saved->y                   = screen->cursorY;
+  saved->style               = screen->style;
+  screen->savedUseGMap       = screen->useGMap;
+  memcpy(screen->savedGMap, screen->gmap, sizeof(screen->gmap));
+}
+
+static void restoreCursor(struct Screen *screen) {
+  struct ScreenCursor *saved = &screen->saved[screen->current];
+  if (!saved->valid) {
+    return;
+  }
+  screen->style              = saved->style;
+  screen->useGMap            = screen->savedUseGMap;
+  memcpy(screen->gmap, screen->savedGMap, sizeof(screen->gmap));
+  screen->translate          = screen->gmap[screen->useGMap];
+  gotoXY(screen, saved->x, saved->y);
+}
+
+static void enableAlternateScreen(struct Screen *screen, int state) {
+  if (state == screen->current) {
+    return;
+  }
+  if (state) {
+    saveCursor(screen);
+  }
+  screen->current            = state;
+  if (state) {
+    // The alternate screen always starts out blank and in 80 column mode.
+    screen->wideMode[1]      = 0;
+    gotoXY(screen, 0, 0);
+    clearRegion(screen, 0, 0, screen->width, screen->height, &defaultStyle);
+  } else {
+    restoreCursor(screen);
+  }
+}
+
+static void resetTerminal(struct Screen *screen) {
+  // Mirrors VT100.prototype.reset(). Just like in the browser, the
+  // contents of the screen get cleared, but the window title and any
+  // saved cursor positions survive.
+  screen->state          = ESnormal;
+  screen->needWrap       = 0;
+  screen->autoWrapMode   = 1;
+  screen->dispCtrl       = 0;
+  screen->toggleMeta     = 0;
+  screen->insertMode     = 0;
+  screen->applKeyMode    = 0;
+  screen->cursorKeyMode  = 0;
+  screen->crLfMode       = 0;
+  screen->offsetMode     = 0;
+  screen->mouseReporting = 0;
+  screen->printing       = 0;
+  screen->utfEnabled     = 1;
+  screen->utfCount       = 0;
+  screen->utfChar        = 0;
+  screen->style          = defaultStyle;
+  screen->useGMap        = 0;
+  for (int i = 0; i < 4; i++) {
+    screen->gmap[i]      = i;
+  }
+  screen->translate      = screen->gmap[screen->useGMap];
+  screen->top            = 0;
+  screen->bottom         = screen->height;
+  screen->lastCharacter  = ' ';
+  resetTabStops(screen);
+  enableAlternateScreen(screen, 0);
+  screen->wideMode[0]    = 0;
+  screen->wideMode[1]    = 0;
+  gotoXY(screen, 0, 0);
+  screen->cursorHidden   = 0;
+  screen->inverted       = 0;
+  clearRegion(screen, 0, 0, screen->width, screen->height, &screen->style);
+}
+
+static void putCharacter(struct Screen *screen, uint32_t ch) {
+  if (screen->needWrap) {
+    cr(screen);
+    lf(screen, 1);
+  }
+  if (screen->insertMode) {
+    scrollCharacters(screen, screen->cursorX,
+                     screen->width - screen->cursorX - 1, 1);
+  }
+  struct ScreenCell *cell = screenRow(screen, screen->cursorY) +
+                            screen->cursorX;
+  cell->ch                = ch;
+  cell->style             = screen->style;
+  if (screen->cursorX + 1 >= screen->width) {
+    screen->needWrap      = screen->autoWrapMode;
+  } else {
+    screen->cursorX++;
+  }
+}
+
+static uint32_t translateCharacter(int map, uint32_t ch) {
+  switch (map) {
+  case MAP_GRAPHICS: return graphicsMap[ch];
+  case MAP_CP437:    return codePage437Map[ch];
+  case MAP_DIRECT:   return 0xF000 | ch;
+  default:           return ch;
+  }
+}
+
+static void expandCharacter(struct Screen *screen, uint32_t ch, int count) {
+  // The browser feeds repeated and single-shifted characters back into
+  // vt100() as a string. With UTF-8 enabled, that only works as intended
+  // for plain ASCII.
+  if (ch < 0x80 || !screen->utfEnabled) {
+    while (count-- > 0) {
+      screen->utfCount = 0;
+      processCharacter(screen, ch);
+    }
+  }
+}
+
+static void setMode(struct Screen *screen, int state) {
+  for (int i = 0; i <= screen->npar; i++) {
+    if (screen->questionMark) {
+      switch (screen->par[i]) {
+      case    1: screen->cursorKeyMode                   = state; break;
+      case    3: screen->wideMode[screen->current]       = state; break;
+      case    5: screen->inverted                        = state; break;
+      case    6: screen->offsetMode                      = state; break;
+      case    7: screen->autoWrapMode                    = state; break;
+      case 1000:
+      case    9: screen->mouseReporting                  = state; break;
+      case   25: screen->cursorHidden                    = !state; break;
+      case 1047:
+      case 1049:
+      case   47: enableAlternateScreen(screen, state);            break;
+      default:                                                    break;
+      }
+    } else {
+      switch (screen->par[i]) {
+      case    3: screen->dispCtrl                        = state; break;
+      case    4: screen->insertMode                      = state; break;
+      case   20: screen->crLfMode                        = state; break;
+      default:                                                    break;
+      }
+    }
+  }
+}
+
+static void csiAt(struct Screen *screen, int number) {
+  if (number == 0) {
+    number   = 1;
+  }
+  if (number > screen->width - screen->cursorX) {
+    number   = screen->width - screen->cursorX;
+  }
+  scrollCharacters(screen, screen->cursorX,
+                   screen->width - screen->cursorX - number, number);
+  screen->needWrap = 0;
+}
+
+static void csiJ(struct Screen *screen, int number) {
+  switch (number) {
+  case 0:
+    clearRegion(screen, screen->cursorX, screen->cursorY,
+                screen->width - screen->cursorX, 1, &screen->style);
+    // Just like the browser, this leaves the last line alone if the cursor
+    // is on the line right above it.
+    if (screen->cursorY < screen->height - 2) {
+      clearRegion(screen, 0, screen->cursorY + 1, screen->width,
+                  screen->height - screen->cursorY - 1, &screen->style);
+    }
+    break;
+  case 1:
+    if (screen->cursorY > 0) {
+      clearRegion(screen, 0, 0, screen->width, screen->cursorY,
+                  &screen->style);
+    }
+    clearRegion(screen, 0, screen->cursorY, screen->cursorX + 1, 1,
+                &screen->style);
+    break;
+  case 2:
+    clearRegion(screen, 0, 0, screen->width, screen->height,
+                &screen->style);
+    break;
+  default:
+    return;
+  }
+  screen->needWrap = 0;
+}
+
+static void csiK(struct Screen *screen, int number) {
+  switch (number) {
+  case 0:
+    clearRegion(screen, screen->cursorX, screen->cursorY,
+                screen->width - screen->cursorX, 1, &screen->style);
+    break;
+  case 1:
+    clearRegion(screen, 0, screen->cursorY, screen->cursorX + 1, 1,
+                &screen->style);
+    break;
+  case 2:
+    clearRegion(screen, 0, screen->cursorY, screen->width, 1,
+                &screen->style);
+    break;
+  default:
+    return;
+  }
+  screen->needWrap = 0;
+}
+
+static void csiLM(struct Screen *screen, int number, int insert) {
+  if (screen->cursorY >= screen->bottom) {
+    return;
+  }
+  if (number == 0) {
+    number   = 1;
+  }
+  if (number > screen->bottom - screen->cursorY) {
+    number   = screen->bottom - screen->cursorY;
+  }
+  if (insert) {
+    scrollLines(screen, screen->cursorY,
+                screen->bottom - screen->cursorY - number, number);
+  } else {
+    scrollLines(screen, screen->cursorY + number,
+                screen->bottom - screen->cursorY - number, -number);
+  }
+  screen->needWrap = 0;
+}
+
+static void csim(struct Screen *screen) {
+  struct ScreenStyle *style = &screen->style;
+  for (int i = 0; i <= screen->npar; i++) {
+    int par                 = screen->par[i];
+    switch (par) {
+    case 0:  *style         = defaultStyle;                         break;
+    case 1:  style->attr    = (style->attr & ~ATTR_DIM)|ATTR_BRIGHT; break;
+    case 2:  style->attr    = (style->attr & ~ATTR_BRIGHT)|ATTR_DIM; break;
+    case 4:  style->attr   |= ATTR_UNDERLINE;                       break;
+    case 5:  style->attr   |= ATTR_BLINK;                           break;
+    case 7:  style->attr   |= ATTR_REVERSE;                         break;
+    case 10:
+      screen->translate     = screen->gmap[screen->useGMap];
+      screen->dispCtrl      = 0;
+      screen->toggleMeta    = 0;
+      break;
+    case 11:
+    case 12:
+      screen->translate     = MAP_CP437;
+      screen->dispCtrl      = 1;
+      screen->toggleMeta    = par == 12;
+      break;
+    case 21:
+    case 22: style->attr   &= ~(ATTR_BRIGHT|ATTR_DIM);              break;
+    case 24: style->attr   &= ~ATTR_UNDERLINE;                      break;
+    case 25: style->attr   &= ~ATTR_BLINK;                          break;
+    case 27: style->attr   &= ~ATTR_REVERSE;                        break;
+    case 38:
+      if (screen->npar >= i + 2 && screen->par[i + 1] == 5) {
+        par                 = screen->par[i + 2];
+        style->fg           = par >= 0 && par <= 255 ? par : -1;
+        i                  += 2;
+      } else {
+        style->attr         = (style->attr & ~(ATTR_DIM|ATTR_BRIGHT|0x0F)) |
+                              ATTR_UNDERLINE | ATTR_DEF_FG;
+      }
+      break;
+    case 39:
+      style->attr           = (style->attr & ~(ATTR_DIM|ATTR_BRIGHT|
+                                               ATTR_UNDERLINE|0x0F)) |
+                              ATTR_DEF_FG;
+      style->fg             = -1;
+      break;
+    case 48:
+      if (screen->npar >= i + 2 && screen->par[i + 1] == 5) {
+        par                 = screen->par[i + 2];
+        style->bg           = par >= 0 && par <= 255 ? par : -1;
+        i                  += 2;
+      }
+      break;
+    case 49:
+      style->attr          |= 0xF0|ATTR_DEF_BG;
+      style->bg             = -1;
+      break;
+    default:
+      if (par >= 30 && par <= 37) {
+        style->attr         = ((style->attr & ~0x0F) | (par - 30)) &
+                              ~ATTR_DEF_FG;
+        style->fg           = -1;
+      } else if (par >= 40 && par <= 47) {
+        style->attr         = ((style->attr & ~0xF0) | ((par - 40) << 4)) &
+                              ~ATTR_DEF_BG;
+        style->bg           = -1;
+      }
+      break;
+    }
+  }
+}
+
+static void csiPX(struct Screen *screen, int number, int delete) {
+  if (number == 0) {
+    number   = 1;
+  }
+  if (number > screen->width - screen->cursorX) {
+    number   = screen->width - screen->cursorX;
+  }
+  if (delete) {
+    scrollCharacters(screen, screen->cursorX + number,
+                     screen->width - screen->cursorX - number, -number);
+  } else {
+    clearRegion(screen, screen->cursorX, screen->cursorY, number, 1,
+                &screen->style);
+  }
+  screen->needWrap = 0;
+}
+
+static void appendTitle(struct Screen *screen, uint32_t ch) {
+  if (screen->titleLength >= MAX_TITLE) {
+    return;
+  }
+  if (screen->titleLength == screen->titleSize) {
+    screen->titleSize     = screen->titleSize ? 2*screen->titleSize : 64;
+    check(screen->title   = realloc(screen->title,
+                                    screen->titleSize*sizeof(uint32_t)));
+  }
+  screen->title[screen->titleLength++] = ch;
+}
+
+static void gotPars(struct Screen *screen, uint32_t ch) {
+  int *par             = screen->par;
+  screen->state        = ESnormal;
+  if (screen->questionMark) {
+    switch (ch) {
+    case 'h': setMode(screen, 1);                                    break;
+    case 'l': setMode(screen, 0);                                    break;
+    default:                                                         break;
+    }
+    screen->questionMark = 0;
+    return;
+  }
+  int cx               = screen->cursorX;
+  int cy               = screen->cursorY;
+  switch (ch) {
+  case '!': screen->state = ESbang;                                  break;
+  case '>': if (!screen->npar) screen->state = ESdeviceattr;         break;
+  case 'G':
+  case '`': gotoXY(screen, par[0] - 1, cy);                          break;
+  case 'A': gotoXY(screen, cx, cy - (par[0] ? par[0] : 1));          break;
+  case 'B':
+  case 'e': gotoXY(screen, cx, cy + (par[0] ? par[0] : 1));          break;
+  case 'C':
+  case 'a': gotoXY(screen, cx + (par[0] ? par[0] : 1), cy);          break;
+  case 'D': gotoXY(screen, cx - (par[0] ? par[0] : 1), cy);          break;
+  case 'E': gotoXY(screen, 0, cy + (par[0] ? par[0] : 1));           break;
+  case 'F': gotoXY(screen, 0, cy - (par[0] ? par[0] : 1));           break;
+  case 'd': gotoXaY(screen, cx, par[0] - 1);                         break;
+  case 'H':
+  case 'f': gotoXaY(screen, par[1] - 1, par[0] - 1);                 break;
+  case 'I': ht(screen, par[0] ? par[0] : 1);                         break;
+  case '@': csiAt(screen, par[0]);                                   break;
+  case 'i': if (par[0] == 5) screen->printing = 1;                   break;
+  case 'J': csiJ(screen, par[0]);                                    break;
+  case 'K': csiK(screen, par[0]);                                    break;
+  case 'L': csiLM(screen, par[0], 1);                                break;
+  case 'M': csiLM(screen, par[0], 0);                                break;
+  case 'm': csim(screen);                                            break;
+  case 'P': csiPX(screen, par[0], 1);                                break;
+  case 'X': csiPX(screen, par[0], 0);                                break;
+  case 'S': lf(screen, par[0] ? par[0] : 1);                         break;
+  case 'T': ri(screen, par[0] ? par[0] : 1);                         break;
+  case 'g':
+    if (par[0] == 0) {
+      screen->tabStops[cx]  = 0;
+      screen->userTabStops  = 1;
+    } else if (par[0] == 2 || par[0] == 3) {
+      memset(screen->tabStops, 0, screen->width);
+      screen->userTabStops  = 1;
+    }
+    break;
+  case 'h': setMode(screen, 1);                                      break;
+  case 'l': setMode(screen, 0);                                      break;
+  case 'r': {
+    int t                   = par[0] ? par[0] : 1;
+    int b                   = par[1] ? par[1] : screen->height;
+    if (t < b && b <= screen->height) {
+      screen->top           = t - 1;
+      screen->bottom        = b;
+      gotoXaY(screen, 0, 0);
+    }
+    break; }
+  case 'b': {
+    int count               = par[0] ? par[0] : 1;
+    if (count > screen->width * screen->height) {
+      count                 = screen->width * screen->height;
+    }
+    expandCharacter(screen, screen->lastCharacter, count);
+    break; }
+  case 's': saveCursor(screen);                                      break;
+  case 'u': restoreCursor(screen);                                   break;
+  case 'Z': rt(screen, par[0] ? par[0] : 1);                         break;
+  default:                                                           break;
+  }
+}
+
+static void doControl(struct Screen *screen, uint32_t ch) {
+  switch (ch) {
+  case 0x00: /* ignored */                                           break;
+  case 0x08: bs(screen);                                             break;
+  case 0x09: ht(screen, 1);                                          break;
+  case 0x0A:
+  case 0x0B:
+  case 0x0C:
+  case 0x84: lf(screen, 1);
+             if (!screen->crLfMode) {
+               break;
+             }
+             /* fall thru */
+  case 0x0D: cr(screen);                                             break;
+  case 0x85: cr(screen); lf(screen, 1);                              break;
+  case 0x0E: screen->useGMap   = 1;
+             screen->translate = screen->gmap[1];
+             screen->dispCtrl  = 1;                                  break;
+  case 0x0F: screen->useGMap   = 0;
+             screen->translate = screen->gmap[0];
+             screen->dispCtrl  = 0;                                  break;
+  case 0x18:
+  case 0x1A: screen->state     = ESnormal;                           break;
+  case 0x1B: screen->state     = ESesc;                              break;
+  case 0x7F: /* ignored */                                           break;
+  case 0x88: screen->tabStops[screen->cursorX] = 1;
+             screen->userTabStops = 1;                               break;
+  case 0x8D: ri(screen, 1);                                          break;
+  case 0x8E: screen->state     = ESss2;                              break;
+  case 0x8F: screen->state     = ESss3;                              break;
+  case 0x9A: /* answered by the browser */                           break;
+  case 0x9B: screen->state     = ESsquare;                           break;
+  case 0x07: if (screen->state != EStitle) {
+               break;
+             }
+             /* fall thru */
+  default:   switch (screen->state) {
+    case ESesc:
+      screen->state            = ESnormal;
+      switch (ch) {
+      case '%': screen->state  = ESpercent;                          break;
+      case '(': screen->state  = ESsetG0;                            break;
+      case '-':
+      case ')': screen->state  = ESsetG1;                            break;
+      case '.':
+      case '*': screen->state  = ESsetG2;                            break;
+      case '/':
+      case '+': screen->state  = ESsetG3;                            break;
+      case '#': screen->state  = EShash;                             break;
+      case '7': saveCursor(screen);                                  break;
+      case '8': restoreCursor(screen);                               break;
+      case '>': screen->applKeyMode = 0;                             break;
+      case '=': screen->applKeyMode = 1;                             break;
+      case 'D': lf(screen, 1);                                       break;
+      case 'E': cr(screen); lf(screen, 1);                           break;
+      case 'M': ri(screen, 1);                                       break;
+      case 'N': screen->state  = ESss2;                              break;
+      case 'O': screen->state  = ESss3;                              break;
+      case 'H': screen->tabStops[screen->cursorX] = 1;
+                screen->userTabStops = 1;                            break;
+      case '[': screen->state  = ESsquare;                           break;
+      case ']': screen->state  = ESnonstd;                           break;
+      case 'c': resetTerminal(screen);                               break;
+      default:                                                       break;
+      }
+      break;
+    case ESnonstd:
+      switch (ch) {
+      case '0':
+      case '1':
+      case '2': screen->state       = EStitle;
+                screen->titleLength = 0;
+                screen->hasTitle    = 1;                             break;
+      case '6':
+      case '7': screen->state       = ESVTEtitle;                    break;
+      case 'P': screen->npar        = 0;
+                screen->state       = ESpalette;                     break;
+      default:  screen->state       = ESnormal;                      break;
+      }
+      break;
+    case ESpalette:
+      if ((ch >= '0' && ch <= '9') || (ch >= 'A' && ch <= 'F') ||
+          (ch >= 'a' && ch <= 'f')) {
+        if (++screen->npar == 7) {
+          screen->state        = ESnormal;
+        }
+      } else {
+        screen->state          = ESnormal;
+      }
+      break;
+    case ESsquare:
+      screen->npar             = 0;
+      memset(screen->par, 0, sizeof(screen->par));
+      screen->state            = ESgetpars;
+      if (ch == '[') {
+        screen->state          = ESfunckey;
+        break;
+      }
+      screen->questionMark     = ch == '?';
+      if (screen->questionMark) {
+        break;
+      }
+      /* fall thru */
+    case ESdeviceattr:
+    case ESgetpars:
+      if (ch == ';') {
+        // The browser accepts any number of parameters, but none of the
+        // sequences that we care about use more than a handful.
+        if (screen->npar < 15) {
+          screen->npar++;
+        }
+        break;
+      } else if (ch >= '0' && ch <= '9') {
+        int *par               = &screen->par[screen->npar];
+        if (*par < 100000) {
+          *par                 = 10*(*par) + (ch & 0xF);
+        }
+        break;
+      } else if (screen->state == ESdeviceattr) {
+        screen->state          = ESnormal;
+        break;
+      }
+      gotPars(screen, ch);
+      break;
+    case ESbang:
+      if (ch == 'p') {
+        resetTerminal(screen);
+      }
+      screen->state            = ESnormal;
+      break;
+    case ESpercent:
+      screen->state            = ESnormal;
+      switch (ch) {
+      case '@': screen->utfEnabled = 0;                              break;
+      case 'G':
+      case '8': screen->utfEnabled = 1;                              break;
+      default:                                                       break;
+      }
+      break;
+    case ESsetG0:
+    case ESsetG1:
+    case ESsetG2:
+    case ESsetG3: {
+      int g                    = screen->state - ESsetG0;
+      screen->state            = ESnormal;
+      switch (ch) {
+      case '0': screen->gmap[g] = MAP_GRAPHICS;                      break;
+      case 'B': screen->gmap[g] = MAP_LATIN1;                        break;
+      case 'U': screen->gmap[g] = MAP_CP437;                         break;
+      case 'K': screen->gmap[g] = MAP_DIRECT;                        break;
+      default:                                                       break;
+      }
+      if (screen->useGMap == g) {
+        screen->translate      = screen->gmap[g];
+      }
+      break; }
+    case EStitle:
+      if (ch == 0x07) {
+        screen->state          = ESnormal;
+      } else {
+        appendTitle(screen, ch);
+      }
+      break;
+    case ESss2:
+    case ESss3:
+      if (ch < 256) {
+        ch                     = translateCharacter(
+                                   screen->gmap[screen->state - ESss2 + 2],
+                                   screen->toggleMeta ? (ch | 0x80) : ch);
+        if ((ch & 0xFF00) == 0xF000) {
+          ch                  &= 0xFF;
+        } else if (ch == 0xFEFF || (ch >= 0x200A && ch <= 0x200F)) {
+          screen->state        = ESnormal;
+          break;
+        }
+      }
+      screen->lastCharacter    = ch;
+      screen->state            = ESnormal;
+      expandCharacter(screen, ch, 1);
+      break;
+    case ESVTEtitle:
+      if (ch == 0x07 || ch == '\\') {
+        screen->state          = ESnormal;
+      }
+      break;
+    default:
+      // ESfunckey, EShash and ESignore all swallow exactly one character.
+      screen->state            = ESnormal;
+      break;
+    }
+    break;
+  }
+}
+
+static void printerControl(struct Screen *screen, uint32_t ch) {
+  // While the browser is printing, the screen doesn't change. All we need
+  // to recognize is the sequence that turns the printer off again.
+  if (ch == 0x1B) {
+    screen->state              = ESesc;
+    return;
+  }
+  switch (screen->state) {
+  case ESesc:
+    screen->state              = ch == '[' ? ESsquare : ESnormal;
+    break;
+  case ESsquare:
+    screen->npar               = 0;
+    memset(screen->par, 0, sizeof(screen->par));
+    screen->state              = ESgetpars;
+    screen->questionMark       = ch == '?';
+    if (screen->questionMark) {
+      break;
+    }
+    /* fall thru */
+  case ESgetpars:
+    if (ch == ';') {
+      if (screen->npar < 15) {
+        screen->npar++;
+      }
+      break;
+    } else if (ch >= '0' && ch <= '9') {
+      int *par                 = &screen->par[screen->npar];
+      if (*par < 100000) {
+        *par                   = 10*(*par) + (ch & 0xF);
+      }
+      break;
+    }
+    screen->state              = ESnormal;
+    if (!screen->questionMark && ch == 'i' && screen->par[0] == 4) {
+      screen->printing         = 0;
+    }
+    screen->questionMark       = 0;
+    break;
+  default:
+    screen->state              = ESnormal;
+    break;
+  }
+}
+
+static void processCharacter(struct Screen *screen, uint32_t ch) {
+  int isNormalCharacter =
+    ((ch >= 32 && ch <= 127) || ch >= 160 ||
+     (screen->utfEnabled && ch >= 128) ||
+     !(screen->dispCtrl ? ctrlAlways : ctrlAction)[ch & 0x1F]) &&
+    (ch != 0x7F || screen->dispCtrl);
+  if (isNormalCharacter && screen->state == ESnormal) {
+    if (ch < 256) {
+      ch                    = translateCharacter(screen->translate,
+                                    screen->toggleMeta ? (ch | 0x80) : ch);
+    }
+    if ((ch & 0xFF00) == 0xF000) {
+      ch                   &= 0xFF;
+    } else if (ch == 0xFEFF || (ch >= 0x200A && ch <= 0x200F)) {
+      return;
+    }
+    screen->lastCharacter   = ch;
+    if (!screen->printing) {
+      putCharacter(screen, ch);
+    }
+  } else if (screen->printing) {
+    printerControl(screen, ch);
+  } else {
+    doControl(screen, ch);
+  }
+}
+
+void screenWrite(struct Screen *screen, const char *buf, int len) {
+  for (int i = 0; i < len; i++) {
+    uint32_t ch           = (unsigned char)buf[i];
+    if (ch >= 0x20 && ch < 0x7F && screen->state == ESnormal &&
+        screen->translate == MAP_LATIN1 && !screen->toggleMeta &&
+        !screen->printing) {
+      // Plain ASCII text is by far the most common input, and it doesn't
+      // need any of the checks below.
+      screen->utfCount    = 0;
+      screen->lastCharacter = ch;
+      putCharacter(screen, ch);
+      continue;
+    }
+    if (screen->utfEnabled) {
+      if (ch > 0x7F) {
+        if (screen->utfCount > 0 && (ch & 0xC0) == 0x80) {
+          screen->utfChar = (screen->utfChar << 6) | (ch & 0x3F);
+          if (--screen->utfCount > 0) {
+            continue;
+          }
+          ch              = screen->utfChar > 0xFFFF ? 0xFFFD
+                                                     : screen->utfChar;
+        } else {
+          if ((ch & 0xE0) == 0xC0) {
+            screen->utfCount = 1;
+            screen->utfChar  = ch & 0x1F;
+          } else if ((ch & 0xF0) == 0xE0) {
+            screen->utfCount = 2;
+            screen->utfChar  = ch & 0x0F;
+          } else if ((ch & 0xF8) == 0xF0) {
+            screen->utfCount = 3;
+            screen->utfChar  = ch & 0x07;
+          } else if ((ch & 0xFC) == 0xF8) {
+            screen->utfCount = 4;
+            screen->utfChar  = ch & 0x03;
+          } else if ((ch & 0xFE) == 0xFC) {
+            screen->utfCount = 5;
+            screen->utfChar  = ch & 0x01;
+          } else {
+            screen->utfCount = 0;
+          }
+          continue;
+        }
+      } else {
+        screen->utfCount  = 0;
+      }
+    }
+    processCharacter(screen, ch);
+  }
+}
+
+static int usedLines(struct ScreenCell **rows, int width, int height) {
+  while (height > 0) {
+    for (int x = 0; x < width; x++) {
+      if (!isBlankCell(&rows[height - 1][x])) {
+        return height;
+      }
+    }
+    height--;
+  }
+  return 0;
+}
+
+void screenResize(struct Screen *screen, int width, int height) {
+  // The browser keeps the bottom of the screen in place, and pushes lines
+  // into the scroll back buffer when the window shrinks. As we cannot pull
+  // lines back out of our history, we only approximate this by dropping
+  // lines from the top whenever the cursor or the text would no longer fit.
+  check(width > 0 && height > 0);
+  clampSize(&width, &height);
+  if (width == screen->width && height == screen->height) {
+    return;
+  }
+  int oldWidth                  = screen->width;
+  int oldHeight                 = screen->height;
+  struct ScreenCell *oldCells[2];
+  struct ScreenCell **oldRows[2];
+  for (int i = 0; i < 2; i++) {
+    oldCells[i]                 = screen->cells[i];
+    oldRows[i]                  = screen->rows[i];
+  }
+  allocateCells(screen, width, height);
+  int columns                   = width < oldWidth ? width : oldWidth;
+  for (int i = 0; i < 2; i++) {
+    int used                    = usedLines(oldRows[i], oldWidth, oldHeight);
+    if (i == screen->current && used <= screen->cursorY) {
+      used                      = screen->cursorY + 1;
+    }
+    int drop                    = used > height ? used - height : 0;
+    for (int y = 0; i == 0 && screen->history && y < drop; y++) {
+      recordHistory(screen, oldRows[i][y], oldWidth);
+    }
+    for (int y = 0; y < height && y + drop < oldHeight; y++) {
+      memcpy(screen->rows[i][y], oldRows[i][y + drop],
+             (size_t)columns*sizeof(struct ScreenCell));
+    }
+    if (i == screen->current) {
+      screen->cursorY          -= drop;
+    }
+    struct ScreenCursor *saved  = &screen->saved[i];
+    saved->y                   -= drop;
+    if (saved->y < 0) {
+      saved->y                  = 0;
+    } else if (saved->y >= height) {
+      saved->y                  = height - 1;
+    }
+    if (saved->x >= width) {
+      saved->x                  = width - 1;
+    }
+    free(oldCells[i]);
+    free(oldRows[i]);
+  }
+  screen->width                 = width;
+  screen->height                = height;
+  if (screen->cursorX >= width) {
+    screen->cursorX             = width - 1;
+  }
+  if (screen->cursorY < 0) {
+    screen->cursorY             = 0;
+  } else if (screen->cursorY >= height) {
+    screen->cursorY             = height - 1;
+  }
+  if (screen->bottom > height || screen->bottom == oldHeight) {
+    screen->bottom              = height;
+  }
+  if (screen->top >= screen->bottom) {
+    screen->top                 = screen->bottom > 0 ? screen->bottom - 1 : 0;
+  }
+  check(screen->tabStops        = realloc(screen->tabStops, width + 1));
+  if (width > oldWidth) {
+    memset(screen->tabStops + oldWidth + 1, -1, width - oldWidth);
+  }
+}
+
+struct Snapshot {
+  char *data;
+  int  length;
+  int  size;
+};
+
+static void appendBytes(struct Snapshot *out, const char *buf, int len) {
+  if (out->length + len > out->size) {
+    while (out->length + len > out->size) {
+      out->size                 = out->size ? 2*out->size : 4096;
+    }
+    check(out->data             = realloc(out->data, out->size));
+  }
+  memcpy(out->data + out->length, buf, len);
+  out->length                  += len;
+}
+
+static void appendString(struct Snapshot *out, const char *s) {
+  appendBytes(out, s, strlen(s));
+}
+
+static void appendf(struct Snapshot *out, const char *fmt, int a, int b) {
+  char buf[32];
+  appendBytes(out, buf, snprintf(buf, sizeof(buf), fmt, a, b));
+}
+
+static void appendCharacter(struct Snapshot *out, uint32_t ch) {
+  // The browser would either act upon, or drop, control characters. So,
+  // the rare cell that holds one gets rendered as a blank.
+  char buf[3];
+  if (ch < 0x20 || ch == 0x7F) {
+    ch                          = ' ';
+  }
+  if (ch < 0x80) {
+    buf[0]                      = ch;
+    appendBytes(out, buf, 1);
+  } else if (ch < 0x800) {
+    buf[0]                      = 0xC0 | (ch >> 6);
+    buf[1]                      = 0x80 | (ch & 0x3F);
+    appendBytes(out, buf, 2);
+  } else {
+    buf[0]                      = 0xE0 | (ch >> 12);
+    buf[1]                      = 0x80 | ((ch >> 6) & 0x3F);
+    buf[2]                      = 0x80 | (ch & 0x3F);
+    appendBytes(out, buf, 3);
+  }
+}
+
+static void appendStyle(struct Snapshot *out,
+                        const struct ScreenStyle *style) {
+  int attr                      = style->attr;
+  appendString(out, "\x1B[0");
+  if (attr & ATTR_BRIGHT) {
+    appendString(out, ";1");
+  } else if (attr & ATTR_DIM) {
+    appendString(out, ";2");
+  }
+  if (attr & ATTR_UNDERLINE) {
+    appendString(out, ";4");
+  }
+  if (attr & ATTR_BLINK) {
+    appendString(out, ";5");
+  }
+  if (attr & ATTR_REVERSE) {
+    appendString(out, ";7");
+  }
+  if (style->fg >= 0) {
+    appendf(out, ";38;5;%d", style->fg, 0);
+  } else if (!(attr & ATTR_DEF_FG)) {
+    appendf(out, ";%d", 30 + (attr & 0xF), 0);
+  }
+  if (style->bg >= 0) {
+    appendf(out, ";48;5;%d", style->bg, 0);
+  } else if (!(attr & ATTR_DEF_BG)) {
+    appendf(out, ";%d", 40 + ((attr >> 4) & 0xF), 0);
+  }
+  appendString(out, "m");
+}
+
+static void appendCharsets(struct Snapshot *out, const int gmap[4],
+                           int useGMap) {
+  static const char designate[] = "()*+";
+  static const char charset[]   = "B0UK";
+  for (int i = 0; i < 4; i++) {
+    char buf[3]                 = { '\x1B', designate[i], charset[gmap[i]] };
+    appendBytes(out, buf, sizeof(buf));
+  }
+  appendString(out, useGMap ? "\x0E" : "\x0F");
+}
+
+static void appendCursor(struct Snapshot *out, int x, int y) {
+  appendf(out, "\x1B[%d;%dH", y + 1, x + 1);
+}
+
+static void appendLine(struct Snapshot *out, const struct ScreenCell *line,
+                       int width) {
+  // Renders a single line, without any cursor positioning, and without its
+  // trailing blanks. The line ends in CR LF and in the default attributes.
+  struct ScreenStyle style      = defaultStyle;
+  while (width > 0 && sameStyle(&line[width - 1].style, &defaultStyle) &&
+         (line[width - 1].ch <= ' ' || line[width - 1].ch == 0x7F)) {
+    width--;
+  }
+  for (int x = 0; x < width; x++) {
+    if (!sameStyle(&style, &line[x].style)) {
+      style                     = line[x].style;
+      appendStyle(out, &style);
+    }
+    appendCharacter(out, line[x].ch);
+  }
+  if (!sameStyle(&style, &defaultStyle)) {
+    appendString(out, "\x1B[0m");
+  }
+  appendString(out, "\r\n");
+}
+
+static void recordHistory(struct Screen *screen,
+                          const struct ScreenCell *line, int width) {
+  // Adds a line that is about to scroll off the screen to our history. If
+  // there is not enough space, the oldest lines make room. Each line ends
+  // in the only LF character of its rendering.
+  struct RingBuffer *history    = screen->history;
+  struct Snapshot out           = { screen->scratch, 0, screen->scratchSize };
+  appendLine(&out, line, width);
+  screen->scratch               = out.data;
+  screen->scratchSize           = out.size;
+  if (out.length > ringBufferCapacity(history)) {
+    return;
+  }
+  while (ringBufferSpace(history) < out.length) {
+    struct iovec iov[2];
+    int count                   = ringBufferPeek(history,
+                                                 ringBufferLength(history),
+                                                 iov);
+    int len                     = 0;
+    for (int i = 0; i < count; i++) {
+      const char *lf            = memchr(iov[i].iov_base, '\n',
+                                         iov[i].iov_len);
+      if (lf) {
+        len                    += lf - (const char *)iov[i].iov_base + 1;
+        break;
+      }
+      len                      += iov[i].iov_len;
+    }
+    ringBufferConsume(history, len);
+  }
+  ringBufferWrite(history, out.data, out.length);
+  screen->historyTotal         += out.length;
+}
+
+unsigned screenHistoryMark(const struct Screen *screen) {
+  // Returns a position in the history. A snapshot can replay all the lines
+  // that got added after this position. Unlike the ring buffer's own
+  // positions, this count never starts over.
+  return screen->historyTotal;
+}
+
+static void appendHistory(struct Snapshot *out, const struct Screen *screen,
+                          unsigned historyMark) {
+  // Expects a blank screen and auto-wrapping turned off. Prints the lines
+  // from our history, then scrolls all of them into the browser's scroll
+  // back buffer, leaving the screen blank again.
+  if (!screen->history) {
+    return;
+  }
+  unsigned len                  = screenHistoryMark(screen) - historyMark;
+  if (len > (unsigned)ringBufferLength(screen->history)) {
+    len                         = ringBufferLength(screen->history);
+  }
+  if (!len) {
+    return;
+  }
+  appendCursor(out, 0, 0);
+  struct iovec iov[2];
+  int count                     = ringBufferPeekNewest(screen->history, len,
+                                                       iov);
+  int lines                     = 0;
+  for (int i = 0; i < count; i++) {
+    appendBytes(out, iov[i].iov_base, iov[i].iov_len);
+    for (const char *ptr = iov[i].iov_base,
+                    *end = ptr + iov[i].iov_len;
+         (ptr = memchr(ptr, '\n', end - ptr)) != NULL; ptr++) {
+      lines++;
+    }
+  }
+  if (lines > screen->height - 1) {
+    lines                       = screen->height - 1;
+  }
+  appendCursor(out, 0, screen->height - 1);
+  while (lines-- > 0) {
+    appendString(out, "\n");
+  }
+}
+
+static void paintScreen(struct Snapshot *out, const struct Screen *screen,
+                        int which) {
+  // Expects a blank screen, default attributes and auto-wrapping turned
+  // off. Only draws the cells that are not blank, and skips over longer
+  // runs of blank cells.
+  struct ScreenStyle style      = defaultStyle;
+  for (int y = 0; y < screen->height; y++) {
+    const struct ScreenCell *line = screen->rows[which][y];
+    int end                     = screen->width;
+    while (end > 0 && isBlankCell(&line[end - 1])) {
+      end--;
+    }
+    int x                       = 0;
+    int pos                     = -1;
+    while (x < end) {
+      int blanks                = 0;
+      while (x + blanks < end && isBlankCell(&line[x + blanks])) {
+        blanks++;
+      }
+      if (blanks > 4 || (pos < 0 && blanks)) {
+        x                      += blanks;
+        pos                     = -1;
+        continue;
+      }
+      if (pos != x) {
+        appendCursor(out, x, y);
+      }
+      if (!sameStyle(&style, &line[x].style)) {
+        style                   = line[x].style;
+        appendStyle(out, &style);
+      }
+      appendCharacter(out, line[x].ch);
+      pos                       = ++x;
+    }
+  }
+  if (!sameStyle(&style, &defaultStyle)) {
+    appendString(out, "\x1B[0m");
+  }
+}
+
+static void appendSavedCursor(struct Snapshot *out,
+                              const struct Screen *screen, int which) {
+  const struct ScreenCursor *saved = &screen->saved[which];
+  appendCursor(out, saved->x, saved->y);
+  appendStyle(out, &saved->style);
+  appendCharsets(out, screen->savedGMap, screen->savedUseGMap);
+}
+
+static void appendMode(struct Snapshot *out, const char *mode, int state) {
+  appendString(out, "\x1B[");
+  appendString(out, mode);
+  appendString(out, state ? "h" : "l");
+}
+
+char *screenSnapshot(const struct Screen *screen, unsigned historyMark,
+                     int *length) {
+  // Returns a sequence of escape codes that puts a browser, whatever state
+  // it was in, into the same state as our model. The browser has to be
+  // the same size as the model. Lines that scrolled off the screen since
+  // "historyMark" get added to the browser's scroll back buffer.
+  struct Snapshot out           = { NULL, 0, 0 };
+  static const int latin1[4]    = { MAP_LATIN1, MAP_LATIN1,
+                                    MAP_LATIN1, MAP_LATIN1 };
+
+  // Stop printing, if the browser was doing so. Then reset the terminal,
+  // which also clears the normal screen. From here on, all cells are
+  // blank, and output is interpreted as UTF-8.
+  appendString(&out, "\x1B[4i" "\x1B" "c" "\x1B%G" "\x1B[?7l");
+  // If the browser was showing the alternate screen, resetting restored
+  // the saved attributes before clearing the screen. Clear it once more.
+  appendString(&out, "\x1B[0m");
+  appendCharsets(&out, latin1, 0);
+  appendString(&out, "\x1B[2J");
+  appendHistory(&out, screen, historyMark);
+  if (screen->wideMode[0]) {
+    appendString(&out, "\x1B[?3h");
+  }
+  paintScreen(&out, screen, 0);
+  if (screen->current) {
+    // Switching to the alternate screen saves the state of the normal one.
+    appendSavedCursor(&out, screen, 0);
+    appendString(&out, "\x1B[?1049h" "\x1B[0m");
+    appendCharsets(&out, latin1, 0);
+    if (screen->wideMode[1]) {
+      appendString(&out, "\x1B[?3h");
+    }
+    paintScreen(&out, screen, 1);
+  }
+
+  // Explicitly set and cleared tab stops, and the saved cursor position.
+  for (int x = 0; x < screen->width; x++) {
+    if (screen->tabStops[x] >= 0) {
+      appendCursor(&out, x, 0);
+      appendString(&out, screen->tabStops[x] ? "\x1BH" : "\x1B[g");
+    }
+  }
+  if (screen->saved[screen->current].valid) {
+    appendSavedCursor(&out, screen, screen->current);
+    appendString(&out, "\x1B" "7" "\x1B[0m");
+    appendCharsets(&out, latin1, 0);
+  }
+
+  // Setting the scroll region moves the cursor. So, do that before
+  // positioning the cursor. If the next character is going to wrap to a
+  // new line, the only way to get the browser into that state is by
+  // printing the last character on the line once more.
+  if (screen->top || screen->bottom != screen->height) {
+    appendf(&out, "\x1B[%d;%dr", screen->top + 1, screen->bottom);
+  }
+  int wrap                      = screen->needWrap &&
+                                  screen->cursorX == screen->width - 1;
+  if (screen->autoWrapMode || wrap) {
+    appendMode(&out, "?7", 1);
+  }
+  if (wrap) {
+    const struct ScreenCell *cell =
+                        &screen->rows[screen->current][screen->cursorY]
+                                     [screen->width - 1];
+    appendCursor(&out, screen->width - 1, screen->cursorY);
+    appendStyle(&out, &cell->style);
+    appendCharacter(&out, cell->ch);
+    if (!screen->autoWrapMode) {
+      appendMode(&out, "?7", 0);
+    }
+  } else {
+    appendCursor(&out, screen->cursorX, screen->cursorY);
+  }
+
+  // None of the remaining settings move the cursor.
+  appendStyle(&out, &screen->style);
+  int override                  = screen->translate !=
+                                  screen->gmap[screen->useGMap];
+  if (screen->toggleMeta && !override) {
+    appendString(&out, "\x1B[12m");
+  }
+  appendCharsets(&out, screen->gmap, screen->useGMap);
+  if (override) {
+    appendString(&out, screen->toggleMeta ? "\x1B[12m" : "\x1B[11m");
+  }
+  appendMode(&out, "3", screen->dispCtrl);
+  if (screen->insertMode) {
+    appendMode(&out, "4", 1);
+  }
+  if (screen->crLfMode) {
+    appendMode(&out, "20", 1);
+  }
+  if (screen->cursorKeyMode) {
+    appendMode(&out, "?1", 1);
+  }
+  if (screen->inverted) {
+    appendMode(&out, "?5", 1);
+  }
+  if (screen->offsetMode) {
+    appendMode(&out, "?6", 1);
+  }
+  if (screen->mouseReporting) {
+    appendMode(&out, "?1000", 1);
+  }
+  if (screen->cursorHidden) {
+    appendMode(&out, "?25", 0);
+  }
+  if (screen->applKeyMode) {
+    appendString(&out, "\x1B=");
+  }
+  if (screen->hasTitle) {
+    appendString(&out, "\x1B]0");
+    for (int i = 0; i < screen->titleLength; i++) {
+      appendCharacter(&out, screen->title[i]);
+    }
+    appendString(&out, "\x07");
+  }
+  if (!screen->utfEnabled) {
+    appendString(&out, "\x1B%@");
+  }
+  if (screen->printing) {
+    appendString(&out, "\x1B[5i");
+  }
+  *length                       = out.length;
+  return out.data;
+}
@@ -0,0 +1,150 @@
+// screen.h -- Server-side model of the terminal screen
+// Copyright (C) 2008-2010 Markus Gutschke <markus@shellinabox.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// In addition to these license terms, the author grants the following
+// additional rights:
+//
+// If you modify this program, or any covered work, by linking or
+// combining it with the OpenSSL project's OpenSSL library (or a
+// modified version of that library), containing parts covered by the
+// terms of the OpenSSL or SSLeay licenses, the author
+// grants you additional permission to convey the resulting work.
+// Corresponding Source for a non-source form of such a combination
+// shall include the source code for the parts of OpenSSL used as well
+// as that of the covered work.
+//
+// You may at your option choose to remove this additional permission from
+// the work, or from any part of it.
+//
+// It is possible to build this program in a way that it loads OpenSSL
+// libraries at run-time. If doing so, the following notices are required
+// by the OpenSSL and SSLeay licenses:
+//
+// This product includes software developed by the OpenSSL Project
+// for use in the OpenSSL Toolkit. (http://www.openssl.org/)
+//
+// This product includes cryptographic software written by Eric Young
+// (eay@cryptsoft.com)
+//
+//
+// The most up-to-date version of this program is always available from
+// http://shellinabox.com
+
+#ifndef SCREEN_H__
+#define SCREEN_H__
+
+#include <stdint.h>
+
+#include "shellinabox/ring.h"
+
+// A headless copy of the state machine that VT100.prototype.vt100() runs in
+// the browser. The server feeds it everything that it reads from the pty,
+// so that it can tell a client, which has fallen too far behind, what its
+// screen should look like now instead of replaying all the missed output.
+// The client's rendering quirks are reproduced deliberately, as the goal is
+// to match what the browser would have shown, not what an xterm would have
+// shown.
+//
+// Lines that scroll off the top of the normal screen are kept, already
+// rendered as escape sequences, in a bounded history. A snapshot can replay
+// them into the browser's scroll back buffer before repainting the screen.
+
+// The largest terminal that gets modelled. Clients can claim any size that
+// they like, but bigger screens are clamped to this.
+#define MAX_SCREEN_WIDTH  1024
+#define MAX_SCREEN_HEIGHT 512
+
+struct ScreenStyle {
+  uint16_t attr;
+  int16_t  fg;
+  int16_t  bg;
+};
+
+struct ScreenCell {
+  uint32_t           ch;
+  struct ScreenStyle style;
+};
+
+struct ScreenCursor {
+  int                valid;
+  int                x;
+  int                y;
+  struct ScreenStyle style;
+};
+
+struct Screen {
+  int                 width;
+  int                 height;
+  struct ScreenCell   *cells[2];
+  struct ScreenCell   **rows[2];
+  int                 current;
+  int                 cursorX;
+  int                 cursorY;
+  int                 top;
+  int                 bottom;
+  int                 needWrap;
+  struct ScreenStyle  style;
+  int                 state;
+  int                 npar;
+  int                 par[16];
+  int                 questionMark;
+  int                 utfEnabled;
+  int                 utfCount;
+  uint32_t            utfChar;
+  int                 gmap[4];
+  int                 useGMap;
+  int                 translate;
+  int                 dispCtrl;
+  int                 toggleMeta;
+  int                 autoWrapMode;
+  int                 insertMode;
+  int                 crLfMode;
+  int                 offsetMode;
+  int                 cursorKeyMode;
+  int                 applKeyMode;
+  int                 mouseReporting;
+  int                 cursorHidden;
+  int                 inverted;
+  int                 wideMode[2];
+  int                 printing;
+  struct ScreenCursor saved[2];
+  int                 savedGMap[4];
+  int                 savedUseGMap;
+  signed char         *tabStops;
+  int                 userTabStops;
+  uint32_t            lastCharacter;
+  uint32_t            *title;
+  int                 titleLength;
+  int                 titleSize;
+  int                 hasTitle;
+  struct RingBuffer   *history;
+  unsigned            historyTotal;
+  char                *scratch;
+  int                 scratchSize;
+};
+
+struct Screen *newScreen(int width, int height, int history);
+void initScreen(struct Screen *screen, int width, int height, int history);
+void destroyScreen(struct Screen *screen);
+void deleteScreen(struct Screen *screen);
+void screenResize(struct Screen *screen, int width, int height);
+int  screenAtBoundary(const struct Screen *screen);
+void screenWrite(struct Screen *screen, const char *buf, int len);
+unsigned screenHistoryMark(const struct Screen *screen);
+char *screenSnapshot(const struct Screen *screen, unsigned historyMark,
+                     int *length);
+
+#endif /* SCREEN_H__ */
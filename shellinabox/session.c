@@ -62,10 +62,15 @@
 #define UNUSED(x)    do { (void)(x); } while (0)
 #endif
 
-static HashMap *sessions;
+// Each reactor thread keeps track of the sessions that it owns.
+static __thread HashMap *sessions;
+static __thread char    *sessionKeyPrefix;
 
+// Configured once at start up, before any reactor threads exist.
+static int              sessionBufferSize = DEFAULT_SESSION_BUFFER;
 
-static struct Graveyard {
+
+static __thread struct Graveyard {
   struct Graveyard *next;
   time_t           timeout;
   const char       *sessionKey;
@@ -114,14 +119,37 @@ void initSession(struct Session *session, const char *sessionKey,
   check(session->peerName = strdup(peerName));
   session->connection     = NULL;
   session->http           = NULL;
+  session->websocket      = NULL;
+  session->stream         = NULL;
+  session->echo           = NULL;
+  session->echoSince      = 0;
+  session->keys           = NULL;
+  session->input          = NULL;
+  session->inputStart     = 0;
+  session->inputLength    = 0;
+  session->inputSize      = 0;
+  session->upload         = NULL;
   session->done           = 0;
   session->pty            = -1;
   session->ptyFirstRead   = 1;
   session->width          = 0;
   session->height         = 0;
-  session->buffered       = NULL;
   session->useLogin       = 0;
-  session->len            = 0;
+  initRingBuffer(&session->output, sessionBufferSize);
+  session->outputOffset   = 0;
+  session->unacked        = 0;
+  session->acking         = 0;
+  session->replySize      = MIN_RESPONSE;
+  session->flushPending   = 0;
+  session->lastOutput     = 0;
+  session->screen         = NULL;
+  session->skipping       = 0;
+  session->historyMark    = 0;
+  session->blockedSince   = 0;
+  session->deflate        = NULL;
+  session->deflated       = 0;
+  session->inflated       = -1;
+  session->utf8           = 0;
   session->pid            = 0;
   session->cleanup        = 0;
 }
@@ -138,6 +166,10 @@ void destroySession(struct Session *session) {
   if (session) {
     free((char *)session->peerName);
     free((char *)session->sessionKey);
+    deleteHttpDeflateStream(session->deflate);
+    destroyRingBuffer(&session->output);
+    free(session->input);
+    deleteScreen(session->screen);
     if (session->pty >= 0) {
       NOINTR(close(session->pty));
     }
@@ -170,15 +202,29 @@ static void destroySessionHashEntry(void *arg ATTR_UNUSED,
   deleteSession((struct Session *)value);
 }
 
+void setSessionKeyPrefix(const char *prefix) {
+  free(sessionKeyPrefix);
+  sessionKeyPrefix   = prefix ? strdup(prefix) : NULL;
+}
+
+void setSessionBufferSize(int size) {
+  check(size >= MIN_SESSION_BUFFER && size <= MAX_SESSION_BUFFER);
+  sessionBufferSize  = size;
+}
+
 char *newSessionKey(void) {
   int fd;
   check((fd = NOINTR(open("/dev/urandom", O_RDONLY))) >= 0);
   unsigned char buf[16];
   check(NOINTR(read(fd, buf, sizeof(buf))) == sizeof(buf));
   NOINTR(close(fd));
+  int prefixLength   = sessionKeyPrefix ? strlen(sessionKeyPrefix) : 0;
   char *sessionKey;
-  check(sessionKey   = malloc((8*sizeof(buf) + 5)/6 + 1));
-  char *ptr          = sessionKey;
+  check(sessionKey   = malloc(prefixLength + (8*sizeof(buf) + 5)/6 + 1));
+  if (prefixLength) {
+    memcpy(sessionKey, sessionKeyPrefix, prefixLength);
+  }
+  char *ptr          = sessionKey + prefixLength;
   int count          = 0;
   int bits           = 0;
   for (unsigned i = 0;;) {
@@ -240,6 +286,14 @@ struct Session *findSession(const char *sessionKey, const char *cgiSessionKey,
   return session;
 }
 
+void addSession(struct Session *session) {
+  if (!sessions) {
+    sessions             = newHashMap(destroySessionHashEntry, NULL);
+  }
+  check(!getFromHashMap(sessions, session->sessionKey));
+  addToHashMap(sessions, session->sessionKey, (const char *)session);
+}
+
 void iterateOverSessions(int (*fnc)(void *, const char *, char **), void *arg){
   iterateOverHashMap(sessions, fnc, arg);
 }
@@ -46,26 +46,62 @@
 #ifndef SESSION_H__
 #define SESSION_H__
 
+#include <stdint.h>
+
 #include "libhttp/http.h"
+#include "shellinabox/ring.h"
+#include "shellinabox/screen.h"
 
 #define AJAX_TIMEOUT 45
+#define MIN_RESPONSE 2048
+#define DEFAULT_SESSION_BUFFER (32 << 10)
+#define MIN_SESSION_BUFFER     (1 << 10)
+#define MAX_SESSION_BUFFER     (1 << 20)
+#define SESSION_HISTORY        (32 << 10)
+#define MAX_INPUT_QUEUE        (16 << 20)
+#define INPUT_HIGH_WATER       (64 << 10)
+
+struct KeysUpload;
 
 struct Session {
-  const char       *sessionKey;
-  Server           *server;
-  ServerConnection *connection;
-  const char       *peerName;
-  HttpConnection   *http;
-  int              done;
-  int              pty;
-  int              ptyFirstRead;
-  int              width;
-  int              height;
-  char             *buffered;
-  int              useLogin;
-  int              len;
-  pid_t            pid;
-  int              cleanup;
+  const char        *sessionKey;
+  Server            *server;
+  ServerConnection  *connection;
+  const char        *peerName;
+  HttpConnection    *http;
+  HttpConnection    *websocket;
+  HttpConnection    *stream;
+  HttpConnection    *echo;
+  int64_t           echoSince;
+  HttpConnection    *keys;
+  char              *input;
+  int               inputStart;
+  int               inputLength;
+  int               inputSize;
+  struct KeysUpload *upload;
+  int               done;
+  int               pty;
+  int               ptyFirstRead;
+  int               width;
+  int               height;
+  int               useLogin;
+  struct RingBuffer output;
+  int64_t           outputOffset;
+  int               unacked;
+  int               acking;
+  int               replySize;
+  int               flushPending;
+  int64_t           lastOutput;
+  struct Screen     *screen;
+  int               skipping;
+  unsigned          historyMark;
+  int64_t           blockedSince;
+  HttpDeflateStream *deflate;
+  int               deflated;
+  int               inflated;
+  int               utf8;
+  pid_t             pid;
+  int               cleanup;
 };
 
 void addToGraveyard(struct Session *session);
@@ -77,9 +113,12 @@ struct Session *newSession(const char *sessionKey, Server *server,
 void destroySession(struct Session *session);
 void deleteSession(struct Session *session);
 void abandonSession(struct Session *session);
+void setSessionKeyPrefix(const char *prefix);
+void setSessionBufferSize(int size);
 char *newSessionKey(void);
 void finishSession(struct Session *session);
 void finishAllSessions(void);
+void addSession(struct Session *session);
 struct Session *findSession(const char *sessionKey, const char *cgiSessionKey,
                             int *sessionIsNew, HttpConnection *http);
 void iterateOverSessions(int (*fnc)(void *, const char *, char **), void *arg);
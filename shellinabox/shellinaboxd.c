@@ -73,12 +73,15 @@
 #include "libhttp/http.h"
 #include "libhttp/server.h"
 #include "logging/logging.h"
+#include "shellinabox/escape.h"
 #include "shellinabox/externalfile.h"
 #include "shellinabox/launcher.h"
 #include "shellinabox/privileges.h"
 #include "shellinabox/service.h"
 #include "shellinabox/session.h"
 #include "shellinabox/usercss.h"
+#include "shellinabox/upgrade.h"
+#include "shellinabox/workers.h"
 
 #ifdef HAVE_UNUSED
 #defined ATTR_UNUSED __attribute__((unused))
@@ -102,7 +105,13 @@
 #include "shellinabox/vt100.h"
 
 #define PORTNUM           4200
-#define MAX_RESPONSE      2048
+#define MAX_WEBSOCKET_BACKLOG (16*MIN_RESPONSE)
+#define MAX_STREAM_BACKLOG    (16*MIN_RESPONSE)
+
+// Reads from the pty that are at least this large, or that follow the
+// previous read within this many milliseconds, indicate bulk output.
+#define BULK_READ         512
+#define BULK_INTERVAL     10
 
 static int            port;
 static int            portMin;
@@ -117,6 +126,14 @@ static int            forceSSL          = 1; // TODO enable http fallback with c
 int                   enableUtmpLogging = 1;
 static char           *messagesOrigin   = NULL;
 static int            linkifyURLs       = 1;
+static int            numWorkers        = 1;
+static int            numThreads        = 1;
+static int            maxConnections    = 0;
+static int            maxPerPeer        = 0;
+static int            coalesceDelay     = 2;
+static int            frameSkipDelay    = 1000;
+static int            echoDelay         = 0;
+static int            sessionGrace      = AJAX_TIMEOUT;
 static char           *certificateDir;
 static int            certificateFd     = -1;
 static HashMap        *externalFiles;
@@ -125,74 +142,13 @@ static char           *cgiSessionKey;
 static int            cgiSessions;
 static char           *cssStyleSheet;
 static struct UserCSS *userCSSList;
+static char           *rootPage;
+static char           *shellInABoxJS;
+static int            shellInABoxJSLength;
 static const char     *pidfile;
 static sigjmp_buf     jmpenv;
 static volatile int   exiting;
 
-static char *jsonEscape(const char *buf, int len) {
-  static const char *hexDigit = "0123456789ABCDEF";
-
-  // Determine the space that is needed to encode the buffer
-  int count                   = 0;
-  const char *ptr             = buf;
-  for (int i = 0; i < len; i++) {
-    unsigned char ch          = *(unsigned char *)ptr++;
-    if (ch < ' ') {
-      switch (ch) {
-      case '\b': case '\f': case '\n': case '\r': case '\t':
-        count                += 2;
-        break;
-      default:
-        count                += 6;
-        break;
-      }
-    } else if (ch == '"' || ch == '\\' || ch == '/') {
-      count                  += 2;
-    } else if (ch > '\x7F') {
-      count                  += 6;
-    } else {
-      count++;
-    }
-  }
-
-  // Encode the buffer using JSON string escaping
-  char *result;
-  check(result                = malloc(count + 1));
-  char *dst                   = result;
-  ptr                         = buf;
-  for (int i = 0; i < len; i++) {
-    unsigned char ch          = *(unsigned char *)ptr++;
-    if (ch < ' ') {
-      *dst++                  = '\\';
-      switch (ch) {
-      case '\b': *dst++       = 'b'; break;
-      case '\f': *dst++       = 'f'; break;
-      case '\n': *dst++       = 'n'; break;
-      case '\r': *dst++       = 'r'; break;
-      case '\t': *dst++       = 't'; break;
-      default:
-      unicode:
-        *dst++                = 'u';
-        *dst++                = '0';
-        *dst++                = '0';
-        *dst++                = hexDigit[ch >> 4];
-        *dst++                = hexDigit[ch & 0xF];
-        break;
-      }
-    } else if (ch == '"' || ch == '\\' || ch == '/') {
-      *dst++                  = '\\';
-      *dst++                  = ch;
-    } else if (ch > '\x7F') {
-      *dst++                  = '\\';
-      goto unicode;
-    } else {
-      *dst++                  = ch;
-    }
-  }
-  *dst++                      = '\000';
-  return result;
-}
-
 static int printfUnchecked(const char *format, ...) {
   // Some Linux distributions enable -Wformat=2 by default. This is a
   // very unfortunate decision, as that option generates a lot of false
@@ -205,91 +161,529 @@ static int printfUnchecked(const char *format, ...) {
   return rc;
 }
 
-static int completePendingRequest(struct Session *session,
-                                  const char *buf, int len, int maxLength) {
-  // If there is no pending HTTP request, save the data and return
-  // immediately.
-  if (!session->http) {
-    if (len) {
-      if (session->buffered) {
-        check(session->buffered = realloc(session->buffered,
-                                          session->len + len));
-        memcpy(session->buffered + session->len, buf, len);
-        session->len           += len;
-      } else {
-        check(session->buffered = malloc(len));
-        memcpy(session->buffered, buf, len);
-        session->len            = len;
-      }
-    }
+static void detachWebSocket(struct Session *session, int code) {
+  HttpConnection *http          = session->websocket;
+  if (http) {
+    session->websocket          = NULL;
+    httpSetPrivate(http, NULL);
+    httpCloseWebSocket(http, code, NULL);
+  }
+}
+
+// Marks an event stream that has sent its last event. The next callback
+// completes the reply.
+static char streamDetached;
+
+static int streamIsChunked(HttpConnection *http) {
+  const char *version           = httpGetVersion(http);
+  return version && strcmp(version, "HTTP/1.1") >= 0;
+}
+
+static void sendStreamEvent(HttpConnection *http, char *event) {
+  // Takes ownership of "event". HTTP/1.1 clients receive each event as a
+  // separate chunk, and an empty event terminates the stream. Older clients
+  // read until the connection gets closed.
+  int len                       = strlen(event);
+  if (streamIsChunked(http)) {
+    char *chunk                 = stringPrintf(NULL, "%x\r\n%s\r\n",
+                                               len, event);
+    free(event);
+    event                       = chunk;
+    len                         = strlen(chunk);
+  }
+  if (len) {
+    httpTransferPartialReply(http, event, len);
   } else {
-    // If we have a pending HTTP request, we can reply to it, now.
-    char *data;
-    if (session->buffered) {
-      check(session->buffered   = realloc(session->buffered,
-                                          session->len + len));
-      memcpy(session->buffered + session->len, buf, len);
-      session->len             += len;
-      if (maxLength > 0 && session->len > maxLength) {
-        data                    = jsonEscape(session->buffered, maxLength);
-        session->len           -= maxLength;
-        memmove(session->buffered, session->buffered + maxLength,
-                session->len);
-      } else {
-        data                    = jsonEscape(session->buffered, session->len);
-        free(session->buffered);
-        session->buffered       = NULL;
-        session->len            = 0;
-      }
+    free(event);
+  }
+}
+
+static void sendStreamData(struct Session *session, const struct iovec *iov,
+                           int count) {
+  // Each event holds a JSON encoded string, so that it never contains any
+  // line breaks.
+  char *data                    = jsonEscapeV(iov, count, session->utf8);
+  sendStreamEvent(session->stream,
+                  stringPrintf(NULL, "data: \"%s\"\n\n", data));
+  free(data);
+}
+
+static void detachStream(struct Session *session) {
+  HttpConnection *http          = session->stream;
+  if (http) {
+    session->stream             = NULL;
+    httpSetPrivate(http, &streamDetached);
+    if (session->done) {
+      sendStreamEvent(http, stringPrintf(NULL, "event: closed\ndata:\n\n"));
+    }
+    char *end;
+    check(end                   = strdup(""));
+    sendStreamEvent(http, end);
+  }
+}
+
+static void setSessionTimeout(struct Session *session) {
+  // While a keypress waits for its echo, the timer marks how long we are
+  // prepared to wait. While output is being coalesced, it marks the end of
+  // the coalescing window. While the client is falling behind, it marks the
+  // point at which we start skipping output. Otherwise, sessions time out
+  // unless the client keeps on polling. A session that has no client at all
+  // lingers for the grace period, so that a reloaded page can resume it.
+  // Sessions that use a WebSocket never time out.
+  session->connection           = serverGetConnection(session->server,
+                                                      session->connection,
+                                                      session->pty);
+  if (session->connection) {
+    if (session->echo) {
+      int64_t remaining         = session->echoSince + echoDelay -
+                                  timerGetMonotonicTime();
+      serverSetTimeoutMs(session->connection,
+                         remaining > 0 ? (int)remaining : 1);
+    } else if (session->flushPending) {
+      serverSetTimeoutMs(session->connection, coalesceDelay);
+    } else if (session->blockedSince) {
+      int64_t remaining         = session->blockedSince + frameSkipDelay -
+                                  timerGetMonotonicTime();
+      serverSetTimeoutMs(session->connection,
+                         remaining > 0 ? (int)remaining : 1);
+    } else if (session->websocket) {
+      serverSetTimeout(session->connection, 0);
+    } else if (!session->http && !session->stream && sessionGrace) {
+      serverSetTimeout(session->connection, sessionGrace);
     } else {
-      if (maxLength > 0 && len > maxLength) {
-        session->len            = len - maxLength;
-        check(session->buffered = malloc(session->len));
-        memcpy(session->buffered, buf + maxLength, session->len);
-        data                    = jsonEscape(buf, maxLength);
-      } else {
-        data                    = jsonEscape(buf, len);
+      serverSetTimeout(session->connection, AJAX_TIMEOUT);
+    }
+  }
+}
+
+static void consumeOutput(struct Session *session, int len) {
+  // Drops output from the ring buffer, once the client no longer needs it.
+  ringBufferConsume(&session->output, len);
+  session->outputOffset        += len;
+  session->unacked              = len < session->unacked
+                                  ? session->unacked - len : 0;
+}
+
+static int unsentOutput(struct Session *session) {
+  return ringBufferLength(&session->output) - session->unacked;
+}
+
+static void acknowledgeOutput(struct Session *session, const char *ack) {
+  // Long poll replies can get lost on the way, e.g. when a proxy drops the
+  // connection. So, clients that report how much of the output they have
+  // received get to keep the rest of it, until they acknowledge it. An
+  // offset that does not match what we sent means that the client was using
+  // another transport in the meantime. Assume that all data has arrived.
+  int64_t offset                = ack ? strtoll(ack, NULL, 10) : -1;
+  if (ack && offset >= session->outputOffset &&
+      offset <= session->outputOffset + session->unacked) {
+    consumeOutput(session, (int)(offset - session->outputOffset));
+    if (session->unacked) {
+      debug("[server] Resending %d bytes for session %s",
+            session->unacked, session->sessionKey);
+    }
+    session->unacked            = 0;
+  } else {
+    consumeOutput(session, session->unacked);
+  }
+  session->acking               = ack != NULL;
+}
+
+static void adaptReplySize(struct Session *session, int sent) {
+  // Bulk output fills every reply that we send. Let replies grow, so that
+  // it takes fewer round trips and fewer wake ups to move. Once the output
+  // turns interactive again, shrink back, so that replies are not held up
+  // waiting for data that is not going to come. Replies that have to be
+  // acknowledged only get to use half of the buffer, so that we can keep on
+  // reading while they are in flight.
+  int maxSize                   = ringBufferCapacity(&session->output);
+  if (session->acking) {
+    maxSize                    /= 2;
+  }
+  if (sent >= session->replySize && session->replySize < maxSize) {
+    session->replySize         *= 2;
+  } else if (sent < session->replySize/4 &&
+             session->replySize > MIN_RESPONSE) {
+    session->replySize         /= 2;
+  }
+}
+
+static int clientCongested(struct Session *session) {
+  return (session->websocket &&
+          httpWebSocketCongested(session->websocket, MAX_WEBSOCKET_BACKLOG)) ||
+         (session->stream &&
+          httpGetPendingOutput(session->stream) > MAX_STREAM_BACKLOG);
+}
+
+static int clientCaughtUp(struct Session *session) {
+  // A client that skipped output gets to see the screen again, once it is
+  // ready to receive data, and once the output that it skipped does not end
+  // in the middle of an escape sequence.
+  return (session->websocket || session->stream || session->http) &&
+         !clientCongested(session) && screenAtBoundary(session->screen);
+}
+
+static void skipOutput(struct Session *session, unsigned historyMark) {
+  // Discards all output that the client has not seen yet. Once the client
+  // is ready, it receives a snapshot of the screen instead, which replays
+  // the lines that scrolled off the screen after "historyMark".
+  consumeOutput(session, ringBufferLength(&session->output));
+  session->skipping             = 1;
+  session->historyMark          = historyMark;
+  session->blockedSince         = 0;
+  session->replySize            = MIN_RESPONSE;
+}
+
+static void startSkipping(struct Session *session) {
+  debug("[server] Session %s fell behind, skipping output",
+        session->sessionKey);
+  skipOutput(session, screenHistoryMark(session->screen));
+}
+
+static void resizeScreen(struct Session *session) {
+  // The model of the screen always has the size of the client's terminal.
+  if (session->width > 0 && session->height > 0) {
+    screenResize(session->screen, session->width, session->height);
+  }
+}
+
+static void updateWindowSize(struct Session *session, int width, int height) {
+  // All transports report the size of the client's terminal in the same
+  // way. Sizes that make no sense are ignored, and sizes that are larger
+  // than anything we are prepared to model are clamped.
+  if (width <= 0 || height <= 0) {
+    return;
+  }
+  if (width > MAX_SCREEN_WIDTH) {
+    width                       = MAX_SCREEN_WIDTH;
+  }
+  if (height > MAX_SCREEN_HEIGHT) {
+    height                      = MAX_SCREEN_HEIGHT;
+  }
+  if (width == session->width && height == session->height) {
+    return;
+  }
+  session->width                = width;
+  session->height               = height;
+  if (session->pty >= 0) {
+    debug("[server] Window size changed to %dx%d", width, height);
+    setWindowSize(session->pty, width, height);
+  }
+}
+
+static short ptyEvents(struct Session *session, short events) {
+  // While input is queued up, we also wait for the pty to become writable.
+  return session->inputLength ? (events | POLLOUT) : (events & ~POLLOUT);
+}
+
+static int queueInput(struct Session *session, const char *buf, int len) {
+  // Keypresses are written to the pty, for as long as it takes them. The
+  // rest goes into the input queue, and gets written once the pty becomes
+  // writable again. Returns zero, if the queue is full.
+  if (!session->inputLength) {
+    struct iovec iov            = { (void *)buf, len };
+    int rc                      = serverWritev(session->server, session->pty,
+                                               &iov, 1);
+    if (rc < 0 && errno != EAGAIN) {
+      // The pty is going away. Nobody is going to read the input.
+      return 1;
+    }
+    if (rc > 0) {
+      buf                      += rc;
+      len                      -= rc;
+    }
+    if (!len) {
+      return 1;
+    }
+  }
+  if (session->inputLength + len > MAX_INPUT_QUEUE) {
+    return 0;
+  }
+  if (session->inputStart + session->inputLength + len > session->inputSize) {
+    memmove(session->input, session->input + session->inputStart,
+            session->inputLength);
+    session->inputStart         = 0;
+    if (session->inputLength + len > session->inputSize) {
+      session->inputSize        = 2*(session->inputLength + len);
+      check(session->input      = realloc(session->input,
+                                          session->inputSize));
+    }
+  }
+  memcpy(session->input + session->inputStart + session->inputLength,
+         buf, len);
+  session->inputLength         += len;
+  session->connection           = serverGetConnection(session->server,
+                                                      session->connection,
+                                                      session->pty);
+  if (session->connection) {
+    serverConnectionSetEvents(session->server, session->connection,
+                              session->pty, ptyEvents(session,
+                              serverConnectionGetEvents(session->connection)));
+  }
+  return 1;
+}
+
+static void drainInput(struct Session *session) {
+  // Writes as much of the input queue as the pty takes.
+  while (session->inputLength) {
+    struct iovec iov            = { session->input + session->inputStart,
+                                    session->inputLength };
+    int rc                      = serverWritev(session->server, session->pty,
+                                               &iov, 1);
+    if (rc <= 0) {
+      if (rc < 0 && errno != EAGAIN) {
+        session->inputLength    = 0;
       }
+      break;
     }
+    session->inputStart        += rc;
+    session->inputLength       -= rc;
+  }
+  if (!session->inputLength) {
+    session->inputStart         = 0;
+  }
+}
+
+static void completeKeysRequest(struct Session *session) {
+  // Lets the client send more keypresses.
+  HttpConnection *http          = session->keys;
+  if (http) {
+    session->keys               = NULL;
+    httpSendReply(http, 200, "OK", " ");
+  }
+}
 
-    char *json                  = stringPrintf(NULL, "{"
-                                               "\"session\":\"%s\","
-                                               "\"data\":\"%s\""
-                                               "}",
-                                               session->sessionKey, data);
-    free(data);
+static void blockSession(struct Session *session, short *events) {
+  // Stops reading from the pty, until the client has caught up. If that
+  // takes too long, the timer starts skipping output instead.
+  *events                       = ptyEvents(session, 0);
+  if (session->screen && frameSkipDelay && !session->blockedSince) {
+    session->blockedSince       = timerGetMonotonicTime();
+  }
+}
+
+static HttpReply *newJsonReply(struct Session *session,
+                               const struct iovec *iov, int count,
+                               int64_t offset, int snapshot) {
+  // Each reply tells the client where its data goes in the output stream.
+  // A snapshot replaces all the output up to that point. The data is
+  // escaped straight into the reply.
+  int len                       = 0;
+  for (int i = 0; i < count; i++) {
+    len                        += iov[i].iov_len;
+  }
+  HttpReply *reply              = newHttpReply(6*len + 128);
+  httpReplyPrintf(reply, "{\"session\":\"%s\",\"data\":\"",
+                  session->sessionKey);
+  char *data                    = httpReplyReserve(reply, 6*len);
+  httpReplyCommit(reply, jsonEscapeTo(data, iov, count, session->utf8) -
+                         data);
+  httpReplyPrintf(reply, "\",\"offset\":%lld%s}", (long long)offset,
+                  snapshot ? ",\"snapshot\":true" : "");
+  return reply;
+}
+
+static void sendJsonReply(HttpConnection *http, HttpReply *reply) {
+  httpTransferReply(http, reply, 1,
+                    "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: application/json; charset=utf-8\r\n"
+                    "Cache-Control: no-cache\r\n");
+}
+
+static void completeEchoRequest(struct Session *session, int maxLength) {
+  // Replies to a keypress that has been waiting for its echo. Up to
+  // "maxLength" bytes of whatever output we have by now go along with the
+  // reply. The client acknowledges them on its next poll, just like any
+  // other reply.
+  HttpConnection *http          = session->echo;
+  session->echo                 = NULL;
+  int len                       = session->skipping ? 0
+                                                    : unsentOutput(session);
+  if (len > maxLength) {
+    len                         = maxLength;
+  }
+  struct iovec iov[2];
+  int count                     = ringBufferPeekAt(&session->output,
+                                                   session->unacked, len, iov);
+  sendJsonReply(http, newJsonReply(session, iov, count,
+                                   session->outputOffset + session->unacked,
+                                   0));
+  session->unacked             += len;
+  if (!unsentOutput(session)) {
+    // There is nothing left for the pending poll.
+    session->flushPending       = 0;
+  }
+}
+
+static int completePendingRequest(struct Session *session, int maxLength) {
+  // Sends any output that is waiting in the session's ring buffer. Long
+  // polls receive no more than "maxLength" bytes at a time, unless
+  // "maxLength" is zero.
+  struct RingBuffer *output     = &session->output;
+  int len;
+  char *snapshot                = NULL;
+  struct iovec iov[2];
+  int count;
+  if (session->flushPending) {
+    // We are sending the data now, so the coalescing timer is no longer
+    // needed. Go back to the regular session timeout.
+    session->flushPending       = 0;
+    setSessionTimeout(session);
+  }
+  if (session->skipping) {
+    // Output that arrived while skipping is never sent. Once the client has
+    // caught up, it receives a snapshot of the screen instead, regardless
+    // of "maxLength".
+    consumeOutput(session, ringBufferLength(output));
+    len                         = 0;
+    if (clientCaughtUp(session)) {
+      debug("[server] Session %s caught up, sending snapshot",
+            session->sessionKey);
+      resizeScreen(session);
+      snapshot                  = screenSnapshot(session->screen,
+                                                 session->historyMark, &len);
+      session->skipping         = 0;
+    }
+    iov[0].iov_base             = snapshot;
+    iov[0].iov_len              = len;
+    count                       = len ? 1 : 0;
+  } else {
+    if (session->websocket || session->stream) {
+      // Streams are reliable. Any long poll reply that the client
+      // received before switching over does not need to be kept.
+      consumeOutput(session, session->unacked);
+    }
+    len                         = unsentOutput(session);
+    if (len && (session->websocket || session->stream || session->http)) {
+      adaptReplySize(session, maxLength > 0 && len > maxLength
+                              ? maxLength : len);
+    }
+    if (!session->websocket && !session->stream &&
+        maxLength > 0 && len > maxLength) {
+      len                       = maxLength;
+    }
+    count                       = ringBufferPeekAt(output, session->unacked,
+                                                   len, iov);
+  }
+  int64_t offset                = session->outputOffset + session->unacked;
+  int sent                      = 0;
+  int retain                    = 0;
+  if (session->websocket) {
+    // A WebSocket can take the data right away, and in its raw form.
+    for (int i = 0; i < count; i++) {
+      httpSendWebSocketBinaryMsg(session->websocket,
+                          WS_BINARY_FRAME|WS_START_OF_FRAME|WS_END_OF_FRAME,
+                          iov[i].iov_base, iov[i].iov_len);
+    }
+    sent                        = len;
+  } else if (session->stream) {
+    // An event stream can also take the data right away.
+    if (len) {
+      sendStreamData(session, iov, count);
+      sent                      = len;
+    }
+  } else if (session->http) {
+    // If we have a pending HTTP request, we can reply to it, now. Otherwise,
+    // the data stays in the ring buffer until the next request arrives.
+    sent                        = len;
+    retain                      = session->acking;
+    HttpReply *reply            = newJsonReply(session, iov, count, offset,
+                                               snapshot != NULL);
     HttpConnection *http        = session->http;
-    char *response              = stringPrintf(NULL,
-                                             "HTTP/1.1 200 OK\r\n"
-                                             "Content-Type: application/json; "
-                                             "charset=utf-8\r\n"
-                                             "Content-Length: %ld\r\n"
-                                             "Cache-Control: no-cache\r\n"
-                                             "\r\n"
-                                             "%s",
-                                             (long)strlen(json),
-                                             strcmp(httpGetMethod(http),
-                                                    "HEAD") ? json : "");
-    free(json);
+    int compress                = session->inflated >= 0 &&
+                                  strcmp(httpGetMethod(http), "HEAD");
+    if (compress && !session->deflate) {
+      session->deflate          = newHttpDeflateStream();
+    }
     session->http               = NULL;
-    httpTransfer(http, response, strlen(response));
+    if (compress && session->deflate) {
+      // The client asked for replies to be compressed as one continuous
+      // stream. Unless it reports having seen all of our earlier replies,
+      // we have to start a new stream.
+      if (session->inflated != session->deflated) {
+        httpResetDeflateStream(session->deflate);
+        session->deflated       = 0;
+      }
+      int jsonLength;
+      const char *json          = httpReplyBody(reply, &jsonLength);
+      HttpReply *compressed     = newHttpReply(jsonLength/2);
+      httpDeflateStreamToReply(session->deflate, json, jsonLength,
+                               compressed);
+      deleteHttpReply(reply);
+      // The data is compressed already.
+      httpTransferReply(http, compressed, 0,
+                        "HTTP/1.1 200 OK\r\n"
+                        "Content-Type: application/octet-stream\r\n"
+                        "Cache-Control: no-cache, no-transform\r\n"
+                        "X-Deflate-Sequence: %d\r\n"
+                        "X-Deflate-Length: %d\r\n",
+                        session->deflated++, jsonLength);
+    } else {
+      sendJsonReply(http, reply);
+    }
+  }
+  if (snapshot) {
+    free(snapshot);
+  } else if (retain) {
+    session->unacked           += sent;
+  } else {
+    consumeOutput(session, sent);
   }
-  if (session->done && !session->buffered) {
+  if (session->done && !ringBufferLength(output)) {
+    detachWebSocket(session, WS_CLOSE_NORMAL);
+    detachStream(session);
     finishSession(session);
     return 0;
   }
   return 1;
 }
 
+static void writeKeys(struct Session *session, const char *buf, int len) {
+  if (!queueInput(session, buf, len)) {
+    // The input queue is full. Let the user know that keypresses got lost.
+    ringBufferWrite(&session->output, "\007", 1);
+    completePendingRequest(session, session->replySize);
+  }
+}
+
+struct KeysUpload {
+  HttpConnection *http;
+  struct Session *session;
+  int            remaining;
+  int            echo;
+};
+
 static void sessionDone(void *arg) {
   struct Session *session = (struct Session *)arg;
   debug("[server] Session %s done.", session->sessionKey);
   if (session->cleanup) {
     terminateChild(session);
   }
+  if (session->echo) {
+    completeEchoRequest(session, session->replySize);
+  }
+  session->inputLength    = 0;
+  completeKeysRequest(session);
+  if (session->upload) {
+    // Any keypresses that are still being uploaded have nowhere to go.
+    httpPauseRead(session->upload->http, 0);
+    session->upload->session = NULL;
+    session->upload       = NULL;
+  }
   session->done           = 1;
   addToGraveyard(session);
-  completePendingRequest(session, "", 0, INT_MAX);
+  completePendingRequest(session, INT_MAX);
+}
+
+static int flushPendingRequest(void *arg ATTR_UNUSED,
+                               const char *key ATTR_UNUSED, char **value) {
+  UNUSED(arg);
+  UNUSED(key);
+  struct Session *session = *(struct Session **)value;
+  if (session->http && !session->done) {
+    completePendingRequest(session, session->replySize);
+  }
+  return 1;
 }
 
 static void delaySession(void) {
@@ -299,39 +693,153 @@ static void delaySession(void) {
   nanosleep(&ts, NULL);
 }
 
+static char *describeSession(void *arg) {
+  struct Session *session = (struct Session *)arg;
+  return stringPrintf(NULL, "session for %s, pid %d",
+                      session->peerName, (int)session->pid);
+}
+
+static int shouldCoalesce(struct Session *session, int bytes, int64_t now) {
+  // A short read after a quiet period is most likely the echo of a
+  // keystroke, and is sent right away. Output that keeps on coming is
+  // batched, until there is enough for a full reply, or until the
+  // coalescing window closes.
+  if (!coalesceDelay ||
+      (!session->http && !session->websocket && !session->stream) ||
+      !ringBufferSpace(&session->output) ||
+      unsentOutput(session) >= session->replySize) {
+    return 0;
+  }
+  return session->flushPending || bytes >= BULK_READ ||
+         now - session->lastOutput < BULK_INTERVAL;
+}
+
+static void updateScreen(struct Session *session, int bytes) {
+  // Keeps the model of the terminal screen in sync with the output that
+  // was just read from the pty.
+  struct Screen *screen         = session->screen;
+  resizeScreen(session);
+  struct iovec iov[2];
+  int count                     = ringBufferPeekNewest(&session->output,
+                                                       bytes, iov);
+  for (int i = 0; i < count; i++) {
+    screenWrite(screen, iov[i].iov_base, iov[i].iov_len);
+  }
+}
+
 static int handleSession(struct ServerConnection *connection, void *arg,
                          short *events, short revents) {
   struct Session *session       = (struct Session *)arg;
   session->connection           = connection;
-  int len                       = MAX_RESPONSE - session->len;
-  if (len <= 0) {
-    len                         = 1;
-  }
-  char buf[MAX_RESPONSE];
   int bytes                     = 0;
+  if (revents & POLLOUT) {
+    // The pty can take more of the queued up input. Once all of it is gone,
+    // the client gets to send more.
+    drainInput(session);
+    *events                     = ptyEvents(session, *events);
+    if (!session->inputLength) {
+      completeKeysRequest(session);
+    }
+    if (session->upload && session->inputLength < INPUT_HIGH_WATER) {
+      httpPauseRead(session->upload->http, 0);
+    }
+    revents                    &= ~POLLOUT;
+    if (!revents && serverGetTimeout(connection) >= 0) {
+      return 1;
+    }
+  }
   if (revents & POLLIN) {
-    bytes                       = NOINTR(read(session->pty, buf, len));
+    if (!ringBufferSpace(&session->output)) {
+      // Input was re-enabled before the client caught up. Wait for it.
+      blockSession(session, events);
+      setSessionTimeout(session);
+      return 1;
+    }
+    // Read straight into the session's ring buffer.
+    struct iovec iov[2];
+    int count                   = ringBufferReserve(&session->output, iov);
+    bytes                       = serverReadv(session->server, session->pty,
+                                              iov, count);
     if (bytes <= 0) {
       return 0;
     }
+    ringBufferCommit(&session->output, bytes);
+    if (session->screen) {
+      updateScreen(session, bytes);
+    }
   }
   int timedOut                  = serverGetTimeout(connection) < 0;
-  if (bytes || timedOut) {
-    if (!session->http && timedOut) {
+  int coalesced                 = 0;
+  if (session->echo && (bytes || timedOut)) {
+    // The program echoed the keypress, or we gave up waiting for it. Either
+    // way, the keypress gets its reply now. Any output that did not fit is
+    // left for the pending poll.
+    completeEchoRequest(session, session->replySize);
+    if (!bytes || !unsentOutput(session)) {
+      setSessionTimeout(session);
+      session->ptyFirstRead     = 0;
+      return 1;
+    }
+    timedOut                    = 0;
+  }
+  if (timedOut && session->flushPending) {
+    // The coalescing window has closed. This is not a session timeout.
+    timedOut                    = 0;
+    coalesced                   = 1;
+  } else if (timedOut && session->blockedSince) {
+    // The client has not been able to keep up for a while. Keep reading
+    // from the pty, but only tell the client about the end result.
+    startSkipping(session);
+    *events                     = ptyEvents(session, POLLIN);
+    setSessionTimeout(session);
+    return 1;
+  }
+  if (session->skipping && !timedOut && !clientCaughtUp(session)) {
+    // Don't touch the timer, so that sessions without a client still time
+    // out eventually.
+    consumeOutput(session, ringBufferLength(&session->output));
+    session->ptyFirstRead       = 0;
+    return 1;
+  }
+  if (bytes || timedOut || coalesced || session->skipping) {
+    if (!session->http && !session->websocket && !session->stream &&
+        timedOut) {
       debug("[server] Timeout. Closing session %s!", session->sessionKey);
       session->cleanup = 1;
       return 0;
     }
     check(!session->done);
-    check(completePendingRequest(session, buf, bytes, MAX_RESPONSE));
+    if (session->stream && timedOut && !bytes) {
+      // Keep proxies from closing an event stream that has been idle for a
+      // while.
+      sendStreamEvent(session->stream, stringPrintf(NULL, ":\n\n"));
+    }
+    if (bytes) {
+      int64_t now               = timerGetMonotonicTime();
+      int defer                 = !coalesced &&
+                                  shouldCoalesce(session, bytes, now);
+      session->lastOutput       = now;
+      if (defer) {
+        // Give the program a moment to produce more output, and then send
+        // all of it in one reply. Keep reading in the meantime.
+        if (!session->flushPending) {
+          session->flushPending = 1;
+          setSessionTimeout(session);
+        }
+        session->ptyFirstRead   = 0;
+        return 1;
+      }
+    }
+    check(completePendingRequest(session, session->replySize));
     connection                  = serverGetConnection(session->server,
                                                       connection,
                                                       session->pty);
     session->connection         = connection;
-    if (session->len >= MAX_RESPONSE) {
-      *events                   = 0;
+    if (!session->skipping &&
+        (!ringBufferSpace(&session->output) || clientCongested(session))) {
+      blockSession(session, events);
     }
-    serverSetTimeout(connection, AJAX_TIMEOUT);
+    setSessionTimeout(session);
     session->ptyFirstRead       = 0;
     return 1;
   } else {
@@ -356,9 +864,49 @@ static int handleSession(struct ServerConnection *connection, void *arg,
   }
 }
 
+static int replyToKeys(struct Session *session, HttpConnection *http,
+                       int echo) {
+  if (session->inputLength) {
+    // The pty is not keeping up with the client, e.g. because a lot of
+    // text was pasted. Hold on to the request, until the pty has taken all
+    // of the input. In the meantime, the client keeps any further
+    // keypresses to itself.
+    completeKeysRequest(session);
+    session->keys         = http;
+    return HTTP_SUSPEND;
+  }
+  if (echoDelay && echo && session->acking &&
+      !session->echo && !session->skipping && !session->done &&
+      !session->websocket && !session->stream) {
+    // Most programs echo keypresses right away. Rather than sending the
+    // echo on the pending poll, hold on to this request for a moment and
+    // reply with the echo. That saves a round trip on slow links. The
+    // offset in the reply lets the client put the data in order.
+    session->echo         = http;
+    session->echoSince    = timerGetMonotonicTime();
+    setSessionTimeout(session);
+    if (session->connection) {
+      return HTTP_SUSPEND;
+    }
+    session->echo         = NULL;
+  }
+  httpSendReply(http, 200, "OK", " ");
+  return HTTP_DONE;
+}
+
 static int invalidatePendingHttpSession(void *arg, const char *key,
                                         char **value) {
   struct Session *session = *(struct Session **)value;
+  if (session->echo && session->echo == (HttpConnection *)arg) {
+    // The client gave up on a keypress that was waiting for its echo.
+    session->echo         = NULL;
+    setSessionTimeout(session);
+    return 1;
+  }
+  if (session->keys && session->keys == (HttpConnection *)arg) {
+    session->keys         = NULL;
+    return 1;
+  }
   if (session->http && session->http == (HttpConnection *)arg) {
     debug("[server] Clearing pending HTTP connection for session %s!", key);
     session->http         = NULL;
@@ -401,17 +949,19 @@ static int dataHandler(HttpConnection *http, struct Service *service,
     return HTTP_DONE;
   }
 
-  int oldWidth            = session->width;
-  int oldHeight           = session->height;
   const char *width       = getFromHashMap(args, "width");
   const char *height      = getFromHashMap(args, "height");
   const char *keys        = getFromHashMap(args, "keys");
   const char *rootURL     = getFromHashMap(args, "rooturl");
+  const char *inflated    = getFromHashMap(args, "deflate");
+  const char *utf8        = getFromHashMap(args, "utf8");
+  const char *resume      = getFromHashMap(args, "resume");
+  const char *ack         = getFromHashMap(args, "ack");
+  const char *echo        = getFromHashMap(args, "echo");
 
   // Adjust window dimensions if provided by client
   if (width && height) {
-    session->width        = atoi(width);
-    session->height       = atoi(height);
+    updateWindowSize(session, atoi(width), atoi(height));
   }
 
   // Create a new session, if the client did not provide an existing one
@@ -428,6 +978,8 @@ static int dataHandler(HttpConnection *http, struct Service *service,
       goto bad_new_session;
     }
     session->http         = http;
+    session->inflated     = inflated ? atoi(inflated) : -1;
+    session->utf8         = utf8 && atoi(utf8);
     session->useLogin     = service->useLogin;
     if (launchChild(service->id, session,
                     rootURL && *rootURL ? rootURL : urlGetURL(url)) < 0) {
@@ -441,79 +993,413 @@ static int dataHandler(HttpConnection *http, struct Service *service,
     session->connection   = serverAddConnection(httpGetServer(http),
                                                 session->pty, handleSession,
                                                 sessionDone, session);
-    serverSetTimeout(session->connection, AJAX_TIMEOUT);
-  }
+    serverSetConnectionDescriber(session->connection, describeSession);
 
-  // Reset window dimensions of the pseudo TTY, if changed since last time set.
-  if (session->width > 0 && session->height > 0 &&
-      (session->width != oldWidth || session->height != oldHeight)) {
-    debug("[server] Window size changed to %dx%d", session->width,
-          session->height);
-    setWindowSize(session->pty, session->width, session->height);
+    // Nothing but the session itself ever touches the pty. Let the server
+    // perform the I/O, if its event backend is able to.
+    serverDelegateIo(session->server, session->pty,
+                     SERVER_READ | SERVER_WRITE);
+    serverSetTimeout(session->connection, AJAX_TIMEOUT);
+    if (frameSkipDelay || sessionGrace) {
+      session->screen     = newScreen(session->width  > 0 ? session->width
+                                                          : 80,
+                                      session->height > 0 ? session->height
+                                                          : 24,
+                                      SESSION_HISTORY);
+    }
   }
 
   // Process keypresses, if any. Then send a synchronous reply.
   if (keys) {
     char *keyCodes;
-    check(keyCodes        = malloc(strlen(keys)/2));
-    int len               = 0;
-    for (const unsigned char *ptr = (const unsigned char *)keys; ;) {
-      unsigned c0         = *ptr++;
-      if (c0 < '0' || (c0 > '9' && c0 < 'A') ||
-          (c0 > 'F' && c0 < 'a') || c0 > 'f') {
-        break;
-      }
-      unsigned c1         = *ptr++;
-      if (c1 < '0' || (c1 > '9' && c1 < 'A') ||
-          (c1 > 'F' && c1 < 'a') || c1 > 'f') {
-        break;
-      }
-      keyCodes[len++]     = 16*((c0 & 0xF) + 9*(c0 > '9')) +
-                                (c1 & 0xF) + 9*(c1 > '9');
-    }
-    if (write(session->pty, keyCodes, len) < 0 && errno == EAGAIN) {
-      completePendingRequest(session, "\007", 1, MAX_RESPONSE);
-    }
+    int keysLength        = strlen(keys);
+    check(keyCodes        = malloc(keysLength/2));
+    int len               = hexDecode(keyCodes, keys, keysLength);
+    writeKeys(session, keyCodes, len);
     free(keyCodes);
-    httpSendReply(http, 200, "OK", " ");
+    int status            = replyToKeys(session, http, echo && atoi(echo));
     check(session->http != http);
-    return HTTP_DONE;
+    return status;
   } else {
     // This request is polling for data. Finish any pending requests and
-    // queue (or process) a new one.
+    // queue (or process) a new one. A client that polls has given up on its
+    // event stream, if it had one.
+    detachStream(session);
     if (session->http && session->http != http &&
-        !completePendingRequest(session, "", 0, MAX_RESPONSE)) {
+        !completePendingRequest(session, session->replySize)) {
       httpSendReply(http, 400, "Bad Request", NO_MSG);
       return HTTP_DONE;
     }
+    if (resume && !sessionIsNew && session->screen && sessionGrace) {
+      // The page was reloaded, and the terminal lost everything that it
+      // showed. The new page takes over from the old one, and gets to see
+      // the screen and the recent history, instead of just new output.
+      debug("[server] Resuming session %s", session->sessionKey);
+      detachWebSocket(session, WS_CLOSE_NORMAL);
+      skipOutput(session, screenHistoryMark(session->screen) -
+                          SESSION_HISTORY);
+    }
+    acknowledgeOutput(session, ack);
     session->http         = http;
+    session->inflated     = inflated ? atoi(inflated) : -1;
+    session->utf8         = utf8 && atoi(utf8);
   }
 
   session->connection     = serverGetConnection(session->server,
                                                 session->connection,
                                                 session->pty);
-  if (session->buffered || sessionIsNew) {
-    if (completePendingRequest(session, "", 0, MAX_RESPONSE) &&
+  if (unsentOutput(session) || sessionIsNew || session->done ||
+      (session->skipping && clientCaughtUp(session))) {
+    if (completePendingRequest(session, session->replySize) &&
         session->connection) {
-      // Reset the timeout, as we just received a new request.
-      serverSetTimeout(session->connection, AJAX_TIMEOUT);
-      if (session->len < MAX_RESPONSE) {
+      if (ringBufferSpace(&session->output)) {
         // Re-enable input on the child's pty
+        session->blockedSince = 0;
         serverConnectionSetEvents(session->server, session->connection,
-                                  session->pty, POLLIN);
+                                  session->pty, ptyEvents(session, POLLIN));
       }
+      // Reset the timeout, as we just received a new request.
+      setSessionTimeout(session);
     }
     return HTTP_DONE;
   } else if (session->connection) {
     // Re-enable input on the child's pty
+    session->blockedSince = 0;
     serverConnectionSetEvents(session->server, session->connection,
-                              session->pty, POLLIN);
+                              session->pty, ptyEvents(session, POLLIN));
     serverSetTimeout(session->connection, AJAX_TIMEOUT);
   }
 
   return HTTP_SUSPEND;
 }
 
+static void resumeSession(struct Session *session) {
+  // Re-enables input on the child's pty, and restarts the session timeout.
+  // A client that skipped output might be ready for a snapshot now.
+  session->connection     = serverGetConnection(session->server,
+                                                session->connection,
+                                                session->pty);
+  if (session->connection) {
+    session->blockedSince = 0;
+    serverConnectionSetEvents(session->server, session->connection,
+                              session->pty, ptyEvents(session, POLLIN));
+    setSessionTimeout(session);
+    if (session->skipping && !session->done && clientCaughtUp(session)) {
+      completePendingRequest(session, session->replySize);
+    }
+  }
+}
+
+static int webSocketHandler(HttpConnection *http, void *arg ATTR_UNUSED,
+                            int type, const char *buf, int len) {
+  UNUSED(arg);
+  struct Session *session = (struct Session *)httpGetPrivate(http);
+  switch (type) {
+  case WS_CONNECTION_OPENED: {
+    // The client upgrades a session that it previously created with a
+    // regular HTTP request.
+    URL *url              = newURL(http, NULL, 0);
+    const HashMap *args   = urlGetArgs(url);
+    const char *sessionKey= getFromHashMap(args, "session");
+    const char *width     = getFromHashMap(args, "width");
+    const char *height    = getFromHashMap(args, "height");
+    int sessionIsNew      = 0;
+    if (sessionKey && *sessionKey) {
+      session             = findSession(sessionKey, cgiSessionKey,
+                                        &sessionIsNew, http);
+    }
+    if (session && sessionIsNew) {
+      abandonSession(session);
+      session             = NULL;
+    }
+    if (!session || session->done || session->websocket ||
+        (peerCheckEnabled &&
+         strcmp(session->peerName, httpGetPeerName(http)))) {
+      deleteURL(url);
+      httpCloseWebSocket(http, WS_CLOSE_POLICY, "Unknown session");
+      return HTTP_DONE;
+    }
+    if (width && height) {
+      updateWindowSize(session, atoi(width), atoi(height));
+    }
+    deleteURL(url);
+
+    // Answer any pending poll, before all output goes to the WebSocket.
+    if (session->echo) {
+      completeEchoRequest(session, 0);
+    }
+    if (session->http && !completePendingRequest(session, session->replySize)) {
+      httpCloseWebSocket(http, WS_CLOSE_NORMAL, NULL);
+      return HTTP_DONE;
+    }
+    debug("[server] Session %s switched to WebSocket", session->sessionKey);
+    detachStream(session);
+    session->websocket    = http;
+    httpSetPrivate(http, session);
+    completePendingRequest(session, 0);
+    resumeSession(session);
+    return HTTP_DONE; }
+  case WS_CONNECTION_CLOSED:
+    if (session) {
+      // Unless the client comes back with a regular HTTP request, the
+      // session times out eventually.
+      debug("[server] WebSocket for session %s closed", session->sessionKey);
+      session->websocket  = NULL;
+      httpSetPrivate(http, NULL);
+      resumeSession(session);
+    }
+    return HTTP_DONE;
+  case WS_CONNECTION_DRAINED:
+    if (session) {
+      resumeSession(session);
+    }
+    return HTTP_DONE;
+  default:
+    break;
+  }
+  if (!session) {
+    return HTTP_DONE;
+  }
+  if ((type & 0xF) == WS_BINARY_FRAME) {
+    // Binary messages carry keypresses. They can be passed on to the pty
+    // as they arrive, even if the message is fragmented.
+    writeKeys(session, buf, len);
+  } else if ((type & WS_START_OF_FRAME) && (type & WS_END_OF_FRAME)) {
+    // Text messages carry commands, such as changes to the window size.
+    // They are always short, and never fragmented.
+    int w, h;
+    char cmd[32];
+    if (len < (int)sizeof(cmd)) {
+      memcpy(cmd, buf, len);
+      cmd[len]            = '\000';
+      if (sscanf(cmd, "width=%d&height=%d", &w, &h) == 2) {
+        updateWindowSize(session, w, h);
+      }
+    }
+  }
+  return HTTP_DONE;
+}
+
+static int streamHandler(HttpConnection *http, const char *buf, URL *url) {
+  struct Session *session = (struct Session *)httpGetPrivate(http);
+  if (session == (struct Session *)&streamDetached) {
+    // The last event has been sent. This completes the reply.
+    httpSetPrivate(http, NULL);
+    return HTTP_DONE;
+  } else if (session) {
+    if (!buf) {
+      // The client went away. Unless it comes back, the session times out
+      // eventually.
+      debug("[server] Event stream for session %s closed",
+            session->sessionKey);
+      session->stream     = NULL;
+      httpSetPrivate(http, NULL);
+      resumeSession(session);
+      return HTTP_DONE;
+    }
+
+    // All events have been written. Read more data from the pty.
+    resumeSession(session);
+    return HTTP_PARTIAL_REPLY;
+  } else if (!buf) {
+    return HTTP_DONE;
+  }
+
+  // The client streams the output of a session that it previously created
+  // with a regular HTTP request. Keypresses still arrive as separate
+  // requests.
+  const HashMap *args     = urlGetArgs(url);
+  const char *sessionKey  = getFromHashMap(args, "session");
+  const char *width       = getFromHashMap(args, "width");
+  const char *height      = getFromHashMap(args, "height");
+  const char *utf8        = getFromHashMap(args, "utf8");
+  int sessionIsNew        = 0;
+  if (sessionKey && *sessionKey) {
+    session               = findSession(sessionKey, cgiSessionKey,
+                                        &sessionIsNew, http);
+  }
+  if (session && sessionIsNew) {
+    abandonSession(session);
+    session               = NULL;
+  }
+  if (!session || session->done || session->websocket ||
+      (peerCheckEnabled && strcmp(session->peerName, httpGetPeerName(http)))){
+    httpSendReply(http, 400, "Bad Request", NO_MSG);
+    return HTTP_DONE;
+  }
+  if (width && height) {
+    updateWindowSize(session, atoi(width), atoi(height));
+  }
+
+  // Answer any pending poll, and end any stream that the client abandoned.
+  if (session->echo) {
+    completeEchoRequest(session, 0);
+  }
+  if (session->http && !completePendingRequest(session, session->replySize)) {
+    httpSendReply(http, 400, "Bad Request", NO_MSG);
+    return HTTP_DONE;
+  }
+  detachStream(session);
+
+  debug("[server] Session %s switched to an event stream",
+        session->sessionKey);
+  char *response          = stringPrintf(NULL,
+                                 "HTTP/1.1 200 OK\r\n"
+                                 "Content-Type: text/event-stream; "
+                                 "charset=utf-8\r\n"
+                                 "Cache-Control: no-cache, no-transform\r\n"
+                                 "X-Accel-Buffering: no\r\n"
+                                 "%s"
+                                 "\r\n",
+                                 streamIsChunked(http) ?
+                                 "Transfer-Encoding: chunked\r\n" :
+                                 "Connection: close\r\n");
+  httpTransferPartialReply(http, response, strlen(response));
+
+  // The stream stays open for as long as the session. It does not time out.
+  serverSetTimeout(httpGetServerConnection(http), 0);
+  session->stream         = http;
+  session->utf8           = utf8 && atoi(utf8);
+  httpSetPrivate(http, session);
+  completePendingRequest(session, 0);
+  resumeSession(session);
+  return HTTP_PARTIAL_REPLY;
+}
+
+static int keysUploadHandler(HttpConnection *http, void *arg,
+                             const char *buf, int len) {
+  struct KeysUpload *upload = (struct KeysUpload *)arg;
+  if (!buf) {
+    // The client went away, either while uploading or while waiting for
+    // the reply.
+    if (upload) {
+      if (upload->session) {
+        upload->session->upload = NULL;
+      }
+      free(upload);
+    }
+    iterateOverSessions(invalidatePendingHttpSession, http);
+    return HTTP_DONE;
+  }
+  if (!upload) {
+    return HTTP_READ_MORE;
+  }
+  struct Session *session = upload->session;
+  upload->remaining      -= len;
+  if (session && len > 0) {
+    writeKeys(session, buf, len);
+    if (session->inputLength >= INPUT_HIGH_WATER) {
+      // Stop reading from the client, until the pty has caught up.
+      httpPauseRead(http, 1);
+    }
+  }
+  if (upload->remaining > 0) {
+    return HTTP_READ_MORE;
+  }
+  int echo                = upload->echo;
+  httpSetCallback(http, keysUploadHandler, NULL);
+  free(upload);
+  if (!session) {
+    httpSendReply(http, 400, "Bad Request", NO_MSG);
+    return HTTP_DONE;
+  }
+  session->upload         = NULL;
+  return replyToKeys(session, http, echo);
+}
+
+static int keysHandler(HttpConnection *http, URL *url) {
+  // Keypresses can be uploaded as raw bytes, instead of as a hex encoded
+  // form. This takes up half the space, and large pastes are passed on to
+  // the pty as they arrive, rather than having to fit into a single form.
+  // The session key goes into a header, so that it never shows up in the
+  // URL.
+  const HashMap *args     = urlGetArgs(url);
+  const HashMap *headers  = httpGetHeaders(http);
+  const char *sessionKey  = getFromHashMap(headers, "x-shellinabox-session");
+  const char *width       = getFromHashMap(args, "width");
+  const char *height      = getFromHashMap(args, "height");
+  const char *echo        = getFromHashMap(args, "echo");
+  const char *length      = getFromHashMap(headers, "content-length");
+  struct Session *session = NULL;
+  int sessionIsNew        = 0;
+  if (sessionKey && *sessionKey) {
+    session               = findSession(sessionKey, cgiSessionKey,
+                                        &sessionIsNew, http);
+  }
+  if (session && sessionIsNew) {
+    abandonSession(session);
+    session               = NULL;
+  }
+  if (!session || session->done || session->upload || !length ||
+      atoi(length) < 0 ||
+      (peerCheckEnabled && strcmp(session->peerName, httpGetPeerName(http)))){
+    httpSendReply(http, 400, "Bad Request", NO_MSG);
+    return HTTP_DONE;
+  }
+  if (width && height) {
+    updateWindowSize(session, atoi(width), atoi(height));
+  }
+  if (!atoi(length)) {
+    return replyToKeys(session, http, echo && atoi(echo));
+  }
+  struct KeysUpload *upload;
+  check(upload            = malloc(sizeof(struct KeysUpload)));
+  upload->http            = http;
+  upload->session         = session;
+  upload->remaining       = atoi(length);
+  upload->echo            = echo && atoi(echo);
+  session->upload         = upload;
+  httpSetCallback(http, keysUploadHandler, upload);
+  return HTTP_READ_MORE;
+}
+
+static void adoptSession(struct Session *session) {
+  addSession(session);
+  session->connection     = serverAddConnection(session->server,
+                                                session->pty, handleSession,
+                                                sessionDone, session);
+  serverSetConnectionDescriber(session->connection, describeSession);
+  serverDelegateIo(session->server, session->pty, SERVER_READ | SERVER_WRITE);
+  serverSetTimeout(session->connection, AJAX_TIMEOUT);
+}
+
+static void initStaticPages(void) {
+  // The pages that depend on our command line arguments never change once
+  // we are running. Build them just once, so that they can be served
+  // without making any copies.
+  UNUSED(rootPageSize);
+  rootPage                       = stringPrintf(NULL, rootPageStart,
+                                                enableSSL ? "true" : "false");
+
+  // ShellInABox.js combines vt100.js and shell_in_a_box.js. Also, it
+  // indicates to the client whether the server is SSL enabled.
+  char *userCSSString            = getUserCSSString(userCSSList);
+  char *stateVars                = stringPrintf(NULL,
+                                         "serverSupportsSSL = %s;\n"
+                                         "disableSSLMenu    = %s;\n"
+                                         "suppressAllAudio  = %s;\n"
+                                         "linkifyURLs       = %d;\n"
+                                         "userCSSList       = %s;\n"
+                                         "serverMessagesOrigin = %s%s%s;\n\n",
+                                         enableSSL      ? "true" : "false",
+                                         !enableSSLMenu ? "true" : "false",
+                                         noBeep         ? "true" : "false",
+                                         linkifyURLs,
+                                         userCSSString,
+                                         messagesOrigin ? "'" : "",
+                                         messagesOrigin ? messagesOrigin : "false",
+                                         messagesOrigin ? "'" : "");
+  free(userCSSString);
+  int stateVarsLength            = strlen(stateVars);
+  shellInABoxJSLength            = stateVarsLength +
+                                   vt100Size - 1 +
+                                   shellInABoxSize - 1;
+  check(shellInABoxJS            = realloc(stateVars, shellInABoxJSLength));
+  memcpy(memcpy(shellInABoxJS + stateVarsLength,
+                vt100Start, vt100Size - 1) + vt100Size - 1,
+         shellInABoxStart, shellInABoxSize - 1);
+}
+
 static void serveStaticFile(HttpConnection *http, const char *contentType,
                             const char *start, const char *end) {
   char *body                     = (char *)start;
@@ -633,6 +1519,13 @@ static void serveStaticFile(HttpConnection *http, const char *contentType,
                                   contentType, (long)(bodyEnd - body),
                                   body == start ? "" :
                                   "Cache-Control: no-cache\r\n");
+
+  // Unmodified files can be sent straight from where they are stored.
+  if (body == start) {
+    httpTransferStatic(http, response, start, end - start);
+    return;
+  }
+
   int len          = strlen(response);
   if (strcmp(httpGetMethod(http), "HEAD")) {
     check(response = realloc(response, len + (bodyEnd - body)));
@@ -642,9 +1535,7 @@ static void serveStaticFile(HttpConnection *http, const char *contentType,
 
   // If we expanded conditionals, we had to create a temporary copy. Delete
   // it now.
-  if (body != start) {
-    free(body);
-  }
+  free(body);
 
   httpTransfer(http, response, len);
 }
@@ -671,6 +1562,14 @@ static int shellInABoxHttpHandler(HttpConnection *http, void *arg,
       (pathInfoLength == 5 && !memcmp(pathInfo, "plain", 5)) ||
       (pathInfoLength == 6 && !memcmp(pathInfo, "secure", 6))) {
     // The root page serves the AJAX application.
+    const char *accept    = getFromHashMap(headers, "accept");
+    if (accept && strstr(accept, "text/event-stream") &&
+        !strcmp(httpGetMethod(http), "GET")) {
+      // EventSource streaming the output of an existing session.
+      int status          = streamHandler(http, buf, url);
+      deleteURL(url);
+      return status;
+    }
     if (contentType &&
         !strncasecmp(contentType, "application/x-www-form-urlencoded", 33)) {
       // XMLHttpRequest carrying data between the AJAX application and the
@@ -679,11 +1578,7 @@ static int shellInABoxHttpHandler(HttpConnection *http, void *arg,
       deleteURL(url);
       return status;
     }
-    UNUSED(rootPageSize);
-    char *html            = stringPrintf(NULL, rootPageStart,
-                                         enableSSL ? "true" : "false");
-    serveStaticFile(http, "text/html", html, strrchr(html, '\000'));
-    free(html);
+    serveStaticFile(http, "text/html", rootPage, strrchr(rootPage, '\000'));
   } else if (pathInfoLength == 8 && !memcmp(pathInfo, "beep.wav", 8)) {
     // Serve the audio sample for the console bell.
     serveStaticFile(http, "audio/x-wav", beepStart, beepStart + beepSize - 1);
@@ -705,46 +1600,13 @@ static int shellInABoxHttpHandler(HttpConnection *http, void *arg,
                     keyboardStart + keyboardSize - 1);
   } else if (pathInfoLength == 14 && !memcmp(pathInfo, "ShellInABox.js", 14)) {
     // Serve both vt100.js and shell_in_a_box.js in the same transaction.
-    // Also, indicate to the client whether the server is SSL enabled.
-    char *userCSSString   = getUserCSSString(userCSSList);
-    char *stateVars       = stringPrintf(NULL,
-                                         "serverSupportsSSL = %s;\n"
-                                         "disableSSLMenu    = %s;\n"
-                                         "suppressAllAudio  = %s;\n"
-                                         "linkifyURLs       = %d;\n"
-                                         "userCSSList       = %s;\n"
-                                         "serverMessagesOrigin = %s%s%s;\n\n",
-                                         enableSSL      ? "true" : "false",
-                                         !enableSSLMenu ? "true" : "false",
-                                         noBeep         ? "true" : "false",
-                                         linkifyURLs,
-                                         userCSSString,
-                                         messagesOrigin ? "'" : "",
-                                         messagesOrigin ? messagesOrigin : "false",
-                                         messagesOrigin ? "'" : "");
-    free(userCSSString);
-    int stateVarsLength   = strlen(stateVars);
-    int contentLength     = stateVarsLength +
-                            vt100Size - 1 +
-                            shellInABoxSize - 1;
     char *response        = stringPrintf(NULL,
                              "HTTP/1.1 200 OK\r\n"
                              "Content-Type: text/javascript; charset=utf-8\r\n"
                              "Content-Length: %d\r\n"
                              "\r\n",
-                             contentLength);
-    int headerLength      = strlen(response);
-    if (strcmp(httpGetMethod(http), "HEAD")) {
-      check(response      = realloc(response, headerLength + contentLength));
-      memcpy(memcpy(memcpy(
-          response + headerLength, stateVars, stateVarsLength)+stateVarsLength,
-        vt100Start, vt100Size - 1) + vt100Size - 1,
-      shellInABoxStart, shellInABoxSize - 1);
-    } else {
-      contentLength       = 0;
-    }
-    free(stateVars);
-    httpTransfer(http, response, headerLength + contentLength);
+                             shellInABoxJSLength);
+    httpTransferStatic(http, response, shellInABoxJS, shellInABoxJSLength);
   } else if (pathInfoLength == 10 && !memcmp(pathInfo, "styles.css", 10)) {
     // Serve the style sheet.
     serveStaticFile(http, "text/css; charset=utf-8",
@@ -773,6 +1635,22 @@ static int shellInABoxHttpHandler(HttpConnection *http, void *arg,
   return HTTP_DONE;
 }
 
+static int shellInABoxStreamingHandler(HttpConnection *http, void *arg) {
+  // Raw keypresses are streamed straight to the session. Everything else
+  // is collected in full, before it gets handled.
+  const char *contentType = getFromHashMap(httpGetHeaders(http),
+                                           "content-type");
+  if (!strcmp(httpGetMethod(http), "POST") && contentType &&
+      !strncasecmp(contentType, "application/octet-stream", 24)) {
+    checkGraveyard();
+    URL *url              = newURL(http, NULL, 0);
+    int status            = keysHandler(http, url);
+    deleteURL(url);
+    return status;
+  }
+  return serverCollectPayload(http, shellInABoxHttpHandler, arg);
+}
+
 static int strtoint(const char *s, int minVal, int maxVal) {
   char *ptr;
   if (!*s) {
@@ -805,18 +1683,30 @@ static void usage(void) {
           "%s"
           "      --css=FILE              attach contents to CSS style sheet\n"
           "      --cgi[=PORTMIN-PORTMAX] run as CGI\n"
+          "      --coalesce-delay=MS     batch bulk output (default: 2ms)\n"
           "  -d, --debug                 enable debug mode\n"
+          "      --echo-delay=MS         wait this long for keypresses to "
+                                         "echo (default: off)\n"
+          "      --event-backend=[poll|epoll|io_uring] default is \"epoll\"\n"
           "  -f, --static-file=URL:FILE  serve static file from URL path\n"
+          "      --frame-skip=MS         skip output for slow clients "
+                                         "(default: 1000ms)\n"
           "  -g, --group=GID             switch to this group (default: %s)\n"
           "  -h, --help                  print this message\n"
           "      --linkify=[none|normal|aggressive] default is \"normal\"\n"
           "      --localhost-only        only listen on 127.0.0.1\n"
           "      --no-beep               suppress all audio output\n"
           "  -n, --numeric               do not resolve hostnames\n"
+          "      --max-connections=N     limit concurrent HTTP connections\n"
+          "      --max-connections-per-peer=N limit connections per client\n"
           "  -m, --messages-origin=ORIGIN allow iframe message passing from origin\n"
           "      --pidfile=PIDFILE       publish pid of daemon process\n"
           "  -p, --port=PORT             select a port (default: %d)\n"
           "  -s, --service=SERVICE       define one or more services\n"
+          "      --session-buffer=BYTES  buffer this much output per session\n"
+          "      --session-grace=SECS    keep sessions without a client alive "
+                                         "(default: %ds)\n"
+          "      --stall-threshold=MS    report event loop stalls and latency\n"
           "%s"
           "      --disable-utmp-logging  disable logging to utmp and wtmp\n"
           "  -q, --quiet                 turn off all messages\n"
@@ -826,6 +1716,8 @@ static void usage(void) {
           "  -v, --verbose               enable logging messages\n"
           "      --version               prints version information\n"
           "      --disable-peer-check    disable peer check on a session\n"
+          "      --threads=N             serve requests from N threads\n"
+          "      --workers=N             serve requests from N processes\n"
           "\n"
           "Debug, quiet, and verbose are mutually exclusive.\n"
           "\n"
@@ -870,7 +1762,7 @@ static void usage(void) {
           "  -c, --cert=CERTDIR          set certificate dir "
           "(default: $PWD)\n"
           "      --cert-fd=FD            set certificate file from fd\n",
-          group, PORTNUM,
+          group, PORTNUM, AJAX_TIMEOUT,
           !serverSupportsSSL() ? "" :
           "  -t, --disable-ssl           disable transparent SSL support\n"
           "      --disable-ssl-menu      disallow changing transport mode\n",
@@ -937,6 +1829,17 @@ static void parseArgs(int argc, char * const argv[]) {
       { "verbose",              0, 0, 'v' },
       { "version",              0, 0,  0  },
       { "disable-peer-check",   0, 0,  0  },
+      { "workers",              1, 0,  0  },
+      { "threads",              1, 0,  0  },
+      { "max-connections",      1, 0,  0  },
+      { "max-connections-per-peer", 1, 0,  0  },
+      { "event-backend",        1, 0,  0  },
+      { "stall-threshold",      1, 0,  0  },
+      { "session-buffer",       1, 0,  0  },
+      { "coalesce-delay",       1, 0,  0  },
+      { "frame-skip",           1, 0,  0  },
+      { "session-grace",        1, 0,  0  },
+      { "echo-delay",           1, 0,  0  },
       { 0,                  0, 0,  0  } };
     int idx                = -1;
     int c                  = getopt_long(argc, argv, optstring, options, &idx);
@@ -1249,6 +2152,81 @@ static void parseArgs(int argc, char * const argv[]) {
     } else if (!idx--) {
       // disable-peer-check
       peerCheckEnabled = 0;
+    } else if (!idx--) {
+      // Workers
+      if (!optarg || *optarg < '0' || *optarg > '9') {
+        fatal("[config] Option --workers expects a number of processes.");
+      }
+      numWorkers           = strtoint(optarg, 1, 1024);
+    } else if (!idx--) {
+      // Threads
+      if (!optarg || *optarg < '0' || *optarg > '9') {
+        fatal("[config] Option --threads expects a number of threads.");
+      }
+      numThreads           = strtoint(optarg, 1, 1024);
+    } else if (!idx--) {
+      // Max connections
+      if (!optarg || *optarg < '0' || *optarg > '9') {
+        fatal("[config] Option --max-connections expects a number.");
+      }
+      maxConnections       = strtoint(optarg, 0, INT_MAX);
+    } else if (!idx--) {
+      // Max connections per peer
+      if (!optarg || *optarg < '0' || *optarg > '9') {
+        fatal("[config] Option --max-connections-per-peer expects a number.");
+      }
+      maxPerPeer           = strtoint(optarg, 0, INT_MAX);
+    } else if (!idx--) {
+      // Event backend
+      if (!optarg || (strcmp(optarg, "poll") && strcmp(optarg, "epoll") &&
+                      strcmp(optarg, "io_uring"))) {
+        fatal("[config] Option --event-backend expects one of \"poll\", "
+              "\"epoll\", or \"io_uring\".");
+      }
+      free(serverEventBackend);
+      check(serverEventBackend = strdup(optarg));
+    } else if (!idx--) {
+      // Stall threshold
+      if (!optarg || *optarg < '0' || *optarg > '9') {
+        fatal("[config] Option --stall-threshold expects a number of "
+              "milliseconds.");
+      }
+      serverStallThreshold = strtoint(optarg, 1, INT_MAX);
+    } else if (!idx--) {
+      // Session buffer
+      if (!optarg || *optarg < '0' || *optarg > '9') {
+        fatal("[config] Option --session-buffer expects a number of bytes.");
+      }
+      setSessionBufferSize(strtoint(optarg, MIN_SESSION_BUFFER,
+                                    MAX_SESSION_BUFFER));
+    } else if (!idx--) {
+      // Coalesce delay
+      if (!optarg || *optarg < '0' || *optarg > '9') {
+        fatal("[config] Option --coalesce-delay expects a number of "
+              "milliseconds.");
+      }
+      coalesceDelay        = strtoint(optarg, 0, 100);
+    } else if (!idx--) {
+      // Frame skip
+      if (!optarg || *optarg < '0' || *optarg > '9') {
+        fatal("[config] Option --frame-skip expects a number of "
+              "milliseconds.");
+      }
+      frameSkipDelay       = strtoint(optarg, 0, 60000);
+    } else if (!idx--) {
+      // Session grace period
+      if (!optarg || *optarg < '0' || *optarg > '9') {
+        fatal("[config] Option --session-grace expects a number of "
+              "seconds.");
+      }
+      sessionGrace         = strtoint(optarg, 0, 24*60*60);
+    } else if (!idx--) {
+      // Echo delay
+      if (!optarg || *optarg < '0' || *optarg > '9') {
+        fatal("[config] Option --echo-delay expects a number of "
+              "milliseconds.");
+      }
+      echoDelay            = strtoint(optarg, 0, 1000);
     }
   }
   if (optind != argc) {
@@ -1269,6 +2247,37 @@ static void parseArgs(int argc, char * const argv[]) {
     port                   = PORTNUM;
   }
 
+  // Worker processes hand off plain TCP connections to each other. This
+  // cannot work for SSL connections, or for unix domain sockets.
+  if (numWorkers > 1) {
+#ifndef SO_REUSEPORT
+    fatal("[config] Option --workers is not supported on this platform!");
+#endif
+    if (cgi) {
+      fatal("[config] CGI operation and --workers are mutually exclusive!");
+    }
+    if (enableSSL) {
+      fatal("[config] Option --workers requires --disable-ssl!");
+    }
+    if (unixDomainPath) {
+      fatal("[config] Option --workers cannot be used with --unixdomain-only!");
+    }
+    if (numThreads > 1) {
+      fatal("[config] Options --workers and --threads are mutually exclusive!");
+    }
+  }
+
+  // Reactor threads all share the same process, and thus the same SSL
+  // session cache. But they cannot be used for CGI operation.
+  if (numThreads > 1) {
+#ifndef HAVE_PTHREAD_CREATE
+    fatal("[config] Option --threads is not supported on this platform!");
+#endif
+    if (cgi) {
+      fatal("[config] CGI operation and --threads are mutually exclusive!");
+    }
+  }
+
   // If the user did not register any services, provide the default service
   if (!getHashmapSize(serviceTable)) {
     addToHashMap(serviceTable, "/",
@@ -1293,7 +2302,9 @@ static void parseArgs(int argc, char * const argv[]) {
     check(cgiSessionKey    = newSessionKey());
   }
 
-  if (demonize) {
+  // After an upgrade, we continue to run in the background, if the previous
+  // process did.
+  if (demonize && !isUpgrading()) {
     pid_t pid;
     check((pid             = fork()) >= 0);
     if (pid) {
@@ -1336,6 +2347,31 @@ static void removeLimits() {
   }
 }
 
+static void removePidfile(void) {
+  if (pidfile) {
+    // As a convenience, remove the pidfile, if it is still the version that
+    // we wrote. In general, pidfiles are not expected to be incredibly
+    // reliable, as there is no way to properly deal with multiple programs
+    // accessing the same pidfile. But we at least make a best effort to be
+    // good citizens.
+    char buf[40];
+    int fd        = open(pidfile, O_RDONLY);
+    if (fd >= 0) {
+      ssize_t sz;
+      NOINTR(sz   = read(fd, buf, sizeof(buf)-1));
+      NOINTR(close(fd));
+      if (sz > 0) {
+        buf[sz]   = '\000';
+        if (atoi(buf) == getpid()) {
+          unlink(pidfile);
+        }
+      }
+    }
+    free((char *)pidfile);
+    pidfile       = NULL;
+  }
+}
+
 static void setUpSSL(Server *server) {
 
   serverSetupSSL(server, enableSSL, forceSSL);
@@ -1370,20 +2406,47 @@ int main(int argc, char * const argv[]) {
 
   // Parse command line arguments
   parseArgs(argc, argv);
+  initStaticPages();
 
   // Fork the launcher process, allowing us to drop privileges in the main
-  // process.
-  int launcherFd  = forkLauncher();
+  // process. After an upgrade, we inherit the launcher instead.
+  int launcherFd  = isUpgrading() ? -1 : forkLauncher();
 
   // Make sure that our timestamps will print in the standard format
   setlocale(LC_TIME, "POSIX");
 
+  // Only a single server process can hand over to a new binary. In all other
+  // modes, SIGUSR2 must not kill us.
+  signal(SIGUSR2, SIG_IGN);
+
   // Create a new web server
   Server *server;
-  if (port) {
+  if (isUpgrading()) {
+    check(server  = inheritServer(&launcherFd));
+    dropPrivileges();
+    setUpSSL(server);
+    serverSetConnectionLimits(server, maxConnections, maxPerPeer);
+    initUpgrade(server);
+  } else if (port) {
+    if (numWorkers > 1 && forkWorkers(numWorkers) < 0) {
+      // The parent process only waits for the workers to exit.
+      dropPrivileges();
+      waitForWorkers();
+      removePidfile();
+      info("[server] Done");
+      _exit(0);
+    }
     check(server  = newServer(localhostOnly, port));
     dropPrivileges();
     setUpSSL(server);
+    serverSetConnectionLimits(server, maxConnections, maxPerPeer);
+    if (numWorkers > 1) {
+      initWorker(server);
+    } else if (numThreads > 1) {
+      initReactors(server, numThreads);
+    } else {
+      initUpgrade(server);
+    }
   } else {
     // For CGI operation we fork the new server, so that it runs in the
     // background.
@@ -1430,13 +2493,21 @@ int main(int argc, char * const argv[]) {
 
   // Register HTTP handler(s)
   for (int i = 0; i < numServices; i++) {
-    serverRegisterHttpHandler(server, services[i]->path,
-                              shellInABoxHttpHandler, services[i]);
+    serverRegisterStreamingHttpHandler(server, services[i]->path,
+                                       shellInABoxStreamingHandler,
+                                       services[i]);
+    serverRegisterWebSocketHandler(server, services[i]->path,
+                                   webSocketHandler, services[i]);
   }
 
   // Register handlers for external files
   iterateOverHashMap(externalFiles, registerExternalFiles, server);
 
+  // Take over the sessions of the process that we are replacing
+  if (isUpgrading()) {
+    inheritSessions(server, adoptSession);
+  }
+
   // Start the server
   if (!sigsetjmp(jmpenv, 1)) {
     // Clean up upon orderly shut down. Do _not_ cleanup if we die
@@ -1450,7 +2521,21 @@ int main(int argc, char * const argv[]) {
     for (int i = 0; i < sizeof(signals)/sizeof(*signals); ++i) {
       sigaction(signals[i], &sa, NULL);
     }
-    serverLoop(server);
+    for (;;) {
+      serverLoop(server);
+      if (!upgradeRequested()) {
+        break;
+      }
+
+      // Answer all pending requests, so that browsers reconnect right away.
+      // Then pass everything on to a new copy of our binary. If that fails,
+      // keep serving.
+      iterateOverSessions(flushPendingRequest, NULL);
+      if (!upgradeServer(argv, server, launcherFd)) {
+        info("[server] Upgrade complete");
+        _exit(0);
+      }
+    }
   }
 
   // Clean up
@@ -1464,27 +2549,7 @@ int main(int argc, char * const argv[]) {
   free(certificateDir);
   free(cgiSessionKey);
   free(messagesOrigin);
-  if (pidfile) {
-    // As a convenience, remove the pidfile, if it is still the version that
-    // we wrote. In general, pidfiles are not expected to be incredibly
-    // reliable, as there is no way to properly deal with multiple programs
-    // accessing the same pidfile. But we at least make a best effort to be
-    // good citizens.
-    char buf[40];
-    int fd        = open(pidfile, O_RDONLY);
-    if (fd >= 0) {
-      ssize_t sz;
-      NOINTR(sz   = read(fd, buf, sizeof(buf)-1));
-      NOINTR(close(fd));
-      if (sz > 0) {
-        buf[sz]   = '\000';
-        if (atoi(buf) == getpid()) {
-          unlink(pidfile);
-        }
-      }
-    }
-    free((char *)pidfile);
-  }
+  removePidfile();
   info("[server] Done");
   _exit(0);
 }
@@ -0,0 +1,417 @@
+// upgrade.c -- Hand over the listening socket and all sessions to a new binary
+// Copyright (C) 2008-2010 Markus Gutschke <markus@shellinabox.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// In addition to these license terms, the author grants the following
+// additional rights:
+//
+// If you modify this program, or any covered work, by linking or
+// combining it with the OpenSSL project's OpenSSL library (or a
+// modified version of that library), containing parts covered by the
+// terms of the OpenSSL or SSLeay licenses, the author
+// grants you additional permission to convey the resulting work.
+// Corresponding Source for a non-source form of such a combination
+// shall include the source code for the parts of OpenSSL used as well
+// as that of the covered work.
+//
+// You may at your option choose to remove this additional permission from
+// the work, or from any part of it.
+//
+// It is possible to build this program in a way that it loads OpenSSL
+// libraries at run-time. If doing so, the following notices are required
+// by the OpenSSL and SSLeay licenses:
+//
+// This product includes software developed by the OpenSSL Project
+// for use in the OpenSSL Toolkit. (http://www.openssl.org/)
+//
+// This product includes cryptographic software written by Eric Young
+// (eay@cryptsoft.com)
+//
+//
+// The most up-to-date version of this program is always available from
+// http://shellinabox.com
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shellinabox/launcher.h"
+#include "shellinabox/session.h"
+#include "shellinabox/upgrade.h"
+#include "libhttp/server.h"
+#include "logging/logging.h"
+
+#ifdef HAVE_UNUSED
+#defined ATTR_UNUSED __attribute__((unused))
+#defined UNUSED(x)   do { } while (0)
+#else
+#define ATTR_UNUSED
+#define UNUSED(x)    do { (void)(x); } while (0)
+#endif
+
+// Sending SIGUSR2 to the daemon makes it execute its binary again, which
+// can have been replaced with a newer version in the meantime. The old
+// process passes the listening socket, the launcher socket, and the pty of
+// every live session to the new process. The new process rebuilds its
+// session table and starts serving from the same listening socket. Browsers
+// only notice that their pending request completed early.
+//
+// The old process only exits once the new one confirms that it took over.
+// If anything goes wrong before that, the old process resumes serving.
+
+#define UPGRADE_ENV        "SHELLINABOX_UPGRADE_FD"
+#define UPGRADE_VERSION    1
+#define UPGRADE_TIMEOUT    30
+#define UPGRADE_MAX_RECORD (MAX_SESSION_BUFFER + (64<<10))
+
+// Each live session is sent as one record, followed by its session key, the
+// peer name, and any output that has not been delivered yet. A record with
+// an empty session key ends the list.
+struct UpgradeRecord {
+  pid_t   pid;
+  int     width;
+  int     height;
+  int     useLogin;
+  int     keyLength;
+  int     peerLength;
+  int     bufferedLength;
+  int64_t outputOffset;
+};
+
+static int          upgradeFds[2] = { -1, -1 };
+static volatile int upgradePending;
+static int          inheritFd     = -1;
+
+static void upgradeSignalHandler(int signo ATTR_UNUSED) {
+  UNUSED(signo);
+  int err                   = errno;
+  upgradePending            = 1;
+  char ch                   = 0;
+  if (write(upgradeFds[1], &ch, 1) < 0) {
+    // The pipe is full. The server loop will still notice.
+  }
+  errno                     = err;
+}
+
+static int upgradeHandler(ServerConnection *connection ATTR_UNUSED,
+                          void *arg, short *events,
+                          short revents ATTR_UNUSED) {
+  UNUSED(connection);
+  UNUSED(revents);
+  Server *server            = (Server *)arg;
+  char buf[16];
+  while (NOINTR(read(upgradeFds[0], buf, sizeof(buf))) > 0) {
+  }
+  if (upgradePending) {
+    // Return from serverLoop(), so that main() can hand over to the new
+    // binary.
+    serverExitLoop(server, 0);
+  }
+  *events                   = POLLIN;
+  return 1;
+}
+
+static void upgradeDestroy(void *arg ATTR_UNUSED) {
+  UNUSED(arg);
+}
+
+void initUpgrade(Server *server) {
+  check(!pipe(upgradeFds));
+  for (int i = 0; i < 2; i++) {
+    check(!fcntl(upgradeFds[i], F_SETFL, O_NONBLOCK));
+    check(!fcntl(upgradeFds[i], F_SETFD, FD_CLOEXEC));
+  }
+  serverAddConnection(server, upgradeFds[0], upgradeHandler, upgradeDestroy,
+                      server);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler             = upgradeSignalHandler;
+  sa.sa_flags               = SA_RESTART;
+  check(!sigaction(SIGUSR2, &sa, NULL));
+}
+
+int upgradeRequested(void) {
+  return upgradePending;
+}
+
+static int sendRecord(int fd, const void *buf, int len, const int *fds,
+                      int numFds) {
+  char cmsg_buf[CMSG_SPACE(2*sizeof(int))];
+  memset(cmsg_buf, 0, sizeof(cmsg_buf));
+  struct iovec  iov         = { 0 };
+  struct msghdr msg         = { 0 };
+  iov.iov_base              = (void *)buf;
+  iov.iov_len               = len;
+  msg.msg_iov               = &iov;
+  msg.msg_iovlen            = 1;
+  if (numFds) {
+    check(numFds <= 2);
+    msg.msg_control         = &cmsg_buf;
+    msg.msg_controllen      = CMSG_SPACE(numFds*sizeof(int));
+    struct cmsghdr *cmsg    = CMSG_FIRSTHDR(&msg);
+    check(cmsg);
+    cmsg->cmsg_level        = SOL_SOCKET;
+    cmsg->cmsg_type         = SCM_RIGHTS;
+    cmsg->cmsg_len          = CMSG_LEN(numFds*sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, numFds*sizeof(int));
+  }
+  return NOINTR(sendmsg(fd, &msg, MSG_NOSIGNAL)) == len ? 0 : -1;
+}
+
+static int receiveRecord(int fd, void *buf, int len, int *fds, int numFds) {
+  char cmsg_buf[CMSG_SPACE(2*sizeof(int))];
+  struct iovec  iov         = { 0 };
+  struct msghdr msg         = { 0 };
+  iov.iov_base              = buf;
+  iov.iov_len               = len;
+  msg.msg_iov               = &iov;
+  msg.msg_iovlen            = 1;
+  msg.msg_control           = &cmsg_buf;
+  msg.msg_controllen        = sizeof(cmsg_buf);
+  for (int i = 0; i < numFds; i++) {
+    fds[i]                  = -1;
+  }
+  int rc                    = NOINTR(recvmsg(fd, &msg, MSG_CMSG_CLOEXEC));
+  if (rc < 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+    return -1;
+  }
+  struct cmsghdr *cmsg      = CMSG_FIRSTHDR(&msg);
+  if (cmsg &&
+      cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type  == SCM_RIGHTS) {
+    int n                   = (cmsg->cmsg_len - CMSG_LEN(0))/sizeof(int);
+    check(n <= numFds);
+    memcpy(fds, CMSG_DATA(cmsg), n*sizeof(int));
+  }
+  return rc;
+}
+
+struct SendState {
+  Server *server;
+  int    fd;
+  int    failed;
+};
+
+static int sendSession(void *arg, const char *key ATTR_UNUSED,
+                       char **value) {
+  UNUSED(key);
+  struct SendState *state   = (struct SendState *)arg;
+  struct Session *session   = *(struct Session **)value;
+  if (state->failed || session->done || session->pty < 0) {
+    // Sessions whose child has already exited stay behind.
+    return 1;
+  }
+
+  // The server may already have read output from the pty, that it hasn't
+  // passed on yet. It travels along with the rest of the buffered output.
+  struct iovec iov[2];
+  int count;
+  ssize_t bytes;
+  while ((count = ringBufferReserve(&session->output, iov)) > 0 &&
+         (bytes = serverReadv(state->server, session->pty, iov, count)) > 0) {
+    ringBufferCommit(&session->output, bytes);
+  }
+
+  struct UpgradeRecord record;
+  record.pid                = session->pid;
+  record.width              = session->width;
+  record.height             = session->height;
+  record.useLogin           = session->useLogin;
+  record.keyLength          = strlen(session->sessionKey);
+  record.peerLength         = strlen(session->peerName);
+  record.bufferedLength     = ringBufferLength(&session->output);
+  record.outputOffset       = session->outputOffset;
+  int len                   = sizeof(record) + record.keyLength +
+                              record.peerLength + record.bufferedLength;
+  if (len > UPGRADE_MAX_RECORD) {
+    state->failed           = 1;
+    return 1;
+  }
+  char *buf;
+  check(buf                 = malloc(len));
+  char *ptr                 = buf;
+  memcpy(ptr, &record, sizeof(record));
+  ptr                      += sizeof(record);
+  memcpy(ptr, session->sessionKey, record.keyLength);
+  ptr                      += record.keyLength;
+  memcpy(ptr, session->peerName, record.peerLength);
+  ptr                      += record.peerLength;
+  ringBufferCopy(&session->output, ptr, record.bufferedLength);
+  if (sendRecord(state->fd, buf, len, &session->pty, 1)) {
+    state->failed           = 1;
+  }
+  free(buf);
+  return 1;
+}
+
+int upgradeServer(char * const argv[], Server *server, int launcherFd) {
+  upgradePending            = 0;
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair)) {
+    warn("[server] Cannot upgrade: %s", strerror(errno));
+    return -1;
+  }
+  pid_t pid                 = fork();
+  if (pid < 0) {
+    warn("[server] Cannot upgrade: %s", strerror(errno));
+    NOINTR(close(pair[0]));
+    NOINTR(close(pair[1]));
+    return -1;
+  }
+  if (!pid) {
+    // Everything that the new process needs gets passed explicitly.
+    closeAllFds((int []){ 0, 1, 2, pair[1] }, 4);
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d", pair[1]);
+    setenv(UPGRADE_ENV, buf, 1);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    execvp(argv[0], argv);
+    error("[server] Failed to execute %s: %s", argv[0], strerror(errno));
+    _exit(1);
+  }
+  NOINTR(close(pair[1]));
+  info("[server] Handing over to new process %d", pid);
+
+  // Send the listening socket and the launcher socket, then all sessions.
+  int version               = UPGRADE_VERSION;
+  struct SendState state    = { server, pair[0], 0 };
+  state.failed              = !!sendRecord(pair[0], &version, sizeof(version),
+                                   (int []){ serverGetFd(server),
+                                             launcherFd }, 2);
+  iterateOverSessions(sendSession, &state);
+  struct UpgradeRecord end  = { 0 };
+  if (state.failed || sendRecord(pair[0], &end, sizeof(end), NULL, 0)) {
+    state.failed            = 1;
+  }
+
+  // Wait for the new process to confirm that it is ready to take over.
+  char ack                  = 0;
+  struct pollfd pfd         = { .fd = pair[0], .events = POLLIN };
+  if (!state.failed &&
+      NOINTR(poll(&pfd, 1, UPGRADE_TIMEOUT*1000)) == 1 &&
+      NOINTR(read(pair[0], &ack, 1)) == 1 && ack == 'Y') {
+    NOINTR(close(pair[0]));
+    return 0;
+  }
+  NOINTR(close(pair[0]));
+  kill(pid, SIGKILL);
+  NOINTR(waitpid(pid, NULL, 0));
+  error("[server] New process failed to take over. Resuming service.");
+  return -1;
+}
+
+int isUpgrading(void) {
+  static int initialized;
+  if (!initialized) {
+    initialized             = 1;
+    const char *fd          = getenv(UPGRADE_ENV);
+    if (fd) {
+      inheritFd             = atoi(fd);
+      unsetenv(UPGRADE_ENV);
+      check(!fcntl(inheritFd, F_SETFD, FD_CLOEXEC));
+    }
+  }
+  return inheritFd >= 0;
+}
+
+Server *inheritServer(int *launcherFd) {
+  check(isUpgrading());
+  int version;
+  int fds[2];
+  if (receiveRecord(inheritFd, &version, sizeof(version), fds, 2) !=
+      sizeof(version) || version != UPGRADE_VERSION ||
+      fds[0] < 0 || fds[1] < 0) {
+    fatal("[server] Failed to inherit state from previous process!");
+  }
+  *launcherFd               = adoptLauncher(fds[1]);
+  return newServerFromFd(fds[0]);
+}
+
+void inheritSessions(Server *server,
+                     void (*adoptSession)(struct Session *session)) {
+  check(isUpgrading());
+  char *buf;
+  check(buf                 = malloc(UPGRADE_MAX_RECORD));
+  int numSessions           = 0;
+  for (;;) {
+    int pty;
+    int len                 = receiveRecord(inheritFd, buf,
+                                            UPGRADE_MAX_RECORD, &pty, 1);
+    struct UpgradeRecord record;
+    if (len < (int)sizeof(record)) {
+      fatal("[server] Failed to inherit sessions from previous process!");
+    }
+    memcpy(&record, buf, sizeof(record));
+    if (!record.keyLength) {
+      break;
+    }
+    if (pty < 0 || record.keyLength < 0 || record.peerLength < 0 ||
+        record.bufferedLength < 0 ||
+        len != (int)sizeof(record) + record.keyLength + record.peerLength +
+               record.bufferedLength) {
+      fatal("[server] Failed to inherit sessions from previous process!");
+    }
+    char *ptr               = buf + sizeof(record);
+    char *sessionKey;
+    check(sessionKey        = malloc(record.keyLength + 1));
+    memcpy(sessionKey, ptr, record.keyLength);
+    sessionKey[record.keyLength] = '\000';
+    ptr                    += record.keyLength;
+    char *peerName;
+    check(peerName          = malloc(record.peerLength + 1));
+    memcpy(peerName, ptr, record.peerLength);
+    peerName[record.peerLength]  = '\000';
+    ptr                    += record.peerLength;
+
+    struct Session *session = newSession(sessionKey, server, peerName);
+    free(peerName);
+    session->pty            = pty;
+    session->pid            = record.pid;
+    session->width          = record.width;
+    session->height         = record.height;
+    session->useLogin       = record.useLogin;
+    session->ptyFirstRead   = 0;
+    if (record.bufferedLength > ringBufferCapacity(&session->output)) {
+      // The old process was configured with a larger buffer.
+      destroyRingBuffer(&session->output);
+      initRingBuffer(&session->output, record.bufferedLength);
+    }
+    ringBufferWrite(&session->output, ptr, record.bufferedLength);
+    session->outputOffset   = record.outputOffset;
+    adoptSession(session);
+    numSessions++;
+  }
+  free(buf);
+
+  // Let the old process know that it can go away now.
+  char ack                  = 'Y';
+  check(NOINTR(write(inheritFd, &ack, 1)) == 1);
+  NOINTR(close(inheritFd));
+  inheritFd                 = -1;
+  info("[server] Took over %d sessions from previous process", numSessions);
+}
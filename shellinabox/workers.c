@@ -0,0 +1,310 @@
+// workers.c -- Spread sessions over several worker processes
+// Copyright (C) 2008-2010 Markus Gutschke <markus@shellinabox.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// In addition to these license terms, the author grants the following
+// additional rights:
+//
+// If you modify this program, or any covered work, by linking or
+// combining it with the OpenSSL project's OpenSSL library (or a
+// modified version of that library), containing parts covered by the
+// terms of the OpenSSL or SSLeay licenses, the author
+// grants you additional permission to convey the resulting work.
+// Corresponding Source for a non-source form of such a combination
+// shall include the source code for the parts of OpenSSL used as well
+// as that of the covered work.
+//
+// You may at your option choose to remove this additional permission from
+// the work, or from any part of it.
+//
+// It is possible to build this program in a way that it loads OpenSSL
+// libraries at run-time. If doing so, the following notices are required
+// by the OpenSSL and SSLeay licenses:
+//
+// This product includes software developed by the OpenSSL Project
+// for use in the OpenSSL Toolkit. (http://www.openssl.org/)
+//
+// This product includes cryptographic software written by Eric Young
+// (eay@cryptsoft.com)
+//
+//
+// The most up-to-date version of this program is always available from
+// http://shellinabox.com
+
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shellinabox/launcher.h"
+#include "shellinabox/session.h"
+#include "shellinabox/workers.h"
+#include "libhttp/server.h"
+#include "logging/logging.h"
+
+#ifdef HAVE_UNUSED
+#defined ATTR_UNUSED __attribute__((unused))
+#defined UNUSED(x)   do { } while (0)
+#else
+#define ATTR_UNUSED
+#define UNUSED(x)    do { (void)(x); } while (0)
+#endif
+
+// In worker mode, several processes listen on the same port, and the
+// kernel distributes new connections between them. Each session is owned by
+// the worker that created it. Its session key starts with the number of
+// that worker, and the client repeats this number as "route=" in the query
+// string of every request. A worker that receives a request for somebody
+// else's session passes the unread connection to the owner over a
+// datagram socket.
+//
+// Reactor threads use the same session keys and routing hints. But as they
+// all live in the same process, libhttp can move connections between them
+// directly.
+
+static int   numWorkers;
+static int   workerId = -1;
+static int   *workerInboxes;
+static int   *workerOutboxes;
+static pid_t *workerPids;
+
+int forkWorkers(int n) {
+  check(n > 1);
+  numWorkers                = n;
+  check(workerInboxes       = malloc(n*sizeof(int)));
+  check(workerOutboxes      = malloc(n*sizeof(int)));
+  check(workerPids          = calloc(n, sizeof(pid_t)));
+  for (int i = 0; i < n; i++) {
+    int pair[2];
+    check(!socketpair(AF_UNIX, SOCK_DGRAM, 0, pair));
+    workerInboxes[i]        = pair[0];
+    workerOutboxes[i]       = pair[1];
+  }
+
+  // All workers share the same launcher and listen on the same port.
+  shareLauncher();
+  serverReusePort           = 1;
+
+  for (int i = 0; i < n; i++) {
+    pid_t pid;
+    check((pid              = fork()) >= 0);
+    if (!pid) {
+      workerId              = i;
+      for (int j = 0; j < n; j++) {
+        if (j != i) {
+          NOINTR(close(workerInboxes[j]));
+          workerInboxes[j]  = -1;
+        }
+      }
+      NOINTR(close(workerOutboxes[i]));
+      workerOutboxes[i]     = -1;
+      char prefix[16];
+      snprintf(prefix, sizeof(prefix), "%d.", i);
+      setSessionKeyPrefix(prefix);
+      debug("[server] Started worker %d", i);
+      return i;
+    }
+    workerPids[i]           = pid;
+  }
+
+  // The parent process only supervises the workers.
+  for (int i = 0; i < n; i++) {
+    NOINTR(close(workerInboxes[i]));
+    NOINTR(close(workerOutboxes[i]));
+    workerInboxes[i]        = -1;
+    workerOutboxes[i]       = -1;
+  }
+  terminateLauncher();
+  return -1;
+}
+
+static void forwardSignal(int signo) {
+  for (int i = 0; i < numWorkers; i++) {
+    if (workerPids[i] > 0) {
+      kill(workerPids[i], signo);
+    }
+  }
+}
+
+void waitForWorkers(void) {
+  static const int signals[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM };
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler             = forwardSignal;
+  for (unsigned i = 0; i < sizeof(signals)/sizeof(*signals); i++) {
+    sigaction(signals[i], &sa, NULL);
+  }
+  for (int running = numWorkers; running > 0; ) {
+    int status;
+    pid_t pid               = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    for (int i = 0; i < numWorkers; i++) {
+      if (workerPids[i] == pid) {
+        workerPids[i]       = 0;
+        running--;
+        if (WIFSIGNALED(status)) {
+          warn("[server] Worker %d terminated by signal %d!",
+               i, WTERMSIG(status));
+        } else {
+          debug("[server] Worker %d exited with exit code %d.",
+                i, WEXITSTATUS(status));
+        }
+      }
+    }
+  }
+}
+
+static int requestedWorker(const char *line, int len) {
+  // Look for a "route=" parameter in the query string of the request line.
+  const char *end           = line + len;
+  const char *ptr           = memchr(line, '?', len);
+  while (ptr && ++ptr < end && *ptr != ' ') {
+    if (end - ptr > 6 && !memcmp(ptr, "route=", 6)) {
+      int worker            = 0;
+      int digits            = 0;
+      for (ptr += 6; ptr < end && *ptr >= '0' && *ptr <= '9' && digits < 6;
+           ptr++, digits++) {
+        worker              = 10*worker + *ptr - '0';
+      }
+      return digits ? worker : -1;
+    }
+    while (ptr < end && *ptr != '&' && *ptr != ' ') {
+      ptr++;
+    }
+    if (ptr >= end || *ptr != '&') {
+      break;
+    }
+  }
+  return -1;
+}
+
+static int handOffRequest(void *arg ATTR_UNUSED, int fd, const char *line,
+                          int len) {
+  UNUSED(arg);
+  int worker                = requestedWorker(line, len);
+  if (worker < 0 || worker >= numWorkers || worker == workerId) {
+    return 0;
+  }
+
+  char tag                  = 0;
+  char cmsg_buf[CMSG_SPACE(sizeof(int))];
+  memset(cmsg_buf, 0, sizeof(cmsg_buf));
+  struct iovec  iov         = { 0 };
+  struct msghdr msg         = { 0 };
+  iov.iov_base              = &tag;
+  iov.iov_len               = sizeof(tag);
+  msg.msg_iov               = &iov;
+  msg.msg_iovlen            = 1;
+  msg.msg_control           = &cmsg_buf;
+  msg.msg_controllen        = sizeof(cmsg_buf);
+  struct cmsghdr *cmsg      = CMSG_FIRSTHDR(&msg);
+  check(cmsg);
+  cmsg->cmsg_level          = SOL_SOCKET;
+  cmsg->cmsg_type           = SCM_RIGHTS;
+  cmsg->cmsg_len            = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  if (NOINTR(sendmsg(workerOutboxes[worker], &msg, MSG_DONTWAIT)) !=
+      sizeof(tag)) {
+    debug("[server] Failed to hand off connection to worker %d!", worker);
+    return 0;
+  }
+  return 1;
+}
+
+static int workerInboxHandler(ServerConnection *connection ATTR_UNUSED,
+                              void *arg, short *events,
+                              short revents ATTR_UNUSED) {
+  UNUSED(connection);
+  UNUSED(revents);
+  Server *server            = (Server *)arg;
+  for (;;) {
+    char tag;
+    char cmsg_buf[CMSG_SPACE(sizeof(int))];
+    struct iovec  iov       = { 0 };
+    struct msghdr msg       = { 0 };
+    iov.iov_base            = &tag;
+    iov.iov_len             = sizeof(tag);
+    msg.msg_iov             = &iov;
+    msg.msg_iovlen          = 1;
+    msg.msg_control         = &cmsg_buf;
+    msg.msg_controllen      = sizeof(cmsg_buf);
+    if (NOINTR(recvmsg(workerInboxes[workerId], &msg, MSG_DONTWAIT)) <= 0) {
+      break;
+    }
+    struct cmsghdr *cmsg    = CMSG_FIRSTHDR(&msg);
+    if (cmsg &&
+        cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type  == SCM_RIGHTS) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+      serverAdoptConnection(server, fd);
+    }
+  }
+  *events                   = POLLIN;
+  return 1;
+}
+
+static void workerInboxDestroy(void *arg ATTR_UNUSED) {
+  UNUSED(arg);
+}
+
+static void initReactor(Server *reactor ATTR_UNUSED, int id,
+                        void *arg ATTR_UNUSED) {
+  UNUSED(reactor);
+  UNUSED(arg);
+  char prefix[16];
+  snprintf(prefix, sizeof(prefix), "%d.", id);
+  setSessionKeyPrefix(prefix);
+}
+
+static void destroyReactor(Server *reactor ATTR_UNUSED, int id ATTR_UNUSED,
+                           void *arg ATTR_UNUSED) {
+  UNUSED(reactor);
+  UNUSED(id);
+  UNUSED(arg);
+  finishAllSessions();
+  setSessionKeyPrefix(NULL);
+}
+
+static int routeRequest(void *arg ATTR_UNUSED, const char *line, int len) {
+  UNUSED(arg);
+  return requestedWorker(line, len);
+}
+
+void initReactors(Server *server, int numReactors) {
+  serverSetReactors(server, numReactors, initReactor, destroyReactor, NULL);
+  serverSetRouter(server, routeRequest, NULL);
+}
+
+void initWorker(Server *server) {
+  check(workerId >= 0);
+  serverSetHandOff(server, handOffRequest, NULL);
+  serverAddConnection(server, workerInboxes[workerId], workerInboxHandler,
+                      workerInboxDestroy, server);
+}